@@ -8,6 +8,7 @@
 #include <mutex>
 #include <atomic>
 #include <map>
+#include <algorithm>
 #include "network.h"
 #include "usbip_protocol.h"
 
@@ -21,6 +22,7 @@ struct USBDeviceInfo {
     std::string product;
     uint8_t bDeviceClass;
     bool isMassStorage;
+    uint32_t devid;  // 服务端的设备号（busnum<<16|devnum），URB按它路由
 };
 
 // 虚拟USB设备接口
@@ -83,19 +85,99 @@ public:
     // 检查客户端是否正在运行
     bool isRunning() const { return running_; }
     
+    // 经path处的Unix域套接字连接本机服务端并使用共享内存传输，需在start()之前设置
+    void setLocalPath(const std::string& path) { localPath_ = path; }
+    
+    // 经服务端的数据报控制端口port连接并使用UDP传输，0表示使用TCP，需在start()之前设置
+    void setDatagramPort(int port) { datagramPort_ = port; }
+    
+    // 数据报传输按rate的概率丢弃发出的数据报，用于在回环上测试重传
+    void setDatagramLoss(double rate) { datagramLoss_ = rate; }
+    
+    // 经TLS 1.3连接服务端，按caFile中的证书验证服务端（空为系统信任库），需在start()之前设置
+    void setTls(bool enable, const std::string& caFile = "") { tls_ = enable; tlsCa_ = caFile; }
+    
+    // 导入时向服务端提供负载压缩，服务端接受后不小于threshold字节的URB负载压缩发送，0表示不提供
+    void setCompressionThreshold(size_t threshold) { compressionThreshold_ = threshold; }
+    
+    // 导入时向服务端提供零块编码：CMD_SUBMIT负载中全零的512字节块不再发送
+    void setZeroBlockElision(bool enable) { zeroBlocks_ = enable; }
+    
+    // 导入时要求URB负载附加CRC32C校验，服务端同意后双向负载都经校验
+    void setIntegrityCheck(bool enable) { integrity_ = enable; }
+    
+    // 导入时要求count条附加数据连接（不超过15），非端点0的URB按seqnum分散到这些连接上
+    void setDataStreams(size_t count) { dataStreams_ = std::min<size_t>(count, 15); }
+    
+    // 导入服务端列表中的前count个设备，全部经同一连接（及其数据连接）收发，需在start()之前设置
+    void setMaxDevices(size_t count) { maxDevices_ = std::max<size_t>(count, 1); }
+    
+    // 连接建立后在能力交换中提出批量帧，服务端同意后小URB合并发送，每帧至多maxEntries个；0表示不交换
+    void setBatching(size_t maxEntries) { batchLimit_ = maxEntries; }
+    
+    // 连接建立后在能力交换中提出心跳，希望在约ms毫秒内发现失联的对端（服务端设置了时限时以其为准）；
+    // 同意后各连接定期发送心跳，内核同样在该时限内发现服务端失联。0表示不提出
+    void setDeadPeerTimeout(int ms) { deadPeerMs_ = ms; }
+    
+    // 导入时提出可恢复的会话：连接中断后在ms毫秒内反复重连并接续会话，虚拟设备保持不变，
+    // 未收到回复的URB重新提交；服务端不同意或超过时限时按原来的方式结束。0表示不提出
+    void setResumeGrace(int ms) { resumeGraceMs_ = ms; }
+    
+    // 忙轮询低延迟模式，us为自旋时长（微秒），0表示关闭：通信线程绑定一个CPU，
+    // 连接关闭Nagle算法、立即确认并锁定接收缓冲区，等待回复时先自旋us微秒再阻塞
+    void setBusyPoll(int us) { busyPollUs_ = us; }
+    
+    // 快速导入：直接导入总线ID或"vid:pid"（十六进制）所指的设备，不先等待设备列表。
+    // 能力交换、设备列表（仅选择器）和导入请求一次写出，TCP连接使用TCP Fast Open，
+    // 导入只需一个往返。空表示按设备列表导入前--devices个设备
+    void setAttach(const std::string& selector) { attach_ = selector; }
+    
 private:
+    // 先获取设备列表，再逐个导入前maxDevices_个设备
+    bool attachFromList();
+    
+    // 按attach_快速导入：选择器不被服务端认识时按同时取得的设备列表再导入一次
+    bool fastAttach();
+    
     // 获取服务端设备列表
     bool getDeviceList();
+    usbip_packet deviceListRequest() const;
+    bool parseDeviceList(const usbip_packet& reply);
     
     // 导入并创建虚拟设备
     bool importDevice(const std::string& busid);
     
+    // 导入请求，以及按导入响应开启协商的功能并创建虚拟设备
+    usbip_packet importRequest(const std::string& busid);
+    bool finishImport(const usbip_packet& reply);
+    
+    // 本端提供的负载编码的能力位
+    uint32_t codecCaps() const;
+    
     // 通信线程
     void communicationThread();
     
+    // 连接中断后在宽限期内反复尝试恢复会话，成功时返回true
+    bool resumeSession();
+    
     // 客户端变量
     std::string serverHost_;
     int port_;
+    std::string localPath_;
+    int datagramPort_;
+    double datagramLoss_;
+    bool tls_;
+    std::string tlsCa_;
+    size_t compressionThreshold_;
+    bool zeroBlocks_;
+    bool integrity_;
+    size_t dataStreams_;
+    size_t maxDevices_;
+    size_t batchLimit_;
+    int deadPeerMs_;
+    int resumeGraceMs_;
+    int busyPollUs_;
+    std::string attach_;
     std::unique_ptr<Client> client_;
     std::atomic<bool> running_;
     std::thread commThread_;
@@ -104,8 +186,8 @@ private:
     std::vector<USBDeviceInfo> deviceList_;
     std::mutex deviceListMutex_;
     
-    // 已导入的设备
-    std::unique_ptr<VirtualUSBDevice> virtualDevice_;
+    // 已导入的设备，按devid索引
+    std::map<uint32_t, std::unique_ptr<VirtualUSBDevice>> virtualDevices_;
     std::mutex virtualDeviceMutex_;
 };
 
@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C（Castagnoli多项式，iSCSI/ext4使用的同一校验）
+// x86上使用SSE4.2的crc32指令，arm64上使用CRC扩展指令，其他情况退化为8路查表。
+// crc为之前数据的结果，可以分段累加计算：crc32c(b, n2, crc32c(a, n1)) == crc32c(ab, n1 + n2)
+uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0);
+
+#endif // CRC32C_H
@@ -0,0 +1,166 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "timer_wheel.h"
+
+class IoUring;
+
+// 单线程I/O事件循环
+// 默认后端为就绪通知：Linux上使用epoll，其他平台（macOS）退化为poll。
+// 内核支持时可选io_uring后端：以完成通知驱动accept/recv/send，
+// 一次io_uring_enter同时提交和收割所有连接的请求。
+// 循环自带一个时间轮，等待I/O的时限取自最近的定时器，到期的定时器在本轮I/O事件处理完之后执行。
+// 除post()和stop()外，所有方法只能在循环线程中调用（run()之前除外）。
+class EventLoop {
+public:
+    enum class Backend {
+        Readiness,  // epoll/poll：add/modify/remove
+        IoUring     // io_uring：acceptAsync/receiveAsync/sendAsync
+    };
+
+    // 关注/就绪的事件类型
+    enum : uint32_t {
+        kReadable = 1u << 0,
+        kWritable = 1u << 1,
+        kError    = 1u << 2,
+        kHangup   = 1u << 3
+    };
+
+    using Handler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using Clock = TimerWheel::Clock;
+    using TimerId = TimerWheel::TimerId;
+    
+    // 完成式接口的回调
+    using AcceptHandler = std::function<void(int fd)>;
+    // 收到数据；len为0表示对端关闭，小于0为负的错误码。data只在回调期间有效
+    using ReceiveHandler = std::function<void(const uint8_t* data, ssize_t len)>;
+    // 发送完成；result为写出的字节数或负的错误码
+    using SendHandler = std::function<void(ssize_t result)>;
+
+    EventLoop();
+    ~EventLoop();
+
+    // 禁止拷贝和赋值
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool init(Backend backend = Backend::Readiness);
+    Backend backend() const { return backend_; }
+
+    // 忙轮询：收到I/O事件之后的spin时间内以0时限反复检查，不进入阻塞等待，
+    // 省去线程被唤醒和重新调度的延迟，代价是这段时间内占满一个CPU；之后没有新事件时照常阻塞。
+    // io_uring后端同时锁定接收缓冲区。在init()之后、run()之前调用
+    void setBusyPoll(std::chrono::microseconds spin);
+    
+    // 当前内核能否使用io_uring后端
+    static bool ioUringSupported();
+
+    // 就绪式接口：注册/修改/注销文件描述符
+    // IoUring后端以多次触发的poll请求实现，用于不能走完成式接口的描述符（如eventfd）
+    bool add(int fd, uint32_t interest, Handler handler);
+    bool modify(int fd, uint32_t interest);
+    void remove(int fd);
+    
+    // 完成式接口（IoUring后端）
+    // 持续接受listenFd上的新连接
+    bool acceptAsync(int listenFd, AcceptHandler handler);
+    // 持续接收fd上的数据，数据放在内核提供的缓冲区中，回调返回后缓冲区即归还
+    bool receiveAsync(int fd, ReceiveHandler handler);
+    // 发送iov描述的数据，数据在回调之前必须保持有效；回调恰好执行一次
+    bool sendAsync(int fd, const struct iovec* iov, int iovcnt, SendHandler handler);
+    // 停止fd上的accept/recv，之后不再回调；未完成的发送仍会回调
+    void cancelAsync(int fd);
+    // 暂停fd上的recv：内核中已收到的数据仍会回调，之后的数据留在套接字中，TCP随之限制对端的发送
+    void pauseReceive(int fd);
+    // 恢复暂停的recv
+    bool resumeReceive(int fd);
+    // 关闭fd：与之前准备的请求一起按顺序提交，避免描述符在提交前被复用
+    void closeAsync(int fd);
+    
+    // 定时器：到期后在循环线程中执行task；添加、取消都不做系统调用
+    TimerId runAt(Clock::time_point deadline, Task task);
+    // delay从本轮被唤醒的时刻（now()）算起
+    TimerId runAfter(std::chrono::milliseconds delay, Task task);
+    // 取消尚未到期的定时器，已到期或已取消时返回false
+    bool cancelTimer(TimerId id);
+
+    // 本轮等待结束的时刻：循环线程中判断超时时使用，不必每次读取时钟
+    Clock::time_point now() const { return now_; }
+    
+    // io_uring_enter调用次数（其他后端为0）
+    uint64_t enterCalls() const;
+
+    // 投递任务到循环线程执行（线程安全）
+    void post(Task task);
+
+    // 运行直到stop()
+    void run();
+
+    // 请求退出循环（线程安全）
+    void stop();
+
+    bool isRunning() const { return running_; }
+    bool inLoopThread() const { return std::this_thread::get_id() == loopThread_; }
+
+private:
+    void wakeup();
+    void drainWakeup();
+    void runPosted();
+    void dispatch(int fd, uint32_t events);
+    
+    // 等待I/O的时限（毫秒），没有定时器时为-1；忙轮询期间为0
+    int waitTimeout();
+    // 记录唤醒时刻并执行到期的定时器
+    void runTimers();
+    
+    // io_uring后端
+    struct Channel;
+    struct SendOp;
+    bool initIoUring();
+    void runIoUring();
+    void armWakeup();
+    bool armChannel(int fd, Channel& channel);
+    void handleCompletion(uint64_t userData, int32_t res, uint32_t flags);
+
+    Backend backend_;
+
+    int pollFd_;      // epoll实例（poll模式下不使用）
+    int wakeFds_[2];  // 唤醒用：Linux为eventfd（两端相同），其他平台为管道
+
+    std::unordered_map<int, std::shared_ptr<Handler>> handlers_;
+    std::unordered_map<int, uint32_t> interests_;
+
+    std::mutex postMutex_;
+    std::vector<Task> posted_;
+
+    std::atomic<bool> running_;
+    std::thread::id loopThread_;
+    
+    TimerWheel timers_;
+    Clock::time_point now_;
+    
+    // 忙轮询的时长和最近一次收到I/O事件的时刻
+    std::chrono::microseconds spin_;
+    Clock::time_point lastEvent_;
+    
+    std::unique_ptr<IoUring> ring_;
+    std::unordered_map<int, std::shared_ptr<Channel>> channels_;
+    std::unordered_map<uint64_t, std::unique_ptr<SendOp>> sends_;
+    uint32_t nextGeneration_;
+    uint64_t nextSendId_;
+    uint64_t wakeValue_;
+};
+
+#endif // EVENT_LOOP_H
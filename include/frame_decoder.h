@@ -0,0 +1,168 @@
+#ifndef FRAME_DECODER_H
+#define FRAME_DECODER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "usbip_protocol.h"
+#include "memory_budget.h"
+
+// USBIP帧的增量解码器
+// 连接分两个阶段：握手阶段（设备列表、导入）和URB阶段。两个阶段共用0x0003命令码，
+// 握手阶段它是OP_REP_IMPORT，URB阶段是RET_SUBMIT，解码器按所处阶段直接选择布局。
+// 收到或发出第一个CMD_SUBMIT时进入URB阶段（客户端总在导入完成之后才提交URB），此后不再返回。
+// 字节可以任意切分送入：固定部分在内部拼装，负载写入包的data，调用者也可以经
+// payloadWindow()把负载直接读入包中。解出的包中负载保持线上的样子（可能压缩、带校验和）。
+// 压缩的URB负载在接收之前按声明的解压后长度检查单帧上限。
+// 批量帧中的条目逐个解出，与单独成帧的CMD_SUBMIT/RET_SUBMIT没有区别；未知命令无法确定长度，按数据错乱处理。
+// 开启分段后，较大的未压缩、不带校验的CMD_SUBMIT OUT负载（端点0的控制传输除外）不等收齐：
+// 先交出头部，再按段逐段交出。
+// 设置了内存预算时，URB负载（及每一段）在分配缓冲区时计入预算（压缩的负载按解压后的长度），
+// 包被取出时释放，由调用者按实际持有的缓冲区重新计入；
+// 预算已耗尽时停在负载之前，不分配也不再消费数据，直到预算回落。
+// 超过预算上限的负载永远无法容纳：不分配缓冲区，读过并丢弃，交出不带负载的包，
+// 状态为-ENOMEM（CMD_SUBMIT记在头部的status中，RET_SUBMIT记在URB的status中）。
+class FrameDecoder {
+public:
+    enum class Phase {
+        Handshake,  // 0x0003为OP_REP_IMPORT
+        Urb         // 0x0003为RET_SUBMIT
+    };
+
+    // 单帧负载的上限，超过时视为数据错乱
+    static const size_t kMaxPayload = 64 * 1024 * 1024;
+
+    FrameDecoder();
+    ~FrameDecoder();
+
+    // 禁止拷贝和赋值
+    FrameDecoder(const FrameDecoder&) = delete;
+    FrameDecoder& operator=(const FrameDecoder&) = delete;
+
+    Phase phase() const { return urbPhase_ ? Phase::Urb : Phase::Handshake; }
+
+    // 进入URB阶段，发送方向发出第一个CMD_SUBMIT时调用（可在其他线程中调用）
+    void enterUrbPhase() { urbPhase_ = true; }
+
+    // 消费data中至多len字节，返回消费的字节数。解出一个完整的包之后不再消费，直到包被取出
+    size_t feed(const uint8_t* data, size_t len);
+
+    bool hasPacket() const { return step_ == Step::Done; }
+    bool failed() const { return step_ == Step::Failed; }
+
+    // 负载因预算耗尽停在头部之后
+    bool payloadBlocked() const { return step_ == Step::Blocked; }
+
+    // 负载停在头部之后时重新检查预算，已回落时分配缓冲区继续接收；仍耗尽时返回false。
+    // feed()每次调用时也会重新检查
+    bool admitPayload();
+
+    // 取出解出的包，之后开始解码下一帧；没有完整的包时返回false
+    bool next(usbip_packet& packet);
+
+    // 正在接收负载时返回负载中尚未填充的部分，读入后以commitPayload()确认；其他时候返回nullptr
+    uint8_t* payloadWindow(size_t& len);
+    void commitPayload(size_t n);
+
+    // 丢弃正在解码的帧并回到握手阶段（连接关闭时）
+    void reset();
+
+    // 负载不小于threshold字节的非端点0 CMD_SUBMIT OUT分段交出，每段segment字节（最后一段可能较短），threshold为0时关闭。
+    // 段的长度应是端点最大包长的整数倍，分块提交给设备时总线上的包与整体提交相同
+    void setSegmentation(size_t threshold, size_t segment) {
+        segmentThreshold_ = threshold;
+        segmentSize_ = segment;
+    }
+
+    // URB负载缓冲区计入的预算，为空时不限
+    void setMemoryBudget(std::shared_ptr<MemoryBudget> budget) { budget_ = std::move(budget); }
+
+private:
+    enum class Step { Fixed, Blocked, Payload, Discard, Done, Failed };
+
+    // 固定部分中正在拼装的一段
+    enum class Part {
+        Header,
+        CmdSubmit,
+        RetSubmit,
+        CodecLength,     // 压缩负载的编码后长度
+        ImportRequest,
+        ImportReply,
+        ImportDevice,    // 成功的导入响应中的设备信息
+        DevlistRequest,
+        DevlistCount,
+        DevlistDevice,   // 设备信息和1字节接口数量
+        DevlistInterfaces,
+        Caps,
+        BatchLength,     // 批量帧头部之后的总长度
+        BatchEntry       // 批量帧中一个条目开头的flags
+    };
+
+    // 开始解码下一帧（批量帧未结束时为其中的下一个条目）
+    void startFrame();
+
+    // 一帧已完整：批量帧中的条目从剩余长度中扣除
+    void finishFrame();
+
+    // 在固定部分之后再拼装size字节作为part
+    void expect(Part part, size_t size);
+
+    // URB头部标记了负载编码：hasPayload为该方向是否带负载，plain为解压后的长度，检查之后拼装编码后的长度
+    void expectCoded(bool hasPayload, size_t plain);
+
+    // 当前段已拼装完整，解析它并决定下一步
+    void parsePart();
+
+    // 设备列表中的一个设备已完整，继续下一个或结束
+    void nextDevice();
+
+    // 固定部分结束，其后是size字节的负载（带校验的URB负载另加校验和）
+    void startPayload(size_t size);
+
+    // 分段的负载：上一段（或头部）prev已取出，开始接收下一段
+    void nextSegment(const usbip_packet& prev);
+
+    // 为size字节的负载分配缓冲区并开始接收；budget为true时计入预算，预算耗尽时停在负载之前，
+    // 超过预算上限时改为丢弃
+    void allocatePayload(size_t size, bool budget);
+
+    // 不接收size字节的负载，读过后交出以error标记的不带负载的包
+    void discardPayload(size_t size, int error);
+
+    // 释放当前负载计入预算的字节
+    void releaseCharge();
+
+    std::atomic<bool> urbPhase_;
+    Step step_;
+    Part part_;
+    std::vector<uint8_t> fixed_;  // 已拼装的固定部分
+    size_t partStart_;            // 当前段在fixed_中的起点
+    size_t want_;                 // 固定部分当前需要的总长度
+    uint32_t devicesLeft_;        // 设备列表中尚未拼装的设备数
+
+    // 正在解码的批量帧：条目的命令（不在批量帧中时为0）、头部中的版本和尚未解码的字节数
+    uint32_t batchCommand_;
+    uint32_t batchVersion_;
+    size_t batchLeft_;
+
+    usbip_packet packet_;
+    size_t filled_;               // 负载已填充（丢弃时为已读过）的字节数
+    size_t discarded_;            // 正在丢弃的负载长度，不丢弃时为0
+
+    // 分段交出负载的阈值和段长（阈值为0时不分段），以及正在分段的负载中尚未交出的字节数
+    size_t segmentThreshold_;
+    size_t segmentSize_;
+    size_t segmentLeft_;
+
+    // 负载缓冲区计入的预算、当前负载已计入的字节，以及停在负载之前时等待分配的长度
+    std::shared_ptr<MemoryBudget> budget_;
+    size_t charged_;
+    size_t blockedSize_;
+
+    // 压缩负载声明的解压后长度，未压缩时为0
+    size_t codedSize_;
+};
+
+#endif // FRAME_DECODER_H
@@ -0,0 +1,109 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+
+// io_uring的最小封装：直接使用系统调用，不依赖liburing
+// 只提供事件循环用到的几种操作：多次触发的accept/recv（配合内核提供缓冲区环）、
+// sendmsg、read和按user_data取消。非Linux平台或内核头文件过旧时supported()返回false。
+class IoUring {
+public:
+    struct Completion {
+        uint64_t userData;
+        int32_t res;
+        uint32_t flags;
+    };
+
+    IoUring();
+    ~IoUring();
+
+    // 禁止拷贝和赋值
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // 当前内核是否支持所需的全部特性（多次触发recv需要6.0以上）
+    static bool supported();
+
+    bool init(unsigned entries);
+
+    // 注册内核提供缓冲区环：count个size字节的缓冲区，count需为2的幂
+    bool setupBufferRing(uint16_t group, unsigned count, unsigned size);
+
+    // 准备各类请求，SQ已满时先提交已有的请求
+    bool prepAcceptMultishot(int fd, uint64_t userData);
+    bool prepRecvMultishot(int fd, uint16_t group, uint64_t userData);
+    bool prepPollMultishot(int fd, uint32_t events, uint64_t userData);
+    bool prepSendmsg(int fd, const struct msghdr* msg, uint64_t userData);
+    bool prepRead(int fd, void* buf, unsigned len, uint64_t userData);
+    bool prepCancel(uint64_t targetUserData, uint64_t userData);
+    bool prepClose(int fd, uint64_t userData);
+
+    // 一次系统调用提交所有已准备的请求，并等待至少waitNr个完成事件；
+    // timeoutMs不小于0时至多等待这么久，到时返回-ETIME（已提交的请求不受影响）
+    int submitAndWait(unsigned waitNr, int timeoutMs = -1);
+
+    // 取出已完成的事件，返回个数
+    size_t reapCompletions(Completion* out, size_t max);
+
+    // 完成事件携带的缓冲区编号，没有时返回false
+    static bool bufferId(const Completion& cqe, uint16_t& bid);
+
+    // 完成事件之后该多次触发请求是否仍然有效
+    static bool hasMore(const Completion& cqe);
+
+    uint8_t* buffer(uint16_t bid) { return bufferBase_ + static_cast<size_t>(bid) * bufferSize_; }
+
+    // 将缓冲区还给内核
+    void recycleBuffer(uint16_t bid);
+
+    // 全部接收缓冲区所在的内存，供调用者锁定
+    uint8_t* bufferArea() { return bufferStorage_.data(); }
+    size_t bufferAreaSize() const { return bufferStorage_.size(); }
+
+    // 统计：io_uring_enter调用次数和提交的请求数
+    uint64_t enterCalls() const { return enterCalls_; }
+    uint64_t submitted() const { return submitted_; }
+
+private:
+    void* getSqe();
+    void destroy();
+
+    int ringFd_;
+
+    // SQ/CQ环和SQE数组的映射
+    void* sqRing_;
+    size_t sqRingSize_;
+    void* cqRing_;
+    size_t cqRingSize_;
+    void* sqes_;
+    size_t sqesSize_;
+
+    unsigned* sqHead_;
+    unsigned* sqTail_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned cqMask_;
+    void* cqes_;
+
+    unsigned sqeTail_;    // 本地已准备到的位置
+    unsigned sqeFlushed_; // 已发布给内核的位置
+
+    // 提供缓冲区环
+    void* bufRing_;
+    size_t bufRingSize_;
+    unsigned bufCount_;
+    uint16_t bufTail_;
+    std::vector<uint8_t> bufferStorage_;
+    uint8_t* bufferBase_;
+    unsigned bufferSize_;
+
+    uint64_t enterCalls_;
+    uint64_t submitted_;
+};
+
+#endif // IO_URING_H
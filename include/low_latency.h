@@ -0,0 +1,29 @@
+#ifndef LOW_LATENCY_H
+#define LOW_LATENCY_H
+
+#include <chrono>
+#include <cstddef>
+#include <poll.h>
+
+// 忙轮询低延迟模式的辅助函数：线程绑核、预先缺页并锁定内存、先自旋后阻塞的poll
+
+// 为第index个自旋线程挑选CPU：从进程允许运行的CPU中按编号从高到低取（0号CPU通常还要处理中断和其他任务，
+// 留到最后），index超过可用数时循环使用。无法获取时返回-1
+int lowLatencyCpu(size_t index);
+
+// 进程允许运行的CPU数，无法获取时为硬件线程数
+size_t allowedCpuCount();
+
+// 把调用线程绑定到cpu（仅Linux），cpu小于0时不做处理
+bool pinThread(int cpu);
+
+// 逐页读写一次以预先缺页，再以mlock锁定，收发路径上不会再发生缺页和换出。
+// 锁定失败（如超过RLIMIT_MEMLOCK）时打印警告并返回false，内存仍可正常使用
+bool lockMemory(void* addr, size_t len);
+void unlockMemory(void* addr, size_t len);
+
+// 与poll()相同，但先以0时限轮询至多spin，期间就绪时立即返回，之后按timeoutMs的剩余部分阻塞等待；
+// spin为0时即poll()。被信号打断时重试
+int pollSpin(struct pollfd* fds, nfds_t count, int timeoutMs, std::chrono::microseconds spin);
+
+#endif // LOW_LATENCY_H
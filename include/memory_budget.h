@@ -0,0 +1,59 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// 内存预算：记录在途URB负载占用的字节数，达到上限后由使用者暂停接收新的请求，
+// 已接收的请求照常处理，用量随URB完成回落后再恢复。
+// 服务端每个连接一个预算，同时计入所有连接共享的上一级（全局）预算，任一级耗尽都算耗尽。
+// 计入、释放和等待可在任意线程中进行
+class MemoryBudget {
+public:
+    using Waiter = std::function<void()>;
+
+    // limit为0表示不限；parent不为空时计入本级的字节同时计入parent
+    explicit MemoryBudget(size_t limit, std::shared_ptr<MemoryBudget> parent = nullptr);
+
+    // 禁止拷贝和赋值
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // 计入bytes，总是成功：调用者在计入之前检查exhausted()，最后一次计入可以越过上限
+    void charge(size_t bytes);
+
+    // 释放之前计入的bytes，用量因此回到上限以下时唤醒等待者
+    void release(size_t bytes);
+
+    // 本级或上一级的用量已达到上限
+    bool exhausted() const;
+
+    // 单次计入的上限：本级和上一级上限中较小的一个，0为不限。超过它的请求永远无法满足，应直接拒绝
+    size_t capacity() const;
+
+    size_t used() const { return used_; }
+    size_t limit() const { return limit_; }
+
+    // 用量可能已回到上限以下时调用waiter一次（在释放内存的线程中，或登记时已不再耗尽则立即调用）。
+    // 上一级的用量回落也会唤醒，调用者应重新检查exhausted()，仍耗尽时再次等待
+    void wait(Waiter waiter);
+
+private:
+    // 取出并调用全部等待者
+    void wake();
+
+    const size_t limit_;
+    const std::shared_ptr<MemoryBudget> parent_;
+    std::atomic<size_t> used_;
+
+    // 等待者；waiting_在有等待者时为true，释放时不必每次加锁
+    std::mutex mutex_;
+    std::vector<Waiter> waiters_;
+    std::atomic<bool> waiting_;
+};
+
+#endif // MEMORY_BUDGET_H
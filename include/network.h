@@ -11,69 +11,578 @@
 #include <condition_variable>
 #include <atomic>
 #include <queue>
+#include <map>
+#include <deque>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "usbip_protocol.h"
+#include "usbip_wire.h"
+#include "ring_buffer.h"
+#include "frame_decoder.h"
+#include "output_queue.h"
+#include "event_loop.h"
+#include "shm_transport.h"
+#include "udp_transport.h"
+#include "tls.h"
+#include "payload_codec.h"
+#include "urb_window.h"
+#include "memory_budget.h"
 
 class TCPSocket {
 public:
-    TCPSocket() : sockfd_(-1) {}
-    explicit TCPSocket(int sockfd) : sockfd_(sockfd) {}
+    // 非阻塞接收的结果
+    enum class ReadStatus {
+        Packet,    // 取出了一个完整的包
+        NeedMore,  // 数据不足，等待下一次可读事件
+        Closed,    // 对端关闭连接
+        Error      // 接收或解析失败
+    };
+
+    TCPSocket() : sockfd_(-1), family_(AF_INET), timeoutMs_(-1), heartbeatMs_(0), busyPollUs_(0), integrity_(false), integrityErrors_(0), nonBlocking_(false), completionIo_(false), batchLimit_(0), batchEntries_(0), batchCommand_(0) {}
+    explicit TCPSocket(int sockfd, int family = AF_INET) : sockfd_(sockfd), family_(family), timeoutMs_(-1), heartbeatMs_(0), busyPollUs_(0), integrity_(false), integrityErrors_(0), nonBlocking_(false), completionIo_(false), batchLimit_(0), batchEntries_(0), batchCommand_(0) {}
     ~TCPSocket();
 
-    bool create();
+    // family为AF_INET、AF_INET6或AF_UNIX；IPv6套接字只监听IPv6（IPV6_V6ONLY），IPv4另开一个套接字
+    bool create(int family = AF_INET);
     bool bind(int port);
-    bool listen(int backlog = 5);
+    bool listen(int backlog = SOMAXCONN);
     bool connect(const std::string& host, int port);
+    
+    // Unix域套接字的绑定和连接（本地共享内存传输的握手通道）
+    bool bindLocal(const std::string& path);
+    bool connectLocal(const std::string& path);
+    
+    // 切换到共享内存传输：服务端创建共享内存并经本套接字发给对端，客户端接收。
+    // 之后帧的编解码不变，字节流改走共享内存环，本套接字只用于发现对端退出
+    bool offerSharedMemory();
+    bool acceptSharedMemory();
+    bool isSharedMemory() const { return shm_ != nullptr; }
+    
+    // 切换到数据报传输：双方经本套接字交换UDP端口，之后帧按端点分流走UDP，
+    // 本套接字只用于发现对端退出。客户端以acceptDatagram()阻塞交换；服务端在事件循环中
+    // 分步交换（DatagramTransport::beginOffer()），完成后以adoptDatagram()接管
+    bool acceptDatagram();
+    void adoptDatagram(std::unique_ptr<DatagramTransport> dgram);
+    bool isDatagram() const { return dgram_ != nullptr; }
+    
+    // 按rate的概率丢弃发出的数据报（测试重传用），未使用数据报传输时忽略
+    void setDatagramLoss(double rate);
+    
+    // 数据报传输统计，未使用时全为0
+    DatagramTransport::Stats datagramStats() const {
+        return dgram_ ? dgram_->stats() : DatagramTransport::Stats();
+    }
+    
+    // 数据是否经共享内存或数据报传输收发（本套接字只用于发现对端退出）
+    bool hasTransport() const { return shm_ || dgram_; }
+    
+    // 事件循环关注的描述符：普通套接字为其本身，共享内存传输为本端门铃，
+    // 数据报传输为其内部的epoll描述符
+    int pollFd() const { return shm_ ? shm_->doorbellFd() : dgram_ ? dgram_->pollFd() : sockfd_; }
+    
+    // 在阻塞模式下完成TLS握手，角色由context决定；客户端按peerHost验证服务端证书。
+    // 之后内核TLS接管的方向照常读写套接字，其余方向经OpenSSL在用户态加解密
+    bool startTls(const std::shared_ptr<TlsContext>& context, const std::string& peerHost = "");
+    bool isTls() const { return tls_ != nullptr; }
+    
+    // 接管已在本套接字上完成握手的TLS会话（服务端在事件循环中分步握手之后）
+    void adoptTls(std::unique_ptr<TlsSession> tls);
+    
+    // 是否有方向需要在用户态加解密（此时不能交给io_uring直接收发）
+    bool userspaceTls() const { return tls_ && (!tls_->kernelSend() || !tls_->kernelRecv()); }
+    
+    // 允许多个套接字绑定同一端口，Linux内核在它们之间分配新连接
+    bool setReusePort();
+    
+    // TCP Fast Open：监听套接字接受SYN中携带的数据（queue为等待完成握手的此类连接数上限），
+    // 连接前调用setFastOpenConnect()时connect()立即返回，第一次写出的数据随SYN发送。
+    // 后者要求本端先写，首次连接时内核只取得cookie，之后的连接才真正省去一个往返
+    bool setFastOpen(int queue);
+    bool setFastOpenConnect();
+    
+    // 让内核在ms毫秒内发现失联的对端：已发出的数据超过ms仍未确认时断开（TCP_USER_TIMEOUT），
+    // 空闲连接按秒级间隔发送保活探测；Unix域套接字不需要，直接返回true
+    bool setDeadPeerTimeout(int ms);
+    
+    // 把发送和接收缓冲区都设置为bytes字节（受net.core.wmem_max/rmem_max限制），之后内核不再自动调节；
+    // 共享内存和数据报传输不经过本套接字收发，直接返回true
+    bool setBufferSize(size_t bytes);
+    
+    // 忙轮询低延迟模式：关闭Nagle算法（TCP_NODELAY）并立即确认（TCP_QUICKACK，内核会自行退出，每次读取后重新设置），
+    // SO_BUSY_POLL让阻塞的读取在网卡队列上忙轮询us微秒（超过net.core.busy_read时需要CAP_NET_ADMIN），
+    // 预先缺页并锁定接收缓冲区；之后等待可读时先自旋us微秒再阻塞。
+    // 共享内存和数据报传输只锁定缓冲区；有设置失败时打印警告并返回false，其余设置仍然生效
+    bool setBusyPoll(int us);
+    int busyPoll() const { return busyPollUs_; }
+    
+    // 忙轮询模式下重新设置TCP_QUICKACK，收到数据之后调用，其他情况不做处理
+    void quickAck();
+    
+    // 能力交换同意了心跳：对端应至少每windowMs毫秒发来数据或心跳，超过时视为失联
+    void enableHeartbeat(int windowMs) { heartbeatMs_ = windowMs; }
+    int heartbeatWindow() const { return heartbeatMs_; }
+    
+    // 发送一个心跳帧；发送队列中已有待写出的数据时对端自会收到，不再追加。可在任意线程调用
+    bool sendHeartbeat();
+    
+    int family() const { return family_; }
     std::shared_ptr<TCPSocket> accept();
     
     bool send(const void* data, size_t size);
     bool receive(void* buffer, size_t size, size_t& bytesRead);
     
-    // 新增：带超时的接收方法
+    // 带超时的接收：超时只限制等待，由poll()完成，不修改套接字选项；timeoutSec不大于0时不限
     bool receiveWithTimeout(void* buffer, size_t size, size_t& bytesRead, int timeoutSec = 5);
     
-    // 新增：设置套接字超时
+    // 设置阻塞模式下单次收发的超时（SO_RCVTIMEO/SO_SNDTIMEO），连接建立时设置一次
     bool setTimeout(int seconds);
     
     bool isValid() const { return sockfd_ >= 0; }
     void close();
     
+    // 交出文件描述符（由调用者负责关闭），套接字随后视为已关闭
+    int release();
+    
+    int fd() const { return sockfd_; }
+    
+    // 切换为非阻塞模式，由事件循环驱动读写
+    bool setNonBlocking(bool enable);
+    bool isNonBlocking() const { return nonBlocking_; }
+    
+    // 收发由外部的完成式I/O（io_uring）代为进行：收到的数据经feed()送入，
+    // 发送队列经prepareSend()/completeSend()写出
+    void setCompletionIo(bool enable) { completionIo_ = enable; }
+    
+    // 接收缓冲区中尚未送入解码器的字节数
+    size_t bufferedBytes() const { return rxBuffer_.size(); }
+    
+    // 连接所处的阶段：握手阶段收发的0x0003为OP_REP_IMPORT，URB阶段为RET_SUBMIT
+    FrameDecoder::Phase phase() const { return decoder_.phase(); }
+    
     // 发送和接收完整的USBIP包
     bool sendPacket(const usbip_packet& packet);
     bool receivePacket(usbip_packet& packet);
     
-    // 新增：带超时的接收包方法
+    // 带超时的接收包：超时发生在帧中间时，已收到的部分留在解码器中，下次接收从断点继续
     bool receivePacketWithTimeout(usbip_packet& packet, int timeoutSec = 5);
+    
+    // 取出下一个包：缓冲区中已有完整帧时不做系统调用；非阻塞模式下最多读一次套接字，
+    // 阻塞模式下一直读到取出一个包、出错或超时（超时返回NeedMore，已收到的部分帧保留到下次）。
+    // 正在接收的负载直接读入包的data
+    ReadStatus readPacket(usbip_packet& packet);
+    
+    // 只从已缓冲的数据中取出下一个包，不做系统调用；数据不足时返回NeedMore
+    ReadStatus nextBufferedPacket(usbip_packet& packet);
+    
+    // 送入外部收到的数据，返回接受的字节数；解码器中有未取出的包且缓冲区已满时需先取出包再送入剩余部分
+    size_t feed(const uint8_t* data, size_t len);
+    
+    // 将回复放入发送队列（负载被移动，不拷贝），由flush/flushIfDue统一写出
+    // 可在任意线程调用
+    bool queuePacket(usbip_packet&& packet);
+    
+    // 回复进入发送队列后的通知（可能在其他线程中调用），事件循环据此安排写出
+    void setOutputNotifier(std::function<void()> notifier) { outputNotifier_ = std::move(notifier); }
+    
+    // 写出发送队列中的全部数据
+    bool flush();
+    
+    // 非阻塞地写出发送队列，返回Pending时需等待可写事件后再次调用
+    OutputQueue::FlushResult flushSome();
+    
+    // 读取暂停期间处理共享内存和数据报传输自身的事件（门铃、确认、重传），使发送得以继续；
+    // 收到的数据留在传输层，恢复读取后再读出。普通套接字不做处理
+    void serviceTransport();
+    
+    // 读取错误队列中的零拷贝完成通知
+    void reapZeroCopyCompletions();
+    
+    // 把发送队列前部映射为iovec供异步发送，返回段数；在completeSend之前iovec保持有效
+    int prepareSend(struct iovec* iov, int maxIov);
+    
+    // 异步发送写出了n字节
+    void completeSend(size_t n);
+    
+    // 按冲刷策略决定是否写出：接收缓冲区中已没有完整的帧（下一次接收将阻塞），
+    // 或队列深度、积压字节、等待时间达到上限
+    bool flushIfDue();
+    
+    // 设置发送队列的冲刷策略
+    void setCorkPolicy(const OutputQueue::Policy& policy) {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        txQueue_.setPolicy(policy);
+    }
+    
+    // 开启MSG_ZEROCOPY发送：负载达到threshold字节的帧由内核直接引用用户内存发送
+    // 缓冲区在收到完成通知后才回收；不支持时返回false并保持普通发送
+    bool enableZeroCopy(size_t threshold);
+    
+    // 零拷贝发送统计
+    const OutputQueue::ZeroCopyStats& zeroCopyStats() const { return txQueue_.zeroCopyStats(); }
+    
+    // 取得一个回复负载缓冲区，优先复用已发送完毕（零拷贝时为内核已完成）的缓冲区
+    std::vector<uint8_t> acquireBuffer(size_t size) {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        return txQueue_.acquireBuffer(size);
+    }
+    
+    // 开启负载压缩：此后CMD_SUBMIT/RET_SUBMIT的负载按policy以编号为codecId的编码压缩发送。
+    // 收到的压缩负载只在编号与开启的编码相同时解压，其他编号（包括未开启时的任何编号）按数据错乱断开连接。
+    // 开启后不再更换：同一连接上再次导入时
+    // 其他设备的URB可能正在其他线程中压缩，编码相同时沿用原来的压缩器，不同时返回false
+    bool enableCompression(uint8_t codecId, const PayloadCompressor::Policy& policy);
+    bool compressionEnabled() const {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        return compressor_ != nullptr;
+    }
+    
+    // 压缩统计，未开启时全为0
+    PayloadCompressor::Stats compressionStats() const {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        return compressor_ ? compressor_->stats() : PayloadCompressor::Stats();
+    }
+    
+    // 开启完整性校验：此后发送的URB负载之后附带CRC32C，开启后不再关闭。收到的带校验的负载总是验证，
+    // 不符时包仍交给上层，但标记为URB错误（-EILSEQ）：CMD_SUBMIT记在头部状态中，RET_SUBMIT记在URB状态中
+    void enableIntegrity() {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        integrity_ = true;
+    }
+    bool integrityEnabled() const {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        return integrity_;
+    }
+    
+    // 校验失败的负载数
+    uint64_t integrityErrors() const { return integrityErrors_; }
+    
+    // 开启批量帧：此后连续放入发送队列的小URB（同一设备的同一端点和方向）合并为一个批量帧，
+    // 每帧至多maxEntries个；发送队列写出时正在合并的批量帧随之结束，只有一个条目时按普通帧发送。
+    // 收到的批量帧总是拆开解码，需在能力交换中双方同意后才调用
+    void enableBatching(size_t maxEntries) {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        batchLimit_ = maxEntries;
+    }
+    bool batchingEnabled() const { return batchLimit_ > 1; }
+    
+    // 在途URB负载的内存预算（服务端连接），由服务器在接管连接时设置；未设置时为空，不做限制。
+    // 接收中的OUT负载从分配缓冲区起即计入，预算耗尽时停在头部之后，不再读取
+    void setMemoryBudget(std::shared_ptr<MemoryBudget> budget) {
+        decoder_.setMemoryBudget(budget);
+        memoryBudget_ = std::move(budget);
+    }
+    const std::shared_ptr<MemoryBudget>& memoryBudget() const { return memoryBudget_; }
+    
+    // 收到的URB头部之后的负载在等待内存预算，调用者应暂停读取，预算回落后再继续
+    bool payloadBlocked() const { return decoder_.payloadBlocked(); }
+    
+    // 发送队列中尚未写出的字节数
+    size_t queuedBytes() {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        return txQueue_.bytes();
+    }
+    
+    // 负载不小于threshold字节的CMD_SUBMIT OUT（未压缩、不带校验）分段交给上层：先是不带负载的头部，
+    // 之后每段segment字节，设备可以在负载收齐之前开始传输；threshold为0时关闭
+    void enableSegmentation(size_t threshold, size_t segment) { decoder_.setSegmentation(threshold, segment); }
+    
+    // 已缓冲的数据中是否已有一个完整的帧（会把缓冲的数据送入解码器）
+    bool hasCompleteFrame() {
+        decodeBuffered();
+        return decoder_.hasPacket();
+    }
 
 private:
+    // 读取一次传输层（套接字或共享内存）；timeoutMs为共享内存和数据报传输等待数据的时间，
+    // 套接字的等待由SO_RCVTIMEO限制
+    ssize_t readSome(struct iovec* iov, int iovcnt, int timeoutMs);
+    
+    // 阻塞模式下单次读取的等待时间
+    int readTimeout() const { return nonBlocking_ ? 0 : timeoutMs_; }
+    
+    // 读一次传输层：正在接收的负载直接读入包中，多出的字节（后续帧）收进缓冲区。返回值同readSome
+    ssize_t readIntoDecoder(int timeoutMs);
+    
+    // 等待至多timeoutMs毫秒直到有数据可读；共享内存和数据报传输在读取时自行等待，总是返回true
+    bool waitReadable(int timeoutMs);
+    
+    // 写出发送队列，timeoutMs为共享内存传输环满或数据报传输未确认数据过多时的等待时间；调用者持有txMutex_
+    OutputQueue::FlushResult flushQueue(int timeoutMs);
+    
+    // 一次recv读取内核中尽可能多的数据到接收缓冲区
+    bool fillBuffer();
+    
+    // 把接收缓冲区中的数据送入解码器，直到解出一个包或缓冲区取空
+    void decodeBuffered();
+    
+    // 解码器解出的包交给上层之前的处理：负载校验和解压，握手包的日志
+    bool finishPacket(usbip_packet& packet);
+    
+    // 按iovec写出全部数据
+    bool sendv(struct iovec* iov, int iovcnt);
+    
+    // 将头部和命令相关的固定部分编码到out，返回字节数
+    size_t encodePacketHead(const usbip_packet& packet, uint8_t* out);
+    
+    // 只编码头部之后的固定部分（批量帧的条目中头部只保留flags）
+    size_t encodePacketBody(const usbip_packet& packet, uint8_t* out);
+    
+    // 把一个URB追加到正在合并的批量帧，crc为负载的校验和（未附加时忽略）；调用者持有txMutex_
+    void appendBatchEntry(usbip_packet& packet, uint32_t flow, uint16_t stream, bool checksum, uint32_t crc);
+    
+    // 结束正在合并的批量帧并放入发送队列；调用者持有txMutex_
+    void closeBatch();
+    
+    // URB负载需要压缩时就地替换为压缩结果并在帧头中记录编码
+    void compressPayload(usbip_packet& packet, PayloadCompressor& compressor);
+    
+    // 负载收完之后按帧头中的编码解压，未压缩的包原样返回true
+    bool decompressPayload(usbip_packet& packet);
+    
+    // 负载收完之后：取下校验、解压并验证，连接无法继续时返回false
+    bool finishPayload(usbip_packet& packet);
+    
     int sockfd_;
+    int family_;
+    int timeoutMs_;  // 收发超时，共享内存传输等待门铃时使用；-1为不限
+    int heartbeatMs_;  // 协商的心跳时限，0为未开启
+    int busyPollUs_;   // 忙轮询的自旋时长（微秒），0为未开启
+    
+    // 本地共享内存传输，未启用时为空
+    std::unique_ptr<ShmTransport> shm_;
+    
+    // 数据报传输，未启用时为空
+    std::unique_ptr<DatagramTransport> dgram_;
+    
+    // TLS会话，未启用时为空
+    std::unique_ptr<TlsSession> tls_;
+    
+    // 发送方向的负载压缩，未协商时为空。与integrity_一起由txMutex_保护：
+    // 发送路径在锁内取得副本，在锁外压缩，协商发生在其他线程中也不会释放正在使用的压缩器
+    std::shared_ptr<PayloadCompressor> compressor_;
+    
+    // 发送的URB负载附带CRC32C
+    bool integrity_;
+    std::atomic<uint64_t> integrityErrors_;
+    
+    bool nonBlocking_;
+    bool completionIo_;
+    
+    // 每个连接的接收环形缓冲区
+    RingBuffer rxBuffer_;
+    
+    // 接收方向的帧解码器，同时记录连接所处的阶段：收到或发出第一个CMD_SUBMIT之后进入URB阶段，
+    // 之前可以有多个导入响应（一个连接导入多个设备）
+    FrameDecoder decoder_;
+    
+    // 每个连接的发送队列，USB完成回调线程和事件循环线程都会访问
+    mutable std::mutex txMutex_;
+    OutputQueue txQueue_;
+    std::function<void()> outputNotifier_;
+    
+    // 在途URB负载的内存预算，未设置时为空
+    std::shared_ptr<MemoryBudget> memoryBudget_;
+    
+    // 批量帧：每帧的条目上限（0为不合并），正在合并的帧、其条目数和条目的命令
+    size_t batchLimit_;
+    OutputFrame batch_;
+    size_t batchEntries_;
+    uint32_t batchCommand_;
 };
 
+// 基于事件循环的TCP服务器
+// 固定数量的工作线程各运行一个EventLoop，同时监听IPv4和IPv6。
+// Linux上每个循环各有一组SO_REUSEPORT监听套接字，由内核把新连接分散到各循环；
+// 其他平台由第一个循环监听，新连接轮流分配。连接上的读写都在所属循环的线程中完成。
+// 设置本地路径后还监听该Unix域套接字，经它连接的本机客户端改用共享内存传输；
+// 设置数据报端口后还监听该TCP端口，经它连接的客户端改用UDP数据报传输
 class Server {
 public:
-    explicit Server(int port);
+    using ConnectionHandler = std::function<void(std::shared_ptr<TCPSocket>)>;
+    
+    // 收到完整的包时调用，返回false时关闭连接
+    using PacketHandler = std::function<bool(const std::shared_ptr<TCPSocket>&, usbip_packet&)>;
+    
+    // URB超过处理时限时调用，devid和seqnum取自该URB的CMD_SUBMIT；URB可能已经完成
+    using UrbTimeoutHandler = std::function<void(const std::shared_ptr<TCPSocket>&, uint32_t devid, uint32_t seqnum)>;
+    
+    // numWorkers为0时按CPU核数创建工作线程
+    explicit Server(int port, size_t numWorkers = 0);
     ~Server();
     
     bool start();
     void stop();
     
-    // 设置新连接回调
-    void setConnectionHandler(std::function<void(std::shared_ptr<TCPSocket>)> handler) {
+    // 设置新连接回调（在连接所属的工作线程中调用）
+    void setConnectionHandler(ConnectionHandler handler) {
         connectionHandler_ = std::move(handler);
     }
+    
+    // 设置收包回调（在连接所属的工作线程中调用）
+    void setPacketHandler(PacketHandler handler) {
+        packetHandler_ = std::move(handler);
+    }
+    
+    // 设置连接关闭回调（在连接所属的工作线程中调用）
+    void setCloseHandler(ConnectionHandler handler) {
+        closeHandler_ = std::move(handler);
+    }
+    
+    // 设置URB超时回调（在连接所属的工作线程中调用）
+    void setUrbTimeoutHandler(UrbTimeoutHandler handler) {
+        urbTimeoutHandler_ = std::move(handler);
+    }
+    
+    size_t workerCount() const { return workers_.size(); }
+    size_t connectionCount() const { return connectionCount_; }
+    
+    // delay之后在工作线程中执行task：在工作线程中调用时由该线程的时间轮计时，否则交给第一个工作线程。
+    // 服务器停止时尚未到期的任务不再执行
+    void runAfter(std::chrono::milliseconds delay, std::function<void()> task);
+    
+    // 连接超过ms毫秒没有收到任何数据时关闭，0表示不限；需在start()之前设置
+    void setIdleTimeout(int ms) { idleTimeoutMs_ = ms; }
+    
+    // CMD_SUBMIT分发之后超过ms毫秒时调用URB超时回调，0表示不限；需在start()之前设置。
+    // 两种时限都由工作线程的时间轮管理，在一轮I/O事件处理完之后检查，不打断正在分发的请求
+    void setUrbTimeout(int ms) { urbTimeoutMs_ = ms; }
+    
+    // TCP连接由内核在约ms毫秒内发现失联的对端（TCP_USER_TIMEOUT和保活探测），0表示不设置；需在start()之前设置。
+    // 同意了心跳的连接另按其心跳时限计时，期间收不到任何数据即关闭，与空闲时限取较小值
+    void setDeadPeerTimeout(int ms) { deadPeerMs_ = ms; }
+    
+    // 内核支持时使用io_uring收发（默认开启），需在start()之前设置
+    void setIoUring(bool enable) { useIoUring_ = enable; }
+    
+    // 同时监听path处的Unix域套接字，供本机客户端以共享内存传输连接，需在start()之前设置
+    void setLocalPath(const std::string& path) { localPath_ = path; }
+    
+    // 同时在port上监听TCP控制连接，经它连接的客户端改用数据报（UDP）传输，需在start()之前设置
+    void setDatagramPort(int port) { datagramPort_ = port; }
+    
+    // 数据报连接按rate的概率丢弃发出的数据报，用于测试重传
+    void setDatagramLoss(double rate) { datagramLoss_ = rate; }
+    
+    // TCP连接（含附加数据连接）先完成TLS握手再收发，需在start()之前设置；
+    // 本地共享内存连接不加密，数据报传输不支持TLS，设置后不再监听数据报端口
+    void setTls(std::shared_ptr<TlsContext> context) { tls_ = std::move(context); }
+    bool usingIoUring() const { return backend_ == EventLoop::Backend::IoUring; }
+    
+    // 在途URB负载的内存预算：每个连接至多perConnection字节，所有连接合计至多total字节，0表示不限；
+    // 需在start()之前设置。连接的预算或全局预算耗尽后暂停读取该连接（TCP随之向客户端施加背压），
+    // 用量随URB完成回落后恢复；发送队列积压超过perConnection字节时同样暂停读取（共享内存和数据报传输也不例外）
+    void setMemoryBudget(size_t perConnection, size_t total) {
+        connectionBudget_ = perConnection;
+        totalBudget_ = total;
+    }
+    
+    // 所有连接在途URB负载占用的字节数
+    size_t memoryInUse() const { return memoryBudget_ ? memoryBudget_->used() : 0; }
+    
+    // 全局预算（start()之后才有）：连接之外长期持有的负载同样计入，例如可恢复会话的重放历史
+    const std::shared_ptr<MemoryBudget>& memoryBudget() const { return memoryBudget_; }
+    
+    // 忙轮询低延迟模式，us为自旋时长（微秒），0表示关闭；需在start()之前设置。
+    // 第i个工作线程绑定到lowLatencyCpu(i)，有I/O事件之后自旋us微秒才阻塞等待；
+    // 连接按TCPSocket::setBusyPoll()设置套接字选项并锁定接收缓冲区
+    void setBusyPoll(int us) { busyPollUs_ = us; }
+    int busyPoll() const { return busyPollUs_; }
 
 private:
-    void acceptLoop();
+    struct Connection;
+    struct Worker;
+    struct Handshake;
+    
+    // 为worker打开IPv4和IPv6监听套接字并注册到其循环，至少一个成功时返回true
+    bool openListeners(Worker* worker, bool reusePort);
+    
+    // 打开本地（Unix域）监听套接字，由worker负责接受
+    bool openLocalListener(Worker* worker);
+    
+    // 打开数据报传输的控制连接监听套接字，由worker负责接受
+    bool openDatagramListener(Worker* worker);
+    
+    // 把监听套接字注册到worker的循环，datagram表示经它接受的连接改用数据报传输
+    bool registerListener(Worker* worker, const std::shared_ptr<TCPSocket>& listener, bool datagram = false);
+    
+    // 监听套接字可读：接受所有排队的连接
+    void onAcceptable(Worker* worker, TCPSocket& listener, bool datagram);
+    
+    // 交给接受它的循环（分片监听时）或轮流分配给各工作线程
+    void dispatchConnection(Worker* acceptor, std::shared_ptr<TCPSocket> socket, bool datagram);
+    
+    // io_uring后端收到数据：送入接收缓冲区并处理其中所有完整的请求
+    void onConnectionData(const std::shared_ptr<Connection>& conn, const uint8_t* data, ssize_t len);
+    
+    // 在工作线程中接管一个新连接：需要握手时先开始握手，否则直接启用
+    void attach(Worker* worker, std::shared_ptr<TCPSocket> socket, bool datagram);
+    
+    // 握手在循环中按套接字就绪分步进行，时限由时间轮计时，缓慢或沉默的客户端不会占住工作线程。
+    // 握手成功时启用连接，失败或超时时关闭
+    void startHandshake(Worker* worker, const std::shared_ptr<Handshake>& handshake);
+    void continueHandshake(Worker* worker, const std::shared_ptr<Handshake>& handshake);
+    void endHandshake(Worker* worker, const std::shared_ptr<Handshake>& handshake, bool done);
+    
+    // 启用一个已完成握手的连接：切换到非阻塞模式并注册到worker的循环
+    void activate(Worker* worker, std::shared_ptr<TCPSocket> socket);
+    
+    void onConnectionEvent(const std::shared_ptr<Connection>& conn, uint32_t events);
+    void flushConnection(const std::shared_ptr<Connection>& conn);
+    
+    // 连接的空闲时限：空闲时限和心跳时限中的较小值，0为不限
+    int idleLimitMs(const Connection& conn) const;
+    
+    // 空闲时限到达：期间收到过数据时顺延，否则关闭连接
+    void armIdleTimer(const std::shared_ptr<Connection>& conn);
+    void onIdleTimer(const std::shared_ptr<Connection>& conn);
+    
+    // io_uring后端的冲刷：每个连接同时只有一个发送在进行
+    void sendConnection(const std::shared_ptr<Connection>& conn);
+    
+    // 把io_uring收到的数据送入接收缓冲区并处理其中的请求，暂停读取时把剩余的数据留到恢复时；
+    // 连接因此被关闭时返回false
+    bool feedConnection(const std::shared_ptr<Connection>& conn, const uint8_t* data, size_t len);
+    
+    // 逐个取出请求交给packetHandler_，readSocket为false时只处理已缓冲的数据；内存预算耗尽时暂停读取并返回。
+    // 连接因此被关闭时返回false
+    bool dispatchPackets(const std::shared_ptr<Connection>& conn, bool readSocket);
+    
+    // 连接的内存预算已耗尽或发送队列积压过多
+    bool overBudget(Connection& conn);
+    
+    // 暂停读取连接，等待预算回落或发送队列写出后恢复
+    void pauseReading(const std::shared_ptr<Connection>& conn);
+    void resumeReading(const std::shared_ptr<Connection>& conn);
+    void closeConnection(const std::shared_ptr<Connection>& conn);
     
     int port_;
+    std::string localPath_;
+    int datagramPort_;
+    double datagramLoss_;
+    std::shared_ptr<TlsContext> tls_;
+    size_t numWorkers_;
+    bool useIoUring_;
+    EventLoop::Backend backend_;
     std::atomic<bool> running_;
-    TCPSocket serverSocket_;
-    std::thread acceptThread_;
-    std::function<void(std::shared_ptr<TCPSocket>)> connectionHandler_;
+    bool shardedAccept_;  // 每个循环各自监听（SO_REUSEPORT）
+    std::vector<std::unique_ptr<Worker>> workers_;
+    size_t nextWorker_;
+    std::atomic<size_t> connectionCount_;
+    int idleTimeoutMs_;
+    int urbTimeoutMs_;
+    int deadPeerMs_;
+    size_t connectionBudget_;
+    size_t totalBudget_;
+    std::shared_ptr<MemoryBudget> memoryBudget_;  // 全局预算，start()时创建
+    int busyPollUs_;
+    
+    ConnectionHandler connectionHandler_;
+    PacketHandler packetHandler_;
+    ConnectionHandler closeHandler_;
+    UrbTimeoutHandler urbTimeoutHandler_;
 };
 
 class Client {
@@ -82,19 +591,157 @@ public:
     ~Client();
     
     bool connect(const std::string& host, int port);
+    
+    // 经本地Unix域套接字连接同一主机上的服务端，之后使用共享内存传输
+    bool connectLocal(const std::string& path);
+    
+    // 经数据报传输的控制端口连接服务端，之后使用UDP传输（不支持TLS）
+    bool connectDatagram(const std::string& host, int port);
+    
+    // 此后的TCP连接（含附加数据连接）先完成TLS握手并验证服务端证书，需在connect()之前设置
+    void setTls(std::shared_ptr<TlsContext> context) { tls_ = std::move(context); }
+    
+    // 此后的TCP连接（含附加数据连接）使用TCP Fast Open，需在connect()之前设置。
+    // 连接后须由本端先写，数据报传输的控制连接不适用
+    void setFastOpen(bool enable) { fastOpen_ = enable; }
+    
+    // 此后的连接（含附加数据连接）使用忙轮询低延迟模式，us为自旋时长（微秒），需在connect()之前设置。
+    // 套接字设置见TCPSocket::setBusyPoll()，等待回复时先自旋us微秒再阻塞
+    void setBusyPoll(int us) { busyPollUs_ = us; }
     void disconnect();
     
     // 发送和接收USBIP包
+    // CMD_SUBMIT受在途窗口限制：窗口已满时暂存，收到回复腾出位置后按顺序发出，sendPacket()仍返回true
     bool sendPacket(const usbip_packet& packet);
     bool receivePacket(usbip_packet& packet);
     
+    // 握手阶段的流水线：在控制连接上一次写出多个请求，回复按请求的顺序依次接收
+    bool sendPackets(std::vector<usbip_packet>& packets);
+    
     // 新增：带超时的接收包方法
+    // 有数据连接时等待任一连接上的下一个包，各连接轮流优先
     bool receivePacketWithTimeout(usbip_packet& packet, int timeoutSec = 5);
     
+    // 导入时协商出负载编码后开启发送方向的压缩，之后打开的数据连接同样开启
+    bool enableCompression(uint8_t codecId, const PayloadCompressor::Policy& policy);
+    
+    // 导入时协商出负载校验后开启
+    void enableIntegrity();
+    
+    // 连接建立后、获取设备列表之前与服务端交换能力：提出批量帧（每帧至多maxBatch个URB，0为不提出）
+    // 和心跳（失联时限heartbeatMs毫秒，0为不提出），服务端同意后本连接开启，之后打开的数据连接同样交换。
+    // 同意心跳时各连接每隔时限的四分之一发送一次心跳，并由内核在同样的时限内发现服务端失联。
+    // 不调用时连接保持标准帧格式
+    bool exchangeCaps(size_t maxBatch, int heartbeatMs = 0);
+    
+    // 与exchangeCaps()相同，但分为两步，以便请求与其他握手请求一起写出：
+    // capsRequest()记下提出的能力并返回请求，收到回复后由acceptCaps()在控制连接上开启服务端同意的能力
+    usbip_packet capsRequest(size_t maxBatch, int heartbeatMs = 0);
+    bool acceptCaps(const usbip_packet& reply);
+    
+    // 导入成功后打开count条附加数据连接并加入服务端的会话session。
+    // 之后端点0的URB仍走本连接（控制连接），其余URB按seqnum分散到各数据连接，
+    // 回复从请求所在的连接返回；部分连接失败时以已打开的连接继续
+    bool openStreams(size_t count, const usbip_wire::SessionToken& session, const std::string& busid);
+    size_t streamCount() const { return streams_.size(); }
+    
+    // 导入时服务端同意了可恢复的会话：记下会话号，此后发出的URB保留到收到回复为止
+    void addResumable(const std::string& busid, const usbip_wire::SessionToken& session) {
+        resumables_.emplace_back(busid, session);
+    }
+    bool resumable() const { return !resumables_.empty(); }
+    
+    // 连接中断后以原来的方式重新连接，重新交换能力，在新连接上接续所有可恢复的会话并重新打开数据连接，
+    // 之后重新提交尚未收到回复的URB（服务端对已完成的重放回复，对仍在进行的不再提交）。
+    // 任一会话无法接续（如已超过服务端的宽限期）时返回false
+    bool resume();
+    
+    // 在途窗口的当前状态：窗口、在途URB数、RTT和估计的带宽；以及因窗口已满暂存的URB数
+    UrbWindow::Stats windowStats() const { return window_.stats(); }
+    size_t heldCount() const { return held_.size(); }
+    
+    // 是否使用共享内存传输（此时不协商压缩）
+    bool isSharedMemory() const { return socket_ && socket_->isSharedMemory(); }
+    
+    // 是否使用数据报传输（此时不打开附加数据连接）
+    bool isDatagram() const { return socket_ && socket_->isDatagram(); }
+    
+    // 数据报传输按rate的概率丢弃发出的数据报，用于测试重传，需在连接之后调用
+    void setDatagramLoss(double rate) { socket_->setDatagramLoss(rate); }
+    
     bool isConnected() const { return socket_ && socket_->isValid(); }
 
 private:
+    // 发送packet使用的连接
+    TCPSocket& route(const usbip_packet& packet);
+    
+    // 从控制连接或任一数据连接接收一个包，返回收到它的连接，超时或出错时返回nullptr
+    TCPSocket* receiveAny(usbip_packet& packet, int timeoutSec);
+    
+    // 收到URB回复：计入在途窗口并发出暂存的URB；可恢复的会话中从未完成的URB中移除，
+    // 重复的回复（恢复后的重放）返回false
+    bool acknowledge(const TCPSocket& socket, const usbip_packet& packet);
+    
+    // 发出一个CMD_SUBMIT并计入在途窗口
+    bool submit(const usbip_packet& packet);
+    
+    // 窗口有空位时按顺序发出暂存的URB
+    void releaseHeld();
+    
+    // 带宽时延积增长后相应增大各连接的套接字缓冲区
+    void adaptBuffers();
+    
+    // 在socket上完成一次能力交换，服务端同意的能力在socket上开启
+    bool negotiate(const std::shared_ptr<TCPSocket>& socket);
+    
+    // 按batchLimit_和heartbeatMs_组装能力交换请求，以及在socket上开启回复中同意的能力
+    usbip_packet makeCapsRequest() const;
+    bool applyCaps(const std::shared_ptr<TCPSocket>& socket, const usbip_packet& reply);
+    
+    // 心跳线程：定期在同意了心跳的各连接上发送心跳
+    void heartbeatLoop(int intervalMs);
+    void stopHeartbeat();
+    
     std::shared_ptr<TCPSocket> socket_;
+    std::string host_;
+    int port_;
+    std::string localPath_;  // 经共享内存传输连接时的路径
+    bool datagram_;          // 经数据报传输连接
+    bool fastOpen_;          // TCP连接使用TCP Fast Open
+    int busyPollUs_;         // 忙轮询的自旋时长（微秒），0为不使用
+    std::shared_ptr<TlsContext> tls_;
+    
+    // 附加数据连接，以及它们要沿用的负载编码和校验设置
+    std::vector<std::shared_ptr<TCPSocket>> streams_;
+    size_t nextStream_;
+    uint8_t codecId_;
+    PayloadCompressor::Policy policy_;
+    bool integrity_;
+    
+    // 数据连接加入的会话和希望的条数，恢复时按它们重新打开
+    usbip_wire::SessionToken streamSession_;
+    std::string streamBusid_;
+    size_t streamTarget_;
+    
+    // 可恢复的会话（总线ID和会话号），以及已发出尚未收到回复的URB（按seqnum）
+    std::vector<std::pair<std::string, usbip_wire::SessionToken>> resumables_;
+    std::map<uint32_t, usbip_packet> unacked_;
+    
+    // 在途窗口、窗口已满时暂存的URB，以及已设置的套接字缓冲区大小（0为内核默认）
+    UrbWindow window_;
+    std::deque<usbip_packet> held_;
+    size_t bufferBytes_;
+    
+    // 能力交换中提出的批量帧条目上限和心跳时限，都为0时不交换
+    size_t batchLimit_;
+    int heartbeatMs_;
+    
+    // 同意了心跳的连接和发送心跳的线程
+    std::vector<std::shared_ptr<TCPSocket>> heartbeatSockets_;
+    std::thread heartbeatThread_;
+    std::mutex heartbeatMutex_;
+    std::condition_variable heartbeatCv_;
+    bool heartbeatStop_;
 };
 
 #endif // NETWORK_H 
\ No newline at end of file
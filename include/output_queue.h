@@ -0,0 +1,163 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <sys/uio.h>
+#include "usbip_wire.h"
+
+// 待发送的一帧：编码后的固定部分 + 负载 + 负载之后的校验（可选）
+struct OutputFrame {
+    uint8_t head[usbip_wire::kMaxHeadSize];
+    size_t headLen = 0;
+    std::vector<uint8_t> payload;
+    std::shared_ptr<const std::vector<uint8_t>> shared;  // 与其他持有者共用的只读负载，不为空时代替payload
+    uint8_t trailer[usbip_wire::kTrailerSize];
+    size_t trailerLen = 0;
+
+    const uint8_t* payloadData() const { return shared ? shared->data() : payload.data(); }
+    size_t payloadSize() const { return shared ? shared->size() : payload.size(); }
+    size_t size() const { return headLen + payloadSize() + trailerLen; }
+
+    // 所属的流（URB帧为其devid），积压时不同流之间按字节轮流发送，同一流内保持顺序
+    uint32_t flow = 0;
+
+    // 数据报传输中所属的有序流（按设备和端点划分），0为导入等非URB帧
+    uint16_t stream = 0;
+
+    // 负载通过MSG_ZEROCOPY发送时，覆盖它的通知序号范围
+    bool zeroCopy = false;
+    uint32_t zcFirst = 0;
+    uint32_t zcLast = 0;
+    uint32_t zcCompleted = 0;  // 帧还在队列中时已到达的通知数（非阻塞发送可能只写出一部分）
+};
+
+// 每个连接的发送队列
+// 已就绪的回复先进入队列（cork），满足冲刷条件后用一次writev批量写出，
+// 减少小URB较多时的系统调用次数和网络上的小包数量。
+// 一个连接承载多个设备时，已排定发送顺序的数据超过公平窗口后新帧按流暂存，
+// 再以差额轮转（DRR）从各流中取出，繁忙的设备不会让其他设备的回复长时间排在其后
+class OutputQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // 冲刷策略：队列深度、积压字节数或最早一帧的等待时间任一达到上限即冲刷
+    struct Policy {
+        size_t maxFrames = 32;
+        size_t maxBytes = 256 * 1024;
+        std::chrono::microseconds deadline{200};
+        size_t fairWindow = 512 * 1024;  // 排定发送顺序的字节上限，0表示严格按入队顺序
+    };
+
+    enum class FlushResult {
+        Done,     // 队列已清空
+        Pending,  // 套接字暂时不可写，剩余数据仍在队列中
+        Error     // 发送失败
+    };
+
+    // 零拷贝发送统计
+    struct ZeroCopyStats {
+        uint64_t sends = 0;      // MSG_ZEROCOPY发送次数
+        uint64_t completed = 0;  // 已完成通知的发送次数
+        uint64_t copied = 0;     // 内核回退为拷贝的发送次数
+        uint64_t fallbacks = 0;  // 因ENOBUFS改用普通发送的次数
+    };
+
+    OutputQueue();
+
+    void setPolicy(const Policy& policy) { policy_ = policy; }
+    const Policy& policy() const { return policy_; }
+
+    // 负载达到threshold字节时以MSG_ZEROCOPY发送，0表示关闭
+    // 调用前套接字需已开启SO_ZEROCOPY
+    void setZeroCopyThreshold(size_t threshold) { zeroCopyThreshold_ = threshold; }
+    size_t zeroCopyThreshold() const { return zeroCopyThreshold_; }
+    const ZeroCopyStats& zeroCopyStats() const { return zcStats_; }
+
+    void push(OutputFrame&& frame);
+
+    bool empty() const { return frames_.empty() && stagedFrames_ == 0; }
+    size_t frames() const { return frames_.size() + stagedFrames_; }
+    size_t bytes() const { return bytes_; }
+
+    // 已排定发送顺序的第一帧，没有时返回nullptr（按帧发送的传输使用，要求尚未写出其任何部分）
+    const OutputFrame* front() const { return frames_.empty() ? nullptr : &frames_.front(); }
+
+    // 按策略判断是否应当立即冲刷
+    bool shouldFlush(Clock::time_point now = Clock::now()) const;
+
+    // 将队列写入fd，每次writev聚合尽可能多的帧
+    FlushResult flush(int fd);
+
+    // 读取fd错误队列中的零拷贝完成通知，释放内核已用完的负载缓冲区
+    void reapCompletions(int fd);
+
+    // 是否还有尚未收到内核完成通知的零拷贝发送
+    bool hasPendingCompletions() const { return zcStats_.completed < zcStats_.sends; }
+
+    // 取得一个负载缓冲区，优先复用已发送完毕的缓冲区
+    std::vector<uint8_t> acquireBuffer(size_t size);
+
+    // 把队列前部映射为iovec，返回段数；遇到需要零拷贝发送的负载时停止
+    // 异步发送（io_uring）直接使用，写出后用consume()出队
+    int gather(struct iovec* iov, int maxIov);
+
+    // 出队已写出的n字节
+    void consume(size_t n);
+
+private:
+    // 等待完成通知的零拷贝负载
+    struct PendingBuffer {
+        uint32_t first;
+        uint32_t last;
+        uint32_t outstanding;
+        std::vector<uint8_t> buffer;
+        std::shared_ptr<const std::vector<uint8_t>> shared;
+    };
+
+    // 队首正处于一个需要零拷贝发送的负载上
+    bool frontIsZeroCopyPayload() const;
+
+    // 以MSG_ZEROCOPY发送队首负载
+    FlushResult sendZeroCopy(int fd);
+
+    // 已写完的帧：零拷贝负载等待通知，其余负载直接回收
+    void retire(OutputFrame& frame);
+
+    void recycle(std::vector<uint8_t>&& buffer);
+
+    // 公平窗口有空余时从暂存的流中轮流取帧排入发送顺序
+    void schedule();
+
+    // 一个流暂存的帧和本轮剩余的发送额度
+    struct Flow {
+        std::deque<OutputFrame> frames;
+        size_t deficit = 0;
+    };
+
+    Policy policy_;
+    std::deque<OutputFrame> frames_;
+    size_t frontOffset_;  // 首帧中已写出的字节数
+    size_t bytes_;        // 队列中尚未写出的字节数（含暂存）
+    Clock::time_point oldest_;
+
+    std::map<uint32_t, Flow> staged_;
+    size_t stagedFrames_;
+    size_t stagedBytes_;
+    uint32_t nextFlow_;   // 下一轮从该流号开始
+
+    size_t zeroCopyThreshold_;
+    uint32_t zcNextId_;   // 内核为每次零拷贝发送分配的递增序号
+    std::deque<PendingBuffer> zcPending_;
+    ZeroCopyStats zcStats_;
+
+    // 可复用的负载缓冲区
+    std::vector<std::vector<uint8_t>> pool_;
+};
+
+#endif // OUTPUT_QUEUE_H
@@ -0,0 +1,90 @@
+#ifndef PAYLOAD_CODEC_H
+#define PAYLOAD_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+
+// URB负载的压缩编码
+// 每种编码有一个1~15的编号，导入时双方以头部flags交换支持的编码（能力位为1<<编号），
+// 之后CMD_SUBMIT/RET_SUBMIT的负载可以按选定的编码压缩，帧头flags中记录所用编号。
+class PayloadCodec {
+public:
+    // 内置编码的编号
+    enum : uint8_t {
+        kLz = 1,          // LZ77字节流（LZ4块格式）
+        kZeroBlocks = 2   // 只省略全零的512字节块，其余原样
+    };
+
+    virtual ~PayloadCodec() = default;
+
+    virtual uint8_t id() const = 0;
+    virtual const char* name() const = 0;
+
+    // 压缩len字节到out；结果不比原数据小时返回false，调用者应原样发送
+    virtual bool compress(const uint8_t* in, size_t len, std::vector<uint8_t>& out) const = 0;
+
+    // 解压到out，解压后必须恰好为expected字节；数据损坏或长度不符时返回false
+    virtual bool decompress(const uint8_t* in, size_t len, std::vector<uint8_t>& out, size_t expected) const = 0;
+
+    // 按编号查找内置编码，未知编号返回nullptr
+    static const PayloadCodec* find(uint8_t id);
+
+    // 本端支持的全部编码的能力位
+    static uint32_t supportedCaps();
+
+    // 从对端提供的能力位中选出本端也支持的编码，没有时返回0
+    static uint8_t choose(uint32_t peerCaps);
+
+    static uint32_t capOf(uint8_t id) { return 1u << id; }
+};
+
+// 每个连接的压缩策略和状态：只压缩不小于阈值的负载，
+// 按采样窗口统计压缩率，收益不足时暂停一段帧数后再试，连续不足时暂停时间加倍
+class PayloadCompressor {
+public:
+    struct Policy {
+        size_t threshold = 4096;      // 负载达到该字节数才尝试压缩
+        double maxRatio = 0.85;       // 窗口内压缩后/压缩前超过该值即视为不值得
+        size_t sampleFrames = 16;     // 每个采样窗口的帧数
+        size_t backoffFrames = 64;    // 首次暂停的帧数
+        size_t maxBackoffFrames = 4096;
+    };
+
+    struct Stats {
+        uint64_t frames = 0;          // 尝试压缩的帧数
+        uint64_t compressed = 0;      // 以压缩形式发送的帧数
+        uint64_t skipped = 0;         // 暂停期间跳过的帧数
+        uint64_t bytesIn = 0;         // 尝试压缩的原始字节数
+        uint64_t bytesOut = 0;        // 对应的发送字节数
+    };
+
+    PayloadCompressor(const PayloadCodec* codec, const Policy& policy);
+
+    // 编码的默认策略：LZ只压缩不小于threshold的负载并按压缩率暂停；
+    // 零块编码扫描没有零块的数据几乎不耗CPU，每个至少一块的负载都检查，不暂停
+    static Policy defaultPolicy(uint8_t codecId, size_t threshold);
+
+    const PayloadCodec* codec() const { return codec_; }
+    size_t threshold() const { return policy_.threshold; }
+
+    // 按策略压缩payload，成功时把压缩结果放入out并返回true（payload不变，可以是与他人共用的缓冲区）；可在任意线程调用
+    bool compress(const std::vector<uint8_t>& payload, std::vector<uint8_t>& out);
+
+    Stats stats() const;
+
+private:
+    const PayloadCodec* codec_;
+    Policy policy_;
+
+    mutable std::mutex mutex_;
+    size_t skipRemaining_;    // 暂停期内还要跳过的帧数
+    size_t backoff_;          // 下一次暂停的帧数
+    size_t windowFrames_;
+    uint64_t windowIn_;
+    uint64_t windowOut_;
+    Stats stats_;
+};
+
+#endif // PAYLOAD_CODEC_H
@@ -0,0 +1,58 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+
+// 字节环形缓冲区
+// 用于每个连接的接收缓存：一次recv尽可能多地读取内核中的数据，
+// 之后从缓冲区中连续解析多个完整的USBIP帧，避免每个字段一次系统调用
+class RingBuffer {
+public:
+    // 容量会向上取整为2的幂
+    explicit RingBuffer(size_t capacity = 64 * 1024);
+    ~RingBuffer();
+
+    size_t size() const { return tail_ - head_; }
+    size_t capacity() const { return buffer_.size(); }
+    size_t freeSpace() const { return capacity() - size(); }
+    bool empty() const { return head_ == tail_; }
+
+    // 拷贝并消费最多n字节，返回实际字节数
+    size_t read(void* dst, size_t n);
+
+    // 从offset处开始拷贝最多n字节，不消费
+    size_t peek(void* dst, size_t n, size_t offset = 0) const;
+
+    // 丢弃前n字节
+    void consume(size_t n);
+
+    // 追加最多n字节，返回实际写入的字节数
+    size_t write(const void* src, size_t n);
+
+    // 获取已有数据所在的区域（环绕时最多两段），不消费
+    int readableRegions(struct iovec iov[2]) const;
+
+    // 获取空闲区域（环绕时最多两段），可直接交给readv填充
+    int writableRegions(struct iovec iov[2]);
+
+    // 确认readv写入了n字节
+    void commit(size_t n);
+
+    void clear() { head_ = tail_ = 0; }
+
+    // 预先缺页并锁定缓冲区的内存，之后读写不会缺页；析构时解除锁定
+    bool lock();
+
+private:
+    std::vector<uint8_t> buffer_;
+    size_t mask_;
+    // 单调递增的读写位置，取模后为实际下标
+    size_t head_;
+    size_t tail_;
+    bool locked_;
+};
+
+#endif // RING_BUFFER_H
@@ -10,7 +10,11 @@
 #include <atomic>
 #include <map>
 #include <queue>
+#include <deque>
+#include <array>
+#include <algorithm>
 #include "network.h"
+#include "usbip_wire.h"
 #include "usbip_protocol.h"
 
 // 前向声明
@@ -26,31 +30,237 @@ public:
     bool start();
     void stop();
     
+    // 批量IN负载达到threshold字节时使用MSG_ZEROCOPY发送，0表示关闭
+    void setZeroCopyThreshold(size_t threshold) { zeroCopyThreshold_ = threshold; }
+    
+    // 事件循环工作线程数，0表示按CPU核数
+    void setWorkerThreads(size_t count) { workerThreads_ = count; }
+    
+    // 内核支持时使用io_uring收发（默认开启），false时固定使用epoll/poll
+    void setIoUring(bool enable) { useIoUring_ = enable; }
+    
+    // 同时监听path处的Unix域套接字，本机客户端经它改用共享内存传输
+    void setLocalPath(const std::string& path) { localPath_ = path; }
+    
+    // 同时在port上接受数据报传输的控制连接，经它连接的客户端改用UDP，各端点的URB互不阻塞
+    void setDatagramPort(int port) { datagramPort_ = port; }
+    
+    // 数据报连接按rate的概率丢弃发出的数据报，用于在回环上测试重传
+    void setDatagramLoss(double rate) { datagramLoss_ = rate; }
+    
+    // 以PEM格式的证书链和私钥为网络连接启用TLS 1.3，内核支持时记录层交给内核TLS加解密
+    void setTls(const std::string& certFile, const std::string& keyFile) { tlsCert_ = certFile; tlsKey_ = keyFile; }
+    
+    // 客户端导入时提供了负载编码则接受压缩，此后不小于threshold字节的URB负载压缩发送，0表示不接受
+    void setCompressionThreshold(size_t threshold) { compressionThreshold_ = threshold; }
+    
+    // 客户端提供了零块编码则接受：RET_SUBMIT负载中全零的512字节块不再发送
+    void setZeroBlockElision(bool enable) { zeroBlocks_ = enable; }
+    
+    // 客户端要求时为URB负载附加CRC32C校验，校验失败的请求直接以-EILSEQ回复
+    void setIntegrityCheck(bool enable) { integrity_ = enable; }
+    
+    // 每个导入最多接受的附加数据连接数（不超过15），0表示不接受。
+    // 客户端的非端点0 URB分散在这些连接上，回复从请求所在的连接返回
+    void setDataStreams(size_t count) { dataStreams_ = std::min<size_t>(count, 15); }
+    
+    // 客户端在能力交换中提出批量帧时同意，每帧至多maxEntries个URB（取双方的较小值），0表示不同意
+    void setBatching(size_t maxEntries) { batchLimit_ = maxEntries; }
+    
+    // 连接超过ms毫秒没有收到任何数据时关闭，0表示不限
+    void setIdleTimeout(int ms) { idleTimeoutMs_ = ms; }
+    
+    // URB提交后超过ms毫秒仍未完成时取消，以LIBUSB_ERROR_TIMEOUT回复；0表示沿用libusb每个传输1秒的时限
+    void setUrbTimeout(int ms) { urbTimeoutMs_ = ms; }
+    
+    // 约ms毫秒内发现失联的客户端：TCP连接设置TCP_USER_TIMEOUT和保活探测，客户端提出心跳时以ms为时限同意
+    // （0时采用客户端提出的时限），超过时限收不到心跳即关闭连接。连接关闭时取消它导入的设备上未完成的传输，
+    // 设备随即可以被重新导入；0表示不设置
+    void setDeadPeerTimeout(int ms) { deadPeerMs_ = ms; }
+    
+    // 客户端导入时提出可恢复的会话则同意：控制连接断开后保留设备ms毫秒，期间客户端凭会话号在新连接上接续，
+    // 不必重新导入和枚举；已完成的URB回复留待客户端重新提交时重放。0表示不同意
+    void setResumeGrace(int ms) { resumeGraceMs_ = ms; }
+    
+    // 在途URB负载的内存预算（字节）：每个连接至多perConnection，所有连接合计至多total，0表示不限。
+    // 预算耗尽时暂停读取该连接直到已提交的URB完成；长度超过预算的URB直接以-ENOMEM回复，不分配缓冲区
+    void setMemoryBudget(size_t perConnection, size_t total) {
+        connectionBudget_ = perConnection;
+        memoryBudget_ = total;
+    }
+    
+    // 不小于threshold字节的批量OUT URB直通转发：负载边收边按64KB分块提交给设备，不等整个URB收齐，0表示关闭。
+    // 线上仍是标准帧；未压缩、不带校验的负载才能直通
+    void setCutThrough(size_t threshold) { cutThroughThreshold_ = threshold; }
+    
+    // 忙轮询低延迟模式，us为自旋时长（微秒），0表示关闭：工作线程和USB事件线程各绑定一个CPU，
+    // 有网络事件或USB传输之后自旋us微秒才阻塞等待，连接关闭Nagle算法、立即确认并锁定接收缓冲区。
+    // 未指定工作线程数时为可用CPU数减一，留一个给USB事件线程
+    void setBusyPoll(int us) { busyPollUs_ = us; }
+    
 private:
-    // 处理客户端连接
-    void handleClient(std::shared_ptr<TCPSocket> clientSocket);
+    // 可恢复会话中设备一侧的状态，USB完成回调线程和事件循环线程都会访问
+    struct ResumeState {
+        std::mutex mutex;
+        
+        // 已提交给设备、尚未完成的URB，以及回复应发往的连接（客户端重新提交时改为新连接）
+        std::map<uint32_t, std::shared_ptr<TCPSocket>> inflight;
+        
+        // 最近完成的回复（压缩前，负载与发出的回复共用）和完成的顺序，超出上限时丢弃最早的
+        std::map<uint32_t, usbip_packet> completed;
+        std::deque<uint32_t> order;
+        size_t bytes = 0;
+        
+        // 历史中的负载计入的预算（服务端的全局预算），为空时不计。预算耗尽时历史让位于在途的URB，
+        // 丢弃最早的回复，否则只剩历史占着预算时所有连接都会一直暂停
+        std::shared_ptr<MemoryBudget> budget;
+        
+        ~ResumeState();
+        
+        // 已丢弃的回复中最大的序列号（evicted为false时无效）：重新提交的URB不在历史和进行中、序列号又不大于它时，
+        // 无法判断设备是否已经执行过，不能再次提交
+        uint32_t lowWater = 0;
+        bool evicted = false;
+        
+        // 每次断开加一，宽限期到期时据此判断期间是否已恢复
+        uint64_t epoch = 0;
+        
+        // 记下socket上提交的URB（reply为它的回复模板），返回false时照常提交给设备。重新提交的URB已完成时在socket上重放回复，
+        // 仍在进行时改从socket回复，回复已超出历史时以-ECONNRESET回复，都返回true
+        bool submit(const std::shared_ptr<TCPSocket>& socket, const usbip_packet& reply, bool resubmit);
+        
+        // URB完成：reply的负载移入共用的缓冲区，历史记下与它共用负载的副本，返回应发往的连接（可能已关闭）
+        std::shared_ptr<TCPSocket> complete(usbip_packet& reply);
+        
+        // 历史中的一个回复被替换或丢弃：从字节数和预算中扣除它的负载，调用者持有mutex
+        void forget(const usbip_packet& entry);
+    };
     
-    // 扫描USB设备
+    // 直通转发的批量OUT URB：负载分段到达，每段作为一个USB传输提交，全部完成后回复
+    struct OutStream {
+        std::mutex mutex;
+        usbip_packet reply;
+        std::shared_ptr<TCPSocket> socket;
+        std::shared_ptr<libusb::USBDevice> device;
+        std::shared_ptr<ResumeState> resume;
+        std::shared_ptr<MemoryBudget> budget;
+        unsigned char endpoint = 0;
+        size_t pending = 0;     // 已提交、尚未完成的分块
+        int actual = 0;         // 已写给设备的字节数
+        int status = 0;         // 第一个失败的分块的状态，之后的分块不再提交
+        bool received = false;  // 最后一段已收到
+        bool replied = false;
+    };
+    
+    // 导入会话：数据连接凭会话号加入，沿用导入时协商的设置；可恢复的会话在控制连接断开后保留到宽限期结束。
+    // 会话按会话ID索引，加入和恢复时还需出示随机密钥
+    struct Session {
+        std::array<uint8_t, usbip_wire::kSessionSecretSize> secret{};
+        std::string busID;
+        usb_device_info udev;
+        uint8_t codec = 0;
+        bool integrity = false;
+        size_t granted = 0;   // 同意的数据连接数
+        size_t attached = 0;  // 已加入的数据连接数
+        const TCPSocket* control = nullptr;  // 断开等待恢复期间为空
+        std::shared_ptr<ResumeState> resume;  // 不可恢复时为空
+    };
+    
+    // 新客户端连接建立
+    void onClientConnected(std::shared_ptr<TCPSocket> clientSocket);
+    
+    // 按命令类型分发一个请求，返回false时关闭连接
+    bool handlePacket(const std::shared_ptr<TCPSocket>& clientSocket, usbip_packet& packet);
+    
+    // 扫描USB设备并替换缓存的设备列表；扫描期间不持有deviceMutex_，不在事件循环线程中调用
     bool scanUSBDevices();
     
+    // 处理连接建立后的能力交换请求
+    bool handleCapsRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet);
+    
     // 处理设备列表请求
     bool handleDeviceListRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet);
     
     // 处理设备导入请求
     bool handleImportRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet);
     
-    // 处理URB请求
-    bool handleURBRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet);
+    // 处理数据连接加入会话的请求
+    bool handleStreamAttach(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet);
+    
+    // 处理在新连接上恢复会话的请求
+    bool handleResume(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet);
+    
+    // 按请求中的会话号找到会话：会话ID存在且密钥一致，调用者持有sessionMutex_；找不到时返回end()
+    std::map<uint32_t, Session>::iterator findSession(const usbip_packet& packet);
+    
+    // 宽限期到期：会话自epoch那次断开以来仍未恢复时释放设备
+    void expireSession(uint32_t token, uint64_t epoch);
+    
+    // 取消设备上未完成的传输并从已导出列表中移除，调用者持有deviceMutex_
+    void releaseDevice(const std::string& busID);
+    
+    // 控制连接关闭：结束它的会话，释放它导入的设备
+    void onClientClosed(const std::shared_ptr<TCPSocket>& clientSocket);
+    
+    // 本端接受的负载编码的能力位
+    uint32_t codecCaps() const;
+    
+    // 处理URB请求：提交异步USB传输后立即返回，回复在传输完成时放入发送队列
+    bool handleURBRequest(std::shared_ptr<TCPSocket> clientSocket, usbip_packet& packet);
+    
+    // 直通URB的一段负载：提交给设备，最后一段到达后等待所有分块完成
+    bool handleSegment(const std::shared_ptr<TCPSocket>& clientSocket, usbip_packet& packet);
+    
+    // 直通URB的负载已全部收到且所有分块都已完成时回复
+    void finishStream(const std::shared_ptr<OutStream>& stream);
+    
+    // URB超过时限：仍在进行时取消对应的USB传输
+    void onUrbTimeout(const std::shared_ptr<TCPSocket>& clientSocket, uint32_t devid, uint32_t seqnum);
     
     // 服务端变量
     int port_;
     std::unique_ptr<Server> server_;
     std::atomic<bool> running_;
+    size_t zeroCopyThreshold_;
+    size_t workerThreads_;
+    bool useIoUring_;
+    std::string localPath_;
+    int datagramPort_;
+    double datagramLoss_;
+    std::string tlsCert_;
+    std::string tlsKey_;
+    size_t compressionThreshold_;
+    bool zeroBlocks_;
+    bool integrity_;
+    size_t dataStreams_;
+    size_t batchLimit_;
+    int idleTimeoutMs_;
+    int urbTimeoutMs_;
+    int deadPeerMs_;
+    int resumeGraceMs_;
+    size_t connectionBudget_;
+    size_t memoryBudget_;
+    size_t cutThroughThreshold_;
+    int busyPollUs_;
+    
+    // 正在接收负载的直通URB，按连接索引：同一连接上一个URB的各段连续到达，每个连接至多一个
+    std::map<const TCPSocket*, std::shared_ptr<OutStream>> streams_;
+    std::mutex streamMutex_;
+    
+    // 导入会话，按会话ID索引
+    std::map<uint32_t, Session> sessions_;
+    std::mutex sessionMutex_;
     
     // USB设备列表
     std::vector<std::shared_ptr<libusb::USBDevice>> usbDevices_;
     std::map<std::string, std::shared_ptr<libusb::USBDevice>> exportedDevices_;
+    std::map<uint32_t, std::shared_ptr<libusb::USBDevice>> devicesById_;  // 按devid索引的已导出设备
+    std::map<std::string, const TCPSocket*> exportOwners_;  // 已导出设备所属的控制连接，等待恢复期间为空
+    std::map<uint32_t, std::shared_ptr<ResumeState>> resumable_;  // 按devid索引的可恢复会话
     std::mutex deviceMutex_;
+    
+    // 收到设备列表请求后置位，由主线程重新扫描
+    std::atomic<bool> rescanRequested_;
 };
 
 #endif // SERVER_H 
\ No newline at end of file
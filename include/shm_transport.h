@@ -0,0 +1,87 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// 同一主机上客户端与服务端之间的共享内存传输（仅Linux）
+// 一个memfd中放两个单生产者单消费者字节环，每个方向一个；两端各有一个eventfd门铃，
+// 只有对端正在等待（环空等数据、环满等空间）时才敲门铃，连续收发不产生系统调用。
+// 共享内存和门铃由服务端创建，经Unix域套接字以SCM_RIGHTS交给客户端，
+// 该套接字此后只用于发现对端退出。
+class ShmTransport {
+public:
+    // 每个方向的环大小，需为2的幂
+    static const size_t kDefaultRingSize = 4 * 1024 * 1024;
+
+    ShmTransport();
+    ~ShmTransport();
+
+    // 禁止拷贝和赋值
+    ShmTransport(const ShmTransport&) = delete;
+    ShmTransport& operator=(const ShmTransport&) = delete;
+
+    // 当前系统是否支持（memfd和eventfd）
+    static bool supported();
+
+    // 服务端：创建共享内存和门铃，经controlFd发给对端
+    bool offer(int controlFd, size_t ringSize = kDefaultRingSize);
+
+    // 客户端：从controlFd接收共享内存和门铃
+    bool accept(int controlFd);
+
+    // 从接收环读出数据，返回字节数。环空时等待至多timeoutMs毫秒（-1为一直等待，0为不等待），
+    // 超时返回-1且errno为EAGAIN；对端已关闭且数据已读完时返回0
+    ssize_t read(const struct iovec* iov, int iovcnt, int timeoutMs);
+
+    // 写入发送环，返回写入的字节数（环中空间不足时少于请求的长度）。
+    // 环满时按timeoutMs等待，超时返回-1且errno为EAGAIN；对端已关闭时返回-1且errno为EPIPE
+    ssize_t write(const struct iovec* iov, int iovcnt, int timeoutMs);
+
+    // 本端门铃：接收环有了新数据或发送环腾出空间时可读，事件循环关注它
+    int doorbellFd() const { return localBell_; }
+
+    // 取走本端门铃的计数，清除事件循环中的可读状态；读取暂停时调用，环中的数据留给之后的读取
+    void drainBell();
+
+    // 通知对端本端已关闭，释放共享内存和门铃
+    void close();
+
+private:
+    struct Header;
+    struct Ring;
+
+    bool map(int memfd, size_t ringSize, int role);
+    bool peerClosed() const;
+
+    // 设置等待标志后再检查一次ready()，仍不满足时等待门铃；超时返回false
+    // drain为true时先取走门铃计数（非阻塞读取时由它清除事件循环的可读状态）
+    bool waitFor(std::atomic<uint32_t>& flag, const std::function<bool()>& ready, int timeoutMs, bool drain);
+
+    void ringPeer();
+
+    // 环的索引在对端也能写入的共享内存中：未读的字节超过环大小时按协议错误处理，
+    // 之后本端视对端为已关闭，返回false且errno为EPROTO
+    bool validSpan(uint64_t head, uint64_t tail);
+
+    int controlFd_;   // Unix域套接字（不归本类所有）
+    int localBell_;   // 对端写入/腾出空间后敲响
+    int remoteBell_;  // 通知对端
+    int role_;        // 0为服务端，1为客户端
+
+    void* base_;
+    size_t mapSize_;
+    Header* header_;
+    Ring* tx_;
+    Ring* rx_;
+    uint8_t* txData_;
+    uint8_t* rxData_;
+    size_t ringSize_;
+    bool peerGone_;   // 控制套接字已断开
+};
+
+#endif // SHM_TRANSPORT_H
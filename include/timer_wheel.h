@@ -0,0 +1,82 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// 分层时间轮：以1毫秒为刻度管理大量定时器，添加、取消和到期处理都不做系统调用
+// 第0层256个槽，每槽1毫秒；第1~3层各64个槽，每槽覆盖下一层的一整圈。定时器按距到期还有多远放入某一层，
+// 时间推进到上层某个槽的起点时，把其中的定时器重新分配到下层（级联），最终都在第0层到期。
+// 超出最上层范围（约18.6小时）的定时器先放在最远处，到时重新计算。
+// 不是线程安全的，由所属的事件循环在自己的线程中使用。
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    // 定时器标识：低32位为槽位，高32位为代数，取消已到期的定时器不会误伤复用同一槽位的新定时器；0为无效值
+    using TimerId = uint64_t;
+
+    explicit TimerWheel(Clock::time_point now = Clock::now());
+
+    // 禁止拷贝和赋值
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // 在deadline之后（不会提前）执行callback；deadline已过时在下一次advance()中执行
+    TimerId schedule(Clock::time_point deadline, Callback callback);
+
+    // 取消尚未到期的定时器，已到期或已取消时返回false
+    bool cancel(TimerId id);
+
+    // 推进到now并执行所有到期的回调，返回执行的个数。回调中可以添加和取消定时器
+    size_t advance(Clock::time_point now);
+
+    // 距下一次需要推进（有定时器到期或需要级联）的毫秒数，供事件循环作为等待时限；没有定时器时返回-1
+    int nextTimeoutMs(Clock::time_point now) const;
+
+    size_t size() const { return active_; }
+
+private:
+    static const unsigned kLevels = 4;
+    static const unsigned kRootBits = 8;   // 第0层：256个槽
+    static const unsigned kLevelBits = 6;  // 第1~3层：各64个槽
+    static const uint32_t kNone = 0xFFFFFFFFu;
+
+    struct Entry {
+        uint64_t expiry;       // 到期的刻度
+        Callback callback;
+        uint32_t generation;
+        uint32_t slot;         // 所在的槽（全局编号），不在轮中时为kNone
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    // 某层的第一个槽的全局编号、槽数和每槽覆盖的刻度数（以位数表示）
+    static unsigned levelBase(unsigned level);
+    static unsigned levelSlots(unsigned level);
+    static unsigned levelShift(unsigned level);
+
+    // 按到期刻度与当前刻度的距离放入合适的层
+    void place(uint32_t index);
+    void link(uint32_t index, uint32_t slot);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+
+    // 把上层槽中的定时器重新分配到下层，返回该层的槽号（为0时应继续级联上一层）
+    unsigned cascade(unsigned level);
+
+    uint64_t tickOf(Clock::time_point t, bool roundUp) const;
+
+    Clock::time_point origin_;
+    uint64_t current_;              // 下一个要处理的刻度
+    std::vector<uint32_t> heads_;   // 各槽链表的头
+    std::vector<Entry> entries_;
+    std::vector<uint32_t> free_;
+    size_t active_;
+};
+
+#endif // TIMER_WHEEL_H
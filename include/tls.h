@@ -0,0 +1,97 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// TLS 1.3加密传输（编译时需要OpenSSL，定义USBIP_HAVE_OPENSSL）
+// 握手由OpenSSL完成，之后Linux上尽量把记录层交给内核TLS（TCP_ULP "tls"）：
+// 内核接管的方向上，套接字照常以writev/readv/io_uring收发明文，加解密（AES-GCM）在内核中进行；
+// 内核不支持的方向由OpenSSL在用户态加解密。两个方向分别判断，互不影响。
+
+// 一端的证书和验证设置，由该端所有连接共用
+class TlsContext {
+public:
+    ~TlsContext();
+
+    // 禁止拷贝和赋值
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    // 是否编译了TLS支持
+    static bool supported();
+
+    // 服务端：以PEM格式的证书链和私钥创建
+    static std::shared_ptr<TlsContext> createServer(const std::string& certFile, const std::string& keyFile);
+
+    // 客户端：按caFile中的证书验证服务端，caFile为空时使用系统默认的信任库
+    static std::shared_ptr<TlsContext> createClient(const std::string& caFile);
+
+    bool isServer() const { return server_; }
+    void* native() const { return ctx_; }
+
+private:
+    TlsContext(void* ctx, bool server) : ctx_(ctx), server_(server) {}
+
+    void* ctx_;   // SSL_CTX
+    bool server_;
+};
+
+// 一个连接上的TLS会话
+class TlsSession {
+public:
+    explicit TlsSession(std::shared_ptr<TlsContext> context);
+    ~TlsSession();
+
+    // 禁止拷贝和赋值
+    TlsSession(const TlsSession&) = delete;
+    TlsSession& operator=(const TlsSession&) = delete;
+
+    // 握手的进度
+    enum class Progress {
+        Done,       // 握手完成
+        WantRead,   // 等fd可读后再调用step()
+        WantWrite,  // 等fd可写后再调用step()
+        Failed      // 握手失败，会话已释放
+    };
+
+    // 在阻塞模式的fd上完成握手，至多等待timeoutMs毫秒。客户端按peerHost（IP地址或主机名）验证证书
+    bool handshake(int fd, const std::string& peerHost, int timeoutMs);
+
+    // 分步握手，用于非阻塞的fd：begin()创建会话，之后每当fd按上次的结果就绪时调用step()，
+    // 直到返回Done或Failed。时限由调用者负责
+    bool begin(int fd, const std::string& peerHost);
+    Progress step();
+
+    // 发送/接收方向是否已交给内核TLS，此时该方向直接读写套接字即可
+    bool kernelSend() const { return kernelSend_; }
+    bool kernelRecv() const { return kernelRecv_; }
+
+    // 用户态解密读取，返回字节数；非阻塞套接字暂无数据时返回-1且errno为EAGAIN，对端关闭时返回0；
+    // 被信号中断时返回-1且errno为EINTR，读写都应重试
+    ssize_t read(const struct iovec* iov, int iovcnt);
+
+    // OpenSSL中是否还有未取走的数据：这些数据不会再让套接字可读，等待可读之前先检查
+    bool pending() const;
+
+    // 用户态加密写出，返回接受的字节数（可能少于请求的长度）；
+    // 非阻塞套接字暂不可写时返回-1且errno为EAGAIN，此后需以相同的数据开头重试
+    ssize_t write(const struct iovec* iov, int iovcnt);
+
+    // 协商出的协议版本和密码套件，用于日志
+    std::string description() const;
+
+    // 释放会话；notifyPeer为true时先发送close_notify（不等待对端），套接字已交出时应为false
+    void close(bool notifyPeer = true);
+
+private:
+    std::shared_ptr<TlsContext> context_;
+    void* ssl_;   // SSL
+    bool kernelSend_;
+    bool kernelRecv_;
+};
+
+#endif // TLS_H
@@ -0,0 +1,200 @@
+#ifndef UDP_TRANSPORT_H
+#define UDP_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+// 基于UDP的数据报传输（仅Linux）
+// 帧属于各自的有序流（按设备和端点划分），切成数据报发送。同一流内按发送顺序交付，
+// 不同流之间互不等待：大批量传输丢了一个包只阻塞它所在的端点，不会拖住端点0的控制传输。
+// 每个数据报有连接内递增的包号，接收方以包号区间选择确认（SACK），发送方只重传确认中
+// 缺失的包（重传使用新包号，RTT采样不会混淆）。拥塞窗口按NewReno增减，
+// 发送按窗口/RTT的速率以令牌桶限速，收发都以sendmmsg/recvmmsg批量进行。
+// 握手经TCP控制连接交换双方的UDP端口，该连接此后只用于发现对端退出。
+class DatagramTransport {
+public:
+    // 每个数据报携带的帧数据上限，加上头部后不超过常见的以太网MTU
+    static const size_t kMaxPayload = 1400;
+
+    // 已接受但对端尚未确认的字节上限，超过后sendFrame等待
+    static const size_t kMaxBuffered = 8 * 1024 * 1024;
+
+    struct Stats {
+        uint64_t datagramsSent = 0;
+        uint64_t datagramsReceived = 0;
+        uint64_t retransmits = 0;     // 重传的数据报数
+        uint64_t duplicates = 0;      // 收到的重复数据报数
+        uint64_t dropped = 0;         // 按设定的丢包率故意丢弃的数据报数
+        uint64_t refused = 0;         // 接收方向放不下而丢弃、未确认的数据报数
+        uint64_t framesDelivered = 0;
+    };
+
+    DatagramTransport();
+    ~DatagramTransport();
+
+    // 禁止拷贝和赋值
+    DatagramTransport(const DatagramTransport&) = delete;
+    DatagramTransport& operator=(const DatagramTransport&) = delete;
+
+    // 当前系统是否支持（sendmmsg/recvmmsg和timerfd）
+    static bool supported();
+
+    // 服务端：在控制连接的本地地址上打开UDP端口，经controlFd与对端交换端口。
+    // 分步进行，不在事件循环中等待对端：beginOffer()发出本端端口，之后每当controlFd可读时调用continueOffer()，
+    // 收齐对端的端口后done为true。失败时返回false，时限由调用者负责
+    bool beginOffer(int controlFd);
+    bool continueOffer(bool& done);
+
+    // 客户端：从controlFd收到服务端的UDP端口后打开本端端口并告知对端
+    bool accept(int controlFd);
+
+    // 读出已按序到齐的帧数据，返回字节数；帧总是完整地依次交出，不同流的帧不会交错。
+    // 没有可交付的数据时等待至多timeoutMs毫秒（-1为一直等待，0为不等待），超时返回-1且errno为EAGAIN；
+    // 对端已关闭时返回0
+    ssize_t read(const struct iovec* iov, int iovcnt, int timeoutMs);
+
+    // 发送一帧，属于stream的帧按调用顺序交付。未确认的数据超过kMaxBuffered时按timeoutMs等待，
+    // 超时返回false且errno为EAGAIN；对端已关闭或不再响应时返回false且errno为EPIPE
+    bool sendFrame(uint16_t stream, const struct iovec* iov, int iovcnt, int timeoutMs);
+
+    // 处理到达的数据报和到期的定时器（确认、重传、限速），不交出数据；读取暂停时由事件循环调用，
+    // 收到的帧留给之后的read()，放不下的数据报不被确认
+    void poll();
+
+    // 事件循环关注的描述符：收到数据报、重传或限速定时器到期时可读
+    int pollFd() const { return epollFd_; }
+
+    // 按rate的概率丢弃发出的数据报，用于在回环上测试重传
+    void setInducedLoss(double rate);
+
+    Stats stats() const;
+
+    void close();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // 待发送（或待重传）的一段帧数据
+    struct Fragment {
+        std::shared_ptr<std::vector<uint8_t>> frame;
+        uint16_t stream = 0;
+        uint32_t frameSeq = 0;
+        uint32_t offset = 0;
+        uint32_t len = 0;
+        bool last = false;
+    };
+
+    // 已发出、等待确认的数据报
+    struct InFlight {
+        Fragment fragment;
+        Clock::time_point sentAt;
+    };
+
+    // 本轮sendmmsg中的一个数据报：头部加上引用帧数据（或确认内容）的一段
+    struct Outgoing {
+        uint8_t head[16];
+        const uint8_t* data;
+        size_t len;
+    };
+
+    // 正在拼装的帧
+    struct PartialFrame {
+        std::vector<uint8_t> data;
+        std::vector<bool> got;
+        uint32_t received = 0;
+        int32_t lastIndex = -1;
+    };
+
+    struct RxStream {
+        uint32_t next = 0;  // 下一个应交付的帧序号
+        std::map<uint32_t, PartialFrame> frames;
+    };
+
+    bool open(int family, const struct sockaddr* local, socklen_t localLen);
+    bool connectPeer(int controlFd, uint16_t port);
+
+    // 收取所有到达的数据报，处理定时器，发出确认和窗口允许的数据；调用者持有mutex_
+    void service();
+
+    void receiveBatch();
+    void onData(const uint8_t* p, size_t len);
+
+    // 流streamId中帧frameSeq的一段（到帧内end字节为止）能否接受：流的数量、重排窗口和接收字节都有上限，
+    // 超出时不记录也不确认该数据报
+    bool admitSegment(uint16_t streamId, uint32_t frameSeq, size_t end) const;
+    void onAck(const uint8_t* p, size_t len);
+
+    // 按包号重排门限和超时判定丢包，丢失的分段放回发送队列前部
+    void detectLoss(Clock::time_point now);
+    void onTimeout(Clock::time_point now);
+
+    void sendPending(Clock::time_point now);
+    void queueAck();
+    void flushBatch();
+    void armTimer(Clock::time_point now);
+
+    Clock::duration rto() const;
+
+    // 在pollFd上等待至多timeoutMs毫秒
+    bool wait(std::unique_lock<std::mutex>& lock, int timeoutMs);
+
+    bool peerClosed();
+
+    int controlFd_;   // TCP控制连接（不归本类所有）
+    std::vector<uint8_t> hello_;  // 服务端已收到的对端握手消息
+    int udpFd_;
+    int timerFd_;
+    int epollFd_;
+
+    mutable std::mutex mutex_;
+    bool failed_;     // 对端已关闭或长时间没有确认
+
+    // 发送方向
+    uint32_t nextPacket_;
+    std::map<uint16_t, uint32_t> nextFrameSeq_;
+    std::deque<Fragment> pending_;
+    std::map<uint32_t, InFlight> inflight_;
+    size_t bufferedBytes_;   // 已接受、未确认的帧字节
+    size_t inflightBytes_;   // 已发出、未确认的数据报字节
+
+    // 拥塞控制、RTT估计和限速
+    size_t cwnd_;
+    size_t ssthresh_;
+    uint32_t largestAcked_;
+    uint32_t recoveryPacket_;   // 该包号之前的丢包属于同一次拥塞事件
+    bool haveRtt_;
+    Clock::duration srtt_;
+    Clock::duration rttvar_;
+    unsigned timeouts_;         // 连续超时次数
+    double tokens_;
+    Clock::time_point lastRefill_;
+
+    // 接收方向
+    std::map<uint16_t, RxStream> rxStreams_;
+    std::map<uint32_t, uint32_t> received_;   // 已收到的包号区间 [起始, 结束]
+    bool ackDue_;
+    std::deque<std::vector<uint8_t>> ready_;  // 已按序到齐、等待读出的帧
+    size_t readOffset_;
+    size_t rxBytes_;   // 拼装中和待读出的帧占用的字节
+
+    // 本轮sendmmsg的数据报，确认的区间列表放在ackBuffer_中
+    std::vector<Outgoing> batch_;
+    std::vector<uint8_t> ackBuffer_;
+    std::vector<uint8_t> rxBuffers_;
+
+    double lossRate_;
+    std::mt19937 lossRng_;
+    Stats stats_;
+};
+
+#endif // UDP_TRANSPORT_H
@@ -0,0 +1,90 @@
+#ifndef URB_WINDOW_H
+#define URB_WINDOW_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+
+// 客户端的URB在途窗口：限制同时等待回复的CMD_SUBMIT数，按带宽时延积调整
+// 每个RET_SUBMIT给出一个RTT样本和一个投递速率样本（从该URB发出到回复到达期间完成的URB数和字节数，
+// 时间取发出间隔和到达间隔中较长的一个，回复成批到达时不会高估）。
+// 最小RTT取最近10秒内的最小值，速率取最近若干个RTT内样本的最大值，窗口为二者之积乘以增益2：
+// 链路未跑满时速率随窗口增长，窗口每个RTT约翻倍；跑满之后速率不再增长，窗口停在带宽时延积的两倍，
+// 排队造成的RTT上升不会再放大窗口。窗口未用满时（发送方本身没有更多URB）的速率样本
+// 只用于抬高估计，不会把窗口压小。不是线程安全的
+class UrbWindow {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        size_t window = 0;            // 允许同时在途的URB数
+        size_t inflight = 0;          // 当前在途的URB数
+        Clock::duration srtt{0};      // 平滑的RTT
+        Clock::duration minRtt{0};    // 最近10秒内的最小RTT
+        double urbRate = 0;           // 估计的URB投递速率（个/秒）
+        double bandwidth = 0;         // 估计的投递带宽（字节/秒，双向负载之和）
+        size_t bdpBytes = 0;          // 带宽时延积（字节）
+    };
+
+    UrbWindow();
+
+    // 窗口未满，可以再发出一个URB
+    bool canSend() const { return inflight_.size() < window_; }
+
+    // 发出seqnum，bytes为请求携带的负载（OUT方向）字节数；同一seqnum再次发出（恢复后重新提交）时重新计时
+    void onSend(uint32_t seqnum, size_t bytes, Clock::time_point now);
+
+    // 收到seqnum的回复，bytes为回复携带的负载（IN方向）字节数；不在途的seqnum（重复的回复）返回false
+    bool onReply(uint32_t seqnum, size_t bytes, Clock::time_point now);
+
+    // 连接断开后丢弃全部状态，窗口回到初始值
+    void reset();
+
+    size_t window() const { return window_; }
+    size_t inflight() const { return inflight_.size(); }
+    Stats stats() const;
+
+private:
+    struct Sent {
+        Clock::time_point sentAt;
+        size_t bytes;
+        uint64_t delivered;               // 发出时已投递的URB数
+        uint64_t deliveredBytes;          // 发出时已投递的字节数
+        Clock::time_point deliveredAt;    // 发出时最近一次投递的时间
+        Clock::time_point firstSentAt;    // 发出时最近一次投递的URB的发出时间
+        bool appLimited;                  // 发出时窗口未用满
+    };
+
+    struct RateSample {
+        Clock::time_point at;
+        double urbRate;
+        double bandwidth;
+    };
+
+    // 按当前的估计重新计算窗口
+    void updateWindow();
+
+    // 速率样本的保留时长：若干个RTT，且不短于下限
+    Clock::duration rateWindow() const;
+
+    size_t window_;
+    std::map<uint32_t, Sent> inflight_;
+
+    // 累计投递的URB数、字节数、最近一次投递的时间和被投递的URB的发出时间
+    uint64_t delivered_;
+    uint64_t deliveredBytes_;
+    Clock::time_point deliveredAt_;
+    Clock::time_point firstSentAt_;
+
+    bool haveRtt_;
+    Clock::duration srtt_;
+    Clock::duration minRtt_;
+    Clock::time_point minRttAt_;
+
+    // 按时间排列的速率样本，队首最旧；估计取其中的最大值
+    std::deque<RateSample> rates_;
+};
+
+#endif // URB_WINDOW_H
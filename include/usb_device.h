@@ -5,7 +5,13 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
 #include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include <libusb.h>
 #include "usbip_protocol.h"
 
@@ -47,6 +53,30 @@ public:
                          int* actualLength,
                          unsigned int timeout = 1000);
     
+    // 异步传输完成回调，在libusb事件线程中执行
+    // status为libusb错误码（0表示成功），actualLength为实际传输的字节数（控制传输不含setup包），
+    // buffer为提交时交出的缓冲区
+    using TransferCallback = std::function<void(int status, int actualLength, std::vector<uint8_t>& buffer)>;
+    
+    // 提交异步传输，type为LIBUSB_TRANSFER_TYPE_*；控制传输时buffer前8字节为setup包
+    // buffer的所有权转交给传输，完成后通过回调交还。timeout为0时不限时，owner和id标识这次传输。返回libusb错误码
+    int submitTransfer(uint8_t type, unsigned char endpoint,
+                       std::vector<uint8_t>&& buffer,
+                       TransferCallback callback,
+                       unsigned int timeout = 1000,
+                       const void* owner = nullptr, uint32_t id = 0);
+    
+    // 由调用者的时限取消owner和id标识的一个尚未取消的传输，回调收到LIBUSB_ERROR_TIMEOUT。
+    // 找到并标记了传输就返回true（即使它已在完成途中、取消不再生效），没有这样的传输时返回false；
+    // 同一id有多个传输（直通URB的分块）时反复调用直到返回false
+    bool expireTransfer(const void* owner, uint32_t id);
+    
+    // 取消所有未完成的异步传输，wait为true时等待它们的回调执行完毕
+    void cancelTransfers(bool wait);
+    
+    // 未完成的异步传输数量
+    size_t pendingTransfers() const;
+    
     // 获取设备信息
     std::string getBusID() const;
     uint8_t getBusNumber() const;
@@ -67,6 +97,13 @@ private:
     libusb_device_descriptor deviceDesc_;
     bool isOpen_;
     
+    // 未完成的异步传输
+    struct AsyncTransfer;
+    static void LIBUSB_CALL onTransferComplete(libusb_transfer* transfer);
+    mutable std::mutex transferMutex_;
+    std::condition_variable transferDone_;
+    std::set<libusb_transfer*> inflight_;
+    
     // 检查设备接口是否为大容量存储类
     bool checkMassStorageInterface();
 };
@@ -97,6 +134,21 @@ public:
     // 按vendor/product ID查找设备
     std::shared_ptr<USBDevice> findDeviceByVendorProduct(uint16_t vendorID, uint16_t productID);
     
+    // 启动/停止处理异步传输完成事件的线程
+    bool startEventThread();
+    void stopEventThread();
+    
+    // 忙轮询低延迟模式：事件线程绑定到cpu（小于0时不绑定），最近us微秒内有传输提交或完成时
+    // 以0时限处理事件，传输完成后不必等待线程被唤醒；0表示关闭。需在startEventThread()之前调用
+    void setBusyPoll(int us, int cpu) {
+        busyPollUs_ = us;
+        eventCpu_ = cpu;
+    }
+    
+    // 忙轮询模式下记录传输的提交和完成。提交时事件线程正阻塞等待则唤醒它，
+    // 使其在传输进行期间转入自旋，完成时立即处理
+    void noteTransfer(bool submitted);
+    
 private:
     // 私有构造函数和析构函数
     USBDeviceManager();
@@ -104,6 +156,15 @@ private:
     
     libusb_context* context_;
     bool isInitialized_;
+    
+    // libusb事件线程
+    void eventLoop();
+    std::thread eventThread_;
+    std::atomic<bool> eventsRunning_;
+    int busyPollUs_;
+    int eventCpu_;
+    std::atomic<std::chrono::steady_clock::rep> lastTransfer_;  // 最近一次提交或完成传输的时刻
+    std::atomic<bool> eventWaiting_;  // 事件线程正阻塞等待
 };
 
 } // namespace libusb
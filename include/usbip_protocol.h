@@ -2,6 +2,7 @@
 #define USBIP_PROTOCOL_H
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 #include <netinet/in.h>
@@ -21,6 +22,27 @@
 #define USBIP_OP_REQ_IMPORT     0x8003
 #define USBIP_OP_REP_IMPORT     0x0003
 
+// 扩展操作（非官方USBIP）：连接建立后的能力交换，客户端不发起时连接保持标准帧格式
+#define USBIP_OP_REQ_CAPS       0x80C0
+#define USBIP_OP_REP_CAPS       0x00C0
+
+// 扩展操作：心跳，只有头部。能力交换中双方同意后客户端在空闲时定期发送，服务端据此判断对端是否存活
+#define USBIP_OP_HEARTBEAT      0x80C1
+
+// 客户端提出的心跳时限（毫秒）在服务端被限制到此范围，过短的时限容不下几次心跳，会误判健康的连接失联
+#define USBIP_HEARTBEAT_MIN_MS  100
+#define USBIP_HEARTBEAT_MAX_MS  60000
+
+// 扩展命令：批量帧，一个头部和一个长度前缀之后是多个CMD_SUBMIT或RET_SUBMIT，能力交换中双方同意后才发送。
+// 头部的状态字段为条目数，其后4字节为其余部分的总长度；每个条目是4字节flags加上
+// 对应命令在头部之后的全部内容（固定部分、编码后长度、负载、校验和）
+#define USBIP_CMD_SUBMIT_BATCH  0x0011
+#define USBIP_RET_SUBMIT_BATCH  0x0013
+
+// 能力交换中的能力位
+#define USBIP_CAP_BATCH         0x00000001u
+#define USBIP_CAP_HEARTBEAT     0x00000002u
+
 // 方向
 #define USBIP_DIR_OUT 0
 #define USBIP_DIR_IN  1
@@ -34,11 +56,34 @@
 #define USBIP_XFER_BULK     2
 #define USBIP_XFER_INT      3
 
+// 头部flags（线上原为保留字段，未使用的一端发送0）
+// OP_REQ_IMPORT/OP_REP_IMPORT：低16位为负载编码能力，请求中为客户端支持的编码，响应中为服务端选定的编码；
+//   其余能力位在请求中表示客户端支持，在响应中表示服务端同意
+//   20~23位为附加数据连接数，请求中为客户端希望的条数，响应中为服务端同意的条数，同意时响应之后是4字节会话号；
+//   带STREAM_ATTACH位的OP_REQ_IMPORT不导入新设备，而是把本连接作为数据连接加入会话，请求之后是4字节会话号；
+//   CAP_RESUME在请求中表示希望可恢复的会话，响应中表示同意，同意时响应之后同样是4字节会话号（与数据连接共用）；
+//   带RESUME位的OP_REQ_IMPORT在新连接上接续会话号所指的导入，请求之后是4字节会话号
+// CMD_SUBMIT/RET_SUBMIT：24~27位为负载所用编码的编号，非0时固定部分之后先是4字节的编码后负载长度；
+//   带CRC标志时负载之后还有4字节的CRC32C（按编码前的负载计算）；
+//   带RESUBMIT标志的CMD_SUBMIT是恢复会话后重新提交的URB，服务端已完成的重放回复，仍在进行的不再提交
+#define USBIP_FLAG_CODEC_CAPS_MASK  0x0000FFFFu
+#define USBIP_FLAG_CAP_CRC32C       0x00010000u
+#define USBIP_FLAG_STREAM_ATTACH    0x00020000u
+#define USBIP_FLAG_CAP_RESUME       0x00040000u
+#define USBIP_FLAG_RESUME           0x00080000u
+#define USBIP_FLAG_STREAMS_SHIFT    20
+#define USBIP_FLAG_STREAMS_MASK     0x00F00000u
+#define USBIP_FLAG_CODEC_SHIFT      24
+#define USBIP_FLAG_CODEC_MASK       0x0F000000u
+#define USBIP_FLAG_PAYLOAD_CRC      0x10000000u
+#define USBIP_FLAG_RESUBMIT         0x20000000u
+
 // USBIP 头部结构
 struct usbip_header {
     uint32_t version;
     uint32_t command;
     uint32_t status;
+    uint32_t flags = 0;
 };
 
 // USB设备描述符
@@ -82,6 +127,22 @@ struct usb_device_info {
     uint8_t bNumInterfaces;
 };
 
+// 设备列表中每个接口的描述
+struct usb_interface_info {
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t padding;
+};
+
+// 能力交换的请求和响应
+struct op_caps {
+    uint32_t version;
+    uint32_t caps;      // 请求中为客户端支持的能力，响应中为服务端同意的能力
+    uint32_t maxBatch;  // 一个批量帧至多携带的URB数，响应中为双方的较小值
+    uint32_t heartbeatMs;  // 对端失联的判定时限（毫秒），请求中为客户端希望的值，响应中为服务端采用的值
+};
+
 // 导入设备请求
 struct op_import_request {
     uint32_t version;
@@ -131,8 +192,19 @@ struct usbip_packet {
         op_devlist_request devlist_req;
         op_import_request import_req;
         op_import_reply import_rep;
+        op_caps caps;
     };
     std::vector<uint8_t> data;
+    
+    // 与其他持有者共用的只读负载（只在本端内部使用）：不为空时代替data发送。
+    // 服务端可恢复会话的重放历史以此与发送队列共用同一份回复负载，不再拷贝
+    std::shared_ptr<const std::vector<uint8_t>> sharedData;
+    
+    // 接收端分段交出的大OUT负载（只在本端内部使用，不上线）：先交出不带负载的头部，
+    // 之后每段的data是负载中从payloadOffset开始的一段，最后一段的lastSegment为true
+    bool segmented = false;
+    uint32_t payloadOffset = 0;
+    bool lastSegment = false;
 };
 
 // 工具函数
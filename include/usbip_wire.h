@@ -0,0 +1,317 @@
+#ifndef USBIP_WIRE_H
+#define USBIP_WIRE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "usbip_protocol.h"
+
+// USBIP线上格式编解码
+// 每个线上结构体通过一张编译期字段表描述一次：字段在主机结构体中的偏移、
+// 主机宽度和线上宽度。编码/解码按字段表单次遍历，直接读写连续缓冲区，
+// 整数统一为大端序，与主机结构体的内存布局和填充无关。
+namespace usbip_wire {
+
+enum class FieldKind : uint8_t {
+    Integer,  // 大端整数，线上宽度可以小于主机宽度
+    Bytes,    // 原样拷贝的字节数组（字符串、setup包）
+    Padding   // 线上保留字节，编码为0，解码时跳过
+};
+
+struct Field {
+    FieldKind kind;
+    size_t offset;    // 主机结构体中的偏移
+    size_t hostSize;  // 主机结构体中的宽度
+    size_t wireSize;  // 线上宽度
+};
+
+// 每个线上结构体特化一次，提供 static constexpr Field fields[]
+template <typename T>
+struct Schema;
+
+#define USBIP_WIRE_INT(T, member) \
+    usbip_wire::Field{usbip_wire::FieldKind::Integer, offsetof(T, member), sizeof(T::member), sizeof(T::member)}
+#define USBIP_WIRE_INT_AS(T, member, width) \
+    usbip_wire::Field{usbip_wire::FieldKind::Integer, offsetof(T, member), sizeof(T::member), width}
+#define USBIP_WIRE_BYTES(T, member) \
+    usbip_wire::Field{usbip_wire::FieldKind::Bytes, offsetof(T, member), sizeof(T::member), sizeof(T::member)}
+#define USBIP_WIRE_PAD(width) \
+    usbip_wire::Field{usbip_wire::FieldKind::Padding, 0, 0, width}
+
+// 线上字节数
+template <typename T>
+constexpr size_t wireSize() {
+    size_t total = 0;
+    for (const Field& field : Schema<T>::fields) {
+        total += field.wireSize;
+    }
+    return total;
+}
+
+// 字段表自检：整数宽度合法且不超过主机宽度，字节数组宽度一致，字段不越界
+template <typename T>
+constexpr bool schemaValid() {
+    for (const Field& field : Schema<T>::fields) {
+        switch (field.kind) {
+            case FieldKind::Integer:
+                if (field.hostSize != 1 && field.hostSize != 2 && field.hostSize != 4) return false;
+                if (field.wireSize == 0 || field.wireSize > field.hostSize) return false;
+                break;
+            case FieldKind::Bytes:
+                if (field.wireSize != field.hostSize) return false;
+                break;
+            case FieldKind::Padding:
+                if (field.hostSize != 0) return false;
+                continue;
+        }
+        if (field.offset + field.hostSize > sizeof(T)) return false;
+    }
+    return true;
+}
+
+// 大端整数读写
+inline uint32_t loadBE(const uint8_t* p, size_t width) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < width; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+inline void storeBE(uint8_t* p, size_t width, uint32_t value) {
+    for (size_t i = width; i > 0; i--) {
+        p[i - 1] = static_cast<uint8_t>(value);
+        value >>= 8;
+    }
+}
+
+inline uint32_t loadBE32(const uint8_t* p) { return loadBE(p, 4); }
+inline void storeBE32(uint8_t* p, uint32_t value) { storeBE(p, 4, value); }
+
+// 主机整数读写（按宽度）
+inline uint32_t loadHost(const uint8_t* p, size_t width) {
+    switch (width) {
+        case 1: return *p;
+        case 2: { uint16_t v; memcpy(&v, p, 2); return v; }
+        default: { uint32_t v; memcpy(&v, p, 4); return v; }
+    }
+}
+
+inline void storeHost(uint8_t* p, size_t width, uint32_t value) {
+    switch (width) {
+        case 1: *p = static_cast<uint8_t>(value); break;
+        case 2: { uint16_t v = static_cast<uint16_t>(value); memcpy(p, &v, 2); break; }
+        default: memcpy(p, &value, 4); break;
+    }
+}
+
+// 编码到out，返回写入的字节数（即 wireSize<T>()）
+template <typename T>
+inline size_t encode(const T& value, uint8_t* out) {
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(&value);
+    uint8_t* p = out;
+    for (const Field& field : Schema<T>::fields) {
+        switch (field.kind) {
+            case FieldKind::Integer:
+                storeBE(p, field.wireSize, loadHost(base + field.offset, field.hostSize));
+                break;
+            case FieldKind::Bytes:
+                memcpy(p, base + field.offset, field.wireSize);
+                break;
+            case FieldKind::Padding:
+                memset(p, 0, field.wireSize);
+                break;
+        }
+        p += field.wireSize;
+    }
+    return p - out;
+}
+
+// 从in解码，返回消费的字节数（即 wireSize<T>()）
+template <typename T>
+inline size_t decode(const uint8_t* in, T& value) {
+    uint8_t* base = reinterpret_cast<uint8_t*>(&value);
+    const uint8_t* p = in;
+    for (const Field& field : Schema<T>::fields) {
+        switch (field.kind) {
+            case FieldKind::Integer:
+                storeHost(base + field.offset, field.hostSize, loadBE(p, field.wireSize));
+                break;
+            case FieldKind::Bytes:
+                memcpy(base + field.offset, p, field.wireSize);
+                break;
+            case FieldKind::Padding:
+                break;
+        }
+        p += field.wireSize;
+    }
+    return p - in;
+}
+
+// 各结构体的字段表
+
+// 头部：版本和命令各占2字节，随后4字节flags，再是状态
+template <>
+struct Schema<usbip_header> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT_AS(usbip_header, version, 2),
+        USBIP_WIRE_INT_AS(usbip_header, command, 2),
+        USBIP_WIRE_INT(usbip_header, flags),
+        USBIP_WIRE_INT(usbip_header, status),
+    };
+};
+
+template <>
+struct Schema<op_devlist_request> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT(op_devlist_request, version),
+    };
+};
+
+template <>
+struct Schema<usb_device_info> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_BYTES(usb_device_info, path),
+        USBIP_WIRE_BYTES(usb_device_info, busid),
+        USBIP_WIRE_INT(usb_device_info, busnum),
+        USBIP_WIRE_INT(usb_device_info, devnum),
+        USBIP_WIRE_INT(usb_device_info, speed),
+        USBIP_WIRE_INT(usb_device_info, idVendor),
+        USBIP_WIRE_INT(usb_device_info, idProduct),
+        USBIP_WIRE_INT(usb_device_info, bcdDevice),
+        USBIP_WIRE_INT(usb_device_info, bDeviceClass),
+        USBIP_WIRE_INT(usb_device_info, bDeviceSubClass),
+        USBIP_WIRE_INT(usb_device_info, bDeviceProtocol),
+        USBIP_WIRE_INT(usb_device_info, bConfigurationValue),
+        USBIP_WIRE_INT(usb_device_info, bNumConfigurations),
+        USBIP_WIRE_INT(usb_device_info, bNumInterfaces),
+    };
+};
+
+template <>
+struct Schema<usb_interface_info> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT(usb_interface_info, bInterfaceClass),
+        USBIP_WIRE_INT(usb_interface_info, bInterfaceSubClass),
+        USBIP_WIRE_INT(usb_interface_info, bInterfaceProtocol),
+        USBIP_WIRE_PAD(1),
+    };
+};
+
+template <>
+struct Schema<op_import_request> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT(op_import_request, version),
+        USBIP_WIRE_BYTES(op_import_request, busid),
+    };
+};
+
+// 导入响应：成功时后面紧跟一个 usb_device_info
+template <>
+struct Schema<op_import_reply> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT(op_import_reply, version),
+        USBIP_WIRE_INT(op_import_reply, status),
+    };
+};
+
+template <>
+struct Schema<op_caps> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT(op_caps, version),
+        USBIP_WIRE_INT(op_caps, caps),
+        USBIP_WIRE_INT(op_caps, maxBatch),
+        USBIP_WIRE_INT(op_caps, heartbeatMs),
+    };
+};
+
+template <>
+struct Schema<cmd_submit> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT(cmd_submit, seqnum),
+        USBIP_WIRE_INT(cmd_submit, devid),
+        USBIP_WIRE_INT(cmd_submit, direction),
+        USBIP_WIRE_INT(cmd_submit, ep),
+        USBIP_WIRE_INT(cmd_submit, transfer_flags),
+        USBIP_WIRE_INT(cmd_submit, transfer_buffer_length),
+        USBIP_WIRE_INT(cmd_submit, start_frame),
+        USBIP_WIRE_INT(cmd_submit, number_of_packets),
+        USBIP_WIRE_INT(cmd_submit, interval),
+        USBIP_WIRE_BYTES(cmd_submit, setup),
+    };
+};
+
+template <>
+struct Schema<ret_submit> {
+    static constexpr Field fields[] = {
+        USBIP_WIRE_INT(ret_submit, seqnum),
+        USBIP_WIRE_INT(ret_submit, devid),
+        USBIP_WIRE_INT(ret_submit, direction),
+        USBIP_WIRE_INT(ret_submit, ep),
+        USBIP_WIRE_INT(ret_submit, status),
+        USBIP_WIRE_INT(ret_submit, actual_length),
+        USBIP_WIRE_INT(ret_submit, start_frame),
+        USBIP_WIRE_INT(ret_submit, number_of_packets),
+        USBIP_WIRE_INT(ret_submit, error_count),
+    };
+};
+
+// 线上尺寸在编译期固定，任何字段表改动都必须同步更新这里
+static_assert(schemaValid<usbip_header>() && wireSize<usbip_header>() == 12, "usbip_header wire size");
+static_assert(schemaValid<op_devlist_request>() && wireSize<op_devlist_request>() == 4, "op_devlist_request wire size");
+static_assert(schemaValid<usb_device_info>() && wireSize<usb_device_info>() == 312, "usb_device_info wire size");
+static_assert(schemaValid<usb_interface_info>() && wireSize<usb_interface_info>() == 4, "usb_interface_info wire size");
+static_assert(schemaValid<op_import_request>() && wireSize<op_import_request>() == 36, "op_import_request wire size");
+static_assert(schemaValid<op_import_reply>() && wireSize<op_import_reply>() == 8, "op_import_reply wire size");
+static_assert(schemaValid<op_caps>() && wireSize<op_caps>() == 16, "op_caps wire size");
+static_assert(schemaValid<cmd_submit>() && wireSize<cmd_submit>() == 44, "cmd_submit wire size");
+static_assert(schemaValid<ret_submit>() && wireSize<ret_submit>() == 36, "ret_submit wire size");
+
+// 压缩负载的帧在固定部分之后多出的长度字段
+constexpr size_t kCodecLengthSize = 4;
+
+// 带完整性校验的帧在负载之后的CRC32C
+constexpr size_t kTrailerSize = 4;
+
+// 带数据连接或可恢复的导入响应、加入和恢复会话的请求在固定部分之后的会话号：
+// 4字节的会话ID（大端，服务端据此查找会话）和16字节的随机密钥（服务端按常数时间核对），
+// 只有收到过导入响应的一方才能加入或接管会话。客户端原样保存和回送
+constexpr size_t kSessionIdSize = 4;
+constexpr size_t kSessionSecretSize = 16;
+constexpr size_t kSessionTokenSize = kSessionIdSize + kSessionSecretSize;
+using SessionToken = std::array<uint8_t, kSessionTokenSize>;
+
+// 导入请求的总线ID也可以是"vvvv:pppp"形式的选择器（十六进制的厂商ID和产品ID），由服务端选出匹配的设备。
+// 总线ID本身不含冒号，两者不会混淆
+inline bool parseSelector(const char* busid, uint16_t& vendor, uint16_t& product) {
+    const char* colon = strchr(busid, ':');
+    if (!colon) {
+        return false;
+    }
+    char* end;
+    unsigned long v = strtoul(busid, &end, 16);
+    if (end == busid || end != colon || v > 0xFFFF) {
+        return false;
+    }
+    unsigned long p = strtoul(colon + 1, &end, 16);
+    if (end == colon + 1 || *end != '\0' || p > 0xFFFF) {
+        return false;
+    }
+    vendor = static_cast<uint16_t>(v);
+    product = static_cast<uint16_t>(p);
+    return true;
+}
+
+// 批量帧头部之后的总长度，以及每个条目开头的flags
+constexpr size_t kBatchLengthSize = 4;
+constexpr size_t kBatchEntryFlagsSize = 4;
+
+// 固定部分最长的帧是成功的导入响应
+constexpr size_t kMaxHeadSize =
+    wireSize<usbip_header>() + wireSize<op_import_reply>() + wireSize<usb_device_info>();
+
+} // namespace usbip_wire
+
+#endif // USBIP_WIRE_H
@@ -1,4 +1,6 @@
 #include "../include/client.h"
+#include "../include/usbip_wire.h"
+#include "../include/low_latency.h"
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -282,9 +284,7 @@ bool VHCIDevice::handleURBResponse(const usbip_packet& packet) {
 
 // USBIPClient实现
 USBIPClient::USBIPClient(int port, const std::string& serverHost)
-    : serverHost_(serverHost), port_(port), running_(false) {
-    // 创建VHCI设备
-    virtualDevice_ = std::make_unique<VHCIDevice>();
+    : serverHost_(serverHost), port_(port), datagramPort_(0), datagramLoss_(0), tls_(false), compressionThreshold_(0), zeroBlocks_(false), integrity_(false), dataStreams_(0), maxDevices_(1), batchLimit_(0), deadPeerMs_(0), resumeGraceMs_(0), busyPollUs_(0), running_(false) {
 }
 
 USBIPClient::~USBIPClient() {
@@ -294,11 +294,64 @@ USBIPClient::~USBIPClient() {
 bool USBIPClient::start() {
     // 创建并连接客户端
     client_ = std::make_unique<Client>();
-    if (!client_->connect(serverHost_, port_)) {
+    if (tls_ && localPath_.empty()) {
+        if (datagramPort_ > 0) {
+            std::cerr << "数据报传输不支持TLS" << std::endl;
+            return false;
+        }
+        auto tls = TlsContext::createClient(tlsCa_);
+        if (!tls) {
+            std::cerr << "初始化TLS失败" << std::endl;
+            return false;
+        }
+        client_->setTls(tls);
+    }
+    // 快速导入时首批请求随SYN发出；数据报传输的控制连接由服务端先写，不适用
+    if (!attach_.empty() && localPath_.empty() && datagramPort_ == 0) {
+        client_->setFastOpen(true);
+    }
+    client_->setBusyPoll(busyPollUs_);
+    if (!localPath_.empty()) {
+        if (!client_->connectLocal(localPath_)) {
+            std::cerr << "连接本机服务端失败: " << localPath_ << std::endl;
+            return false;
+        }
+    } else if (datagramPort_ > 0) {
+        if (!client_->connectDatagram(serverHost_, datagramPort_)) {
+            std::cerr << "以数据报传输连接服务器失败: " << serverHost_ << ":" << datagramPort_ << std::endl;
+            return false;
+        }
+        if (datagramLoss_ > 0) {
+            client_->setDatagramLoss(datagramLoss_);
+        }
+    } else if (!client_->connect(serverHost_, port_)) {
         std::cerr << "连接服务器失败: " << serverHost_ << ":" << port_ << std::endl;
         return false;
     }
     
+    if (!attach_.empty()) {
+        if (!fastAttach()) {
+            std::cerr << "导入设备失败: " << attach_ << std::endl;
+            return false;
+        }
+    } else if (!attachFromList()) {
+        return false;
+    }
+    
+    // 启动通信线程
+    running_ = true;
+    commThread_ = std::thread(&USBIPClient::communicationThread, this);
+    
+    return true;
+}
+
+bool USBIPClient::attachFromList() {
+    // 开启了扩展时先交换能力，否则连接保持标准帧格式
+    if ((batchLimit_ > 0 || deadPeerMs_ > 0) && !client_->exchangeCaps(batchLimit_, deadPeerMs_)) {
+        std::cerr << "与服务端交换能力失败" << std::endl;
+        return false;
+    }
+    
     // 获取服务端设备列表
     if (!getDeviceList()) {
         std::cerr << "获取设备列表失败" << std::endl;
@@ -313,18 +366,87 @@ bool USBIPClient::start() {
             return false;
         }
         
-        // 导入第一个设备
-        if (!importDevice(deviceList_[0].busid)) {
+        // 按列表顺序导入设备，所有导入都在第一个URB之前完成
+        size_t count = std::min(maxDevices_, deviceList_.size());
+        for (size_t i = 0; i < count; i++) {
+            if (!importDevice(deviceList_[i].busid)) {
+                std::cerr << "导入设备失败: " << deviceList_[i].busid << std::endl;
+            }
+        }
+        
+        std::lock_guard<std::mutex> deviceLock(virtualDeviceMutex_);
+        if (virtualDevices_.empty()) {
             std::cerr << "导入设备失败" << std::endl;
             return false;
         }
+        std::cout << "已导入 " << virtualDevices_.size() << " 个设备" << std::endl;
+    }
+    return true;
+}
+
+bool USBIPClient::fastAttach() {
+    uint16_t vendor = 0;
+    uint16_t product = 0;
+    bool selector = usbip_wire::parseSelector(attach_.c_str(), vendor, product);
+    bool caps = batchLimit_ > 0 || deadPeerMs_ > 0;
+    
+    // 能力交换、设备列表（仅vid:pid选择器，服务端不认识选择器时备用）和导入请求一次写出，
+    // 服务端按顺序处理，整个导入只需一个往返
+    std::vector<usbip_packet> requests;
+    if (caps) {
+        requests.push_back(client_->capsRequest(batchLimit_, deadPeerMs_));
+    }
+    if (selector) {
+        requests.push_back(deviceListRequest());
+    }
+    requests.push_back(importRequest(attach_));
+    std::cout << "快速导入: " << attach_ << "，" << requests.size() << " 个请求一次发出" << std::endl;
+    if (!client_->sendPackets(requests)) {
+        std::cerr << "发送导入请求失败" << std::endl;
+        return false;
     }
     
-    // 启动通信线程
-    running_ = true;
-    commThread_ = std::thread(&USBIPClient::communicationThread, this);
+    // 回复按请求的顺序到达
+    usbip_packet reply;
+    if (caps && (!client_->receivePacket(reply) || !client_->acceptCaps(reply))) {
+        std::cerr << "与服务端交换能力失败" << std::endl;
+        return false;
+    }
+    bool listed = false;
+    if (selector) {
+        if (!client_->receivePacket(reply)) {
+            std::cerr << "接收设备列表响应失败" << std::endl;
+            return false;
+        }
+        listed = parseDeviceList(reply);
+    }
+    if (!client_->receivePacket(reply)) {
+        std::cerr << "接收导入设备响应失败" << std::endl;
+        return false;
+    }
+    if (finishImport(reply)) {
+        return true;
+    }
+    if (!selector || !listed) {
+        return false;
+    }
     
-    return true;
+    // 服务端不认识选择器：在设备列表中找到匹配的设备，按总线ID再导入一次
+    std::string busid;
+    {
+        std::lock_guard<std::mutex> lock(deviceListMutex_);
+        for (const auto& device : deviceList_) {
+            if (device.idVendor == vendor && device.idProduct == product) {
+                busid = device.busid;
+                break;
+            }
+        }
+    }
+    if (busid.empty()) {
+        std::cerr << "服务端没有匹配 " << attach_ << " 的设备" << std::endl;
+        return false;
+    }
+    return importDevice(busid);
 }
 
 void USBIPClient::stop() {
@@ -337,9 +459,12 @@ void USBIPClient::stop() {
         
         // 销毁虚拟设备
         std::lock_guard<std::mutex> lock(virtualDeviceMutex_);
-        if (virtualDevice_ && virtualDevice_->isCreated()) {
-            virtualDevice_->destroy();
+        for (auto& entry : virtualDevices_) {
+            if (entry.second->isCreated()) {
+                entry.second->destroy();
+            }
         }
+        virtualDevices_.clear();
         
         // 断开连接
         if (client_) {
@@ -348,18 +473,20 @@ void USBIPClient::stop() {
     }
 }
 
-bool USBIPClient::getDeviceList() {
-    std::cout << "获取服务端设备列表..." << std::endl;
-    
-    // 准备请求数据包
+usbip_packet USBIPClient::deviceListRequest() const {
     usbip_packet packet;
     packet.header.version = USBIP_VERSION;
     packet.header.command = USBIP_OP_REQ_DEVLIST;
     packet.header.status = 0;
     packet.devlist_req.version = USBIP_VERSION;
+    return packet;
+}
+
+bool USBIPClient::getDeviceList() {
+    std::cout << "获取服务端设备列表..." << std::endl;
     
     // 发送请求
-    if (!client_->sendPacket(packet)) {
+    if (!client_->sendPacket(deviceListRequest())) {
         std::cerr << "发送设备列表请求失败" << std::endl;
         return false;
     }
@@ -372,7 +499,10 @@ bool USBIPClient::getDeviceList() {
         std::cerr << "接收设备列表响应失败" << std::endl;
         return false;
     }
-    
+    return parseDeviceList(reply);
+}
+
+bool USBIPClient::parseDeviceList(const usbip_packet& reply) {
     std::cout << "收到响应数据包，大小: " << reply.data.size() << " 字节" << std::endl;
     std::cout << "响应头部: 版本=" << std::hex << reply.header.version 
               << ", 命令=" << reply.header.command 
@@ -419,32 +549,29 @@ bool USBIPClient::getDeviceList() {
         return false;
     }
     
-    // 直接使用第一个字节作为设备数量 - 根据日志分析这是正确的方法
-    // 01 00 00 00 表示设备数量为1
-    uint32_t numDevices = reply.data[0];
+    // 设备数量（线上为大端序）
+    uint32_t numDevices = usbip_wire::loadBE32(reply.data.data());
     
     std::cout << "设备列表中包含 " << numDevices << " 个设备" << std::endl;
     
-    // 计算预期的数据大小
-    size_t expectedSize = sizeof(uint32_t); // 设备数量字段
+    const size_t deviceSize = usbip_wire::wireSize<usb_device_info>();
+    const size_t interfaceSize = usbip_wire::wireSize<usb_interface_info>();
     
     // 检查数据是否足够
-    if (numDevices > 0) {
-        expectedSize += numDevices * sizeof(usb_device_info); // 每个设备的基本信息
-        
-        if (reply.data.size() < expectedSize) {
-            std::cerr << "设备信息数据不完整: 需要至少 " << expectedSize 
-                      << " 字节，但只收到 " << reply.data.size() << " 字节" << std::endl;
-            return false;
-        }
+    size_t expectedSize = sizeof(uint32_t) + numDevices * (deviceSize + 1);
+    if (reply.data.size() < expectedSize) {
+        std::cerr << "设备信息数据不完整: 需要至少 " << expectedSize 
+                  << " 字节，但只收到 " << reply.data.size() << " 字节" << std::endl;
+        return false;
     }
     
     // 解析每个设备信息
     size_t offset = sizeof(uint32_t);
-    for (uint32_t i = 0; i < numDevices && offset + sizeof(usb_device_info) <= reply.data.size(); i++) {
+    for (uint32_t i = 0; i < numDevices && offset + deviceSize <= reply.data.size(); i++) {
         usb_device_info devInfo;
-        memcpy(&devInfo, reply.data.data() + offset, sizeof(devInfo));
-        offset += sizeof(devInfo);
+        offset += usbip_wire::decode(reply.data.data() + offset, devInfo);
+        devInfo.path[sizeof(devInfo.path) - 1] = '\0';
+        devInfo.busid[sizeof(devInfo.busid) - 1] = '\0';
         
         std::cout << "解析设备 " << i + 1 << " 信息，偏移量: " << offset << std::endl;
         
@@ -456,9 +583,7 @@ bool USBIPClient::getDeviceList() {
         info.idProduct = devInfo.idProduct;
         info.bDeviceClass = devInfo.bDeviceClass;
         info.isMassStorage = (devInfo.bDeviceClass == 0x08); // 检查是否为大容量存储设备
-        
-        // 添加到列表
-        deviceList_.push_back(info);
+        info.devid = (devInfo.busnum << 16) | devInfo.devnum;
         
         // 跳过接口信息
         if (offset < reply.data.size()) {
@@ -466,17 +591,26 @@ bool USBIPClient::getDeviceList() {
             std::cout << "设备 " << i + 1 << " 有 " << static_cast<int>(numInterfaces) << " 个接口" << std::endl;
             
             // 检查是否有足够的数据来包含所有接口
-            size_t interfacesSize = numInterfaces * 4; // 每个接口4字节
+            size_t interfacesSize = numInterfaces * interfaceSize;
             if (offset + interfacesSize > reply.data.size()) {
                 std::cerr << "接口信息数据不完整: 需要 " << interfacesSize 
                           << " 字节，但只剩余 " << (reply.data.size() - offset) << " 字节" << std::endl;
                 // 继续处理已有数据，不中断
             }
             
-            // 每个接口有4个字节
-            offset += numInterfaces * 4;
+            // 接口类为大容量存储的设备同样视为U盘
+            for (uint8_t j = 0; j < numInterfaces && offset + interfaceSize <= reply.data.size(); j++) {
+                usb_interface_info interfaceInfo;
+                offset += usbip_wire::decode(reply.data.data() + offset, interfaceInfo);
+                if (interfaceInfo.bInterfaceClass == USB_CLASS_MASS_STORAGE) {
+                    info.isMassStorage = true;
+                }
+            }
         }
         
+        // 添加到列表
+        deviceList_.push_back(info);
+        
         std::cout << "设备 " << i + 1 << ": " << info.busid
                   << " (VID:" << std::hex << info.idVendor
                   << ", PID:" << info.idProduct << std::dec << ")" << std::endl;
@@ -500,6 +634,22 @@ bool USBIPClient::importDevice(const std::string& busid) {
         return false;
     }
     
+    // 发送请求
+    if (!client_->sendPacket(importRequest(busid))) {
+        std::cerr << "发送导入设备请求失败" << std::endl;
+        return false;
+    }
+    
+    // 接收响应
+    usbip_packet reply;
+    if (!client_->receivePacket(reply)) {
+        std::cerr << "接收导入设备响应失败" << std::endl;
+        return false;
+    }
+    return finishImport(reply);
+}
+
+usbip_packet USBIPClient::importRequest(const std::string& busid) {
     // 准备请求数据包
     usbip_packet packet;
     memset(&packet, 0, sizeof(packet));  // 确保完全清零
@@ -513,21 +663,26 @@ bool USBIPClient::importDevice(const std::string& busid) {
     strncpy(packet.import_req.busid, busid.c_str(), sizeof(packet.import_req.busid) - 1);
     packet.import_req.busid[sizeof(packet.import_req.busid) - 1] = '\0';  // 确保字符串终止
     
-    std::cout << "准备导入设备请求，总线ID: [" << packet.import_req.busid << "]" << std::endl;
-    
-    // 发送请求
-    if (!client_->sendPacket(packet)) {
-        std::cerr << "发送导入设备请求失败" << std::endl;
-        return false;
+    // 头部flags中提供本端开启的负载编码、校验和希望的数据连接数，共享内存传输都不需要
+    if (!client_->isSharedMemory()) {
+        packet.header.flags = codecCaps();
+        if (integrity_) {
+            packet.header.flags |= USBIP_FLAG_CAP_CRC32C;
+        }
+        // 数据连接只在第一个导入时建立，之后导入的设备共用；数据报传输本身已按端点分流，不需要
+        if (client_->streamCount() == 0 && !client_->isDatagram()) {
+            packet.header.flags |= static_cast<uint32_t>(dataStreams_) << USBIP_FLAG_STREAMS_SHIFT;
+        }
     }
-    
-    // 接收响应
-    usbip_packet reply;
-    if (!client_->receivePacket(reply)) {
-        std::cerr << "接收导入设备响应失败" << std::endl;
-        return false;
+    if (resumeGraceMs_ > 0) {
+        packet.header.flags |= USBIP_FLAG_CAP_RESUME;
     }
     
+    std::cout << "准备导入设备请求，总线ID: [" << packet.import_req.busid << "]" << std::endl;
+    return packet;
+}
+
+bool USBIPClient::finishImport(const usbip_packet& reply) {
     // 检查响应类型
     if (reply.header.command != USBIP_OP_REP_IMPORT) {
         std::cerr << "收到错误的响应类型: 0x" << std::hex << reply.header.command 
@@ -541,20 +696,56 @@ bool USBIPClient::importDevice(const std::string& busid) {
         return false;
     }
     
-    // 检查导入响应状态（由服务端转换为网络字节序）
-    int status = usbip_utils::ntohl_wrap(reply.import_rep.status);
+    // 检查导入响应状态
+    int status = static_cast<int>(reply.import_rep.status);
     if (status != 0) {
         std::cerr << "导入设备失败: 响应状态 " << status << std::endl;
         return false;
     }
     
-    // 将网络字节序转换为主机字节序
-    reply.import_rep.udev.busnum = usbip_utils::ntohl_wrap(reply.import_rep.udev.busnum);
-    reply.import_rep.udev.devnum = usbip_utils::ntohl_wrap(reply.import_rep.udev.devnum);
-    reply.import_rep.udev.speed = usbip_utils::ntohl_wrap(reply.import_rep.udev.speed);
-    reply.import_rep.udev.idVendor = usbip_utils::ntohs_wrap(reply.import_rep.udev.idVendor);
-    reply.import_rep.udev.idProduct = usbip_utils::ntohs_wrap(reply.import_rep.udev.idProduct);
-    reply.import_rep.udev.bcdDevice = usbip_utils::ntohs_wrap(reply.import_rep.udev.bcdDevice);
+    // 按选择器导入时以服务端选中的设备为准，数据连接和会话恢复都使用它的总线ID
+    std::string busid = reply.import_rep.udev.busid;
+    
+    // 服务端选定了负载编码：之后的CMD_SUBMIT负载按它压缩
+    uint8_t codec = PayloadCodec::choose(reply.header.flags & USBIP_FLAG_CODEC_CAPS_MASK & codecCaps());
+    if (codec != 0) {
+        PayloadCompressor::Policy policy = PayloadCompressor::defaultPolicy(codec, compressionThreshold_);
+        if (client_->enableCompression(codec, policy)) {
+            std::cout << "已开启负载编码: " << PayloadCodec::find(codec)->name()
+                      << "，阈值 " << policy.threshold << " 字节" << std::endl;
+        }
+    }
+    
+    // 服务端同意校验：此后发出的负载附加CRC32C，收到的负载按它核对
+    if (integrity_ && (reply.header.flags & USBIP_FLAG_CAP_CRC32C)) {
+        client_->enableIntegrity();
+        std::cout << "已开启负载CRC32C校验" << std::endl;
+    } else if (integrity_) {
+        std::cout << "服务端不支持负载校验，按无校验传输" << std::endl;
+    }
+    
+    // 服务端同意了数据连接：凭会话号加入，编码和校验设置沿用上面的结果
+    size_t granted = (reply.header.flags & USBIP_FLAG_STREAMS_MASK) >> USBIP_FLAG_STREAMS_SHIFT;
+    usbip_wire::SessionToken session;
+    bool hasSession = reply.data.size() == usbip_wire::kSessionTokenSize;
+    if (hasSession) {
+        std::copy(reply.data.begin(), reply.data.end(), session.begin());
+    }
+    if (granted > 0 && hasSession) {
+        if (!client_->openStreams(granted, session, busid)) {
+            std::cerr << "部分数据连接未能打开，以 " << client_->streamCount() << " 条继续" << std::endl;
+        }
+    } else if (dataStreams_ > 0) {
+        std::cout << "服务端未同意数据连接，全部URB走单条连接" << std::endl;
+    }
+    
+    // 服务端同意可恢复的会话：会话号与数据连接共用
+    if ((reply.header.flags & USBIP_FLAG_CAP_RESUME) && hasSession) {
+        client_->addResumable(busid, session);
+        std::cout << "服务端同意可恢复的会话，连接中断后 " << resumeGraceMs_ << " 毫秒内可以接续" << std::endl;
+    } else if (resumeGraceMs_ > 0) {
+        std::cout << "服务端未同意可恢复的会话" << std::endl;
+    }
     
     // 提取设备信息
     USBDeviceInfo deviceInfo;
@@ -564,6 +755,7 @@ bool USBIPClient::importDevice(const std::string& busid) {
     deviceInfo.idProduct = reply.import_rep.udev.idProduct;
     deviceInfo.bDeviceClass = reply.import_rep.udev.bDeviceClass;
     deviceInfo.isMassStorage = (reply.import_rep.udev.bDeviceClass == USB_CLASS_MASS_STORAGE);
+    deviceInfo.devid = (reply.import_rep.udev.busnum << 16) | reply.import_rep.udev.devnum;
     
     // 打印设备信息，便于调试
     std::cout << "===导入的设备信息===" << std::endl;
@@ -579,28 +771,48 @@ bool USBIPClient::importDevice(const std::string& busid) {
     std::cout << "===================" << std::endl;
     
     // 创建虚拟设备
-    std::lock_guard<std::mutex> lock(virtualDeviceMutex_);
-    if (!virtualDevice_->create(deviceInfo)) {
+    std::unique_ptr<VirtualUSBDevice> virtualDevice = std::make_unique<VHCIDevice>();
+    if (!virtualDevice->create(deviceInfo)) {
         std::cerr << "创建虚拟设备失败" << std::endl;
         return false;
     }
     
     // 将服务器地址记录到VHCIDevice类中用于激活设备
     // 转换为VHCIDevice类型才能调用setServerHost方法
-    VHCIDevice* vhciDevice = dynamic_cast<VHCIDevice*>(virtualDevice_.get());
+    VHCIDevice* vhciDevice = dynamic_cast<VHCIDevice*>(virtualDevice.get());
     if (vhciDevice) {
         vhciDevice->setServerHost(serverHost_);
     } else {
         std::cerr << "无法转换为VHCIDevice类型" << std::endl;
     }
     
-    std::cout << "成功导入设备: " << deviceInfo.busid << std::endl;
+    std::lock_guard<std::mutex> lock(virtualDeviceMutex_);
+    virtualDevices_[deviceInfo.devid] = std::move(virtualDevice);
+    
+    std::cout << "成功导入设备: " << deviceInfo.busid << "，devid=0x" << std::hex << deviceInfo.devid
+              << std::dec << std::endl;
     return true;
 }
 
+uint32_t USBIPClient::codecCaps() const {
+    uint32_t caps = 0;
+    if (compressionThreshold_ > 0) {
+        caps |= PayloadCodec::capOf(PayloadCodec::kLz);
+    }
+    if (zeroBlocks_) {
+        caps |= PayloadCodec::capOf(PayloadCodec::kZeroBlocks);
+    }
+    return caps;
+}
+
 void USBIPClient::communicationThread() {
     std::cout << "通信线程启动，等待USB请求和响应..." << std::endl;
     
+    // 忙轮询时通信线程独占一个CPU，自旋期间不被迁移
+    if (busyPollUs_ > 0) {
+        pinThread(lowLatencyCpu(0));
+    }
+    
     // 为信号处理准备
     bool localRunning = true;
     
@@ -609,6 +821,8 @@ void USBIPClient::communicationThread() {
     int noDataCount = 0;
     const int MAX_NO_DATA = 5;      // 5次无数据后提示用户
     int requestInterval = 0;        // 请求间隔计数器
+    size_t nextDevice = 0;          // 轮流向各导入的设备发送请求
+    auto lastReport = std::chrono::steady_clock::now();  // 上次输出在途窗口状态的时间
     
     while (running_ && localRunning) {
         try {
@@ -627,7 +841,12 @@ void USBIPClient::communicationThread() {
                 request.header.status = 0;
                 
                 request.cmd_submit_data.seqnum = static_cast<uint32_t>(time(nullptr)); // 使用时间戳作为序列号
-                request.cmd_submit_data.devid = 1; // 假设设备ID为1
+                {
+                    std::lock_guard<std::mutex> lock(virtualDeviceMutex_);
+                    auto it = virtualDevices_.begin();
+                    std::advance(it, nextDevice++ % virtualDevices_.size());
+                    request.cmd_submit_data.devid = it->first;
+                }
                 request.cmd_submit_data.direction = USBIP_DIR_IN; // IN方向，从设备读取数据
                 request.cmd_submit_data.ep = 0; // 端点0（控制传输端点）
                 request.cmd_submit_data.transfer_flags = 0;
@@ -658,6 +877,17 @@ void USBIPClient::communicationThread() {
                 requestInterval--;
             }
             
+            // 定期输出在途窗口的状态
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastReport >= std::chrono::seconds(10)) {
+                lastReport = now;
+                UrbWindow::Stats stats = client_->windowStats();
+                std::cout << "URB窗口: " << stats.window << "，在途 " << stats.inflight << "，暂存 " << client_->heldCount()
+                          << "，RTT " << std::chrono::duration<double, std::milli>(stats.srtt).count() << " ms（最小 "
+                          << std::chrono::duration<double, std::milli>(stats.minRtt).count() << " ms），带宽约 "
+                          << stats.bandwidth / (1024 * 1024) << " MB/s" << std::endl;
+            }
+            
             // 尝试接收服务端数据，使用超时方式
             std::cout << "等待服务端数据，超时时间 " << TIMEOUT_SECONDS << " 秒..." << std::endl;
             usbip_packet packet;
@@ -666,8 +896,17 @@ void USBIPClient::communicationThread() {
                 
                 // 处理响应
                 std::lock_guard<std::mutex> lock(virtualDeviceMutex_);
-                if (virtualDevice_ && virtualDevice_->isCreated()) {
-                    virtualDevice_->handleURBResponse(packet);
+                auto it = virtualDevices_.find(packet.ret_submit_data.devid);
+                if (it == virtualDevices_.end()) {
+                    std::cerr << "收到未导入设备的URB响应: devid=0x" << std::hex << packet.ret_submit_data.devid
+                              << std::dec << std::endl;
+                } else if (it->second->isCreated()) {
+                    it->second->handleURBResponse(packet);
+                }
+            } else if (!client_->isConnected() && client_->resumable()) {
+                // 连接中断：虚拟设备保持不变，在宽限期内接续会话
+                if (!resumeSession()) {
+                    localRunning = false;
                 }
             } else {
                 // 超时但没有接收到数据
@@ -692,4 +931,18 @@ void USBIPClient::communicationThread() {
     }
     
     std::cout << "通信线程结束" << std::endl;
+}
+
+bool USBIPClient::resumeSession() {
+    std::cerr << "与服务端的连接已中断，尝试在 " << resumeGraceMs_ << " 毫秒内恢复会话..." << std::endl;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(resumeGraceMs_);
+    while (running_ && std::chrono::steady_clock::now() < deadline) {
+        if (client_->resume()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    
+    std::cerr << "未能在宽限期内恢复会话，通信线程退出" << std::endl;
+    return false;
 } 
\ No newline at end of file
@@ -0,0 +1,685 @@
+#include "../include/event_loop.h"
+#include "../include/io_uring.h"
+#include "../include/low_latency.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// 每次等待最多处理的事件数
+static const int kMaxEvents = 128;
+
+// io_uring后端：SQ深度，以及每个循环的接收缓冲区（256 x 16KB）
+static const unsigned kRingEntries = 256;
+static const uint16_t kBufferGroup = 0;
+static const unsigned kBufferCount = 256;
+static const unsigned kBufferSize = 16 * 1024;
+
+// user_data低4位为请求类型；accept/recv在其上编码fd和注册代数，send编码发送序号
+enum : uint64_t {
+    kOpWake = 1,
+    kOpAccept = 2,
+    kOpRecv = 3,
+    kOpSend = 4,
+    kOpCancel = 5,
+    kOpClose = 6,
+    kOpPoll = 7
+};
+
+static uint64_t channelUserData(int fd, uint32_t generation, uint64_t op) {
+    return static_cast<uint64_t>(generation) << 32 | static_cast<uint64_t>(static_cast<uint32_t>(fd)) << 4 | op;
+}
+
+// 一个fd上持续进行的accept、recv或poll
+struct EventLoop::Channel {
+    uint32_t generation;
+    uint64_t op;
+    uint32_t interest;
+    bool armed = false;   // 多次触发的请求仍在内核中
+    bool paused = false;  // recv已暂停：请求结束后不再重新挂上
+    EventLoop::AcceptHandler onAccept;
+    EventLoop::ReceiveHandler onReceive;
+    EventLoop::Handler onEvents;
+};
+
+// 一次进行中的发送，msghdr和iovec在完成前必须保持有效
+struct EventLoop::SendOp {
+    EventLoop::SendHandler handler;
+    std::vector<struct iovec> iov;
+    struct msghdr msg;
+};
+
+#ifdef __linux__
+static uint32_t toEpoll(uint32_t interest) {
+    uint32_t events = 0;
+    if (interest & EventLoop::kReadable) events |= EPOLLIN | EPOLLRDHUP;
+    if (interest & EventLoop::kWritable) events |= EPOLLOUT;
+    return events;
+}
+
+static uint32_t fromEpoll(uint32_t events) {
+    uint32_t result = 0;
+    if (events & (EPOLLIN | EPOLLPRI)) result |= EventLoop::kReadable;
+    if (events & EPOLLOUT) result |= EventLoop::kWritable;
+    if (events & EPOLLERR) result |= EventLoop::kError;
+    if (events & (EPOLLHUP | EPOLLRDHUP)) result |= EventLoop::kHangup;
+    return result;
+}
+#endif
+
+// poll()和io_uring的poll请求共用
+static short toPoll(uint32_t interest) {
+    short events = 0;
+    if (interest & EventLoop::kReadable) events |= POLLIN;
+    if (interest & EventLoop::kWritable) events |= POLLOUT;
+    return events;
+}
+
+static uint32_t fromPoll(short revents) {
+    uint32_t result = 0;
+    if (revents & POLLIN) result |= EventLoop::kReadable;
+    if (revents & POLLOUT) result |= EventLoop::kWritable;
+    if (revents & (POLLERR | POLLNVAL)) result |= EventLoop::kError;
+    if (revents & POLLHUP) result |= EventLoop::kHangup;
+    return result;
+}
+
+EventLoop::EventLoop()
+    : backend_(Backend::Readiness), pollFd_(-1), running_(false), now_(Clock::now()), spin_(0),
+      nextGeneration_(0), nextSendId_(0), wakeValue_(0) {
+    wakeFds_[0] = wakeFds_[1] = -1;
+}
+
+EventLoop::~EventLoop() {
+    if (ring_ && spin_.count() > 0) {
+        unlockMemory(ring_->bufferArea(), ring_->bufferAreaSize());
+    }
+    if (pollFd_ >= 0) {
+        ::close(pollFd_);
+    }
+    if (wakeFds_[0] >= 0) {
+        ::close(wakeFds_[0]);
+    }
+    if (wakeFds_[1] >= 0 && wakeFds_[1] != wakeFds_[0]) {
+        ::close(wakeFds_[1]);
+    }
+}
+
+bool EventLoop::ioUringSupported() {
+    return IoUring::supported();
+}
+
+bool EventLoop::init(Backend backend) {
+    backend_ = backend;
+    loopThread_ = std::this_thread::get_id();
+
+#ifdef __linux__
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        std::cerr << "创建eventfd失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    wakeFds_[0] = wakeFds_[1] = efd;
+#else
+    if (pipe(wakeFds_) < 0) {
+        std::cerr << "创建唤醒管道失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    for (int fd : wakeFds_) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    if (backend_ == Backend::IoUring) {
+        return initIoUring();
+    }
+
+#ifdef __linux__
+    pollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (pollFd_ < 0) {
+        std::cerr << "创建epoll实例失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+#endif
+
+    return add(wakeFds_[0], kReadable, [this](uint32_t) { drainWakeup(); });
+}
+
+bool EventLoop::add(int fd, uint32_t interest, Handler handler) {
+    if (backend_ == Backend::IoUring) {
+        // 以多次触发的poll请求提供就绪通知
+        auto channel = std::make_shared<Channel>();
+        channel->generation = ++nextGeneration_;
+        channel->op = kOpPoll;
+        channel->interest = interest;
+        channel->onEvents = std::move(handler);
+        channels_[fd] = channel;
+        return armChannel(fd, *channel);
+    }
+
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(interest);
+    ev.data.fd = fd;
+    if (epoll_ctl(pollFd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        std::cerr << "注册文件描述符 " << fd << " 失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+#endif
+
+    handlers_[fd] = std::make_shared<Handler>(std::move(handler));
+    interests_[fd] = interest;
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t interest) {
+    if (backend_ == Backend::IoUring) {
+        auto channel = channels_.find(fd);
+        if (channel == channels_.end() || channel->second->op != kOpPoll) {
+            return false;
+        }
+        if (channel->second->interest == interest) {
+            return true;
+        }
+        
+        // 取消原请求，以新的代数和关注事件重新挂上
+        ring_->prepCancel(channelUserData(fd, channel->second->generation, kOpPoll), kOpCancel);
+        channel->second->generation = ++nextGeneration_;
+        channel->second->interest = interest;
+        return armChannel(fd, *channel->second);
+    }
+    
+    auto it = interests_.find(fd);
+    if (it == interests_.end()) {
+        return false;
+    }
+    if (it->second == interest) {
+        return true;
+    }
+
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = toEpoll(interest);
+    ev.data.fd = fd;
+    if (epoll_ctl(pollFd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        std::cerr << "修改文件描述符 " << fd << " 失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+#endif
+
+    it->second = interest;
+    return true;
+}
+
+void EventLoop::remove(int fd) {
+    if (backend_ == Backend::IoUring) {
+        cancelAsync(fd);
+        return;
+    }
+    
+    if (handlers_.erase(fd) == 0) {
+        return;
+    }
+    interests_.erase(fd);
+
+#ifdef __linux__
+    epoll_ctl(pollFd_, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(postMutex_);
+        posted_.push_back(std::move(task));
+    }
+    wakeup();
+}
+
+void EventLoop::stop() {
+    running_ = false;
+    wakeup();
+}
+
+void EventLoop::wakeup() {
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t ret = ::write(wakeFds_[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t ret = ::write(wakeFds_[1], &one, sizeof(one));
+#endif
+    (void)ret; // 计数溢出或管道已满时无需处理，循环已经会被唤醒
+}
+
+void EventLoop::drainWakeup() {
+    char buf[64];
+    while (::read(wakeFds_[0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+void EventLoop::runPosted() {
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(postMutex_);
+        tasks.swap(posted_);
+    }
+
+    for (auto& task : tasks) {
+        task();
+    }
+}
+
+EventLoop::TimerId EventLoop::runAt(Clock::time_point deadline, Task task) {
+    return timers_.schedule(deadline, std::move(task));
+}
+
+EventLoop::TimerId EventLoop::runAfter(std::chrono::milliseconds delay, Task task) {
+    return timers_.schedule(now_ + delay, std::move(task));
+}
+
+bool EventLoop::cancelTimer(TimerId id) {
+    return timers_.cancel(id);
+}
+
+void EventLoop::setBusyPoll(std::chrono::microseconds spin) {
+    if (ring_ && spin.count() > 0 && spin_.count() == 0) {
+        lockMemory(ring_->bufferArea(), ring_->bufferAreaSize());
+    }
+    spin_ = spin;
+}
+
+int EventLoop::waitTimeout() {
+    // 投递的任务会敲响唤醒描述符，不必在这里检查
+    Clock::time_point now = Clock::now();
+    if (spin_.count() > 0 && now - lastEvent_ < spin_) {
+        return 0;
+    }
+    return timers_.nextTimeoutMs(now);
+}
+
+void EventLoop::runTimers() {
+    now_ = Clock::now();
+    timers_.advance(now_);
+}
+
+void EventLoop::dispatch(int fd, uint32_t events) {
+    auto it = handlers_.find(fd);
+    if (it == handlers_.end()) {
+        return;
+    }
+
+    // 处理函数可能注销自身，持有一份引用
+    std::shared_ptr<Handler> handler = it->second;
+    (*handler)(events);
+}
+
+void EventLoop::run() {
+    loopThread_ = std::this_thread::get_id();
+    running_ = true;
+
+    if (backend_ == Backend::IoUring) {
+        runIoUring();
+        return;
+    }
+
+#ifdef __linux__
+    struct epoll_event events[kMaxEvents];
+#else
+    std::vector<struct pollfd> pollfds;
+#endif
+
+    while (running_) {
+        runPosted();
+        if (!running_) {
+            break;
+        }
+
+#ifdef __linux__
+        int n = epoll_wait(pollFd_, events, kMaxEvents, waitTimeout());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "epoll_wait失败: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        now_ = Clock::now();
+        if (n > 0) {
+            lastEvent_ = now_;
+        } else if (spin_.count() > 0) {
+            // 自旋的一轮没有事件：让出CPU，与其他线程共用CPU时不拖慢它们，独占时立即返回
+            std::this_thread::yield();
+        }
+        for (int i = 0; i < n; i++) {
+            dispatch(events[i].data.fd, fromEpoll(events[i].events));
+        }
+#else
+        pollfds.clear();
+        for (const auto& entry : interests_) {
+            struct pollfd pfd;
+            pfd.fd = entry.first;
+            pfd.events = toPoll(entry.second);
+            pfd.revents = 0;
+            pollfds.push_back(pfd);
+        }
+
+        int n = ::poll(pollfds.data(), pollfds.size(), waitTimeout());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "poll失败: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        now_ = Clock::now();
+        if (n > 0) {
+            lastEvent_ = now_;
+        } else if (spin_.count() > 0) {
+            std::this_thread::yield();
+        }
+        for (const auto& pfd : pollfds) {
+            if (pfd.revents != 0) {
+                dispatch(pfd.fd, fromPoll(pfd.revents));
+            }
+        }
+#endif
+
+        // 本轮的I/O事件处理完之后再处理到期的定时器，回调不会打断正在分发的请求，
+        // 连接上至多有一帧接收了一部分，留在解码器中
+        runTimers();
+    }
+
+    // 退出前执行剩余的任务（例如关闭连接）
+    runPosted();
+    running_ = false;
+}
+
+bool EventLoop::initIoUring() {
+    ring_ = std::make_unique<IoUring>();
+    if (!ring_->init(kRingEntries)) {
+        std::cerr << "创建io_uring失败: " << strerror(errno) << std::endl;
+        ring_.reset();
+        return false;
+    }
+
+    if (!ring_->setupBufferRing(kBufferGroup, kBufferCount, kBufferSize)) {
+        std::cerr << "注册io_uring接收缓冲区失败: " << strerror(errno) << std::endl;
+        ring_.reset();
+        return false;
+    }
+
+    armWakeup();
+    return true;
+}
+
+void EventLoop::armWakeup() {
+    ring_->prepRead(wakeFds_[0], &wakeValue_, sizeof(wakeValue_), kOpWake);
+}
+
+bool EventLoop::armChannel(int fd, Channel& channel) {
+    uint64_t userData = channelUserData(fd, channel.generation, channel.op);
+    channel.armed = true;
+    switch (channel.op) {
+        case kOpAccept:
+            return ring_->prepAcceptMultishot(fd, userData);
+        case kOpPoll:
+            return ring_->prepPollMultishot(fd, static_cast<uint16_t>(toPoll(channel.interest)), userData);
+        default:
+            return ring_->prepRecvMultishot(fd, kBufferGroup, userData);
+    }
+}
+
+bool EventLoop::acceptAsync(int listenFd, AcceptHandler handler) {
+    if (!ring_) {
+        return false;
+    }
+
+    auto channel = std::make_shared<Channel>();
+    channel->generation = ++nextGeneration_;
+    channel->op = kOpAccept;
+    channel->interest = 0;
+    channel->onAccept = std::move(handler);
+    channels_[listenFd] = channel;
+    return armChannel(listenFd, *channel);
+}
+
+bool EventLoop::receiveAsync(int fd, ReceiveHandler handler) {
+    if (!ring_) {
+        return false;
+    }
+
+    auto channel = std::make_shared<Channel>();
+    channel->generation = ++nextGeneration_;
+    channel->op = kOpRecv;
+    channel->interest = 0;
+    channel->onReceive = std::move(handler);
+    channels_[fd] = channel;
+    return armChannel(fd, *channel);
+}
+
+bool EventLoop::sendAsync(int fd, const struct iovec* iov, int iovcnt, SendHandler handler) {
+    if (!ring_) {
+        return false;
+    }
+
+    auto op = std::make_unique<SendOp>();
+    op->handler = std::move(handler);
+    op->iov.assign(iov, iov + iovcnt);
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov.data();
+    op->msg.msg_iovlen = op->iov.size();
+
+    uint64_t id = ++nextSendId_;
+    if (!ring_->prepSendmsg(fd, &op->msg, id << 4 | kOpSend)) {
+        return false;
+    }
+    sends_[id] = std::move(op);
+    return true;
+}
+
+void EventLoop::cancelAsync(int fd) {
+    auto it = channels_.find(fd);
+    if (it == channels_.end()) {
+        return;
+    }
+
+    uint64_t target = channelUserData(fd, it->second->generation, it->second->op);
+    channels_.erase(it);
+
+    // 已经到达但尚未处理的完成事件按代数识别为过期，只归还缓冲区
+    ring_->prepCancel(target, kOpCancel);
+}
+
+void EventLoop::pauseReceive(int fd) {
+    auto it = channels_.find(fd);
+    if (it == channels_.end() || it->second->op != kOpRecv || it->second->paused) {
+        return;
+    }
+
+    // 代数不变：取消生效之前已收到的数据照常回调，不会丢失
+    Channel& channel = *it->second;
+    channel.paused = true;
+    if (channel.armed) {
+        ring_->prepCancel(channelUserData(fd, channel.generation, kOpRecv), kOpCancel);
+    }
+}
+
+bool EventLoop::resumeReceive(int fd) {
+    auto it = channels_.find(fd);
+    if (it == channels_.end() || it->second->op != kOpRecv) {
+        return false;
+    }
+
+    // 取消尚未完成时，由请求结束的完成事件重新挂上
+    Channel& channel = *it->second;
+    channel.paused = false;
+    return channel.armed || armChannel(fd, channel);
+}
+
+void EventLoop::closeAsync(int fd) {
+    if (!ring_ || !ring_->prepClose(fd, kOpClose)) {
+        ::close(fd);
+    }
+}
+
+uint64_t EventLoop::enterCalls() const {
+    return ring_ ? ring_->enterCalls() : 0;
+}
+
+void EventLoop::handleCompletion(uint64_t userData, int32_t res, uint32_t flags) {
+    IoUring::Completion cqe{userData, res, flags};
+    uint64_t op = userData & 0xF;
+
+    switch (op) {
+        case kOpWake:
+            // eventfd计数已被读走，重新挂上
+            if (running_) {
+                armWakeup();
+            }
+            return;
+
+        case kOpSend: {
+            auto it = sends_.find(userData >> 4);
+            if (it == sends_.end()) {
+                return;
+            }
+            std::unique_ptr<SendOp> send = std::move(it->second);
+            sends_.erase(it);
+            send->handler(res);
+            return;
+        }
+
+        case kOpAccept:
+        case kOpRecv:
+        case kOpPoll:
+            break;
+
+        default:
+            return;
+    }
+
+    int fd = static_cast<int>((userData >> 4) & 0x0FFFFFFF);
+    uint32_t generation = static_cast<uint32_t>(userData >> 32);
+    uint16_t bid = 0;
+    bool hasBuffer = IoUring::bufferId(cqe, bid);
+
+    // 回调可能注销通道，持有一份引用
+    auto it = channels_.find(fd);
+    std::shared_ptr<Channel> channel;
+    if (it != channels_.end() && it->second->generation == generation) {
+        channel = it->second;
+    }
+
+    if (!channel) {
+        // 已取消的通道上迟到的完成事件
+        if (hasBuffer) {
+            ring_->recycleBuffer(bid);
+        }
+        if (op == kOpAccept && res >= 0) {
+            ::close(res);
+        }
+        return;
+    }
+
+    // 多次触发的请求被内核终止后，通道仍在、未在回调中重新挂上且未暂停时重新挂上
+    auto rearm = [this, fd, generation, &cqe, &channel]() {
+        auto current = channels_.find(fd);
+        if (!IoUring::hasMore(cqe) && current != channels_.end() && current->second == channel &&
+            channel->generation == generation) {
+            channel->armed = false;
+            if (!channel->paused) {
+                armChannel(fd, *channel);
+            }
+        }
+    };
+    
+    if (op == kOpPoll) {
+        if (res >= 0) {
+            channel->onEvents(fromPoll(static_cast<short>(res)));
+            rearm();
+        } else if (res != -ECANCELED) {
+            std::cerr << "等待文件描述符 " << fd << " 失败: " << strerror(-res) << std::endl;
+            channel->onEvents(kError | kHangup);
+        }
+        return;
+    }
+
+    if (op == kOpAccept) {
+        if (res >= 0) {
+            channel->onAccept(res);
+        } else if (res != -ECANCELED) {
+            std::cerr << "接受连接失败: " << strerror(-res) << std::endl;
+        }
+        rearm();
+        return;
+    }
+
+    if (res > 0) {
+        const uint8_t* data = hasBuffer ? ring_->buffer(bid) : nullptr;
+        channel->onReceive(data, res);
+        if (hasBuffer) {
+            ring_->recycleBuffer(bid);
+        }
+        rearm();
+    } else if (res == -ENOBUFS) {
+        // 接收缓冲区暂时用完，已处理的缓冲区都已归还，重新挂上即可
+        rearm();
+    } else if (res == -ECANCELED) {
+        // 注销通道（cancelAsync）时已从channels_中移除，它的取消在上面按代数丢弃；
+        // 到这里的取消来自pauseReceive()：仍暂停时不再挂上，期间已经恢复的重新挂上
+        rearm();
+    } else {
+        // 对端关闭（0）或出错，接收结束
+        if (hasBuffer) {
+            ring_->recycleBuffer(bid);
+        }
+        channels_.erase(fd);
+        channel->onReceive(nullptr, res);
+    }
+}
+
+void EventLoop::runIoUring() {
+    IoUring::Completion cqes[kMaxEvents];
+
+    while (running_) {
+        runPosted();
+        if (!running_) {
+            break;
+        }
+
+        // 本轮准备的所有请求和等待完成在一次系统调用中完成，等待时限同样随之传入
+        int ret = ring_->submitAndWait(1, waitTimeout());
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY && ret != -ETIME) {
+            std::cerr << "io_uring_enter失败: " << strerror(-ret) << std::endl;
+            break;
+        }
+
+        now_ = Clock::now();
+        size_t n;
+        bool idle = true;
+        while ((n = ring_->reapCompletions(cqes, kMaxEvents)) > 0) {
+            lastEvent_ = now_;
+            idle = false;
+            for (size_t i = 0; i < n; i++) {
+                handleCompletion(cqes[i].userData, cqes[i].res, cqes[i].flags);
+            }
+        }
+        if (idle && spin_.count() > 0) {
+            std::this_thread::yield();
+        }
+
+        runTimers();
+    }
+
+    // 提交退出前准备的取消和关闭请求
+    runPosted();
+    ring_->submitAndWait(0);
+    running_ = false;
+}
@@ -0,0 +1,450 @@
+#include "../include/frame_decoder.h"
+#include "../include/usbip_wire.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+const size_t FrameDecoder::kMaxPayload;
+
+// 设备列表中每个设备的固定部分：设备信息和1字节接口数量
+static const size_t kDevlistDeviceSize = usbip_wire::wireSize<usb_device_info>() + 1;
+
+FrameDecoder::FrameDecoder()
+    : urbPhase_(false), step_(Step::Fixed), part_(Part::Header), partStart_(0),
+      want_(usbip_wire::wireSize<usbip_header>()), devicesLeft_(0), batchCommand_(0), batchVersion_(0),
+      batchLeft_(0), filled_(0), discarded_(0), segmentThreshold_(0), segmentSize_(0), segmentLeft_(0), charged_(0), blockedSize_(0), codedSize_(0) {
+    fixed_.reserve(usbip_wire::kMaxHeadSize);
+}
+
+FrameDecoder::~FrameDecoder() {
+    releaseCharge();
+}
+
+size_t FrameDecoder::feed(const uint8_t* data, size_t len) {
+    size_t used = 0;
+    while (used < len) {
+        if (step_ == Step::Blocked && !admitPayload()) {
+            break;
+        }
+        if (step_ == Step::Fixed) {
+            size_t take = std::min(len - used, want_ - fixed_.size());
+            fixed_.insert(fixed_.end(), data + used, data + used + take);
+            used += take;
+            if (fixed_.size() == want_) {
+                parsePart();
+            }
+        } else if (step_ == Step::Payload) {
+            size_t take = std::min(len - used, packet_.data.size() - filled_);
+            memcpy(packet_.data.data() + filled_, data + used, take);
+            used += take;
+            commitPayload(take);
+        } else if (step_ == Step::Discard) {
+            size_t take = std::min(len - used, discarded_ - filled_);
+            used += take;
+            filled_ += take;
+            if (filled_ == discarded_) {
+                finishFrame();
+            }
+        } else {
+            break;
+        }
+    }
+    return used;
+}
+
+bool FrameDecoder::next(usbip_packet& packet) {
+    if (step_ != Step::Done) {
+        return false;
+    }
+
+    // 包交给调用者，负载由它按实际持有的缓冲区计入预算
+    releaseCharge();
+    packet = std::move(packet_);
+    if (segmentLeft_ > 0) {
+        nextSegment(packet);
+    } else {
+        startFrame();
+    }
+    return true;
+}
+
+bool FrameDecoder::admitPayload() {
+    if (step_ != Step::Blocked) {
+        return true;
+    }
+    if (budget_->exhausted()) {
+        return false;
+    }
+
+    allocatePayload(blockedSize_, true);
+    return step_ != Step::Blocked;
+}
+
+void FrameDecoder::reset() {
+    releaseCharge();
+    urbPhase_ = false;
+    batchCommand_ = 0;
+    batchLeft_ = 0;
+    segmentLeft_ = 0;
+    startFrame();
+}
+
+void FrameDecoder::startFrame() {
+    packet_ = usbip_packet();
+    fixed_.clear();
+    step_ = Step::Fixed;
+    partStart_ = 0;
+    devicesLeft_ = 0;
+    filled_ = 0;
+    discarded_ = 0;
+    codedSize_ = 0;
+
+    if (batchCommand_ != 0) {
+        part_ = Part::BatchEntry;
+        want_ = usbip_wire::kBatchEntryFlagsSize;
+    } else {
+        part_ = Part::Header;
+        want_ = usbip_wire::wireSize<usbip_header>();
+    }
+}
+
+void FrameDecoder::finishFrame() {
+    if (batchCommand_ != 0) {
+        size_t size = fixed_.size() + packet_.data.size() + discarded_;
+        if (size > batchLeft_) {
+            std::cerr << "批量帧长度异常: 条目超出声明的长度" << std::endl;
+            step_ = Step::Failed;
+            return;
+        }
+        batchLeft_ -= size;
+        if (batchLeft_ == 0) {
+            batchCommand_ = 0;
+        }
+    }
+    step_ = Step::Done;
+}
+
+uint8_t* FrameDecoder::payloadWindow(size_t& len) {
+    if (step_ != Step::Payload) {
+        len = 0;
+        return nullptr;
+    }
+
+    len = packet_.data.size() - filled_;
+    return packet_.data.data() + filled_;
+}
+
+void FrameDecoder::commitPayload(size_t n) {
+    if (step_ != Step::Payload) {
+        return;
+    }
+
+    filled_ += n;
+    if (filled_ < packet_.data.size()) {
+        return;
+    }
+
+    if (packet_.segmented) {
+        segmentLeft_ -= filled_;
+        packet_.lastSegment = segmentLeft_ == 0;
+        step_ = Step::Done;
+    } else {
+        finishFrame();
+    }
+}
+
+void FrameDecoder::expect(Part part, size_t size) {
+    part_ = part;
+    partStart_ = fixed_.size();
+    want_ = partStart_ + size;
+
+    // 设备列表整个算作固定部分，设备数错乱时同样按上限拒绝
+    if (want_ > kMaxPayload) {
+        std::cerr << "帧长度异常: 固定部分超过 " << kMaxPayload << " 字节" << std::endl;
+        step_ = Step::Failed;
+    }
+}
+
+void FrameDecoder::expectCoded(bool hasPayload, size_t plain) {
+    // 只有带负载的方向可以压缩；解压后的长度由对端声明，超过单帧上限时不等负载到达直接拒绝，
+    // 解压时不会为它分配内存
+    if (!hasPayload) {
+        std::cerr << "不带负载的URB标记了负载编码，命令=0x" << std::hex << packet_.header.command << std::dec << std::endl;
+        step_ = Step::Failed;
+        return;
+    }
+    if (plain > kMaxPayload) {
+        std::cerr << "压缩负载声明的长度异常: " << plain << " 字节，命令=0x" << std::hex << packet_.header.command
+                  << std::dec << std::endl;
+        step_ = Step::Failed;
+        return;
+    }
+
+    codedSize_ = plain;
+    expect(Part::CodecLength, usbip_wire::kCodecLengthSize);
+}
+
+void FrameDecoder::parsePart() {
+    const uint8_t* p = fixed_.data() + partStart_;
+    usbip_header& header = packet_.header;
+
+    switch (part_) {
+        case Part::Header:
+            usbip_wire::decode(p, header);
+            switch (header.command) {
+                case USBIP_CMD_SUBMIT:
+                    urbPhase_ = true;
+                    expect(Part::CmdSubmit, usbip_wire::wireSize<cmd_submit>());
+                    break;
+                case USBIP_RET_SUBMIT:
+                    // 与OP_REP_IMPORT共用命令码，按连接所处的阶段区分
+                    if (urbPhase_) {
+                        expect(Part::RetSubmit, usbip_wire::wireSize<ret_submit>());
+                    } else {
+                        expect(Part::ImportReply, usbip_wire::wireSize<op_import_reply>());
+                    }
+                    break;
+                case USBIP_OP_REQ_IMPORT:
+                    expect(Part::ImportRequest, usbip_wire::wireSize<op_import_request>());
+                    break;
+                case USBIP_OP_REQ_DEVLIST:
+                    expect(Part::DevlistRequest, usbip_wire::wireSize<op_devlist_request>());
+                    break;
+                case USBIP_OP_REP_DEVLIST:
+                    expect(Part::DevlistCount, sizeof(uint32_t));
+                    break;
+                case USBIP_OP_REQ_CAPS:
+                case USBIP_OP_REP_CAPS:
+                    expect(Part::Caps, usbip_wire::wireSize<op_caps>());
+                    break;
+                case USBIP_OP_HEARTBEAT:
+                    startPayload(0);
+                    break;
+                case USBIP_CMD_SUBMIT_BATCH:
+                case USBIP_RET_SUBMIT_BATCH:
+                    // 批量帧只在URB阶段发送，RET_SUBMIT_BATCH不与任何握手命令共用命令码
+                    urbPhase_ = true;
+                    expect(Part::BatchLength, usbip_wire::kBatchLengthSize);
+                    break;
+                default:
+                    // 不知道头部之后还有多少字节，无法找到下一帧的起点
+                    std::cerr << "收到未知命令: 0x" << std::hex << header.command << std::dec << std::endl;
+                    step_ = Step::Failed;
+                    break;
+            }
+            break;
+
+        case Part::CmdSubmit: {
+            cmd_submit& cmd = packet_.cmd_submit_data;
+            usbip_wire::decode(p, cmd);
+            if (header.flags & USBIP_FLAG_CODEC_MASK) {
+                expectCoded(cmd.direction == USBIP_DIR_OUT, cmd.transfer_buffer_length);
+            } else {
+                startPayload(cmd.direction == USBIP_DIR_OUT ? cmd.transfer_buffer_length : 0);
+            }
+            break;
+        }
+
+        case Part::RetSubmit: {
+            ret_submit& ret = packet_.ret_submit_data;
+            usbip_wire::decode(p, ret);
+            if (header.flags & USBIP_FLAG_CODEC_MASK) {
+                expectCoded(ret.direction == USBIP_DIR_IN, ret.actual_length);
+            } else {
+                startPayload(ret.direction == USBIP_DIR_IN ? ret.actual_length : 0);
+            }
+            break;
+        }
+
+        case Part::CodecLength:
+            // 压缩的负载按编码后的长度接收，解压由调用者进行
+            startPayload(usbip_wire::loadBE32(p));
+            break;
+
+        case Part::ImportRequest:
+            usbip_wire::decode(p, packet_.import_req);
+            packet_.import_req.busid[sizeof(packet_.import_req.busid) - 1] = '\0';
+            // 加入或恢复会话的请求之后是会话号
+            startPayload((header.flags & (USBIP_FLAG_STREAM_ATTACH | USBIP_FLAG_RESUME)) ? usbip_wire::kSessionTokenSize : 0);
+            break;
+
+        case Part::ImportReply:
+            usbip_wire::decode(p, packet_.import_rep);
+            if (packet_.import_rep.status == 0) {
+                expect(Part::ImportDevice, usbip_wire::wireSize<usb_device_info>());
+            } else {
+                startPayload(0);
+            }
+            break;
+
+        case Part::ImportDevice: {
+            usb_device_info& udev = packet_.import_rep.udev;
+            usbip_wire::decode(p, udev);
+            udev.path[sizeof(udev.path) - 1] = '\0';
+            udev.busid[sizeof(udev.busid) - 1] = '\0';
+            // 服务端同意了数据连接或可恢复的会话，其后是会话号
+            startPayload((header.flags & (USBIP_FLAG_STREAMS_MASK | USBIP_FLAG_CAP_RESUME)) ? usbip_wire::kSessionTokenSize : 0);
+            break;
+        }
+
+        case Part::DevlistRequest:
+            usbip_wire::decode(p, packet_.devlist_req);
+            startPayload(0);
+            break;
+
+        case Part::DevlistCount:
+            devicesLeft_ = usbip_wire::loadBE32(p);
+            if (devicesLeft_ == 0) {
+                nextDevice();
+            } else {
+                expect(Part::DevlistDevice, kDevlistDeviceSize);
+            }
+            break;
+
+        case Part::DevlistDevice: {
+            uint8_t numInterfaces = fixed_.back();
+            if (numInterfaces > 0) {
+                expect(Part::DevlistInterfaces, numInterfaces * usbip_wire::wireSize<usb_interface_info>());
+            } else {
+                devicesLeft_--;
+                nextDevice();
+            }
+            break;
+        }
+
+        case Part::DevlistInterfaces:
+            devicesLeft_--;
+            nextDevice();
+            break;
+
+        case Part::Caps:
+            usbip_wire::decode(p, packet_.caps);
+            startPayload(0);
+            break;
+
+        case Part::BatchLength:
+            batchLeft_ = usbip_wire::loadBE32(p);
+            if (batchLeft_ > kMaxPayload) {
+                std::cerr << "批量帧长度异常: " << batchLeft_ << " 字节" << std::endl;
+                step_ = Step::Failed;
+                break;
+            }
+            // 批量帧本身不产生包，其后逐个解码条目（空的批量帧直接结束）
+            if (batchLeft_ > 0) {
+                batchCommand_ = header.command == USBIP_CMD_SUBMIT_BATCH ? USBIP_CMD_SUBMIT : USBIP_RET_SUBMIT;
+                batchVersion_ = header.version;
+            }
+            startFrame();
+            break;
+
+        case Part::BatchEntry:
+            // 条目还原为完整的头部：命令和版本取自批量帧，flags随条目携带
+            header.version = batchVersion_;
+            header.command = batchCommand_;
+            header.status = 0;
+            header.flags = usbip_wire::loadBE32(p);
+            if (batchCommand_ == USBIP_CMD_SUBMIT) {
+                expect(Part::CmdSubmit, usbip_wire::wireSize<cmd_submit>());
+            } else {
+                expect(Part::RetSubmit, usbip_wire::wireSize<ret_submit>());
+            }
+            break;
+    }
+}
+
+void FrameDecoder::nextDevice() {
+    if (devicesLeft_ > 0) {
+        expect(Part::DevlistDevice, kDevlistDeviceSize);
+        return;
+    }
+
+    // data中保存线上格式的设备列表：设备数量 + 每个设备的usb_device_info、
+    // 1字节接口数量和接口描述，由调用者按线上格式解码
+    packet_.data.assign(fixed_.begin() + usbip_wire::wireSize<usbip_header>(), fixed_.end());
+    finishFrame();
+}
+
+void FrameDecoder::startPayload(size_t size) {
+    // 带校验的URB负载之后还有校验和，与负载一起接收
+    bool urb = part_ == Part::CmdSubmit || part_ == Part::RetSubmit || part_ == Part::CodecLength;
+    if (urb && (packet_.header.flags & USBIP_FLAG_PAYLOAD_CRC)) {
+        size += usbip_wire::kTrailerSize;
+    }
+
+    if (size > kMaxPayload) {
+        std::cerr << "帧负载长度异常: " << size << " 字节，命令=0x" << std::hex << packet_.header.command << std::dec << std::endl;
+        step_ = Step::Failed;
+        return;
+    }
+
+    // 批量帧的条目都是小URB，不分段；控制传输的setup包和数据需要一起提交
+    if (segmentThreshold_ > 0 && size >= segmentThreshold_ && part_ == Part::CmdSubmit && batchCommand_ == 0 &&
+        packet_.cmd_submit_data.ep != 0 && !(packet_.header.flags & (USBIP_FLAG_CODEC_MASK | USBIP_FLAG_PAYLOAD_CRC))) {
+        packet_.segmented = true;
+        segmentLeft_ = size;
+        step_ = Step::Done;
+        return;
+    }
+
+    allocatePayload(size, urb);
+}
+
+void FrameDecoder::nextSegment(const usbip_packet& prev) {
+    packet_ = usbip_packet();
+    packet_.header = prev.header;
+    packet_.cmd_submit_data = prev.cmd_submit_data;
+    packet_.segmented = true;
+    packet_.payloadOffset = prev.payloadOffset + static_cast<uint32_t>(prev.data.size());
+    allocatePayload(std::min(segmentLeft_, segmentSize_), true);
+}
+
+void FrameDecoder::allocatePayload(size_t size, bool budget) {
+    // 头部之后先检查预算：耗尽时不分配，连接上大量OUT头部不会各自占用一个负载大小的缓冲区。
+    // 压缩的负载按解压后的长度计入，解压出的缓冲区同样在预算之内
+    if (budget && size > 0 && budget_) {
+        size_t capacity = budget_->capacity();
+        if (!packet_.segmented && capacity > 0 && std::max(size, codedSize_) > capacity) {
+            std::cerr << "URB负载 " << std::max(size, codedSize_) << " 字节，超过内存预算 " << capacity
+                      << "，丢弃: 命令=0x" << std::hex << packet_.header.command << std::dec << std::endl;
+            discardPayload(size, -ENOMEM);
+            return;
+        }
+        if (budget_->exhausted()) {
+            blockedSize_ = size;
+            step_ = Step::Blocked;
+            return;
+        }
+        charged_ = std::max(size, codedSize_);
+        budget_->charge(charged_);
+    }
+
+    packet_.data.resize(size);
+    filled_ = 0;
+    if (size > 0) {
+        step_ = Step::Payload;
+    } else {
+        finishFrame();
+    }
+}
+
+void FrameDecoder::discardPayload(size_t size, int error) {
+    packet_.header.flags &= ~(USBIP_FLAG_CODEC_MASK | USBIP_FLAG_PAYLOAD_CRC);
+    if (packet_.header.command == USBIP_CMD_SUBMIT) {
+        packet_.header.status = static_cast<uint32_t>(error);
+    } else {
+        packet_.ret_submit_data.status = static_cast<uint32_t>(error);
+        packet_.ret_submit_data.actual_length = 0;
+    }
+
+    discarded_ = size;
+    filled_ = 0;
+    step_ = Step::Discard;
+}
+
+void FrameDecoder::releaseCharge() {
+    if (charged_ > 0) {
+        budget_->release(charged_);
+        charged_ = 0;
+    }
+}
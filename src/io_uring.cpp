@@ -0,0 +1,405 @@
+#include "../include/io_uring.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// IORING_REGISTER_PBUF_RING是枚举值，无法用#ifdef检查；它早于多次触发recv（6.0）加入
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define USBIP_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef USBIP_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+static int sysSetup(unsigned entries, struct io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags,
+                    const void* arg = nullptr, size_t argSize = 0) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+}
+
+static int sysRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs));
+}
+
+// 与内核共享的环索引需要用acquire/release访问
+static inline unsigned loadAcquire(const unsigned* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(unsigned* p, unsigned v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+#endif
+
+IoUring::IoUring()
+    : ringFd_(-1), sqRing_(nullptr), sqRingSize_(0), cqRing_(nullptr), cqRingSize_(0),
+      sqes_(nullptr), sqesSize_(0), sqHead_(nullptr), sqTail_(nullptr), sqMask_(0), sqEntries_(0),
+      cqHead_(nullptr), cqTail_(nullptr), cqMask_(0), cqes_(nullptr), sqeTail_(0), sqeFlushed_(0),
+      bufRing_(nullptr), bufRingSize_(0), bufCount_(0), bufTail_(0), bufferBase_(nullptr), bufferSize_(0),
+      enterCalls_(0), submitted_(0) {
+}
+
+IoUring::~IoUring() {
+    destroy();
+}
+
+#ifdef USBIP_HAVE_IO_URING
+
+bool IoUring::supported() {
+    static int cached = -1;
+    if (cached >= 0) {
+        return cached == 1;
+    }
+    cached = 0;
+
+    // 多次触发recv从6.0开始提供，旧内核会在提交时才报EINVAL，这里按版本号判断
+    struct utsname uts;
+    int major = 0, minor = 0;
+    if (uname(&uts) != 0 || sscanf(uts.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+        return false;
+    }
+
+    // 容器的seccomp策略常常禁用io_uring
+    IoUring probe;
+    if (!probe.init(4) || !probe.setupBufferRing(0, 2, 64)) {
+        return false;
+    }
+
+    cached = 1;
+    return true;
+}
+
+bool IoUring::init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // CQ放大到SQ的4倍：多次触发的请求一次提交会产生多个完成事件
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ringFd_ = sysSetup(entries, &params);
+    if (ringFd_ < 0) {
+        return false;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        destroy();
+        return false;
+    }
+
+    if (singleMmap) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            destroy();
+            return false;
+        }
+    }
+
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ringFd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        sqes_ = nullptr;
+        destroy();
+        return false;
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+
+    // SQ数组固定为恒等映射
+    unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; i++) {
+        array[i] = i;
+    }
+
+    uint8_t* cq = static_cast<uint8_t*>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+
+    sqeTail_ = sqeFlushed_ = *sqTail_;
+    return true;
+}
+
+void IoUring::destroy() {
+    if (bufRing_) {
+        munmap(bufRing_, bufRingSize_);
+        bufRing_ = nullptr;
+    }
+    if (sqes_) {
+        munmap(sqes_, sqesSize_);
+        sqes_ = nullptr;
+    }
+    if (cqRing_ && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    cqRing_ = nullptr;
+    if (sqRing_) {
+        munmap(sqRing_, sqRingSize_);
+        sqRing_ = nullptr;
+    }
+    if (ringFd_ >= 0) {
+        ::close(ringFd_);
+        ringFd_ = -1;
+    }
+}
+
+bool IoUring::setupBufferRing(uint16_t group, unsigned count, unsigned size) {
+    bufRingSize_ = count * sizeof(struct io_uring_buf);
+    void* ring = mmap(nullptr, bufRingSize_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sysRegister(ringFd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, bufRingSize_);
+        return false;
+    }
+
+    bufRing_ = ring;
+    bufCount_ = count;
+    bufferSize_ = size;
+    bufferStorage_.resize(static_cast<size_t>(count) * size);
+    bufferBase_ = bufferStorage_.data();
+
+    for (unsigned i = 0; i < count; i++) {
+        recycleBuffer(static_cast<uint16_t>(i));
+    }
+    return true;
+}
+
+void IoUring::recycleBuffer(uint16_t bid) {
+    // 不能用ring->bufs：__DECLARE_FLEX_ARRAY在C++下带一个非空的占位成员，bufs偏移为8而不是0
+    struct io_uring_buf_ring* ring = static_cast<struct io_uring_buf_ring*>(bufRing_);
+    struct io_uring_buf* buf = static_cast<struct io_uring_buf*>(bufRing_) + (bufTail_ & (bufCount_ - 1));
+    buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+    buf->len = bufferSize_;
+    buf->bid = bid;
+    bufTail_++;
+    __atomic_store_n(&ring->tail, bufTail_, __ATOMIC_RELEASE);
+}
+
+void* IoUring::getSqe() {
+    if (sqeTail_ - loadAcquire(sqHead_) >= sqEntries_) {
+        // SQ已满：先把已准备的请求交给内核
+        submitAndWait(0);
+        if (sqeTail_ - loadAcquire(sqHead_) >= sqEntries_) {
+            return nullptr;
+        }
+    }
+
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes_) + (sqeTail_ & sqMask_);
+    memset(sqe, 0, sizeof(*sqe));
+    sqeTail_++;
+    return sqe;
+}
+
+bool IoUring::prepAcceptMultishot(int fd, uint64_t userData) {
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(getSqe());
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepRecvMultishot(int fd, uint16_t group, uint64_t userData) {
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(getSqe());
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepPollMultishot(int fd, uint32_t events, uint64_t userData) {
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(getSqe());
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepSendmsg(int fd, const struct msghdr* msg, uint64_t userData) {
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(getSqe());
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepRead(int fd, void* buf, unsigned len, uint64_t userData) {
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(getSqe());
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepCancel(uint64_t targetUserData, uint64_t userData) {
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(getSqe());
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = targetUserData;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepClose(int fd, uint64_t userData) {
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(getSqe());
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = userData;
+    return true;
+}
+
+int IoUring::submitAndWait(unsigned waitNr, int timeoutMs) {
+    unsigned toSubmit = sqeTail_ - sqeFlushed_;
+    if (toSubmit > 0) {
+        storeRelease(sqTail_, sqeTail_);
+        sqeFlushed_ = sqeTail_;
+    }
+
+    if (toSubmit == 0 && waitNr == 0) {
+        return 0;
+    }
+
+    enterCalls_++;
+    int ret;
+    if (waitNr > 0 && timeoutMs >= 0) {
+        // 等待时限随同一次系统调用传入（IORING_ENTER_EXT_ARG，5.11加入，早于多次触发recv），不占用SQE
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        ret = sysEnter(ringFd_, toSubmit, waitNr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        ret = sysEnter(ringFd_, toSubmit, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    }
+    if (ret < 0) {
+        return -errno;
+    }
+    submitted_ += ret;
+    return ret;
+}
+
+size_t IoUring::reapCompletions(Completion* out, size_t max) {
+    unsigned head = *cqHead_;
+    unsigned tail = loadAcquire(cqTail_);
+    size_t count = 0;
+
+    while (head != tail && count < max) {
+        const struct io_uring_cqe* cqe = static_cast<const struct io_uring_cqe*>(cqes_) + (head & cqMask_);
+        out[count].userData = cqe->user_data;
+        out[count].res = cqe->res;
+        out[count].flags = cqe->flags;
+        count++;
+        head++;
+    }
+
+    storeRelease(cqHead_, head);
+    return count;
+}
+
+bool IoUring::bufferId(const Completion& cqe, uint16_t& bid) {
+    if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+        return false;
+    }
+    bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    return true;
+}
+
+bool IoUring::hasMore(const Completion& cqe) {
+    return cqe.flags & IORING_CQE_F_MORE;
+}
+
+#else // !USBIP_HAVE_IO_URING
+
+bool IoUring::supported() { return false; }
+bool IoUring::init(unsigned) { return false; }
+void IoUring::destroy() {}
+bool IoUring::setupBufferRing(uint16_t, unsigned, unsigned) { return false; }
+void IoUring::recycleBuffer(uint16_t) {}
+void* IoUring::getSqe() { return nullptr; }
+bool IoUring::prepAcceptMultishot(int, uint64_t) { return false; }
+bool IoUring::prepRecvMultishot(int, uint16_t, uint64_t) { return false; }
+bool IoUring::prepPollMultishot(int, uint32_t, uint64_t) { return false; }
+bool IoUring::prepSendmsg(int, const struct msghdr*, uint64_t) { return false; }
+bool IoUring::prepRead(int, void*, unsigned, uint64_t) { return false; }
+bool IoUring::prepCancel(uint64_t, uint64_t) { return false; }
+bool IoUring::prepClose(int, uint64_t) { return false; }
+int IoUring::submitAndWait(unsigned, int) { return -ENOSYS; }
+size_t IoUring::reapCompletions(Completion*, size_t) { return 0; }
+bool IoUring::bufferId(const Completion&, uint16_t&) { return false; }
+bool IoUring::hasMore(const Completion&) { return false; }
+
+#endif
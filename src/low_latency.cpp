@@ -0,0 +1,118 @@
+#include "../include/low_latency.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// 调用线程允许运行的CPU，按编号从高到低
+static std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    return cpus;
+}
+
+int lowLatencyCpu(size_t index) {
+    std::vector<int> cpus = allowedCpus();
+    if (cpus.empty()) {
+        return -1;
+    }
+    return cpus[index % cpus.size()];
+}
+
+size_t allowedCpuCount() {
+    size_t count = allowedCpus().size();
+    return count > 0 ? count : std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool pinThread(int cpu) {
+    if (cpu < 0) {
+        return true;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        std::cerr << "绑定线程到CPU " << cpu << " 失败: " << strerror(ret) << std::endl;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool lockMemory(void* addr, size_t len) {
+    if (addr == nullptr || len == 0) {
+        return true;
+    }
+
+    // 读写同一字节，不改变内容；写入使私有映射的页面分配到实际的物理页
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    volatile uint8_t* p = static_cast<volatile uint8_t*>(addr);
+    for (size_t offset = 0; offset < len; offset += page) {
+        p[offset] = p[offset];
+    }
+    p[len - 1] = p[len - 1];
+
+    if (mlock(addr, len) != 0) {
+        std::cerr << "锁定 " << len << " 字节内存失败: " << strerror(errno) << "（可调高RLIMIT_MEMLOCK）" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void unlockMemory(void* addr, size_t len) {
+    if (addr != nullptr && len > 0) {
+        munlock(addr, len);
+    }
+}
+
+int pollSpin(struct pollfd* fds, nfds_t count, int timeoutMs, std::chrono::microseconds spin) {
+    int ret;
+    if (spin.count() > 0) {
+        auto start = std::chrono::steady_clock::now();
+        auto until = start + spin;
+        do {
+            ret = ::poll(fds, count, 0);
+            if (ret > 0 || (ret < 0 && errno != EINTR)) {
+                return ret;
+            }
+            // 独占CPU时立即返回，与其他线程共用时让它们先运行
+            std::this_thread::yield();
+        } while (std::chrono::steady_clock::now() < until);
+
+        if (timeoutMs > 0) {
+            auto spent = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            timeoutMs = std::max(0, timeoutMs - static_cast<int>(spent.count()));
+        }
+        if (timeoutMs == 0) {
+            return 0;
+        }
+    }
+
+    do {
+        ret = ::poll(fds, count, timeoutMs);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
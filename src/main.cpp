@@ -30,6 +30,38 @@ void print_usage() {
               << "  -s, --server         以服务端模式运行 (Mac)\n"
               << "  -p, --port <port>    指定端口号\n"
               << "  -i, --ip <ip>        客户端模式下指定服务端IP地址 (默认: 127.0.0.1)\n"
+              << "  -z, --zerocopy <n>   服务端模式下对不小于n字节的批量IN负载使用MSG_ZEROCOPY发送 (默认: 关闭)\n"
+              << "  -t, --threads <n>    服务端模式下处理连接的事件循环线程数 (默认: CPU核数)\n"
+              << "      --no-io-uring    服务端模式下不使用io_uring，固定使用epoll/poll\n"
+              << "  -l, --local <path>   本机共享内存传输：服务端额外监听该Unix域套接字，客户端经它连接 (仅Linux)\n"
+              << "      --udp <port>     数据报传输：服务端额外在该端口接受控制连接，客户端经它连接后URB改走UDP，\n"
+              << "                       各端点分别保序、丢包只阻塞所在端点 (仅Linux)\n"
+              << "      --udp-loss <p>   数据报传输按概率p (0~1) 丢弃发出的数据报，用于测试重传 (默认: 0)\n"
+              << "      --tls-cert <pem> 服务端模式下以该PEM证书链启用TLS 1.3，内核支持时由内核TLS加解密\n"
+              << "      --tls-key <pem>  服务端证书的PEM私钥 (默认: 与证书同一文件)\n"
+              << "      --tls            客户端模式下经TLS 1.3连接，按系统信任库验证服务端证书\n"
+              << "      --tls-ca <pem>   客户端模式下按该PEM证书验证服务端，隐含--tls\n"
+              << "      --compress <n>   压缩不小于n字节的URB负载，客户端导入时提供、服务端接受后生效 (默认: 关闭)\n"
+              << "      --zero-blocks    省略URB负载中全零的512字节块，协商方式同上；两者都开启时优先压缩 (默认: 关闭)\n"
+              << "      --devices <n>    客户端模式下导入服务端列表中的前n个设备，共用一条连接 (默认: 1)\n"
+              << "      --attach <id>    客户端模式下直接导入总线ID或vid:pid（十六进制）所指的设备：不等待设备列表，\n"
+              << "                       握手请求一次写出并经TCP Fast Open随SYN发送，导入只需一个往返 (默认: 按设备列表导入)\n"
+              << "      --streams <n>    每个导入设备附加n条并行数据连接分担批量URB，客户端提出、服务端同意的条数为上限 (最多15，默认: 0)\n"
+              << "      --crc            URB负载附加CRC32C校验，客户端导入时提出、服务端同样开启后生效 (默认: 关闭)\n"
+              << "      --batch <n>      小URB合并为批量帧发送，每帧至多n个；客户端连接后在能力交换中提出、服务端同样开启后生效，\n"
+              << "                       否则保持标准帧格式 (默认: 关闭)\n"
+              << "      --idle-timeout <ms> 服务端模式下关闭超过ms毫秒没有收到数据的连接 (默认: 不限)\n"
+              << "      --urb-timeout <ms>  服务端模式下取消提交后超过ms毫秒仍未完成的URB，以超时回复 (默认: 由libusb每个传输限时1秒)\n"
+              << "      --dead-peer <ms>    约ms毫秒内发现失联的对端：心跳和TCP_USER_TIMEOUT/保活探测，服务端随即释放其导入的设备\n"
+              << "                          客户端连接后在能力交换中提出，服务端设置了时限时以其为准 (默认: 关闭)\n"
+              << "      --resume-grace <ms> 可恢复的会话：连接中断后ms毫秒内重连即接续导入，服务端保留设备并重放已完成的回复，\n"
+              << "                          客户端重新提交未收到回复的URB；客户端导入时提出、服务端同样开启后生效 (默认: 关闭)\n"
+              << "      --conn-budget <MB>  服务端模式下每个连接在途URB负载的内存上限，用尽时暂停读取该连接，0表示不限 (默认: 64)\n"
+              << "      --mem-budget <MB>   服务端模式下所有连接在途URB负载的内存上限，用尽时暂停读取各连接，0表示不限 (默认: 512)\n"
+              << "      --cut-through <n>   服务端模式下不小于n字节的批量OUT URB边接收边分块写入设备，不等整个负载到齐 (默认: 关闭)\n"
+              << "      --busy-poll <us>    忙轮询低延迟模式：线程绑核，收到数据或USB传输之后自旋us微秒再阻塞，\n"
+              << "                          套接字设置TCP_NODELAY/TCP_QUICKACK/SO_BUSY_POLL，锁定接收缓冲区；\n"
+              << "                          自旋期间每个线程占满一个CPU (默认: 关闭)\n"
               << "  -h, --help           显示此帮助信息\n";
 }
 
@@ -38,6 +70,31 @@ int main(int argc, char* argv[]) {
     bool is_server = false;
     int port = 3240; // USBIP默认端口
     std::string server_ip = "127.0.0.1"; // 默认IP地址
+    size_t zerocopy_threshold = 0; // 零拷贝发送阈值，0表示关闭
+    size_t worker_threads = 0; // 事件循环线程数，0表示按CPU核数
+    bool use_io_uring = true; // 内核支持时使用io_uring
+    std::string local_path; // 本机共享内存传输的Unix域套接字路径，空表示不使用
+    int udp_port = 0; // 数据报传输的控制端口，0表示不使用
+    double udp_loss = 0; // 数据报传输的模拟丢包率
+    std::string tls_cert; // 服务端TLS证书，空表示不使用TLS
+    std::string tls_key; // 服务端TLS私钥
+    bool use_tls = false; // 客户端经TLS连接
+    std::string tls_ca; // 客户端验证服务端证书用的CA证书，空表示系统信任库
+    size_t compress_threshold = 0; // 负载压缩阈值，0表示关闭
+    bool zero_blocks = false; // 零块省略
+    bool integrity = false; // 负载CRC32C校验
+    size_t data_streams = 0; // 附加数据连接数
+    size_t max_devices = 1; // 客户端导入的设备数
+    std::string attach; // 快速导入的总线ID或vid:pid，空表示按设备列表导入
+    size_t batch_limit = 0; // 批量帧的条目上限，0表示不使用
+    int idle_timeout = 0; // 连接空闲时限（毫秒），0表示不限
+    int urb_timeout = 0; // URB处理时限（毫秒），0表示由libusb限时
+    int dead_peer = 0; // 对端失联的判定时限（毫秒），0表示不检测
+    int resume_grace = 0; // 可恢复会话的宽限期（毫秒），0表示不使用
+    size_t conn_budget = 64; // 每个连接在途URB负载的内存上限（MB），0表示不限
+    size_t mem_budget = 512; // 所有连接在途URB负载的内存上限（MB），0表示不限
+    size_t cut_through = 0; // 批量OUT直通的阈值，0表示关闭
+    int busy_poll = 0; // 忙轮询的自旋时长（微秒），0表示关闭
     
     // 定义长选项
     static struct option long_options[] = {
@@ -45,6 +102,31 @@ int main(int argc, char* argv[]) {
         {"server", no_argument,       0, 's'},
         {"port",   required_argument, 0, 'p'},
         {"ip",     required_argument, 0, 'i'},
+        {"zerocopy", required_argument, 0, 'z'},
+        {"threads", required_argument, 0, 't'},
+        {"no-io-uring", no_argument,  0, 'U'},
+        {"local",  required_argument, 0, 'l'},
+        {"udp",    required_argument, 0, 'u'},
+        {"udp-loss", required_argument, 0, 'L'},
+        {"tls-cert", required_argument, 0, 'E'},
+        {"tls-key", required_argument, 0, 'Y'},
+        {"tls",    no_argument,       0, 'T'},
+        {"tls-ca", required_argument, 0, 'A'},
+        {"compress", required_argument, 0, 'C'},
+        {"zero-blocks", no_argument,  0, 'Z'},
+        {"crc",    no_argument,       0, 'K'},
+        {"streams", required_argument, 0, 'N'},
+        {"devices", required_argument, 0, 'D'},
+        {"attach", required_argument, 0, 'a'},
+        {"batch",  required_argument, 0, 'B'},
+        {"idle-timeout", required_argument, 0, 'I'},
+        {"urb-timeout", required_argument, 0, 'R'},
+        {"dead-peer", required_argument, 0, 'W'},
+        {"resume-grace", required_argument, 0, 'G'},
+        {"conn-budget", required_argument, 0, 'b'},
+        {"mem-budget", required_argument, 0, 'M'},
+        {"cut-through", required_argument, 0, 'X'},
+        {"busy-poll", required_argument, 0, 'P'},
         {"help",   no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
@@ -55,7 +137,7 @@ int main(int argc, char* argv[]) {
     
     int opt;
     int option_index = 0;
-    while ((opt = getopt_long(argc, argv, "csp:i:h", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "csp:i:z:t:l:h", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'c':
                 is_client = true;
@@ -69,6 +151,82 @@ int main(int argc, char* argv[]) {
             case 'i':
                 server_ip = optarg;
                 break;
+            case 'z':
+                zerocopy_threshold = std::stoul(optarg);
+                break;
+            case 't':
+                worker_threads = std::stoul(optarg);
+                break;
+            case 'U':
+                use_io_uring = false;
+                break;
+            case 'l':
+                local_path = optarg;
+                break;
+            case 'u':
+                udp_port = std::stoi(optarg);
+                break;
+            case 'L':
+                udp_loss = std::stod(optarg);
+                break;
+            case 'E':
+                tls_cert = optarg;
+                break;
+            case 'Y':
+                tls_key = optarg;
+                break;
+            case 'T':
+                use_tls = true;
+                break;
+            case 'A':
+                use_tls = true;
+                tls_ca = optarg;
+                break;
+            case 'C':
+                compress_threshold = std::stoul(optarg);
+                break;
+            case 'Z':
+                zero_blocks = true;
+                break;
+            case 'K':
+                integrity = true;
+                break;
+            case 'N':
+                data_streams = std::stoul(optarg);
+                break;
+            case 'D':
+                max_devices = std::stoul(optarg);
+                break;
+            case 'a':
+                attach = optarg;
+                break;
+            case 'B':
+                batch_limit = std::stoul(optarg);
+                break;
+            case 'I':
+                idle_timeout = std::stoi(optarg);
+                break;
+            case 'R':
+                urb_timeout = std::stoi(optarg);
+                break;
+            case 'W':
+                dead_peer = std::stoi(optarg);
+                break;
+            case 'G':
+                resume_grace = std::stoi(optarg);
+                break;
+            case 'b':
+                conn_budget = std::stoul(optarg);
+                break;
+            case 'M':
+                mem_budget = std::stoul(optarg);
+                break;
+            case 'X':
+                cut_through = std::stoul(optarg);
+                break;
+            case 'P':
+                busy_poll = std::stoi(optarg);
+                break;
             case 'h':
                 print_usage();
                 return 0;
@@ -99,6 +257,20 @@ int main(int argc, char* argv[]) {
         if (is_client) {
             std::cout << "以客户端模式启动，连接服务端: " << server_ip << ":" << port << std::endl;
             USBIPClient client(port, server_ip);
+            client.setLocalPath(local_path);
+            client.setDatagramPort(udp_port);
+            client.setDatagramLoss(udp_loss);
+            client.setTls(use_tls, tls_ca);
+            client.setCompressionThreshold(compress_threshold);
+            client.setZeroBlockElision(zero_blocks);
+            client.setIntegrityCheck(integrity);
+            client.setDataStreams(data_streams);
+            client.setMaxDevices(max_devices);
+            client.setAttach(attach);
+            client.setBatching(batch_limit);
+            client.setDeadPeerTimeout(dead_peer);
+            client.setResumeGrace(resume_grace);
+            client.setBusyPoll(busy_poll);
             g_client = &client;
             client.start();
             
@@ -112,6 +284,25 @@ int main(int argc, char* argv[]) {
         } else {
             std::cout << "以服务端模式启动，端口: " << port << std::endl;
             USBIPServer server(port);
+            server.setZeroCopyThreshold(zerocopy_threshold);
+            server.setWorkerThreads(worker_threads);
+            server.setIoUring(use_io_uring);
+            server.setLocalPath(local_path);
+            server.setDatagramPort(udp_port);
+            server.setDatagramLoss(udp_loss);
+            server.setTls(tls_cert, tls_key);
+            server.setCompressionThreshold(compress_threshold);
+            server.setZeroBlockElision(zero_blocks);
+            server.setIntegrityCheck(integrity);
+            server.setDataStreams(data_streams);
+            server.setBatching(batch_limit);
+            server.setIdleTimeout(idle_timeout);
+            server.setUrbTimeout(urb_timeout);
+            server.setDeadPeerTimeout(dead_peer);
+            server.setResumeGrace(resume_grace);
+            server.setMemoryBudget(conn_budget * 1024 * 1024, mem_budget * 1024 * 1024);
+            server.setCutThrough(cut_through);
+            server.setBusyPoll(busy_poll);
             g_server = &server;
             server.start();
             
@@ -0,0 +1,91 @@
+#include "../include/memory_budget.h"
+#include <algorithm>
+
+MemoryBudget::MemoryBudget(size_t limit, std::shared_ptr<MemoryBudget> parent)
+    : limit_(limit), parent_(std::move(parent)), used_(0), waiting_(false) {
+}
+
+void MemoryBudget::charge(size_t bytes) {
+    used_ += bytes;
+    if (parent_) {
+        parent_->charge(bytes);
+    }
+}
+
+void MemoryBudget::release(size_t bytes) {
+    used_ -= bytes;
+    if (parent_) {
+        parent_->release(bytes);
+    }
+
+    if (!waiting_) {
+        return;
+    }
+    if (!exhausted()) {
+        wake();
+    } else if (limit_ == 0 || used_ < limit_) {
+        // 本级已回落但上一级仍耗尽：等待者登记时上一级可能还未耗尽，转到上一级等待，
+        // 否则本级之后可能不再有释放，上一级回落时也不会唤醒它们
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            waiters.swap(waiters_);
+            waiting_ = false;
+        }
+        for (auto& waiter : waiters) {
+            parent_->wait(waiter);
+        }
+    }
+}
+
+bool MemoryBudget::exhausted() const {
+    if (limit_ > 0 && used_ >= limit_) {
+        return true;
+    }
+    return parent_ && parent_->exhausted();
+}
+
+size_t MemoryBudget::capacity() const {
+    size_t parent = parent_ ? parent_->capacity() : 0;
+    if (limit_ == 0 || parent == 0) {
+        return std::max(limit_, parent);
+    }
+    return std::min(limit_, parent);
+}
+
+void MemoryBudget::wait(Waiter waiter) {
+    // 本级和上一级各登记一份，只有先到的一次调用waiter
+    auto called = std::make_shared<std::atomic<bool>>(false);
+    Waiter once = [called, waiter] {
+        if (!called->exchange(true)) {
+            waiter();
+        }
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiters_.push_back(once);
+        waiting_ = true;
+    }
+    if (parent_ && parent_->exhausted()) {
+        parent_->wait(once);
+    }
+
+    // 登记之前用量可能已经回落，此后的释放不会再检查
+    if (!exhausted()) {
+        wake();
+    }
+}
+
+void MemoryBudget::wake() {
+    std::vector<Waiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiters.swap(waiters_);
+        waiting_ = false;
+    }
+
+    for (auto& waiter : waiters) {
+        waiter();
+    }
+}
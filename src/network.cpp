@@ -1,21 +1,32 @@
 #include "../include/network.h"
+#include "../include/usbip_wire.h"
+#include "../include/crc32c.h"
+#include "../include/low_latency.h"
 #include <iostream>
 #include <cstring>
-#include <iomanip>
+#include <cerrno>
 #include <fcntl.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <cctype>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <climits>
 
 // TCPSocket实现
 TCPSocket::~TCPSocket() {
     close();
 }
 
-bool TCPSocket::create() {
-    sockfd_ = socket(AF_INET, SOCK_STREAM, 0);
+bool TCPSocket::create(int family) {
+    sockfd_ = socket(family, SOCK_STREAM, 0);
     if (sockfd_ < 0) {
         std::cerr << "创建套接字失败: " << strerror(errno) << std::endl;
         return false;
     }
+    family_ = family;
     
     // 设置套接字选项以重用地址
     int reuse = 1;
@@ -28,21 +39,295 @@ bool TCPSocket::create() {
     return true;
 }
 
+bool TCPSocket::setReusePort() {
+#ifdef SO_REUSEPORT
+    int reuse = 1;
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        std::cerr << "设置SO_REUSEPORT失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool TCPSocket::setBufferSize(size_t bytes) {
+    if (shm_ || dgram_) {
+        return true;
+    }
+    
+    int size = static_cast<int>(std::min<size_t>(bytes, INT_MAX));
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0 ||
+        setsockopt(sockfd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        std::cerr << "设置套接字缓冲区失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool TCPSocket::setFastOpen(int queue) {
+#ifdef TCP_FASTOPEN
+    if (setsockopt(sockfd_, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) < 0) {
+        std::cerr << "设置TCP_FASTOPEN失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool TCPSocket::setFastOpenConnect() {
+#ifdef TCP_FASTOPEN_CONNECT
+    int enable = 1;
+    if (setsockopt(sockfd_, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(enable)) < 0) {
+        std::cerr << "设置TCP_FASTOPEN_CONNECT失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool TCPSocket::setDeadPeerTimeout(int ms) {
+    if (family_ == AF_UNIX || ms <= 0) {
+        return true;
+    }
+    
+    bool ok = true;
+#ifdef TCP_USER_TIMEOUT
+    unsigned int userTimeout = static_cast<unsigned int>(ms);
+    if (setsockopt(sockfd_, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout)) < 0) {
+        std::cerr << "设置TCP_USER_TIMEOUT失败: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+#endif
+    
+    // 保活探测只能以秒为单位：空闲1秒（或向上取整的时限）后开始探测，每秒一次。
+    // 设置了TCP_USER_TIMEOUT时由它决定探测无应答多久后断开
+    int enable = 1;
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) < 0) {
+        std::cerr << "设置SO_KEEPALIVE失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+#ifdef TCP_KEEPIDLE
+    int idle = std::max(1, (ms + 999) / 1000);
+    int interval = 1;
+    int count = 3;
+    if (setsockopt(sockfd_, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+        setsockopt(sockfd_, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0 ||
+        setsockopt(sockfd_, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0) {
+        std::cerr << "设置TCP保活参数失败: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+#endif
+    return ok;
+}
+
+bool TCPSocket::setBusyPoll(int us) {
+    busyPollUs_ = std::max(us, 0);
+    if (busyPollUs_ == 0) {
+        return true;
+    }
+    bool ok = rxBuffer_.lock();
+    if (shm_ || dgram_ || family_ == AF_UNIX) {
+        return ok;
+    }
+    
+    int enable = 1;
+    if (setsockopt(sockfd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0) {
+        std::cerr << "设置TCP_NODELAY失败: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+#ifdef TCP_QUICKACK
+    if (setsockopt(sockfd_, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(enable)) < 0) {
+        std::cerr << "设置TCP_QUICKACK失败: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+#endif
+#ifdef SO_BUSY_POLL
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs_, sizeof(busyPollUs_)) < 0) {
+        std::cerr << "设置SO_BUSY_POLL失败: " << strerror(errno) << "，只在用户态自旋" << std::endl;
+        ok = false;
+    }
+#endif
+    return ok;
+}
+
+void TCPSocket::quickAck() {
+#ifdef TCP_QUICKACK
+    if (busyPollUs_ > 0 && !shm_ && !dgram_ && family_ != AF_UNIX) {
+        int enable = 1;
+        setsockopt(sockfd_, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(enable));
+    }
+#endif
+}
+
+bool TCPSocket::sendHeartbeat() {
+    {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        if (!isValid()) {
+            return false;
+        }
+        if (!txQueue_.empty() || batchEntries_ > 0) {
+            return true;
+        }
+        
+        // 心跳不经sendPacket，避免每次都打印日志
+        usbip_packet packet;
+        packet.header.version = USBIP_VERSION;
+        packet.header.command = USBIP_OP_HEARTBEAT;
+        packet.header.status = 0;
+        OutputFrame frame;
+        frame.headLen = encodePacketHead(packet, frame.head);
+        txQueue_.push(std::move(frame));
+    }
+    
+    if (outputNotifier_) {
+        outputNotifier_();
+    }
+    return nonBlocking_ || flush();
+}
+
 bool TCPSocket::bind(int port) {
-    struct sockaddr_in addr;
+    struct sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+    socklen_t addrLen;
+    
+    if (family_ == AF_INET6) {
+        // IPv4由单独的套接字监听，避免两者争用同一端口
+        int v6only = 1;
+        if (setsockopt(sockfd_, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+            std::cerr << "设置IPV6_V6ONLY失败: " << strerror(errno) << std::endl;
+            return false;
+        }
+        
+        struct sockaddr_in6* addr = reinterpret_cast<struct sockaddr_in6*>(&storage);
+        addr->sin6_family = AF_INET6;
+        addr->sin6_addr = in6addr_any;
+        addr->sin6_port = htons(port);
+        addrLen = sizeof(*addr);
+    } else {
+        struct sockaddr_in* addr = reinterpret_cast<struct sockaddr_in*>(&storage);
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr->sin_port = htons(port);
+        addrLen = sizeof(*addr);
+    }
+    
+    if (::bind(sockfd_, (struct sockaddr*)&storage, addrLen) < 0) {
+        std::cerr << "绑定端口失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+bool TCPSocket::bindLocal(const std::string& path) {
+    struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "本地套接字路径过长: " << path << std::endl;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    
+    // 清除上次运行遗留的套接字文件
+    ::unlink(path.c_str());
     
     if (::bind(sockfd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        std::cerr << "绑定端口失败: " << strerror(errno) << std::endl;
+        std::cerr << "绑定本地套接字失败: " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+bool TCPSocket::connectLocal(const std::string& path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "本地套接字路径过长: " << path << std::endl;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    
+    if (::connect(sockfd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "连接本地套接字失败: " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+bool TCPSocket::offerSharedMemory() {
+    auto shm = std::make_unique<ShmTransport>();
+    if (!shm->offer(sockfd_)) {
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(txMutex_);
+    shm_ = std::move(shm);
+    return true;
+}
+
+bool TCPSocket::acceptSharedMemory() {
+    auto shm = std::make_unique<ShmTransport>();
+    if (!shm->accept(sockfd_)) {
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(txMutex_);
+    shm_ = std::move(shm);
+    return true;
+}
+
+void TCPSocket::adoptDatagram(std::unique_ptr<DatagramTransport> dgram) {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    dgram_ = std::move(dgram);
+}
+
+bool TCPSocket::acceptDatagram() {
+    auto dgram = std::make_unique<DatagramTransport>();
+    if (!dgram->accept(sockfd_)) {
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(txMutex_);
+    dgram_ = std::move(dgram);
+    return true;
+}
+
+// TLS握手和服务端数据报端口交换的最长等待时间
+static const int kHandshakeTimeoutMs = 5000;
+
+bool TCPSocket::startTls(const std::shared_ptr<TlsContext>& context, const std::string& peerHost) {
+    auto tls = std::make_unique<TlsSession>(context);
+    if (!tls->handshake(sockfd_, peerHost, kHandshakeTimeoutMs)) {
         return false;
     }
     
+    adoptTls(std::move(tls));
     return true;
 }
 
+void TCPSocket::adoptTls(std::unique_ptr<TlsSession> tls) {
+    std::cout << "TLS已建立: " << tls->description() << std::endl;
+    std::lock_guard<std::mutex> lock(txMutex_);
+    tls_ = std::move(tls);
+}
+
+void TCPSocket::setDatagramLoss(double rate) {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    if (dgram_) {
+        dgram_->setInducedLoss(rate);
+    }
+}
+
 bool TCPSocket::listen(int backlog) {
     if (::listen(sockfd_, backlog) < 0) {
         std::cerr << "监听失败: " << strerror(errno) << std::endl;
@@ -53,17 +338,31 @@ bool TCPSocket::listen(int backlog) {
 }
 
 bool TCPSocket::connect(const std::string& host, int port) {
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
+    struct sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+    socklen_t addrLen;
+    int parsed;
     
-    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) <= 0) {
+    if (family_ == AF_INET6) {
+        struct sockaddr_in6* addr = reinterpret_cast<struct sockaddr_in6*>(&storage);
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(port);
+        parsed = inet_pton(AF_INET6, host.c_str(), &addr->sin6_addr);
+        addrLen = sizeof(*addr);
+    } else {
+        struct sockaddr_in* addr = reinterpret_cast<struct sockaddr_in*>(&storage);
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        parsed = inet_pton(AF_INET, host.c_str(), &addr->sin_addr);
+        addrLen = sizeof(*addr);
+    }
+    
+    if (parsed <= 0) {
         std::cerr << "无效的IP地址: " << host << std::endl;
         return false;
     }
     
-    if (::connect(sockfd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (::connect(sockfd_, (struct sockaddr*)&storage, addrLen) < 0) {
         std::cerr << "连接失败: " << strerror(errno) << std::endl;
         return false;
     }
@@ -72,19 +371,29 @@ bool TCPSocket::connect(const std::string& host, int port) {
 }
 
 std::shared_ptr<TCPSocket> TCPSocket::accept() {
-    struct sockaddr_in client_addr;
+    struct sockaddr_storage client_addr;
     socklen_t client_len = sizeof(client_addr);
     
     int client_sockfd = ::accept(sockfd_, (struct sockaddr*)&client_addr, &client_len);
     if (client_sockfd < 0) {
-        std::cerr << "接受连接失败: " << strerror(errno) << std::endl;
+        // 非阻塞监听套接字上已没有排队的连接
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            std::cerr << "接受连接失败: " << strerror(errno) << std::endl;
+        }
         return nullptr;
     }
     
-    return std::make_shared<TCPSocket>(client_sockfd);
+    return std::make_shared<TCPSocket>(client_sockfd, family_);
 }
 
 bool TCPSocket::send(const void* data, size_t size) {
+    if (shm_ || dgram_ || (tls_ && !tls_->kernelSend())) {
+        struct iovec iov;
+        iov.iov_base = const_cast<void*>(data);
+        iov.iov_len = size;
+        return sendv(&iov, 1);
+    }
+    
     const char* p = static_cast<const char*>(data);
     size_t total_sent = 0;
     
@@ -105,789 +414,2345 @@ bool TCPSocket::send(const void* data, size_t size) {
     return true;
 }
 
-bool TCPSocket::receive(void* buffer, size_t size, size_t& bytesRead) {
-    char* p = static_cast<char*>(buffer);
-    size_t total_read = 0;
-    
-    std::cout << "准备接收 " << size << " 字节数据..." << std::endl;
-    
-    while (total_read < size) {
-        std::cout << "尝试接收剩余 " << (size - total_read) << " 字节数据..." << std::endl;
-        ssize_t received = ::recv(sockfd_, p + total_read, size - total_read, 0);
-        
+// 读取一次套接字，EINTR时重试；非阻塞套接字暂无数据时返回-1且errno为EAGAIN
+static ssize_t readvOnce(int sockfd, struct iovec* iov, int iovcnt) {
+    while (true) {
+        ssize_t received = ::readv(sockfd, iov, iovcnt);
         if (received < 0) {
-            if (errno == EINTR) {
-                std::cout << "接收被信号中断，重试..." << std::endl;
-                continue; // 被信号中断，重试
+            if (errno == EINTR) continue; // 被信号中断，重试
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "接收数据失败: " << strerror(errno) << std::endl;
             }
-            std::cerr << "接收数据失败: " << strerror(errno) << std::endl;
-            bytesRead = total_read;
-            return false;
         } else if (received == 0) {
             std::cerr << "连接已关闭" << std::endl;
-            bytesRead = total_read;
-            return false;
         }
-        
-        std::cout << "成功接收 " << received << " 字节数据" << std::endl;
-        
-        // 打印前10个字节的十六进制值（如果有）
+        return received;
+    }
+}
+
+ssize_t TCPSocket::readSome(struct iovec* iov, int iovcnt, int timeoutMs) {
+    // 内核TLS接管接收方向时套接字读出的已是明文
+    bool userTls = tls_ && !tls_->kernelRecv();
+    if (!shm_ && !dgram_ && !userTls) {
+        ssize_t received = readvOnce(sockfd_, iov, iovcnt);
         if (received > 0) {
-            std::cout << "接收的数据前 " << std::min(10, static_cast<int>(received)) << " 字节: ";
-            for (int i = 0; i < std::min(10, static_cast<int>(received)); i++) {
-                std::cout << std::hex << std::setfill('0') << std::setw(2) 
-                          << static_cast<int>(static_cast<unsigned char>(*(p + total_read + i))) << " ";
-            }
-            std::cout << std::dec << std::endl;
+            quickAck();
         }
-        
-        total_read += received;
+        return received;
     }
     
-    std::cout << "总共接收了 " << total_read << " 字节数据" << std::endl;
-    
-    bytesRead = total_read;
-    return true;
-}
-
-void TCPSocket::close() {
-    if (sockfd_ >= 0) {
-        ::close(sockfd_);
-        sockfd_ = -1;
+    ssize_t received;
+    if (shm_) {
+        received = shm_->read(iov, iovcnt, timeoutMs);
+    } else if (dgram_) {
+        received = dgram_->read(iov, iovcnt, timeoutMs);
+    } else {
+        // 阻塞套接字的等待由SO_RCVTIMEO限制，超时同样表现为EAGAIN
+        do {
+            received = tls_->read(iov, iovcnt);
+        } while (received < 0 && errno == EINTR);
     }
+    if (received < 0 && errno != EAGAIN) {
+        std::cerr << "接收数据失败: " << strerror(errno) << std::endl;
+    } else if (received == 0) {
+        std::cerr << "连接已关闭" << std::endl;
+    }
+    return received;
 }
 
-// 发送USBIP数据包
-bool TCPSocket::sendPacket(const usbip_packet& packet) {
-    // 打印发送的包信息
-    std::cout << "准备发送数据包: 版本=0x" << std::hex << packet.header.version
-              << ", 命令=0x" << packet.header.command
-              << ", 状态=0x" << packet.header.status << std::dec << std::endl;
-    
-    // 在发送头部时正确处理字节序
-    // 注意：对于官方客户端兼容性，需要小心处理版本和命令的字节序
-    usbip_header header;
-    
-    // 官方USBIP要求：版本和命令都需要是网络字节序
-    // 但内部表示与发送格式不同
-    uint8_t* headerBytes = reinterpret_cast<uint8_t*>(&header);
-    
-    // 手动构建头部，以确保与官方客户端兼容
-    // 版本和命令需要手动转换为正确的格式
-    headerBytes[0] = (packet.header.version >> 8) & 0xff;
-    headerBytes[1] = packet.header.version & 0xff;
-    headerBytes[2] = (packet.header.command >> 8) & 0xff;
-    headerBytes[3] = packet.header.command & 0xff;
-    
-    // 状态字段是一个完整的uint32_t，使用标准转换
-    header.status = usbip_utils::htonl_wrap(packet.header.status);
+bool TCPSocket::fillBuffer() {
+    struct iovec iov[2];
+    int iovcnt = rxBuffer_.writableRegions(iov);
+    if (iovcnt == 0) {
+        return true;
+    }
     
-    // 发送头部
-    if (!send(&header, sizeof(header))) {
+    ssize_t received = readSome(iov, iovcnt, readTimeout());
+    if (received <= 0) {
         return false;
     }
     
-    // 根据命令类型，发送不同的数据
-    switch (packet.header.command) {
-        case USBIP_CMD_SUBMIT: {
-            cmd_submit cmd = packet.cmd_submit_data;
-            cmd.seqnum = usbip_utils::htonl_wrap(cmd.seqnum);
-            cmd.devid = usbip_utils::htonl_wrap(cmd.devid);
-            cmd.direction = usbip_utils::htonl_wrap(cmd.direction);
-            cmd.ep = usbip_utils::htonl_wrap(cmd.ep);
-            cmd.transfer_flags = usbip_utils::htonl_wrap(cmd.transfer_flags);
-            cmd.transfer_buffer_length = usbip_utils::htonl_wrap(cmd.transfer_buffer_length);
-            cmd.start_frame = usbip_utils::htonl_wrap(cmd.start_frame);
-            cmd.number_of_packets = usbip_utils::htonl_wrap(cmd.number_of_packets);
-            cmd.interval = usbip_utils::htonl_wrap(cmd.interval);
-            
-            if (!send(&cmd, sizeof(cmd))) {
-                return false;
-            }
-            break;
-        }
-        // 已注释掉 USBIP_RET_SUBMIT 的 case
-        case USBIP_OP_REQ_DEVLIST: {
-            op_devlist_request req = packet.devlist_req;
-            req.version = usbip_utils::htonl_wrap(req.version);
-            
-            if (!send(&req, sizeof(req))) {
-                return false;
-            }
-            break;
-        }
-        case USBIP_OP_REQ_IMPORT: {
-            op_import_request req = packet.import_req;
-            req.version = usbip_utils::htonl_wrap(req.version);
+    rxBuffer_.commit(received);
+    return true;
+}
+
+bool TCPSocket::receive(void* buffer, size_t size, size_t& bytesRead) {
+    char* p = static_cast<char*>(buffer);
+    
+    // 优先使用缓冲区中已有的数据
+    size_t total_read = rxBuffer_.read(p, size);
+    
+    // 走到这里时缓冲区一定已被取空
+    while (total_read < size) {
+        size_t remaining = size - total_read;
+        
+        if (remaining >= rxBuffer_.capacity() / 2) {
+            // 大块负载直接读入目标内存，多出的字节（后续帧）顺便收进缓冲区
+            struct iovec iov[3];
+            iov[0].iov_base = p + total_read;
+            iov[0].iov_len = remaining;
+            int iovcnt = 1 + rxBuffer_.writableRegions(iov + 1);
             
-            if (!send(&req, sizeof(req))) {
+            ssize_t received = readSome(iov, iovcnt, readTimeout());
+            if (received <= 0) {
+                bytesRead = total_read;
                 return false;
             }
-            break;
-        }
-        case USBIP_OP_REP_IMPORT: {
-            op_import_reply rep = packet.import_rep;
-            
-            // 构建特定的响应格式，确保字节序正确
-            std::cout << "发送导入设备响应结构，版本=" << std::hex << rep.version
-                      << "，状态=" << rep.status << std::dec 
-                      << "，命令码=0x0003" << std::endl;
-            
-            // 确保状态码在网络字节序中为0（成功）或标准错误码
-            uint32_t status_value = rep.status;
-            
-            // 为了匹配官方客户端预期，确保状态码为0（成功）或为正确的错误值
-            if (rep.status != 0) {
-                // 如果失败，使用一个标准错误代码
-                status_value = -22; // EINVAL对应的负值，常见的错误码
-                std::cout << "设备导入失败，使用错误码: " << status_value << std::endl;
-            }
             
-            // 1. 版本 (4字节)
-            uint32_t version_n = usbip_utils::htonl_wrap(rep.version);
-            if (!send(&version_n, sizeof(version_n))) {
-                return false;
+            if (static_cast<size_t>(received) > remaining) {
+                rxBuffer_.commit(received - remaining);
+                total_read = size;
+            } else {
+                total_read += received;
             }
-            
-            // 2. 状态 (4字节)
-            uint32_t status_n = usbip_utils::htonl_wrap(status_value);
-            if (!send(&status_n, sizeof(status_n))) {
+        } else {
+            // 小块数据：一次recv填充缓冲区，再从中拷贝
+            if (!fillBuffer()) {
+                bytesRead = total_read;
                 return false;
             }
-            
-            // 3. 如果成功，发送设备信息
-            if (rep.status == 0) {
-                std::cout << "发送设备信息, 总线ID=" << rep.udev.busid << std::endl;
-                
-                // 手动构建设备信息结构，确保字节序正确
-                // 注意：path 和 busid 是字符串，保持原样
-                // 步骤 1: 发送 path (256字节)
-                if (!send(rep.udev.path, 256)) {
-                    return false;
-                }
-                
-                // 步骤 2: 发送 busid (32字节)
-                if (!send(rep.udev.busid, 32)) {
-                    return false;
-                }
-                
-                // 步骤 3: 发送 busnum (4字节)
-                uint32_t busnum_n = usbip_utils::htonl_wrap(rep.udev.busnum);
-                if (!send(&busnum_n, sizeof(busnum_n))) {
-                    return false;
-                }
-                
-                // 步骤 4: 发送 devnum (4字节)
-                uint32_t devnum_n = usbip_utils::htonl_wrap(rep.udev.devnum);
-                if (!send(&devnum_n, sizeof(devnum_n))) {
-                    return false;
-                }
-                
-                // 步骤 5: 发送 speed (4字节)
-                uint32_t speed_n = usbip_utils::htonl_wrap(rep.udev.speed);
-                if (!send(&speed_n, sizeof(speed_n))) {
-                    return false;
-                }
-                
-                // 步骤 6: 发送 idVendor (2字节)
-                uint16_t idVendor_n = usbip_utils::htons_wrap(rep.udev.idVendor);
-                if (!send(&idVendor_n, sizeof(idVendor_n))) {
-                    return false;
-                }
-                
-                // 步骤 7: 发送 idProduct (2字节)
-                uint16_t idProduct_n = usbip_utils::htons_wrap(rep.udev.idProduct);
-                if (!send(&idProduct_n, sizeof(idProduct_n))) {
-                    return false;
-                }
-                
-                // 步骤 8: 发送 bcdDevice (2字节)
-                uint16_t bcdDevice_n = usbip_utils::htons_wrap(rep.udev.bcdDevice);
-                if (!send(&bcdDevice_n, sizeof(bcdDevice_n))) {
-                    return false;
-                }
-                
-                // 步骤 9: 发送 bDeviceClass (1字节)
-                if (!send(&rep.udev.bDeviceClass, 1)) {
-                    return false;
-                }
-                
-                // 步骤 10: 发送 bDeviceSubClass (1字节)
-                if (!send(&rep.udev.bDeviceSubClass, 1)) {
-                    return false;
-                }
-                
-                // 步骤 11: 发送 bDeviceProtocol (1字节)
-                if (!send(&rep.udev.bDeviceProtocol, 1)) {
-                    return false;
-                }
-                
-                // 步骤 12: 发送 bConfigurationValue (1字节)
-                if (!send(&rep.udev.bConfigurationValue, 1)) {
-                    return false;
-                }
-                
-                // 步骤 13: 发送 bNumConfigurations (1字节)
-                if (!send(&rep.udev.bNumConfigurations, 1)) {
-                    return false;
-                }
-                
-                // 步骤 14: 发送 bNumInterfaces (1字节)
-                if (!send(&rep.udev.bNumInterfaces, 1)) {
-                    return false;
-                }
-            }
-            
-            std::cout << "导入设备响应发送完成" << std::endl;
-            break;
+            total_read += rxBuffer_.read(p + total_read, remaining);
         }
     }
     
-    // 如果有数据，发送数据
-    if (!packet.data.empty()) {
-        if (!send(packet.data.data(), packet.data.size())) {
-            return false;
+    bytesRead = total_read;
+    return true;
+}
+
+void TCPSocket::close() {
+    {
+        // 其他线程可能正在向发送队列放入回复
+        std::lock_guard<std::mutex> lock(txMutex_);
+        if (shm_) {
+            shm_->close();
+            shm_.reset();
+        }
+        if (dgram_) {
+            dgram_->close();
+            dgram_.reset();
+        }
+        if (tls_) {
+            // 套接字已交给io_uring关闭时不再发送close_notify
+            tls_->close(sockfd_ >= 0);
+            tls_.reset();
+        }
+        if (sockfd_ >= 0) {
+            ::close(sockfd_);
+            sockfd_ = -1;
         }
     }
-    
-    return true;
+    rxBuffer_.clear();
+    decoder_.reset();
 }
 
-// 接收USBIP数据包
-bool TCPSocket::receivePacket(usbip_packet& packet) {
-    // 接收头部
-    usbip_header header;
-    size_t bytesRead;
-    
-    std::cout << "准备接收数据包头部..." << std::endl;
-    if (!receive(&header, sizeof(header), bytesRead)) {
-        std::cerr << "接收数据包头部失败，实际接收 " << bytesRead << " 字节" << std::endl;
+int TCPSocket::release() {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    int fd = sockfd_;
+    sockfd_ = -1;
+    return fd;
+}
+
+bool TCPSocket::setNonBlocking(bool enable) {
+    int flags = fcntl(sockfd_, F_GETFL, 0);
+    if (flags == -1) {
+        std::cerr << "获取套接字标志失败: " << strerror(errno) << std::endl;
         return false;
     }
     
-    // 打印收到的原始头部数据（十六进制）
-    std::cout << "原始头部数据: ";
-    uint8_t* headerBytes = reinterpret_cast<uint8_t*>(&header);
-    for (size_t i = 0; i < sizeof(header); i++) {
-        std::cout << std::hex << std::setw(2) << std::setfill('0') 
-                  << static_cast<int>(headerBytes[i]) << " ";
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(sockfd_, F_SETFL, flags) == -1) {
+        std::cerr << "设置套接字标志失败: " << strerror(errno) << std::endl;
+        return false;
     }
-    std::cout << std::dec << std::endl;
-    
-    // 手动以正确的方式处理字节序
-    // USBIP协议的头部是两个字节一组的小端序，但整个32位是网络字节序(大端)
-    packet.header.version = (headerBytes[0] << 8) | headerBytes[1];
-    packet.header.command = (headerBytes[2] << 8) | headerBytes[3];
-    packet.header.status = 0;  // 前两个字段后面的8字节在某些官方客户端命令中可能是数据部分
     
-    std::cout << "正确解析结果: 版本=0x" << std::hex << packet.header.version
-              << ", 命令=0x" << packet.header.command 
-              << std::dec << std::endl;
+    nonBlocking_ = enable;
+    return true;
+}
+
+// 按iovec写出全部数据，处理部分写入
+bool TCPSocket::sendv(struct iovec* iov, int iovcnt) {
+    if (dgram_) {
+        // 调用者总是写出完整的帧，不属于URB的帧走流0
+        if (!dgram_->sendFrame(0, iov, iovcnt, timeoutMs_)) {
+            std::cerr << "发送数据失败: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
     
-    // 处理官方USBIP客户端的特殊命令格式
-    if (packet.header.command == USBIP_OP_REQ_IMPORT) {
-        std::cout << "检测到导入请求" << std::endl;
-        
-        // 接收导入请求的版本和总线ID
-        op_import_request req;
-        if (!receive(&req, sizeof(req), bytesRead)) {
-            std::cerr << "接收导入请求数据失败，实际接收 " << bytesRead << " 字节" << std::endl;
+    bool userTls = tls_ && !tls_->kernelSend();
+    while (iovcnt > 0) {
+        ssize_t sent = shm_ ? shm_->write(iov, iovcnt, timeoutMs_)
+                     : userTls ? tls_->write(iov, iovcnt)
+                     : ::writev(sockfd_, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR) continue; // 被信号中断，重试
+            std::cerr << "发送数据失败: " << strerror(errno) << std::endl;
             return false;
         }
         
-        // 填充请求数据
-        packet.import_req.version = usbip_utils::ntohl_wrap(req.version);
-        std::strncpy(packet.import_req.busid, req.busid, sizeof(packet.import_req.busid));
-        
-        std::cout << "接收到导入请求: 版本=0x" << std::hex << packet.import_req.version
-                  << ", 总线ID=[" << packet.import_req.busid << "]" << std::dec << std::endl;
-        
-        return true;
+        // 跳过已完整发送的段，调整部分发送的段
+        size_t done = static_cast<size_t>(sent);
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
     }
     
-    // 其他标准USBIP命令的处理...
+    return true;
+}
+
+// 将头部和命令相关的固定部分编码到连续缓冲区
+size_t TCPSocket::encodePacketHead(const usbip_packet& packet, uint8_t* out) {
+    size_t len = usbip_wire::encode(packet.header, out);
+    return len + encodePacketBody(packet, out + len);
+}
+
+size_t TCPSocket::encodePacketBody(const usbip_packet& packet, uint8_t* out) {
+    size_t len = 0;
+    
     switch (packet.header.command) {
-        case USBIP_CMD_SUBMIT: {
-            std::cout << "接收CMD_SUBMIT数据..." << std::endl;
-            cmd_submit cmd;
-            if (!receive(&cmd, sizeof(cmd), bytesRead)) {
-                std::cerr << "接收CMD_SUBMIT数据失败，实际接收 " << bytesRead << " 字节" << std::endl;
-                return false;
-            }
-            
-            packet.cmd_submit_data.seqnum = usbip_utils::ntohl_wrap(cmd.seqnum);
-            packet.cmd_submit_data.devid = usbip_utils::ntohl_wrap(cmd.devid);
-            packet.cmd_submit_data.direction = usbip_utils::ntohl_wrap(cmd.direction);
-            packet.cmd_submit_data.ep = usbip_utils::ntohl_wrap(cmd.ep);
-            packet.cmd_submit_data.transfer_flags = usbip_utils::ntohl_wrap(cmd.transfer_flags);
-            packet.cmd_submit_data.transfer_buffer_length = usbip_utils::ntohl_wrap(cmd.transfer_buffer_length);
-            packet.cmd_submit_data.start_frame = usbip_utils::ntohl_wrap(cmd.start_frame);
-            packet.cmd_submit_data.number_of_packets = usbip_utils::ntohl_wrap(cmd.number_of_packets);
-            packet.cmd_submit_data.interval = usbip_utils::ntohl_wrap(cmd.interval);
-            memcpy(packet.cmd_submit_data.setup, cmd.setup, 8);
-            
-            // 如果是OUT方向，接收数据
-            if (packet.cmd_submit_data.direction == USBIP_DIR_OUT && packet.cmd_submit_data.transfer_buffer_length > 0) {
-                std::cout << "接收CMD_SUBMIT OUT数据，大小: " << packet.cmd_submit_data.transfer_buffer_length << " 字节" << std::endl;
-                packet.data.resize(packet.cmd_submit_data.transfer_buffer_length);
-                if (!receive(packet.data.data(), packet.data.size(), bytesRead)) {
-                    std::cerr << "接收CMD_SUBMIT OUT数据失败，实际接收 " << bytesRead << " 字节" << std::endl;
-                    return false;
-                }
+        case USBIP_CMD_SUBMIT:
+            // 发出第一个CMD_SUBMIT后连接进入URB阶段，此后收到的0x0003都是RET_SUBMIT
+            decoder_.enterUrbPhase();
+            len += usbip_wire::encode(packet.cmd_submit_data, out + len);
+            break;
+        case USBIP_OP_REQ_DEVLIST:
+            len += usbip_wire::encode(packet.devlist_req, out + len);
+            break;
+        case USBIP_OP_REQ_IMPORT:
+            len += usbip_wire::encode(packet.import_req, out + len);
+            break;
+        case USBIP_OP_REP_IMPORT:
+            // OP_REP_IMPORT与RET_SUBMIT共用0x0003，按连接所处的阶段编码
+            if (decoder_.phase() == FrameDecoder::Phase::Urb) {
+                len += usbip_wire::encode(packet.ret_submit_data, out + len);
+            } else {
+                len += usbip_wire::encode(packet.import_rep, out + len);
+                if (packet.import_rep.status == 0) {
+                    len += usbip_wire::encode(packet.import_rep.udev, out + len);
+                }
             }
             break;
-        }
-        case USBIP_OP_REP_IMPORT: {
-            // 根据上下文判断实际命令类型
-            if (packet.header.command == 0x0003) {
-                // 通过检查之前的请求或其他上下文来判断
-                // 这里简化处理，直接检查结构特征
-                
-                // 尝试先接收4字节数据，判断是否为导入响应的版本字段
-                uint32_t firstField;
-                size_t peekSize;
-                if (receive(&firstField, sizeof(firstField), peekSize)) {
-                    firstField = usbip_utils::ntohl_wrap(firstField);
-                    
-                    // 如果第一个字段的值是USBIP版本(0x0111)左右，可能是导入响应
-                    if (firstField == USBIP_VERSION || (firstField & 0xFF00) == 0x0100) {
-                        std::cout << "检测到导入设备响应，版本=0x" << std::hex << firstField << std::dec << std::endl;
-                        
-                        // 这是导入响应，处理导入设备响应
-                        packet.import_rep.version = firstField;
-                        
-                        // 接收状态字段
-                        uint32_t status;
-                        if (!receive(&status, sizeof(status), peekSize)) {
-                            std::cerr << "接收导入设备响应状态失败" << std::endl;
-                            return false;
-                        }
-                        
-                        packet.import_rep.status = usbip_utils::ntohl_wrap(status);
-                        
-                        std::cout << "接收到导入设备响应：版本=0x" << std::hex << packet.import_rep.version
-                                  << ", 状态=" << packet.import_rep.status << std::dec << std::endl;
-                        
-                        // 如果状态为0（成功），接收设备信息
-                        if (packet.import_rep.status == 0) {
-                            // 接收设备信息
-                            usb_device_info& udev = packet.import_rep.udev;
-                            
-                            // 接收设备路径和总线ID
-                            if (!receive(udev.path, sizeof(udev.path), peekSize)) {
-                                std::cerr << "接收设备路径失败" << std::endl;
-                                return false;
-                            }
-                            
-                            if (!receive(udev.busid, sizeof(udev.busid), peekSize)) {
-                                std::cerr << "接收设备总线ID失败" << std::endl;
-                                return false;
-                            }
-                            
-                            // 接收其他设备参数
-                            uint32_t tmp32;
-                            uint16_t tmp16;
-                            
-                            // 接收busnum, devnum, speed (4字节 x 3)
-                            if (!receive(&tmp32, sizeof(tmp32), peekSize)) {
-                                return false;
-                            }
-                            udev.busnum = usbip_utils::ntohl_wrap(tmp32);
-                            
-                            if (!receive(&tmp32, sizeof(tmp32), peekSize)) {
-                                return false;
-                            }
-                            udev.devnum = usbip_utils::ntohl_wrap(tmp32);
-                            
-                            if (!receive(&tmp32, sizeof(tmp32), peekSize)) {
-                                return false;
-                            }
-                            udev.speed = usbip_utils::ntohl_wrap(tmp32);
-                            
-                            // 接收idVendor, idProduct, bcdDevice (2字节 x 3)
-                            if (!receive(&tmp16, sizeof(tmp16), peekSize)) {
-                                return false;
-                            }
-                            udev.idVendor = usbip_utils::ntohs_wrap(tmp16);
-                            
-                            if (!receive(&tmp16, sizeof(tmp16), peekSize)) {
-                                return false;
-                            }
-                            udev.idProduct = usbip_utils::ntohs_wrap(tmp16);
-                            
-                            if (!receive(&tmp16, sizeof(tmp16), peekSize)) {
-                                return false;
-                            }
-                            udev.bcdDevice = usbip_utils::ntohs_wrap(tmp16);
-                            
-                            // 接收bDeviceClass, bDeviceSubClass, bDeviceProtocol, 
-                            // bConfigurationValue, bNumConfigurations, bNumInterfaces (1字节 x 6)
-                            if (!receive(&udev.bDeviceClass, 1, peekSize) ||
-                                !receive(&udev.bDeviceSubClass, 1, peekSize) ||
-                                !receive(&udev.bDeviceProtocol, 1, peekSize) ||
-                                !receive(&udev.bConfigurationValue, 1, peekSize) ||
-                                !receive(&udev.bNumConfigurations, 1, peekSize) ||
-                                !receive(&udev.bNumInterfaces, 1, peekSize)) {
-                                
-                                std::cerr << "接收设备详细信息失败" << std::endl;
-                                return false;
-                            }
-                            
-                            std::cout << "成功接收设备信息:\n"
-                                      << "  总线ID: " << udev.busid << "\n"
-                                      << "  厂商ID: 0x" << std::hex << udev.idVendor << "\n"
-                                      << "  产品ID: 0x" << udev.idProduct << std::dec << "\n"
-                                      << "  设备类: " << static_cast<int>(udev.bDeviceClass) << "\n"
-                                      << "  接口数: " << static_cast<int>(udev.bNumInterfaces) << std::endl;
-                        } else {
-                            std::cerr << "导入设备失败，服务端返回状态码: " << packet.import_rep.status << std::endl;
-                        }
-                    } else {
-                        // 这是URB提交响应，处理RET_SUBMIT
-                        std::cout << "接收RET_SUBMIT数据..." << std::endl;
-                        
-                        // 重新解释第一个字段为seqnum
-                        packet.ret_submit_data.seqnum = firstField;
-                        
-                        // 接收剩余字段
-                        ret_submit ret;
-                        ret.seqnum = usbip_utils::htonl_wrap(firstField); // 已经接收过的seqnum
-                        
-                        // 接收剩余的ret_submit结构体字段
-                        // 计算剩余大小: 总大小 - 已接收的seqnum字段(4字节)
-                        size_t remainingSize = sizeof(ret_submit) - sizeof(uint32_t);
-                        char* remainingData = reinterpret_cast<char*>(&ret) + sizeof(uint32_t);
-                        
-                        if (!receive(remainingData, remainingSize, peekSize)) {
-                            std::cerr << "接收RET_SUBMIT数据失败，实际接收 " << peekSize << " 字节" << std::endl;
-                            return false;
-                        }
-                        
-                        // 填充ret_submit数据到packet
-                        packet.ret_submit_data.devid = usbip_utils::ntohl_wrap(ret.devid);
-                        packet.ret_submit_data.direction = usbip_utils::ntohl_wrap(ret.direction);
-                        packet.ret_submit_data.ep = usbip_utils::ntohl_wrap(ret.ep);
-                        packet.ret_submit_data.status = usbip_utils::ntohl_wrap(ret.status);
-                        packet.ret_submit_data.actual_length = usbip_utils::ntohl_wrap(ret.actual_length);
-                        packet.ret_submit_data.start_frame = usbip_utils::ntohl_wrap(ret.start_frame);
-                        packet.ret_submit_data.number_of_packets = usbip_utils::ntohl_wrap(ret.number_of_packets);
-                        packet.ret_submit_data.error_count = usbip_utils::ntohl_wrap(ret.error_count);
-                        
-                        // 如果是IN方向，接收数据
-                        if (packet.ret_submit_data.direction == USBIP_DIR_IN && 
-                            packet.ret_submit_data.actual_length > 0) {
-                            
-                            std::cout << "接收RET_SUBMIT IN数据，大小: " << packet.ret_submit_data.actual_length 
-                                      << " 字节" << std::endl;
-                            
-                            packet.data.resize(packet.ret_submit_data.actual_length);
-                            if (!receive(packet.data.data(), packet.data.size(), peekSize)) {
-                                std::cerr << "接收RET_SUBMIT IN数据失败，实际接收 " << peekSize 
-                                          << " 字节" << std::endl;
-                                return false;
-                            }
-                        }
-                    }
-                } else {
-                    std::cerr << "接收命令数据失败" << std::endl;
-                    return false;
-                }
-            }
+        case USBIP_OP_REQ_CAPS:
+        case USBIP_OP_REP_CAPS:
+            len += usbip_wire::encode(packet.caps, out + len);
             break;
-        }
-        case USBIP_OP_REQ_DEVLIST: {
-            std::cout << "接收OP_REQ_DEVLIST数据..." << std::endl;
-            op_devlist_request req;
-            if (!receive(&req, sizeof(req), bytesRead)) {
-                std::cerr << "接收OP_REQ_DEVLIST数据失败，实际接收 " << bytesRead << " 字节" << std::endl;
-                return false;
-            }
-            
-            packet.devlist_req.version = usbip_utils::ntohl_wrap(req.version);
+        default:
+            // 其他命令（设备列表响应）只有头部，内容在data中
             break;
+    }
+    
+    // 压缩的负载：固定部分之后先是编码后的长度，接收方据此分帧
+    if (packet.header.flags & USBIP_FLAG_CODEC_MASK) {
+        usbip_wire::storeBE32(out + len, static_cast<uint32_t>(packet.data.size()));
+        len += usbip_wire::kCodecLengthSize;
+    }
+    
+    return len;
+}
+
+// 发送USBIP数据包
+bool TCPSocket::sendPacket(const usbip_packet& packet) {
+    // 打印发送的包信息
+    std::cout << "准备发送数据包: 版本=0x" << std::hex << packet.header.version
+              << ", 命令=0x" << packet.header.command
+              << ", 状态=0x" << packet.header.status << std::dec << std::endl;
+    
+    // 非阻塞套接字统一经发送队列写出，由事件循环负责冲刷；
+    // 发送队列中还有数据时也必须排在其后，保证顺序。需要压缩或附加校验的负载同样经队列（结果由队列持有）；
+    // 数据报传输按队列中记录的流发送
+    std::unique_lock<std::mutex> lock(txMutex_);
+    bool compress = compressor_ && packet.data.size() >= compressor_->threshold();
+    bool checksum = integrity_ && !packet.data.empty();
+    if (nonBlocking_ || !txQueue_.empty() || batchEntries_ > 0 || compress || checksum || dgram_ || packet.sharedData) {
+        lock.unlock();
+        usbip_packet copy = packet;
+        return queuePacket(std::move(copy)) && (nonBlocking_ || flush());
+    }
+    
+    uint8_t head[usbip_wire::kMaxHeadSize];
+    size_t headLen = encodePacketHead(packet, head);
+    
+    // 固定部分和数据一次写出
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = headLen;
+    int iovcnt = 1;
+    
+    if (!packet.data.empty()) {
+        iov[1].iov_base = const_cast<uint8_t*>(packet.data.data());
+        iov[1].iov_len = packet.data.size();
+        iovcnt = 2;
+    }
+    
+    return sendv(iov, iovcnt);
+}
+
+// URB帧在数据报传输中所属的流：每个设备的每个端点和方向各一条，映射到1~65535
+// （流号冲突的端点只是共用一条有序流）；0留给导入等非URB帧
+static uint16_t datagramStream(uint32_t devid, uint32_t direction, uint32_t ep) {
+    uint32_t key = devid * 32 + (direction & 1) * 16 + (ep & 15);
+    return static_cast<uint16_t>(key % 65535 + 1);
+}
+
+// 合并进批量帧的URB负载上限，负载更大时帧头的开销已可忽略，单独成帧
+static const size_t kBatchEntryMaxPayload = 4096;
+
+// 一个批量帧中条目部分的字节上限
+static const size_t kBatchMaxBytes = 64 * 1024;
+
+bool TCPSocket::queuePacket(usbip_packet&& packet) {
+    // 协商的设置可能在其他线程中开启，取得副本后在锁外使用
+    std::shared_ptr<PayloadCompressor> compressor;
+    bool integrity;
+    {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        compressor = compressor_;
+        integrity = integrity_;
+    }
+    
+    // 校验和按压缩前的负载计算，接收方解压后再核对，压缩编码本身的错误也能发现
+    const std::vector<uint8_t>& payload = packet.sharedData ? *packet.sharedData : packet.data;
+    bool checksum = integrity && !payload.empty() &&
+                    (packet.header.command == USBIP_CMD_SUBMIT || packet.header.command == USBIP_RET_SUBMIT);
+    uint32_t crc = checksum ? crc32c(payload.data(), payload.size()) : 0;
+    if (checksum) {
+        packet.header.flags |= USBIP_FLAG_PAYLOAD_CRC;
+    }
+    
+    // 在调用线程（通常是USB完成回调线程）中压缩和计算校验和，不占用事件循环
+    if (compressor) {
+        compressPayload(packet, *compressor);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        if (!isValid()) {
+            return false;
         }
-        case USBIP_OP_REP_DEVLIST: {
-            std::cout << "接收OP_REP_DEVLIST数据..." << std::endl;
-            
-            // 首先接收设备数量（4字节）
-            uint32_t numDevices = 0;
-            if (!receive(&numDevices, sizeof(numDevices), bytesRead)) {
-                std::cerr << "接收设备数量失败，实际接收 " << bytesRead << " 字节" << std::endl;
-                return false;
-            }
-            
-            numDevices = usbip_utils::ntohl_wrap(numDevices);
-            std::cout << "设备列表包含 " << numDevices << " 个设备" << std::endl;
-            
-            // 计算需要接收的数据总大小
-            // 对于每个设备: usb_device_info + 1字节接口数量 + 接口数量*4字节
-            size_t totalSize = sizeof(uint32_t); // 设备数量
-            packet.data.resize(totalSize);
-            memcpy(packet.data.data(), &numDevices, sizeof(numDevices));
-            
-            // 如果有设备，继续接收设备信息
-            if (numDevices > 0) {
-                // 尝试读取设备信息并动态调整缓冲区大小
-                for (uint32_t i = 0; i < numDevices; i++) {
-                    // 接收设备基本信息
-                    usb_device_info devInfo;
-                    if (!receive(&devInfo, sizeof(devInfo), bytesRead)) {
-                        std::cerr << "接收设备 " << i+1 << " 信息失败，实际接收 " << bytesRead << " 字节" << std::endl;
-                        return false;
-                    }
-                    
-                    // 添加设备信息到数据包
-                    size_t oldSize = packet.data.size();
-                    packet.data.resize(oldSize + sizeof(devInfo));
-                    memcpy(packet.data.data() + oldSize, &devInfo, sizeof(devInfo));
-                    
-                    // 接收接口数量
-                    uint8_t numInterfaces = 0;
-                    if (!receive(&numInterfaces, sizeof(numInterfaces), bytesRead)) {
-                        std::cerr << "接收设备 " << i+1 << " 接口数量失败" << std::endl;
-                        return false;
-                    }
-                    
-                    std::cout << "设备 " << i+1 << " 接口数量: " << static_cast<int>(numInterfaces) << std::endl;
-                    
-                    // 添加接口数量到数据包
-                    oldSize = packet.data.size();
-                    packet.data.resize(oldSize + sizeof(numInterfaces));
-                    memcpy(packet.data.data() + oldSize, &numInterfaces, sizeof(numInterfaces));
-                    
-                    // 接收接口信息 (每个接口4字节)
-                    if (numInterfaces > 0) {
-                        size_t interfaceDataSize = numInterfaces * 4;
-                        std::vector<uint8_t> interfaceData(interfaceDataSize);
-                        
-                        if (!receive(interfaceData.data(), interfaceDataSize, bytesRead)) {
-                            std::cerr << "接收设备 " << i+1 << " 接口信息失败，实际接收 " << bytesRead << " 字节" << std::endl;
-                            return false;
-                        }
-                        
-                        // 添加接口信息到数据包
-                        oldSize = packet.data.size();
-                        packet.data.resize(oldSize + interfaceDataSize);
-                        memcpy(packet.data.data() + oldSize, interfaceData.data(), interfaceDataSize);
-                    }
-                }
-            }
-            
-            std::cout << "成功接收设备列表数据，总大小: " << packet.data.size() << " 字节" << std::endl;
-            break;
+        
+        uint32_t flow = 0;
+        uint16_t stream = 0;
+        bool urb = false;
+        if (packet.header.command == USBIP_CMD_SUBMIT) {
+            flow = packet.cmd_submit_data.devid;
+            stream = datagramStream(flow, packet.cmd_submit_data.direction, packet.cmd_submit_data.ep);
+            urb = true;
+        } else if (packet.header.command == USBIP_RET_SUBMIT && decoder_.phase() == FrameDecoder::Phase::Urb) {
+            flow = packet.ret_submit_data.devid;
+            stream = datagramStream(flow, packet.ret_submit_data.direction, packet.ret_submit_data.ep);
+            urb = true;
         }
-        default: {
-            // 处理官方USBIP客户端可能发送的其他命令
-            std::cout << "收到未知命令: 0x" << std::hex << packet.header.command << std::dec << std::endl;
+        
+        // 小URB合并进批量帧，其他帧之前先结束正在合并的批量帧以保持顺序
+        if (urb && batchLimit_ > 1 && (packet.sharedData ? packet.sharedData->size() : packet.data.size()) <= kBatchEntryMaxPayload) {
+            appendBatchEntry(packet, flow, stream, checksum, crc);
+        } else {
+            closeBatch();
             
-            // 尝试读取额外数据作为调试信息
-            std::vector<uint8_t> additionalData(256);
-            try {
-                size_t additionalBytesRead = 0;
-                if (receive(additionalData.data(), additionalData.size(), additionalBytesRead)) {
-                    std::cout << "额外读取了 " << additionalBytesRead << " 字节数据" << std::endl;
-                    
-                    // 打印所有额外读取的数据
-                    if (additionalBytesRead > 0) {
-                        std::cout << "额外数据: ";
-                        for (size_t i = 0; i < additionalBytesRead; i++) {
-                            std::cout << std::hex << std::setw(2) << std::setfill('0') 
-                                      << static_cast<int>(additionalData[i]) << " ";
-                        }
-                        std::cout << std::dec << std::endl;
-                    }
-                    
-                    // 修改：对于命令0，可能是客户端的版本检查请求
-                    if (packet.header.command == 0) {
-                        std::cout << "可能是客户端版本检查请求，将尝试发送版本响应" << std::endl;
-                        
-                        // 准备一个虚拟的版本响应包
-                        usbip_packet versionReply;
-                        versionReply.header.version = USBIP_VERSION; // 使用我们的版本
-                        versionReply.header.command = 0; // 回复同样的命令
-                        versionReply.header.status = 0; // 成功状态
-                        
-                        // 添加版本相关数据
-                        versionReply.data.resize(4);
-                        uint32_t version = usbip_utils::htonl_wrap(USBIP_VERSION);
-                        memcpy(versionReply.data.data(), &version, sizeof(version));
-                        
-                        // 发送响应
-                        if (sendPacket(versionReply)) {
-                            std::cout << "版本响应发送成功" << std::endl;
-                            return true; // 继续保持连接
-                        }
-                    }
-                }
-            } catch (const std::exception& e) {
-                std::cerr << "尝试读取额外数据时发生异常: " << e.what() << std::endl;
+            OutputFrame frame;
+            frame.headLen = encodePacketHead(packet, frame.head);
+            frame.flow = flow;
+            frame.stream = stream;
+            frame.payload = std::move(packet.data);
+            frame.shared = std::move(packet.sharedData);
+            if (checksum) {
+                usbip_wire::storeBE32(frame.trailer, crc);
+                frame.trailerLen = usbip_wire::kTrailerSize;
             }
-            
-            // 为了兼容性，不要立即断开连接
-            std::cout << "收到不支持的命令，但将继续保持连接" << std::endl;
-            return true; // 继续处理后续请求
+            txQueue_.push(std::move(frame));
         }
     }
     
+    if (outputNotifier_) {
+        outputNotifier_();
+    }
     return true;
 }
 
-bool TCPSocket::setTimeout(int seconds) {
-    struct timeval tv;
-    tv.tv_sec = seconds;
-    tv.tv_usec = 0;
+void TCPSocket::appendBatchEntry(usbip_packet& packet, uint32_t flow, uint16_t stream, bool checksum, uint32_t crc) {
+    const std::vector<uint8_t>& payload = packet.sharedData ? *packet.sharedData : packet.data;
+    size_t entrySize = usbip_wire::kBatchEntryFlagsSize + usbip_wire::kMaxHeadSize + payload.size() +
+                       usbip_wire::kTrailerSize;
     
-    // 设置接收超时
-    if (setsockopt(sockfd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        std::cerr << "设置套接字接收超时失败: " << strerror(errno) << std::endl;
-        return false;
+    // 批量帧只合并同一流、同一命令的条目：公平调度和数据报传输按帧所属的流处理，不能混入其他流
+    if (batchEntries_ > 0 && (batch_.flow != flow || batch_.stream != stream || batchCommand_ != packet.header.command ||
+                              batch_.payload.size() + entrySize > kBatchMaxBytes)) {
+        closeBatch();
+    }
+    if (batchEntries_ == 0) {
+        batch_.payload = txQueue_.acquireBuffer(0);
+        batch_.payload.reserve(kBatchMaxBytes);
+        batch_.flow = flow;
+        batch_.stream = stream;
+        batchCommand_ = packet.header.command;
     }
     
-    // 设置发送超时
-    if (setsockopt(sockfd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
-        std::cerr << "设置套接字发送超时失败: " << strerror(errno) << std::endl;
+    // 条目：flags、头部之后的固定部分、负载、校验和
+    std::vector<uint8_t>& body = batch_.payload;
+    size_t offset = body.size();
+    body.resize(offset + entrySize);
+    uint8_t* out = body.data() + offset;
+    usbip_wire::storeBE32(out, packet.header.flags);
+    out += usbip_wire::kBatchEntryFlagsSize;
+    out += encodePacketBody(packet, out);
+    if (!payload.empty()) {
+        memcpy(out, payload.data(), payload.size());
+        out += payload.size();
+    }
+    if (checksum) {
+        usbip_wire::storeBE32(out, crc);
+        out += usbip_wire::kTrailerSize;
+    }
+    body.resize(out - body.data());
+    
+    if (++batchEntries_ >= batchLimit_) {
+        closeBatch();
+    }
+}
+
+void TCPSocket::closeBatch() {
+    if (batchEntries_ == 0) {
+        return;
+    }
+    
+    usbip_header header;
+    header.version = USBIP_VERSION;
+    if (batchEntries_ == 1) {
+        // 只有一个条目时还原为普通帧：以完整的头部代替条目开头的flags
+        header.command = batchCommand_;
+        header.status = 0;
+        header.flags = usbip_wire::loadBE32(batch_.payload.data());
+        batch_.payload.erase(batch_.payload.begin(), batch_.payload.begin() + usbip_wire::kBatchEntryFlagsSize);
+        batch_.headLen = usbip_wire::encode(header, batch_.head);
+    } else {
+        header.command = batchCommand_ == USBIP_CMD_SUBMIT ? USBIP_CMD_SUBMIT_BATCH : USBIP_RET_SUBMIT_BATCH;
+        header.status = static_cast<uint32_t>(batchEntries_);
+        header.flags = 0;
+        batch_.headLen = usbip_wire::encode(header, batch_.head);
+        usbip_wire::storeBE32(batch_.head + batch_.headLen, static_cast<uint32_t>(batch_.payload.size()));
+        batch_.headLen += usbip_wire::kBatchLengthSize;
+    }
+    
+    txQueue_.push(std::move(batch_));
+    batch_ = OutputFrame();
+    batchEntries_ = 0;
+}
+
+bool TCPSocket::enableCompression(uint8_t codecId, const PayloadCompressor::Policy& policy) {
+    const PayloadCodec* codec = PayloadCodec::find(codecId);
+    if (!codec) {
+        std::cerr << "未知的负载编码: " << static_cast<int>(codecId) << std::endl;
         return false;
     }
     
+    std::lock_guard<std::mutex> lock(txMutex_);
+    if (compressor_) {
+        if (compressor_->codec() != codec) {
+            std::cerr << "连接已开启负载编码 " << compressor_->codec()->name() << "，不再更换为 " << codec->name() << std::endl;
+            return false;
+        }
+        return true;
+    }
+    compressor_ = std::make_shared<PayloadCompressor>(codec, policy);
     return true;
 }
 
-bool TCPSocket::receiveWithTimeout(void* buffer, size_t size, size_t& bytesRead, int timeoutSec) {
-    // 保存当前的套接字标志
-    int flags = fcntl(sockfd_, F_GETFL, 0);
-    if (flags == -1) {
-        std::cerr << "获取套接字标志失败: " << strerror(errno) << std::endl;
-        return false;
+void TCPSocket::compressPayload(usbip_packet& packet, PayloadCompressor& compressor) {
+    if (packet.header.command != USBIP_CMD_SUBMIT && packet.header.command != USBIP_RET_SUBMIT) {
+        return;
     }
     
-    // 设置超时
-    struct timeval tv;
-    tv.tv_sec = timeoutSec;
-    tv.tv_usec = 0;
+    // 共用的负载只读，压缩结果放入本包自己的data
+    std::vector<uint8_t> compressed;
+    if (compressor.compress(packet.sharedData ? *packet.sharedData : packet.data, compressed)) {
+        packet.data.swap(compressed);
+        packet.sharedData.reset();
+        packet.header.flags = (packet.header.flags & ~USBIP_FLAG_CODEC_MASK) |
+                              (static_cast<uint32_t>(compressor.codec()->id()) << USBIP_FLAG_CODEC_SHIFT);
+    }
+}
+
+// 压缩负载解压后的长度，即URB中声明的长度
+static size_t plainLength(const usbip_packet& packet) {
+    return packet.header.command == USBIP_CMD_SUBMIT ? packet.cmd_submit_data.transfer_buffer_length
+                                                     : packet.ret_submit_data.actual_length;
+}
+
+// 负载不交给设备或上层：CMD_SUBMIT以头部状态标记，由服务器直接回复错误；RET_SUBMIT改为失败的完成
+static void rejectPayload(usbip_packet& packet, int error) {
+    packet.header.flags &= ~(USBIP_FLAG_CODEC_MASK | USBIP_FLAG_PAYLOAD_CRC);
+    packet.data.clear();
+    if (packet.header.command == USBIP_CMD_SUBMIT) {
+        packet.header.status = static_cast<uint32_t>(error);
+    } else {
+        packet.ret_submit_data.status = static_cast<uint32_t>(error);
+        packet.ret_submit_data.actual_length = 0;
+    }
+}
+
+bool TCPSocket::decompressPayload(usbip_packet& packet) {
+    uint8_t codecId = (packet.header.flags & USBIP_FLAG_CODEC_MASK) >> USBIP_FLAG_CODEC_SHIFT;
+    if (codecId == 0) {
+        return true;
+    }
     
-    if (setsockopt(sockfd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        std::cerr << "设置套接字接收超时失败: " << strerror(errno) << std::endl;
+    const PayloadCodec* codec = PayloadCodec::find(codecId);
+    if (!codec) {
+        std::cerr << "收到未知编码的负载: " << static_cast<int>(codecId) << std::endl;
         return false;
     }
     
-    // 执行带超时的接收
-    bool result = receive(buffer, size, bytesRead);
+    size_t expected = plainLength(packet);
+    std::vector<uint8_t> plain;
+    if (!codec->decompress(packet.data.data(), packet.data.size(), plain, expected)) {
+        std::cerr << "解压负载失败: 编码=" << codec->name() << ", 压缩后 " << packet.data.size()
+                  << " 字节, 声明 " << expected << " 字节" << std::endl;
+        return false;
+    }
     
-    // 恢复原始标志
-    if (fcntl(sockfd_, F_SETFL, flags) == -1) {
-        std::cerr << "恢复套接字标志失败: " << strerror(errno) << std::endl;
+    packet.data.swap(plain);
+    packet.header.flags &= ~USBIP_FLAG_CODEC_MASK;
+    return true;
+}
+
+bool TCPSocket::finishPayload(usbip_packet& packet) {
+    // 只接受本连接协商的编码：对端未经协商就发来的压缩负载不交给解码器，按数据错乱断开
+    uint8_t codecId = (packet.header.flags & USBIP_FLAG_CODEC_MASK) >> USBIP_FLAG_CODEC_SHIFT;
+    if (codecId != 0) {
+        uint8_t negotiated = 0;
+        {
+            std::lock_guard<std::mutex> lock(txMutex_);
+            negotiated = compressor_ ? compressor_->codec()->id() : 0;
+        }
+        if (codecId != negotiated) {
+            std::cerr << "收到未协商的负载编码: " << static_cast<int>(codecId)
+                      << "，协商的编码为 " << static_cast<int>(negotiated) << std::endl;
+            return false;
+        }
+        // 解码器已按解压后的长度计入预算；超过预算上限的负载已被它丢弃，不会到这里
+    }
+    
+    if (!(packet.header.flags & USBIP_FLAG_PAYLOAD_CRC)) {
+        return decompressPayload(packet);
+    }
+    
+    // 负载之后是明文负载的CRC32C
+    size_t len = packet.data.size() - usbip_wire::kTrailerSize;
+    uint32_t expected = usbip_wire::loadBE32(packet.data.data() + len);
+    packet.data.resize(len);
+    packet.header.flags &= ~USBIP_FLAG_PAYLOAD_CRC;
+    
+    // 压缩负载在传输中损坏时通常无法解压，同样按校验失败处理而不断开连接
+    if (decompressPayload(packet) && crc32c(packet.data.data(), packet.data.size()) == expected) {
+        return true;
     }
     
-    return result;
+    integrityErrors_++;
+    std::cerr << "负载校验失败: 命令=0x" << std::hex << packet.header.command << std::dec
+              << ", seqnum=" << (packet.header.command == USBIP_CMD_SUBMIT ? packet.cmd_submit_data.seqnum
+                                                                           : packet.ret_submit_data.seqnum)
+              << std::endl;
+    
+    // 损坏的数据不交给设备或上层
+    rejectPayload(packet, -EILSEQ);
+    return true;
 }
 
-bool TCPSocket::receivePacketWithTimeout(usbip_packet& packet, int timeoutSec) {
-    // 设置接收超时
-    struct timeval tv;
-    tv.tv_sec = timeoutSec;
-    tv.tv_usec = 0;
+OutputQueue::FlushResult TCPSocket::flushQueue(int timeoutMs) {
+    closeBatch();
     
-    if (setsockopt(sockfd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        std::cerr << "设置套接字接收超时失败: " << strerror(errno) << std::endl;
-        return false;
+    if (dgram_) {
+        // 数据报传输：逐帧交给所属的流，未确认的数据过多时按超时等待对端确认
+        while (const OutputFrame* frame = txQueue_.front()) {
+            struct iovec iov[3];
+            int iovcnt = 0;
+            iov[iovcnt].iov_base = const_cast<uint8_t*>(frame->head);
+            iov[iovcnt++].iov_len = frame->headLen;
+            if (frame->payloadSize() > 0) {
+                iov[iovcnt].iov_base = const_cast<uint8_t*>(frame->payloadData());
+                iov[iovcnt++].iov_len = frame->payloadSize();
+            }
+            if (frame->trailerLen > 0) {
+                iov[iovcnt].iov_base = const_cast<uint8_t*>(frame->trailer);
+                iov[iovcnt++].iov_len = frame->trailerLen;
+            }
+            
+            if (!dgram_->sendFrame(frame->stream, iov, iovcnt, timeoutMs)) {
+                if (errno == EAGAIN) {
+                    return OutputQueue::FlushResult::Pending;
+                }
+                std::cerr << "发送数据失败: " << strerror(errno) << std::endl;
+                return OutputQueue::FlushResult::Error;
+            }
+            txQueue_.consume(frame->size());
+        }
+        return OutputQueue::FlushResult::Done;
     }
     
-    // 尝试接收数据包
-    bool result = receivePacket(packet);
+    bool userTls = tls_ && !tls_->kernelSend();
+    if (!shm_ && !userTls) {
+        return txQueue_.flush(sockfd_);
+    }
     
-    return result;
+    // 共享内存传输：把队列中的帧拷入发送环，环满时按超时等待对端腾出空间；
+    // 用户态TLS：加密写出，套接字不可写时（阻塞套接字为SO_SNDTIMEO超时）等待可写事件
+    struct iovec iov[64];
+    int iovcnt;
+    while ((iovcnt = txQueue_.gather(iov, 64)) > 0) {
+        ssize_t written = shm_ ? shm_->write(iov, iovcnt, timeoutMs) : tls_->write(iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return OutputQueue::FlushResult::Pending;
+            }
+            std::cerr << "发送数据失败: " << strerror(errno) << std::endl;
+            return OutputQueue::FlushResult::Error;
+        }
+        txQueue_.consume(static_cast<size_t>(written));
+    }
+    return OutputQueue::FlushResult::Done;
 }
 
-// Server实现
-Server::Server(int port)
-    : port_(port), running_(false) {
+bool TCPSocket::flush() {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    switch (flushQueue(timeoutMs_)) {
+        case OutputQueue::FlushResult::Done:
+            return true;
+        case OutputQueue::FlushResult::Pending:
+            std::cerr << "发送超时，仍有 " << txQueue_.bytes() << " 字节未发送" << std::endl;
+            return false;
+        default:
+            return false;
+    }
 }
 
-Server::~Server() {
-    stop();
+OutputQueue::FlushResult TCPSocket::flushSome() {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    if (!isValid()) {
+        return OutputQueue::FlushResult::Error;
+    }
+    return flushQueue(0);
 }
 
-bool Server::start() {
-    if (!serverSocket_.create()) {
+void TCPSocket::serviceTransport() {
+    if (shm_) {
+        shm_->drainBell();
+    } else if (dgram_) {
+        dgram_->poll();
+    }
+}
+
+int TCPSocket::prepareSend(struct iovec* iov, int maxIov) {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    closeBatch();
+    return txQueue_.gather(iov, maxIov);
+}
+
+void TCPSocket::completeSend(size_t n) {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    txQueue_.consume(n);
+}
+
+void TCPSocket::reapZeroCopyCompletions() {
+    std::lock_guard<std::mutex> lock(txMutex_);
+    if (isValid() && txQueue_.hasPendingCompletions()) {
+        txQueue_.reapCompletions(sockfd_);
+    }
+}
+
+bool TCPSocket::enableZeroCopy(size_t threshold) {
+    if (completionIo_) {
+        std::cerr << "io_uring发送路径不使用MSG_ZEROCOPY，使用普通发送" << std::endl;
         return false;
     }
-    
-    if (!serverSocket_.bind(port_)) {
+    if (shm_ || dgram_) {
+        // 共享内存和数据报传输都不经过本套接字发送
         return false;
     }
-    
-    if (!serverSocket_.listen()) {
+    if (tls_) {
+        // 内核TLS只在sendfile路径上支持零拷贝，sendmsg的MSG_ZEROCOPY会被拒绝
+        std::cerr << "TLS连接不使用MSG_ZEROCOPY，使用普通发送" << std::endl;
         return false;
     }
     
-    running_ = true;
-    acceptThread_ = std::thread(&Server::acceptLoop, this);
+#ifdef SO_ZEROCOPY
+    int enable = 1;
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0) {
+        std::cerr << "开启SO_ZEROCOPY失败: " << strerror(errno) << std::endl;
+        return false;
+    }
     
-    std::cout << "服务器已启动，监听端口: " << port_ << std::endl;
+    std::lock_guard<std::mutex> lock(txMutex_);
+    txQueue_.setZeroCopyThreshold(threshold);
     return true;
+#else
+    (void)threshold;
+    std::cerr << "当前系统不支持MSG_ZEROCOPY，使用普通发送" << std::endl;
+    return false;
+#endif
 }
 
-void Server::stop() {
-    running_ = false;
-    serverSocket_.close();
-    
-    if (acceptThread_.joinable()) {
-        acceptThread_.join();
+bool TCPSocket::flushIfDue() {
+    {
+        std::lock_guard<std::mutex> lock(txMutex_);
+        if (txQueue_.empty() && batchEntries_ == 0) {
+            return true;
+        }
+        
+        // 还有请求等待处理时让批量帧继续合并，直到它装满（装满时已进入队列）
+        if (hasCompleteFrame() && !txQueue_.shouldFlush()) {
+            return true;
+        }
     }
     
-    std::cout << "服务器已停止" << std::endl;
+    return flush();
 }
 
-void Server::acceptLoop() {
-    while (running_) {
-        std::shared_ptr<TCPSocket> clientSocket = serverSocket_.accept();
-        if (clientSocket && connectionHandler_) {
-            connectionHandler_(clientSocket);
-        }
+void TCPSocket::decodeBuffered() {
+    struct iovec iov[2];
+    // 负载在等待内存预算时不再消费，数据留在缓冲区中
+    while (!decoder_.hasPacket() && !decoder_.failed() && decoder_.admitPayload() && rxBuffer_.readableRegions(iov) > 0) {
+        size_t used = decoder_.feed(static_cast<const uint8_t*>(iov[0].iov_base), iov[0].iov_len);
+        rxBuffer_.consume(used);
     }
 }
 
-// Client实现
-Client::Client() 
-    : socket_(std::make_shared<TCPSocket>()) {
+TCPSocket::ReadStatus TCPSocket::nextBufferedPacket(usbip_packet& packet) {
+    decodeBuffered();
+    if (decoder_.failed()) {
+        return ReadStatus::Error;
+    }
+    if (!decoder_.next(packet)) {
+        return ReadStatus::NeedMore;
+    }
+    return finishPacket(packet) ? ReadStatus::Packet : ReadStatus::Error;
 }
 
-Client::~Client() {
-    disconnect();
+TCPSocket::ReadStatus TCPSocket::readPacket(usbip_packet& packet) {
+    while (true) {
+        ReadStatus status = nextBufferedPacket(packet);
+        if (status != ReadStatus::NeedMore) {
+            return status;
+        }
+        if (decoder_.payloadBlocked()) {
+            // 负载在等待内存预算：不再读取，数据留在内核中
+            return ReadStatus::NeedMore;
+        }
+        
+        // 缓冲区已取空，读一次套接字；阻塞套接字在忙轮询模式下先自旋等到数据，再进入阻塞的读取
+        if (busyPollUs_ > 0 && !nonBlocking_) {
+            waitReadable(0);
+        }
+        ssize_t received = readIntoDecoder(readTimeout());
+        if (received == 0) {
+            return ReadStatus::Closed;
+        }
+        if (received < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ReadStatus::NeedMore : ReadStatus::Error;
+        }
+    }
 }
 
-bool Client::connect(const std::string& host, int port) {
-    if (!socket_->create()) {
-        return false;
+ssize_t TCPSocket::readIntoDecoder(int timeoutMs) {
+    struct iovec iov[3];
+    int iovcnt = 0;
+    size_t direct = 0;
+    if (uint8_t* window = decoder_.payloadWindow(direct)) {
+        iov[0].iov_base = window;
+        iov[0].iov_len = direct;
+        iovcnt = 1;
     }
+    iovcnt += rxBuffer_.writableRegions(iov + iovcnt);
     
-    // 设置5秒超时
-    socket_->setTimeout(5);
+    ssize_t received = readSome(iov, iovcnt, timeoutMs);
+    if (received <= 0) {
+        return received;
+    }
     
-    if (!socket_->connect(host, port)) {
-        return false;
+    size_t n = static_cast<size_t>(received);
+    if (n > direct) {
+        decoder_.commitPayload(direct);
+        rxBuffer_.commit(n - direct);
+    } else {
+        decoder_.commitPayload(n);
+    }
+    return received;
+}
+
+bool TCPSocket::waitReadable(int timeoutMs) {
+    if (shm_ || dgram_ || (tls_ && tls_->pending())) {
+        return true;
     }
     
-    std::cout << "已连接到服务器: " << host << ":" << port << std::endl;
-    return true;
+    // 忙轮询模式先自旋，数据在此期间到达时省去线程被唤醒的延迟
+    struct pollfd pfd;
+    pfd.fd = sockfd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ret = pollSpin(&pfd, 1, timeoutMs, std::chrono::microseconds(busyPollUs_));
+    if (ret < 0) {
+        std::cerr << "等待套接字可读失败: " << strerror(errno) << std::endl;
+    }
+    return ret > 0;
 }
 
-void Client::disconnect() {
-    if (socket_) {
-        socket_->close();
+size_t TCPSocket::feed(const uint8_t* data, size_t len) {
+    // 缓冲区已空时直接送入解码器，解出一个包后剩余的数据收进缓冲区
+    size_t used = rxBuffer_.empty() ? decoder_.feed(data, len) : 0;
+    return used + rxBuffer_.write(data + used, len - used);
+}
+
+// 接收USBIP数据包
+bool TCPSocket::receivePacket(usbip_packet& packet) {
+    switch (readPacket(packet)) {
+        case ReadStatus::Packet:
+            return true;
+        case ReadStatus::NeedMore:
+            // 已收到的部分帧留在解码器中，下次接收从断点继续
+            std::cerr << "接收数据包超时" << std::endl;
+            return false;
+        default:
+            // 对端关闭、出错或数据错乱，连接无法继续
+            close();
+            return false;
+    }
+}
+
+bool TCPSocket::finishPacket(usbip_packet& packet) {
+    switch (packet.header.command) {
+        case USBIP_CMD_SUBMIT:
+            return finishPayload(packet);
+        case USBIP_RET_SUBMIT:
+            if (decoder_.phase() == FrameDecoder::Phase::Urb) {
+                return finishPayload(packet);
+            }
+            
+            // 握手阶段的0x0003为导入响应
+            std::cout << "接收到导入设备响应：版本=0x" << std::hex << packet.import_rep.version
+                      << ", 状态=" << packet.import_rep.status << std::dec << std::endl;
+            if (packet.import_rep.status == 0) {
+                const usb_device_info& udev = packet.import_rep.udev;
+                std::cout << "成功接收设备信息:\n"
+                          << "  总线ID: " << udev.busid << "\n"
+                          << "  厂商ID: 0x" << std::hex << udev.idVendor << "\n"
+                          << "  产品ID: 0x" << udev.idProduct << std::dec << "\n"
+                          << "  设备类: " << static_cast<int>(udev.bDeviceClass) << "\n"
+                          << "  接口数: " << static_cast<int>(udev.bNumInterfaces) << std::endl;
+            } else {
+                std::cerr << "导入设备失败，服务端返回状态码: " << static_cast<int>(packet.import_rep.status) << std::endl;
+            }
+            return true;
+        case USBIP_OP_REQ_IMPORT:
+            std::cout << "接收到导入请求: 版本=0x" << std::hex << packet.import_req.version
+                      << ", 总线ID=[" << packet.import_req.busid << "]" << std::dec << std::endl;
+            return true;
+        case USBIP_OP_REQ_DEVLIST:
+            return true;
+        case USBIP_OP_REP_DEVLIST:
+            std::cout << "设备列表包含 " << usbip_wire::loadBE32(packet.data.data()) << " 个设备，总大小: "
+                      << packet.data.size() << " 字节" << std::endl;
+            return true;
+        default:
+            // 能力交换的请求和响应由上层处理
+            return true;
     }
+}
+
+bool TCPSocket::setTimeout(int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    timeoutMs_ = seconds > 0 ? seconds * 1000 : -1;
     
-    std::cout << "已断开连接" << std::endl;
+    // 设置接收超时
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        std::cerr << "设置套接字接收超时失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    
+    // 设置发送超时
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        std::cerr << "设置套接字发送超时失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    
+    return true;
 }
 
-bool Client::sendPacket(const usbip_packet& packet) {
-    return socket_->sendPacket(packet);
+// 距deadline的毫秒数（向上取整），已过时为0
+static int remainingMs(std::chrono::steady_clock::time_point deadline) {
+    auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+    return left.count() > 0 ? static_cast<int>((left.count() + 999) / 1000) : 0;
 }
 
-bool Client::receivePacket(usbip_packet& packet) {
-    return socket_->receivePacket(packet);
+bool TCPSocket::receiveWithTimeout(void* buffer, size_t size, size_t& bytesRead, int timeoutSec) {
+    if (timeoutSec <= 0) {
+        return receive(buffer, size, bytesRead);
+    }
+    
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSec);
+    char* p = static_cast<char*>(buffer);
+    size_t total = rxBuffer_.read(p, size);
+    
+    while (total < size) {
+        int waitMs = remainingMs(deadline);
+        if (waitMs == 0 || !waitReadable(waitMs)) {
+            break;
+        }
+        
+        struct iovec iov;
+        iov.iov_base = p + total;
+        iov.iov_len = size - total;
+        ssize_t received = readSome(&iov, 1, waitMs);
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            break;
+        }
+        if (received > 0) {
+            total += received;
+        }
+    }
+    
+    bytesRead = total;
+    return total == size;
 }
 
-bool Client::receivePacketWithTimeout(usbip_packet& packet, int timeoutSec) {
-    return socket_->receivePacketWithTimeout(packet, timeoutSec);
+bool TCPSocket::receivePacketWithTimeout(usbip_packet& packet, int timeoutSec) {
+    if (timeoutSec <= 0) {
+        return receivePacket(packet);
+    }
+    
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSec);
+    while (true) {
+        ReadStatus status = nextBufferedPacket(packet);
+        if (status == ReadStatus::Error) {
+            close();
+        }
+        if (status != ReadStatus::NeedMore) {
+            return status == ReadStatus::Packet;
+        }
+        
+        int waitMs = remainingMs(deadline);
+        if (waitMs == 0 || !waitReadable(waitMs)) {
+            // 已收到的部分帧留在解码器中，下次接收从断点继续
+            std::cerr << "接收数据包超时" << std::endl;
+            return false;
+        }
+        
+        ssize_t received = readIntoDecoder(waitMs);
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close();
+            return false;
+        }
+    }
+}
+
+// Server实现
+struct Server::Connection {
+    std::shared_ptr<TCPSocket> socket;
+    Worker* worker = nullptr;
+    bool closed = false;
+    
+    // 收发经io_uring完成式接口；否则（包括io_uring后端上的共享内存、数据报和用户态TLS连接）走就绪通知
+    bool completionIo = false;
+    
+    // io_uring后端：已有发送在进行，完成后再发送队列中的剩余数据
+    bool sendInFlight = false;
+    
+    // 已投递到循环、尚未执行的冲刷任务，避免每个回复都唤醒一次循环
+    std::atomic<bool> flushPosted{false};
+    
+    // 最近一次收到数据的时刻（取自循环的唤醒时刻）和空闲定时器；
+    // 收到数据时只更新时刻，定时器到期时再顺延，避免每次读取都重新挂定时器
+    EventLoop::Clock::time_point lastActivity;
+    EventLoop::TimerId idleTimer = 0;
+    
+    // 内存预算耗尽或发送队列积压过多，暂停读取；io_uring后端暂停之前已收到、尚未送入的数据
+    bool readPaused = false;
+    bool budgetWait = false;  // 已在预算上登记等待
+    std::vector<uint8_t> pendingInput;
+};
+
+// 正在握手的连接，握手完成之后才成为Connection：TLS握手或数据报传输的端口交换，二者只有其一
+struct Server::Handshake {
+    std::shared_ptr<TCPSocket> socket;
+    std::unique_ptr<TlsSession> tls;
+    std::unique_ptr<DatagramTransport> dgram;
+    EventLoop::TimerId timer = 0;
+};
+
+struct Server::Worker {
+    EventLoop loop;
+    std::thread thread;
+    std::map<int, std::shared_ptr<Connection>> connections;
+    std::map<int, std::shared_ptr<Handshake>> handshakes;
+    std::vector<std::shared_ptr<TCPSocket>> listeners;
+};
+
+Server::Server(int port, size_t numWorkers)
+    : port_(port), datagramPort_(0), datagramLoss_(0), numWorkers_(numWorkers), useIoUring_(true), backend_(EventLoop::Backend::Readiness),
+      running_(false), shardedAccept_(false), nextWorker_(0), connectionCount_(0), idleTimeoutMs_(0), urbTimeoutMs_(0), deadPeerMs_(0),
+      connectionBudget_(0), totalBudget_(0), busyPollUs_(0) {
+}
+
+Server::~Server() {
+    stop();
+}
+
+bool Server::start() {
+    // 内核支持时以io_uring批量提交所有连接的收发，否则使用epoll/poll
+    backend_ = EventLoop::Backend::Readiness;
+    if (useIoUring_ && EventLoop::ioUringSupported()) {
+        backend_ = EventLoop::Backend::IoUring;
+    }
+    
+    memoryBudget_ = std::make_shared<MemoryBudget>(totalBudget_);
+    
+    size_t numWorkers = numWorkers_;
+    if (numWorkers == 0) {
+        numWorkers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    
+    for (size_t i = 0; i < numWorkers; i++) {
+        auto worker = std::make_unique<Worker>();
+        if (!worker->loop.init(backend_)) {
+            workers_.clear();
+            return false;
+        }
+        if (busyPollUs_ > 0) {
+            worker->loop.setBusyPoll(std::chrono::microseconds(busyPollUs_));
+        }
+        workers_.push_back(std::move(worker));
+    }
+    if (busyPollUs_ > 0 && allowedCpuCount() < numWorkers) {
+        std::cerr << "可用CPU少于工作线程数，忙轮询的线程会相互抢占" << std::endl;
+    }
+    
+    // Linux的SO_REUSEPORT按连接哈希在监听套接字间分配，每个循环各自接受；
+    // 其他平台（macOS）的SO_REUSEPORT不做分配，只由第一个循环监听
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    shardedAccept_ = workers_.size() > 1;
+#else
+    shardedAccept_ = false;
+#endif
+    
+    for (auto& worker : workers_) {
+        if (!openListeners(worker.get(), shardedAccept_)) {
+            workers_.clear();
+            return false;
+        }
+        if (!shardedAccept_) {
+            break;
+        }
+    }
+    
+    if (!localPath_.empty() && !openLocalListener(workers_[0].get())) {
+        workers_.clear();
+        return false;
+    }
+    
+    if (datagramPort_ > 0 && tls_) {
+        std::cerr << "数据报传输不支持TLS，不监听端口 " << datagramPort_ << std::endl;
+    } else if (datagramPort_ > 0 && !openDatagramListener(workers_[0].get())) {
+        workers_.clear();
+        return false;
+    }
+    
+    running_ = true;
+    for (size_t i = 0; i < workers_.size(); i++) {
+        // 忙轮询的线程各占一个CPU，不在CPU之间迁移，缓存保持在同一个核上
+        Worker* w = workers_[i].get();
+        int cpu = busyPollUs_ > 0 ? lowLatencyCpu(i) : -1;
+        w->thread = std::thread([w, cpu] {
+            pinThread(cpu);
+            w->loop.run();
+        });
+    }
+    
+    std::cout << "服务器已启动，监听端口: " << port_ << "，工作线程: " << workers_.size()
+              << "，I/O后端: " << (backend_ == EventLoop::Backend::IoUring ? "io_uring" : "epoll/poll")
+              << (shardedAccept_ ? "，各线程独立监听" : "") << std::endl;
+    return true;
+}
+
+// 每个监听套接字上尚未完成握手、SYN携带了数据的连接数上限
+static const int kFastOpenQueue = 256;
+
+bool Server::openListeners(Worker* worker, bool reusePort) {
+    for (int family : {AF_INET, AF_INET6}) {
+        auto listener = std::make_shared<TCPSocket>();
+        if (!listener->create(family)) {
+            // 系统未启用IPv6时只监听IPv4
+            continue;
+        }
+        
+        if ((reusePort && !listener->setReusePort()) || !listener->bind(port_) ||
+            !listener->listen() || !listener->setNonBlocking(true) || !registerListener(worker, listener)) {
+            return false;
+        }
+        
+        // 接受SYN中携带的首批请求（内核还需开启net.ipv4.tcp_fastopen的服务端位），不支持时按普通连接接受
+        listener->setFastOpen(kFastOpenQueue);
+    }
+    
+    if (worker->listeners.empty()) {
+        std::cerr << "没有可用的监听套接字" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Server::openLocalListener(Worker* worker) {
+    if (!ShmTransport::supported()) {
+        std::cerr << "当前系统不支持共享内存传输，忽略本地路径 " << localPath_ << std::endl;
+        return true;
+    }
+    
+    auto listener = std::make_shared<TCPSocket>();
+    if (!listener->create(AF_UNIX) || !listener->bindLocal(localPath_) || !listener->listen() ||
+        !listener->setNonBlocking(true) || !registerListener(worker, listener)) {
+        return false;
+    }
+    
+    std::cout << "本地共享内存传输监听: " << localPath_ << std::endl;
+    return true;
+}
+
+bool Server::openDatagramListener(Worker* worker) {
+    if (!DatagramTransport::supported()) {
+        std::cerr << "当前系统不支持数据报传输，忽略端口 " << datagramPort_ << std::endl;
+        return true;
+    }
+    
+    size_t opened = 0;
+    for (int family : {AF_INET, AF_INET6}) {
+        auto listener = std::make_shared<TCPSocket>();
+        if (!listener->create(family)) {
+            continue;
+        }
+        
+        if (!listener->bind(datagramPort_) || !listener->listen() || !listener->setNonBlocking(true) ||
+            !registerListener(worker, listener, true)) {
+            return false;
+        }
+        opened++;
+    }
+    
+    if (opened == 0) {
+        std::cerr << "没有可用的数据报传输监听套接字" << std::endl;
+        return false;
+    }
+    
+    std::cout << "数据报传输控制端口: " << datagramPort_ << std::endl;
+    return true;
+}
+
+bool Server::registerListener(Worker* worker, const std::shared_ptr<TCPSocket>& listener, bool datagram) {
+    TCPSocket* raw = listener.get();
+    bool registered;
+    if (backend_ == EventLoop::Backend::IoUring) {
+        registered = worker->loop.acceptAsync(raw->fd(), [this, worker, raw, datagram](int fd) {
+            dispatchConnection(worker, std::make_shared<TCPSocket>(fd, raw->family()), datagram);
+        });
+    } else {
+        registered = worker->loop.add(raw->fd(), EventLoop::kReadable, [this, worker, raw, datagram](uint32_t) {
+            onAcceptable(worker, *raw, datagram);
+        });
+    }
+    
+    if (registered) {
+        worker->listeners.push_back(listener);
+    }
+    return registered;
+}
+
+void Server::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    
+    // 各循环退出前在自己的线程中关闭所有连接
+    for (auto& worker : workers_) {
+        Worker* w = worker.get();
+        w->loop.post([this, w] {
+            for (auto& listener : w->listeners) {
+                w->loop.remove(listener->fd());
+                w->loop.cancelAsync(listener->fd());
+            }
+            
+            std::vector<std::shared_ptr<Handshake>> handshakes;
+            for (auto& entry : w->handshakes) {
+                handshakes.push_back(entry.second);
+            }
+            for (auto& handshake : handshakes) {
+                endHandshake(w, handshake, false);
+            }
+            
+            std::vector<std::shared_ptr<Connection>> connections;
+            for (auto& entry : w->connections) {
+                connections.push_back(entry.second);
+            }
+            for (auto& conn : connections) {
+                closeConnection(conn);
+            }
+        });
+        w->loop.stop();
+    }
+    
+    for (auto& worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    workers_.clear();
+    
+    if (!localPath_.empty()) {
+        ::unlink(localPath_.c_str());
+    }
+    
+    std::cout << "服务器已停止" << std::endl;
+}
+
+void Server::onAcceptable(Worker* worker, TCPSocket& listener, bool datagram) {
+    while (running_) {
+        std::shared_ptr<TCPSocket> clientSocket = listener.accept();
+        if (!clientSocket) {
+            break;
+        }
+        dispatchConnection(worker, clientSocket, datagram);
+    }
+}
+
+void Server::dispatchConnection(Worker* acceptor, std::shared_ptr<TCPSocket> socket, bool datagram) {
+    if (!running_) {
+        socket->close();
+        return;
+    }
+    
+    if (shardedAccept_ && socket->family() != AF_UNIX && !datagram) {
+        // 内核已按连接分配好循环，直接在当前线程接管
+        attach(acceptor, socket, false);
+        return;
+    }
+    
+    Worker* worker = workers_[nextWorker_++ % workers_.size()].get();
+    worker->loop.post([this, worker, socket, datagram] {
+        attach(worker, socket, datagram);
+    });
+}
+
+void Server::attach(Worker* worker, std::shared_ptr<TCPSocket> socket, bool datagram) {
+    if (!running_) {
+        socket->close();
+        return;
+    }
+    
+    // 本地连接先在阻塞模式下交换共享内存，之后的收发都走共享内存环
+    if (socket->family() == AF_UNIX && !socket->offerSharedMemory()) {
+        socket->close();
+        return;
+    }
+    
+    if (datagram) {
+        // 数据报传输的控制连接先交换UDP端口
+        auto handshake = std::make_shared<Handshake>();
+        handshake->socket = socket;
+        handshake->dgram = std::make_unique<DatagramTransport>();
+        if (!socket->setNonBlocking(true) || !handshake->dgram->beginOffer(socket->fd())) {
+            socket->close();
+            return;
+        }
+        startHandshake(worker, handshake);
+        return;
+    }
+    if (tls_ && socket->family() != AF_UNIX) {
+        // 网络连接先完成TLS握手，本地共享内存连接不经过网络
+        auto handshake = std::make_shared<Handshake>();
+        handshake->socket = socket;
+        handshake->tls = std::make_unique<TlsSession>(tls_);
+        if (!socket->setNonBlocking(true) || !handshake->tls->begin(socket->fd(), "")) {
+            socket->close();
+            return;
+        }
+        startHandshake(worker, handshake);
+        return;
+    }
+    
+    activate(worker, socket);
+}
+
+void Server::startHandshake(Worker* worker, const std::shared_ptr<Handshake>& handshake) {
+    int fd = handshake->socket->fd();
+    std::weak_ptr<Handshake> weak = handshake;
+    bool registered = worker->loop.add(fd, EventLoop::kReadable, [this, worker, weak](uint32_t) {
+        std::shared_ptr<Handshake> handshake = weak.lock();
+        if (handshake) {
+            continueHandshake(worker, handshake);
+        }
+    });
+    if (!registered) {
+        handshake->socket->close();
+        return;
+    }
+    
+    worker->handshakes[fd] = handshake;
+    handshake->timer = worker->loop.runAfter(std::chrono::milliseconds(kHandshakeTimeoutMs), [this, worker, weak] {
+        std::shared_ptr<Handshake> handshake = weak.lock();
+        if (handshake) {
+            std::cerr << "握手超时，关闭连接" << std::endl;
+            handshake->timer = 0;
+            endHandshake(worker, handshake, false);
+        }
+    });
+    
+    // 客户端的第一条消息可能已经到达
+    continueHandshake(worker, handshake);
+}
+
+void Server::continueHandshake(Worker* worker, const std::shared_ptr<Handshake>& handshake) {
+    if (handshake->dgram) {
+        // 端口交换只等对端的一条消息，没有收齐时保持关注可读
+        bool done = false;
+        if (!handshake->dgram->continueOffer(done)) {
+            endHandshake(worker, handshake, false);
+        } else if (done) {
+            endHandshake(worker, handshake, true);
+        }
+        return;
+    }
+    
+    switch (handshake->tls->step()) {
+        case TlsSession::Progress::Done:
+            endHandshake(worker, handshake, true);
+            break;
+        case TlsSession::Progress::WantRead:
+            worker->loop.modify(handshake->socket->fd(), EventLoop::kReadable);
+            break;
+        case TlsSession::Progress::WantWrite:
+            worker->loop.modify(handshake->socket->fd(), EventLoop::kWritable);
+            break;
+        case TlsSession::Progress::Failed:
+            endHandshake(worker, handshake, false);
+            break;
+    }
+}
+
+void Server::endHandshake(Worker* worker, const std::shared_ptr<Handshake>& handshake, bool done) {
+    int fd = handshake->socket->fd();
+    worker->loop.remove(fd);
+    if (handshake->timer != 0) {
+        worker->loop.cancelTimer(handshake->timer);
+        handshake->timer = 0;
+    }
+    worker->handshakes.erase(fd);
+    
+    if (!done || !running_) {
+        // 先释放会话再关闭套接字：描述符关闭后可能被新连接复用，不能再经它发送close_notify
+        if (handshake->tls) {
+            handshake->tls->close(false);
+        }
+        handshake->dgram.reset();
+        handshake->socket->close();
+        return;
+    }
+    
+    if (handshake->dgram) {
+        handshake->socket->adoptDatagram(std::move(handshake->dgram));
+        if (datagramLoss_ > 0) {
+            handshake->socket->setDatagramLoss(datagramLoss_);
+        }
+    } else {
+        handshake->socket->adoptTls(std::move(handshake->tls));
+    }
+    activate(worker, handshake->socket);
+}
+
+void Server::activate(Worker* worker, std::shared_ptr<TCPSocket> socket) {
+    if (!socket->setNonBlocking(true)) {
+        socket->close();
+        return;
+    }
+    if (deadPeerMs_ > 0) {
+        socket->setDeadPeerTimeout(deadPeerMs_);
+    }
+    if (busyPollUs_ > 0) {
+        socket->setBusyPoll(busyPollUs_);
+    }
+    socket->setMemoryBudget(std::make_shared<MemoryBudget>(connectionBudget_, memoryBudget_));
+    
+    auto conn = std::make_shared<Connection>();
+    conn->socket = socket;
+    conn->worker = worker;
+    conn->completionIo = backend_ == EventLoop::Backend::IoUring && !socket->hasTransport() && !socket->userspaceTls();
+    
+    // 其他线程（USB传输完成回调）放入回复时，投递一次冲刷到所属循环；
+    // 循环线程内放入的回复在本轮读事件处理完后统一写出
+    std::weak_ptr<Connection> weak = conn;
+    socket->setOutputNotifier([this, weak] {
+        std::shared_ptr<Connection> conn = weak.lock();
+        if (!conn || conn->worker->loop.inLoopThread() || conn->flushPosted.exchange(true)) {
+            return;
+        }
+        conn->worker->loop.post([this, weak] {
+            std::shared_ptr<Connection> conn = weak.lock();
+            if (conn) {
+                conn->flushPosted = false;
+                flushConnection(conn);
+            }
+        });
+    });
+    
+    int fd = socket->fd();
+    bool registered;
+    if (conn->completionIo) {
+        socket->setCompletionIo(true);
+        registered = worker->loop.receiveAsync(fd, [this, weak](const uint8_t* data, ssize_t len) {
+            std::shared_ptr<Connection> conn = weak.lock();
+            if (conn) {
+                onConnectionData(conn, data, len);
+            }
+        });
+    } else {
+        registered = worker->loop.add(socket->pollFd(), EventLoop::kReadable, [this, weak](uint32_t events) {
+            std::shared_ptr<Connection> conn = weak.lock();
+            if (conn) {
+                onConnectionEvent(conn, events);
+            }
+        });
+    }
+    
+    if (registered && socket->hasTransport()) {
+        // 握手之后对端不再经控制套接字发送数据，它可读即表示对端已退出
+        registered = worker->loop.add(fd, EventLoop::kReadable, [this, weak](uint32_t) {
+            std::shared_ptr<Connection> conn = weak.lock();
+            if (conn) {
+                closeConnection(conn);
+            }
+        });
+        if (!registered) {
+            worker->loop.remove(socket->pollFd());
+        }
+    }
+    
+    if (!registered) {
+        socket->close();
+        return;
+    }
+    
+    worker->connections[fd] = conn;
+    connectionCount_++;
+    
+    conn->lastActivity = worker->loop.now();
+    armIdleTimer(conn);
+    
+    if (connectionHandler_) {
+        connectionHandler_(socket);
+    }
+}
+
+void Server::onConnectionEvent(const std::shared_ptr<Connection>& conn, uint32_t events) {
+    TCPSocket& socket = *conn->socket;
+    
+    if (events & EventLoop::kError) {
+        // 零拷贝完成通知也以错误事件报告，先取走它们再检查套接字错误
+        socket.reapZeroCopyCompletions();
+        
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(socket.fd(), SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error != 0) {
+            std::cerr << "连接出错: " << strerror(error) << std::endl;
+            closeConnection(conn);
+            return;
+        }
+    }
+    
+    if (conn->readPaused && (events & EventLoop::kHangup)) {
+        // 暂停期间不关注可读，挂断事件却会一直报告：对端已经离开，不必再等
+        closeConnection(conn);
+        return;
+    }
+    
+    if (conn->readPaused && (events & EventLoop::kReadable)) {
+        // 共享内存和数据报传输暂停时仍关注可读：对端腾出环空间或确认数据后，发送队列才能继续写出
+        socket.serviceTransport();
+    }
+    
+    if (!conn->readPaused && (events & (EventLoop::kReadable | EventLoop::kHangup))) {
+        conn->lastActivity = conn->worker->loop.now();
+        if (!dispatchPackets(conn, true)) {
+            return;
+        }
+    }
+    
+    flushConnection(conn);
+}
+
+void Server::onConnectionData(const std::shared_ptr<Connection>& conn, const uint8_t* data, ssize_t len) {
+    if (len <= 0) {
+        if (len < 0) {
+            std::cerr << "接收数据失败: " << strerror(static_cast<int>(-len)) << std::endl;
+        }
+        closeConnection(conn);
+        return;
+    }
+    
+    conn->lastActivity = conn->worker->loop.now();
+    conn->socket->quickAck();
+    
+    if (conn->readPaused) {
+        // 暂停之前已经收到的数据，恢复时再处理
+        conn->pendingInput.insert(conn->pendingInput.end(), data, data + len);
+        return;
+    }
+    
+    if (feedConnection(conn, data, static_cast<size_t>(len))) {
+        flushConnection(conn);
+    }
+}
+
+bool Server::feedConnection(const std::shared_ptr<Connection>& conn, const uint8_t* data, size_t len) {
+    // 一次完成可能带来多个请求，也可能多于接收缓冲区的剩余空间：
+    // 边送入边处理，直到数据全部被接受
+    size_t offset = 0;
+    while (!conn->closed) {
+        size_t used = conn->socket->feed(data + offset, len - offset);
+        offset += used;
+        
+        size_t buffered = conn->socket->bufferedBytes();
+        if (!dispatchPackets(conn, false)) {
+            return false;
+        }
+        
+        if (offset == len) {
+            return true;
+        }
+        if (conn->readPaused) {
+            conn->pendingInput.insert(conn->pendingInput.end(), data + offset, data + len);
+            return true;
+        }
+        if (used == 0 && conn->socket->bufferedBytes() == buffered) {
+            // 缓冲区已满却解析不出任何包
+            std::cerr << "接收缓冲区已满，无法解析请求，关闭连接" << std::endl;
+            closeConnection(conn);
+            return false;
+        }
+    }
+    return false;
+}
+
+bool Server::dispatchPackets(const std::shared_ptr<Connection>& conn, bool readSocket) {
+    TCPSocket& socket = *conn->socket;
+    
+    // 处理缓冲区中所有完整的请求，直到需要等待更多数据
+    while (!conn->closed) {
+        usbip_packet packet;
+        TCPSocket::ReadStatus status = readSocket ? socket.readPacket(packet) : socket.nextBufferedPacket(packet);
+        
+        if (status == TCPSocket::ReadStatus::NeedMore) {
+            // OUT负载在等待内存预算，停在头部之后
+            if (socket.payloadBlocked()) {
+                pauseReading(conn);
+            }
+            return true;
+        }
+        if (status != TCPSocket::ReadStatus::Packet) {
+            closeConnection(conn);
+            return false;
+        }
+        
+        // 处理函数可能移走负载，先记下URB的标识；分段接收的URB只在头部计时
+        bool urb = packet.header.command == USBIP_CMD_SUBMIT && (!packet.segmented || packet.data.empty());
+        uint32_t devid = urb ? packet.cmd_submit_data.devid : 0;
+        uint32_t seqnum = urb ? packet.cmd_submit_data.seqnum : 0;
+        
+        if (packetHandler_ && !packetHandler_(conn->socket, packet)) {
+            std::cerr << "处理请求失败，关闭连接" << std::endl;
+            closeConnection(conn);
+            return false;
+        }
+        
+        // 能力交换中刚同意了心跳时开始按心跳时限计时
+        if (conn->idleTimer == 0 && idleLimitMs(*conn) > 0) {
+            armIdleTimer(conn);
+        }
+        
+        if (urb && urbTimeoutMs_ > 0 && urbTimeoutHandler_) {
+            // 不随URB完成而取消：到期时由处理函数判断URB是否还在进行
+            std::weak_ptr<Connection> weak = conn;
+            conn->worker->loop.runAfter(std::chrono::milliseconds(urbTimeoutMs_), [this, weak, devid, seqnum] {
+                std::shared_ptr<Connection> conn = weak.lock();
+                if (conn && !conn->closed) {
+                    // 回调中放入的回复同样在循环线程中，需要自行冲刷
+                    urbTimeoutHandler_(conn->socket, devid, seqnum);
+                    flushConnection(conn);
+                }
+            });
+        }
+        
+        // 已接收的请求照常处理完，之后不再读取，未处理的数据留在接收缓冲区和内核中
+        if (overBudget(*conn)) {
+            pauseReading(conn);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Server::overBudget(Connection& conn) {
+    TCPSocket& socket = *conn.socket;
+    if (socket.memoryBudget() && socket.memoryBudget()->exhausted()) {
+        return true;
+    }
+    // 共享内存环满或数据报未确认的数据过多时回复同样留在发送队列中，对所有传输都限制队列长度
+    return connectionBudget_ > 0 && socket.queuedBytes() >= connectionBudget_;
+}
+
+void Server::pauseReading(const std::shared_ptr<Connection>& conn) {
+    if (!conn->readPaused) {
+        conn->readPaused = true;
+        // 就绪通知的关注事件在随后的冲刷中更新
+        if (conn->completionIo) {
+            conn->worker->loop.pauseReceive(conn->socket->fd());
+        }
+    }
+    
+    // 发送队列积压时由冲刷写完后恢复；预算耗尽时等待其他线程（USB完成回调）释放内存
+    // 负载停在头部之后时预算可能已经回落，同样登记：等待者会被立即唤醒并恢复读取
+    const std::shared_ptr<MemoryBudget>& budget = conn->socket->memoryBudget();
+    if (conn->budgetWait || !budget || (!budget->exhausted() && !conn->socket->payloadBlocked())) {
+        return;
+    }
+    conn->budgetWait = true;
+    std::weak_ptr<Connection> weak = conn;
+    Worker* worker = conn->worker;
+    budget->wait([this, weak, worker] {
+        worker->loop.post([this, weak] {
+            std::shared_ptr<Connection> conn = weak.lock();
+            if (conn) {
+                conn->budgetWait = false;
+                resumeReading(conn);
+            }
+        });
+    });
+}
+
+void Server::resumeReading(const std::shared_ptr<Connection>& conn) {
+    if (conn->closed || !conn->readPaused) {
+        return;
+    }
+    if (overBudget(*conn)) {
+        pauseReading(conn);
+        return;
+    }
+    conn->readPaused = false;
+    
+    if (conn->completionIo) {
+        // 先处理暂停时留下的请求和数据，仍未再次暂停时才继续接收
+        std::vector<uint8_t> pending;
+        pending.swap(conn->pendingInput);
+        if (!dispatchPackets(conn, false)) {
+            return;
+        }
+        if (conn->readPaused) {
+            conn->pendingInput.swap(pending);
+        } else if (!pending.empty() && !feedConnection(conn, pending.data(), pending.size())) {
+            return;
+        }
+        if (!conn->readPaused) {
+            conn->worker->loop.resumeReceive(conn->socket->fd());
+        }
+    } else if (!dispatchPackets(conn, true)) {
+        // 用户态TLS等已读入的数据不会再触发可读事件，先处理一次
+        return;
+    }
+    
+    flushConnection(conn);
+}
+
+void Server::runAfter(std::chrono::milliseconds delay, std::function<void()> task) {
+    for (auto& worker : workers_) {
+        if (worker->loop.inLoopThread()) {
+            worker->loop.runAfter(delay, std::move(task));
+            return;
+        }
+    }
+    if (workers_.empty()) {
+        return;
+    }
+    
+    Worker* worker = workers_.front().get();
+    worker->loop.post([worker, delay, task] {
+        worker->loop.runAfter(delay, task);
+    });
+}
+
+int Server::idleLimitMs(const Connection& conn) const {
+    int limit = idleTimeoutMs_;
+    int heartbeat = conn.socket->heartbeatWindow();
+    if (heartbeat > 0 && (limit <= 0 || heartbeat < limit)) {
+        limit = heartbeat;
+    }
+    return limit;
+}
+
+void Server::armIdleTimer(const std::shared_ptr<Connection>& conn) {
+    int limit = idleLimitMs(*conn);
+    if (limit <= 0) {
+        return;
+    }
+    
+    std::weak_ptr<Connection> weak = conn;
+    conn->idleTimer = conn->worker->loop.runAt(conn->lastActivity + std::chrono::milliseconds(limit), [this, weak] {
+        std::shared_ptr<Connection> conn = weak.lock();
+        if (conn) {
+            conn->idleTimer = 0;
+            onIdleTimer(conn);
+        }
+    });
+}
+
+void Server::onIdleTimer(const std::shared_ptr<Connection>& conn) {
+    if (conn->closed) {
+        return;
+    }
+    
+    // 暂停读取期间对端的数据（包括心跳）留在内核中，不算空闲
+    int limit = idleLimitMs(*conn);
+    if (conn->readPaused) {
+        conn->lastActivity = conn->worker->loop.now();
+    }
+    auto idle = conn->worker->loop.now() - conn->lastActivity;
+    if (idle < std::chrono::milliseconds(limit)) {
+        armIdleTimer(conn);
+        return;
+    }
+    
+    if (conn->socket->heartbeatWindow() == limit) {
+        std::cerr << "超过 " << limit << " 毫秒没有收到心跳，对端已失联，关闭连接" << std::endl;
+    } else {
+        std::cerr << "连接超过 " << limit << " 毫秒没有收到数据，关闭连接" << std::endl;
+    }
+    closeConnection(conn);
+}
+
+void Server::flushConnection(const std::shared_ptr<Connection>& conn) {
+    if (conn->closed) {
+        return;
+    }
+    
+    if (conn->completionIo) {
+        sendConnection(conn);
+        return;
+    }
+    
+    int fd = conn->socket->pollFd();
+    // 共享内存和数据报传输的门铃和确认都经可读事件到达，暂停读取时也要关注
+    uint32_t readable = conn->readPaused && !conn->socket->hasTransport() ? 0u : static_cast<uint32_t>(EventLoop::kReadable);
+    switch (conn->socket->flushSome()) {
+        case OutputQueue::FlushResult::Done:
+            conn->worker->loop.modify(fd, readable);
+            if (conn->readPaused) {
+                resumeReading(conn);
+            }
+            break;
+        case OutputQueue::FlushResult::Pending:
+            // 套接字发送缓冲区已满，等待可写事件继续；共享内存传输的门铃总是可写，
+            // 对端腾出空间时会敲门铃（可读）；数据报传输在收到确认时可读
+            conn->worker->loop.modify(fd, conn->socket->hasTransport() ? readable : readable | EventLoop::kWritable);
+            break;
+        default:
+            std::cerr << "发送回复失败，关闭连接" << std::endl;
+            closeConnection(conn);
+            break;
+    }
+}
+
+void Server::sendConnection(const std::shared_ptr<Connection>& conn) {
+    if (conn->sendInFlight) {
+        return;
+    }
+    
+    // 队列中的帧在出队之前保持不变，iovec直接引用它们
+    struct iovec iov[64];
+    int iovcnt = conn->socket->prepareSend(iov, 64);
+    if (iovcnt == 0) {
+        return;
+    }
+    
+    conn->sendInFlight = true;
+    std::shared_ptr<Connection> self = conn;
+    bool submitted = conn->worker->loop.sendAsync(conn->socket->fd(), iov, iovcnt, [this, self](ssize_t result) {
+        self->sendInFlight = false;
+        if (self->closed) {
+            return;
+        }
+        if (result < 0) {
+            std::cerr << "发送回复失败: " << strerror(static_cast<int>(-result)) << "，关闭连接" << std::endl;
+            closeConnection(self);
+            return;
+        }
+        
+        // 可能只写出一部分，剩余部分和期间新放入的回复继续发送
+        self->socket->completeSend(static_cast<size_t>(result));
+        sendConnection(self);
+        if (self->readPaused) {
+            resumeReading(self);
+        }
+    });
+    
+    if (!submitted) {
+        conn->sendInFlight = false;
+        std::cerr << "提交发送请求失败，关闭连接" << std::endl;
+        closeConnection(conn);
+    }
+}
+
+void Server::closeConnection(const std::shared_ptr<Connection>& conn) {
+    if (conn->closed) {
+        return;
+    }
+    conn->closed = true;
+    
+    if (conn->idleTimer != 0) {
+        conn->worker->loop.cancelTimer(conn->idleTimer);
+        conn->idleTimer = 0;
+    }
+    
+    // 先从循环中注销，再关闭文件描述符，避免描述符被复用后误注销
+    int fd = conn->socket->fd();
+    if (conn->completionIo) {
+        conn->worker->loop.cancelAsync(fd);
+    } else {
+        conn->worker->loop.remove(conn->socket->pollFd());
+        if (conn->socket->hasTransport()) {
+            conn->worker->loop.remove(fd);
+        }
+    }
+    conn->worker->connections.erase(fd);
+    connectionCount_--;
+    
+    if (closeHandler_) {
+        closeHandler_(conn->socket);
+    }
+    
+    if (conn->completionIo) {
+        // 已准备的请求还未提交，关闭也交给io_uring按顺序执行；
+        // 先shutdown使进行中的发送尽快结束
+        ::shutdown(fd, SHUT_RDWR);
+        conn->worker->loop.closeAsync(conn->socket->release());
+    }
+    conn->socket->close();
+    std::cout << "客户端连接已关闭" << std::endl;
+}
+
+// Client实现
+Client::Client() 
+    : socket_(std::make_shared<TCPSocket>()), port_(0), datagram_(false), fastOpen_(false), busyPollUs_(0), nextStream_(0), codecId_(0), integrity_(false),
+      streamSession_(), streamTarget_(0), bufferBytes_(0), batchLimit_(0), heartbeatMs_(0), heartbeatStop_(false) {
+}
+
+Client::~Client() {
+    disconnect();
+}
+
+bool Client::connect(const std::string& host, int port) {
+    // 含冒号的地址按IPv6连接
+    if (!socket_->create(host.find(':') != std::string::npos ? AF_INET6 : AF_INET)) {
+        return false;
+    }
+    
+    // 设置5秒超时
+    socket_->setTimeout(5);
+    
+    // 不支持时按普通连接继续
+    if (fastOpen_) {
+        socket_->setFastOpenConnect();
+    }
+    
+    if (!socket_->connect(host, port)) {
+        return false;
+    }
+    if (tls_ && !socket_->startTls(tls_, host)) {
+        socket_->close();
+        return false;
+    }
+    if (busyPollUs_ > 0) {
+        socket_->setBusyPoll(busyPollUs_);
+    }
+    host_ = host;
+    port_ = port;
+    
+    std::cout << "已连接到服务器: " << host << ":" << port << std::endl;
+    return true;
+}
+
+bool Client::connectLocal(const std::string& path) {
+    if (!socket_->create(AF_UNIX)) {
+        return false;
+    }
+    
+    // 设置5秒超时，握手和之后的共享内存等待都受它限制
+    socket_->setTimeout(5);
+    
+    if (!socket_->connectLocal(path) || !socket_->acceptSharedMemory()) {
+        socket_->close();
+        return false;
+    }
+    if (busyPollUs_ > 0) {
+        socket_->setBusyPoll(busyPollUs_);
+    }
+    localPath_ = path;
+    
+    std::cout << "已通过共享内存连接到本机服务端: " << path << std::endl;
+    return true;
+}
+
+bool Client::connectDatagram(const std::string& host, int port) {
+    if (tls_) {
+        std::cerr << "数据报传输不支持TLS" << std::endl;
+        return false;
+    }
+    if (!connect(host, port)) {
+        return false;
+    }
+    
+    if (!socket_->acceptDatagram()) {
+        socket_->close();
+        return false;
+    }
+    datagram_ = true;
+    
+    std::cout << "已切换到数据报传输" << std::endl;
+    return true;
+}
+
+void Client::disconnect() {
+    stopHeartbeat();
+    
+    if (socket_) {
+        socket_->close();
+    }
+    for (auto& stream : streams_) {
+        stream->close();
+    }
+    streams_.clear();
+    resumables_.clear();
+    unacked_.clear();
+    window_.reset();
+    held_.clear();
+    bufferBytes_ = 0;
+    
+    std::cout << "已断开连接" << std::endl;
+}
+
+bool Client::sendPacket(const usbip_packet& packet) {
+    if (packet.header.command != USBIP_CMD_SUBMIT) {
+        return route(packet).sendPacket(packet);
+    }
+    
+    // 已有暂存的URB时排在其后，保持提交顺序
+    if (!held_.empty() || !window_.canSend()) {
+        held_.push_back(packet);
+        return true;
+    }
+    return submit(packet);
+}
+
+bool Client::submit(const usbip_packet& packet) {
+    // 可恢复的会话中保留URB，连接中断后重新提交
+    if (!resumables_.empty()) {
+        unacked_[packet.cmd_submit_data.seqnum] = packet;
+    }
+    window_.onSend(packet.cmd_submit_data.seqnum, packet.data.size(), std::chrono::steady_clock::now());
+    return route(packet).sendPacket(packet);
+}
+
+void Client::releaseHeld() {
+    while (!held_.empty() && window_.canSend()) {
+        usbip_packet packet = std::move(held_.front());
+        held_.pop_front();
+        if (!submit(packet)) {
+            std::cerr << "发送暂存的URB失败: 序列号=" << packet.cmd_submit_data.seqnum << std::endl;
+            return;
+        }
+    }
+}
+
+// 套接字缓冲区按带宽时延积的两倍设置。设置之后内核不再自动调节，
+// 因此只在超过内核自动调节通常能达到的大小之后才设置，并且只增不减
+static const size_t kMinSocketBuffer = 4 * 1024 * 1024;
+static const size_t kMaxSocketBuffer = 64 * 1024 * 1024;
+
+void Client::adaptBuffers() {
+    UrbWindow::Stats stats = window_.stats();
+    size_t target = std::min(stats.bdpBytes * 2, kMaxSocketBuffer);
+    if (target < std::max(kMinSocketBuffer, bufferBytes_ + bufferBytes_ / 4)) {
+        return;
+    }
+    
+    bufferBytes_ = target;
+    socket_->setBufferSize(target);
+    for (auto& stream : streams_) {
+        stream->setBufferSize(target);
+    }
+    std::cout << "带宽时延积约 " << stats.bdpBytes / 1024 << " KB，套接字缓冲区调整为 " << target / 1024 << " KB" << std::endl;
+}
+
+bool Client::sendPackets(std::vector<usbip_packet>& packets) {
+    // 经发送队列合并为一次写出，使用TCP Fast Open时随SYN发送
+    for (auto& packet : packets) {
+        if (!socket_->queuePacket(std::move(packet))) {
+            return false;
+        }
+    }
+    return socket_->flush();
+}
+
+TCPSocket& Client::route(const usbip_packet& packet) {
+    if (streams_.empty() || packet.header.command != USBIP_CMD_SUBMIT || packet.cmd_submit_data.ep == 0) {
+        return *socket_;
+    }
+    return *streams_[packet.cmd_submit_data.seqnum % streams_.size()];
+}
+
+bool Client::receivePacket(usbip_packet& packet) {
+    while (socket_->receivePacket(packet)) {
+        if (acknowledge(*socket_, packet)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Client::receivePacketWithTimeout(usbip_packet& packet, int timeoutSec) {
+    while (TCPSocket* socket = receiveAny(packet, timeoutSec)) {
+        if (acknowledge(*socket, packet)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Client::acknowledge(const TCPSocket& socket, const usbip_packet& packet) {
+    // 握手阶段的0x0003是导入响应
+    if (packet.header.command != USBIP_RET_SUBMIT || socket.phase() != FrameDecoder::Phase::Urb) {
+        return true;
+    }
+    
+    const ret_submit& ret = packet.ret_submit_data;
+    size_t bytes = ret.direction == USBIP_DIR_IN ? ret.actual_length : 0;
+    if (window_.onReply(ret.seqnum, bytes, std::chrono::steady_clock::now())) {
+        adaptBuffers();
+        releaseHeld();
+    }
+    
+    if (resumables_.empty()) {
+        return true;
+    }
+    if (unacked_.erase(ret.seqnum) == 0) {
+        std::cout << "丢弃重复的URB回复: 序列号=" << packet.ret_submit_data.seqnum << std::endl;
+        return false;
+    }
+    return true;
+}
+
+TCPSocket* Client::receiveAny(usbip_packet& packet, int timeoutSec) {
+    if (streams_.empty()) {
+        return socket_->receivePacketWithTimeout(packet, timeoutSec) ? socket_.get() : nullptr;
+    }
+    
+    // 控制连接和各数据连接，从上次之后的一条开始轮流
+    std::vector<TCPSocket*> sockets;
+    sockets.push_back(socket_.get());
+    for (auto& stream : streams_) {
+        sockets.push_back(stream.get());
+    }
+    const size_t count = sockets.size();
+    
+    // 已缓冲的数据不会再触发可读，先处理
+    for (size_t i = 0; i < count; i++) {
+        size_t index = (nextStream_ + i) % count;
+        if (sockets[index]->bufferedBytes() > 0) {
+            nextStream_ = index + 1;
+            return sockets[index]->receivePacketWithTimeout(packet, timeoutSec) ? sockets[index] : nullptr;
+        }
+    }
+    
+    std::vector<struct pollfd> fds(count);
+    for (size_t i = 0; i < count; i++) {
+        fds[i].fd = sockets[i]->fd();
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    
+    int ready = pollSpin(fds.data(), fds.size(), timeoutSec * 1000, std::chrono::microseconds(busyPollUs_));
+    if (ready <= 0) {
+        return nullptr;
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        size_t index = (nextStream_ + i) % count;
+        if (fds[index].revents != 0) {
+            nextStream_ = index + 1;
+            return sockets[index]->receivePacketWithTimeout(packet, timeoutSec) ? sockets[index] : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+bool Client::enableCompression(uint8_t codecId, const PayloadCompressor::Policy& policy) {
+    if (!socket_->enableCompression(codecId, policy)) {
+        return false;
+    }
+    codecId_ = codecId;
+    policy_ = policy;
+    for (auto& stream : streams_) {
+        stream->enableCompression(codecId, policy);
+    }
+    return true;
+}
+
+void Client::enableIntegrity() {
+    integrity_ = true;
+    socket_->enableIntegrity();
+    for (auto& stream : streams_) {
+        stream->enableIntegrity();
+    }
+}
+
+bool Client::exchangeCaps(size_t maxBatch, int heartbeatMs) {
+    batchLimit_ = maxBatch;
+    heartbeatMs_ = heartbeatMs;
+    return negotiate(socket_);
+}
+
+usbip_packet Client::capsRequest(size_t maxBatch, int heartbeatMs) {
+    batchLimit_ = maxBatch;
+    heartbeatMs_ = heartbeatMs;
+    return makeCapsRequest();
+}
+
+bool Client::acceptCaps(const usbip_packet& reply) {
+    return applyCaps(socket_, reply);
+}
+
+usbip_packet Client::makeCapsRequest() const {
+    usbip_packet request;
+    request.header.version = USBIP_VERSION;
+    request.header.command = USBIP_OP_REQ_CAPS;
+    request.header.status = 0;
+    request.caps.version = USBIP_VERSION;
+    request.caps.caps = (batchLimit_ > 0 ? USBIP_CAP_BATCH : 0) | (heartbeatMs_ > 0 ? USBIP_CAP_HEARTBEAT : 0);
+    request.caps.maxBatch = static_cast<uint32_t>(batchLimit_);
+    request.caps.heartbeatMs = static_cast<uint32_t>(std::max(heartbeatMs_, 0));
+    return request;
+}
+
+bool Client::negotiate(const std::shared_ptr<TCPSocket>& socket) {
+    usbip_packet reply;
+    if (!socket->sendPacket(makeCapsRequest()) || !socket->receivePacket(reply)) {
+        std::cerr << "能力交换失败" << std::endl;
+        return false;
+    }
+    return applyCaps(socket, reply);
+}
+
+bool Client::applyCaps(const std::shared_ptr<TCPSocket>& socket, const usbip_packet& reply) {
+    if (reply.header.command != USBIP_OP_REP_CAPS || reply.header.status != 0) {
+        std::cerr << "能力交换收到错误的响应: 命令=0x" << std::hex << reply.header.command
+                  << ", 状态=" << reply.header.status << std::dec << std::endl;
+        return false;
+    }
+    
+    // 服务端不同意时按标准帧格式继续
+    size_t maxBatch = std::min<size_t>(batchLimit_, reply.caps.maxBatch);
+    if ((reply.caps.caps & USBIP_CAP_BATCH) && maxBatch > 1) {
+        socket->enableBatching(maxBatch);
+        std::cout << "已开启批量帧，每帧至多 " << maxBatch << " 个URB" << std::endl;
+    } else if (batchLimit_ > 0) {
+        std::cout << "服务端未同意批量帧，按标准帧格式传输" << std::endl;
+    }
+    
+    // 心跳时限以服务端的回复为准
+    int window = static_cast<int>(reply.caps.heartbeatMs);
+    if ((reply.caps.caps & USBIP_CAP_HEARTBEAT) && window > 0) {
+        socket->setDeadPeerTimeout(window);
+        socket->enableHeartbeat(window);
+        
+        std::lock_guard<std::mutex> lock(heartbeatMutex_);
+        heartbeatSockets_.push_back(socket);
+        if (!heartbeatThread_.joinable()) {
+            heartbeatStop_ = false;
+            // 每个时限内发送四次，丢失或推迟一两次心跳不会被判为失联
+            heartbeatThread_ = std::thread(&Client::heartbeatLoop, this, std::max(window / 4, 1));
+            std::cout << "已开启心跳，服务端失联时限 " << window << " 毫秒" << std::endl;
+        }
+    } else if (heartbeatMs_ > 0) {
+        std::cout << "服务端未同意心跳" << std::endl;
+    }
+    return true;
+}
+
+void Client::heartbeatLoop(int intervalMs) {
+    std::unique_lock<std::mutex> lock(heartbeatMutex_);
+    while (!heartbeatCv_.wait_for(lock, std::chrono::milliseconds(intervalMs), [this] { return heartbeatStop_; })) {
+        // 发送时不持有锁：阻塞的发送不妨碍停止和加入新连接
+        std::vector<std::shared_ptr<TCPSocket>> sockets = heartbeatSockets_;
+        lock.unlock();
+        for (auto& socket : sockets) {
+            socket->sendHeartbeat();
+        }
+        lock.lock();
+    }
+}
+
+void Client::stopHeartbeat() {
+    {
+        std::lock_guard<std::mutex> lock(heartbeatMutex_);
+        heartbeatStop_ = true;
+        heartbeatSockets_.clear();
+    }
+    heartbeatCv_.notify_all();
+    if (heartbeatThread_.joinable()) {
+        heartbeatThread_.join();
+    }
+}
+
+bool Client::resume() {
+    // 旧连接上的心跳随之停止，新连接在能力交换中重新加入
+    {
+        std::lock_guard<std::mutex> lock(heartbeatMutex_);
+        heartbeatSockets_.clear();
+    }
+    socket_->close();
+    for (auto& stream : streams_) {
+        stream->close();
+    }
+    streams_.clear();
+    
+    socket_ = std::make_shared<TCPSocket>();
+    bool connected = !localPath_.empty() ? connectLocal(localPath_) :
+                     datagram_ ? connectDatagram(host_, port_) : connect(host_, port_);
+    if (!connected || ((batchLimit_ > 0 || heartbeatMs_ > 0) && !negotiate(socket_))) {
+        socket_->close();
+        return false;
+    }
+    if (bufferBytes_ > 0) {
+        socket_->setBufferSize(bufferBytes_);
+    }
+    
+    for (const auto& entry : resumables_) {
+        usbip_packet request;
+        request.header.version = USBIP_VERSION;
+        request.header.command = USBIP_OP_REQ_IMPORT;
+        request.header.status = 0;
+        request.header.flags = USBIP_FLAG_RESUME;
+        request.import_req.version = USBIP_VERSION;
+        memset(request.import_req.busid, 0, sizeof(request.import_req.busid));
+        strncpy(request.import_req.busid, entry.first.c_str(), sizeof(request.import_req.busid) - 1);
+        request.data.assign(entry.second.begin(), entry.second.end());
+        
+        usbip_packet reply;
+        if (!socket_->sendPacket(request) || !socket_->receivePacket(reply) ||
+            reply.header.command != USBIP_OP_REP_IMPORT || reply.import_rep.status != 0) {
+            std::cerr << "恢复会话 " << usbip_wire::loadBE32(entry.second.data()) << " 失败" << std::endl;
+            socket_->close();
+            return false;
+        }
+    }
+    
+    // 服务端按会话恢复了原来的编码和校验设置
+    if (codecId_ != 0) {
+        socket_->enableCompression(codecId_, policy_);
+    }
+    if (integrity_) {
+        socket_->enableIntegrity();
+    }
+    if (streamTarget_ > 0 && !openStreams(streamTarget_, streamSession_, streamBusid_)) {
+        std::cerr << "部分数据连接未能重新打开，以 " << streams_.size() << " 条继续" << std::endl;
+    }
+    
+    // 断开前发出的URB可能已完成、仍在进行或根本没有送达，一律带标志重新提交，由服务端区分
+    size_t resubmitted = 0;
+    for (const auto& entry : unacked_) {
+        usbip_packet packet = entry.second;
+        packet.header.flags |= USBIP_FLAG_RESUBMIT;
+        window_.onSend(entry.first, packet.data.size(), std::chrono::steady_clock::now());
+        if (!route(packet).sendPacket(packet)) {
+            return false;
+        }
+        resubmitted++;
+    }
+    releaseHeld();
+    
+    std::cout << "已恢复 " << resumables_.size() << " 个会话，重新提交 " << resubmitted << " 个未完成的URB" << std::endl;
+    return true;
+}
+
+bool Client::openStreams(size_t count, const usbip_wire::SessionToken& session, const std::string& busid) {
+    streamSession_ = session;
+    streamBusid_ = busid;
+    streamTarget_ = count;
+    for (size_t i = 0; i < count; i++) {
+        auto stream = std::make_shared<TCPSocket>();
+        if (!stream->create(socket_->family()) || !stream->setTimeout(5) ||
+            (fastOpen_ && !stream->setFastOpenConnect()) || !stream->connect(host_, port_) ||
+            (tls_ && !stream->startTls(tls_, host_))) {
+            std::cerr << "打开数据连接失败，已打开 " << streams_.size() << " 条" << std::endl;
+            return false;
+        }
+        
+        if (bufferBytes_ > 0) {
+            stream->setBufferSize(bufferBytes_);
+        }
+        if (busyPollUs_ > 0) {
+            stream->setBusyPoll(busyPollUs_);
+        }
+        
+        // 数据连接同样在加入会话之前交换能力
+        if ((batchLimit_ > 0 || heartbeatMs_ > 0) && !negotiate(stream)) {
+            stream->close();
+            return false;
+        }
+        
+        // 以会话号加入导入时建立的会话
+        usbip_packet request;
+        request.header.version = USBIP_VERSION;
+        request.header.command = USBIP_OP_REQ_IMPORT;
+        request.header.status = 0;
+        request.header.flags = USBIP_FLAG_STREAM_ATTACH;
+        request.import_req.version = USBIP_VERSION;
+        memset(request.import_req.busid, 0, sizeof(request.import_req.busid));
+        strncpy(request.import_req.busid, busid.c_str(), sizeof(request.import_req.busid) - 1);
+        request.data.assign(session.begin(), session.end());
+        
+        usbip_packet reply;
+        if (!stream->sendPacket(request) || !stream->receivePacket(reply)) {
+            std::cerr << "数据连接加入会话失败" << std::endl;
+            stream->close();
+            return false;
+        }
+        if (reply.header.command != USBIP_OP_REP_IMPORT || reply.import_rep.status != 0) {
+            std::cerr << "服务端拒绝数据连接，状态=" << static_cast<int>(reply.import_rep.status) << std::endl;
+            stream->close();
+            return false;
+        }
+        
+        if (codecId_ != 0) {
+            stream->enableCompression(codecId_, policy_);
+        }
+        if (integrity_) {
+            stream->enableIntegrity();
+        }
+        streams_.push_back(std::move(stream));
+    }
+    
+    std::cout << "已打开 " << streams_.size() << " 条数据连接" << std::endl;
+    return true;
 } 
\ No newline at end of file
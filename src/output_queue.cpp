@@ -0,0 +1,357 @@
+#include "../include/output_queue.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+// 单次writev聚合的最大段数（每帧最多三段）
+static const int kMaxFlushIov = 64;
+
+// 缓冲池最多保留的缓冲区数量
+static const size_t kMaxPooledBuffers = 16;
+
+// 公平轮转中每个流每轮获得的发送额度
+static const size_t kFairQuantum = 64 * 1024;
+
+OutputQueue::OutputQueue()
+    : frontOffset_(0), bytes_(0), stagedFrames_(0), stagedBytes_(0), nextFlow_(0),
+      zeroCopyThreshold_(0), zcNextId_(0) {
+}
+
+void OutputQueue::push(OutputFrame&& frame) {
+    if (empty()) {
+        oldest_ = Clock::now();
+    }
+    
+    size_t size = frame.size();
+    bytes_ += size;
+    
+    // 没有积压时直接排入发送顺序
+    if (policy_.fairWindow == 0 || (stagedFrames_ == 0 && bytes_ - size < policy_.fairWindow)) {
+        frames_.push_back(std::move(frame));
+        return;
+    }
+    
+    stagedFrames_++;
+    stagedBytes_ += size;
+    staged_[frame.flow].frames.push_back(std::move(frame));
+    schedule();
+}
+
+void OutputQueue::schedule() {
+    while (stagedFrames_ > 0 && bytes_ - stagedBytes_ < policy_.fairWindow) {
+        auto it = staged_.lower_bound(nextFlow_);
+        if (it == staged_.end()) {
+            it = staged_.begin();
+        }
+        
+        // 每轮给当前流一份额度，额度够的帧依次排入；大帧跨多轮积攒额度
+        Flow& flow = it->second;
+        flow.deficit += kFairQuantum;
+        while (!flow.frames.empty() && flow.frames.front().size() <= flow.deficit) {
+            OutputFrame& frame = flow.frames.front();
+            flow.deficit -= frame.size();
+            stagedFrames_--;
+            stagedBytes_ -= frame.size();
+            frames_.push_back(std::move(frame));
+            flow.frames.pop_front();
+        }
+        
+        nextFlow_ = it->first + 1;
+        if (flow.frames.empty()) {
+            staged_.erase(it);
+        }
+    }
+}
+
+bool OutputQueue::shouldFlush(Clock::time_point now) const {
+    if (empty()) {
+        return false;
+    }
+
+    return frames() >= policy_.maxFrames ||
+           bytes_ >= policy_.maxBytes ||
+           now - oldest_ >= policy_.deadline;
+}
+
+bool OutputQueue::frontIsZeroCopyPayload() const {
+    if (zeroCopyThreshold_ == 0 || frames_.empty()) {
+        return false;
+    }
+
+    const OutputFrame& frame = frames_.front();
+    return frontOffset_ >= frame.headLen && frontOffset_ < frame.headLen + frame.payloadSize() &&
+           frame.payloadSize() >= zeroCopyThreshold_;
+}
+
+int OutputQueue::gather(struct iovec* iov, int maxIov) {
+    int count = 0;
+    size_t skip = frontOffset_;
+
+    for (auto& frame : frames_) {
+        if (count + 3 > maxIov) {
+            break;
+        }
+
+        // 首帧可能已部分写出
+        if (skip < frame.headLen) {
+            iov[count].iov_base = frame.head + skip;
+            iov[count].iov_len = frame.headLen - skip;
+            count++;
+            skip = 0;
+        } else {
+            skip -= frame.headLen;
+        }
+
+        if (skip < frame.payloadSize()) {
+            // 大负载单独走零拷贝发送，普通writev在它之前截止
+            if (zeroCopyThreshold_ > 0 && frame.payloadSize() >= zeroCopyThreshold_) {
+                break;
+            }
+            iov[count].iov_base = const_cast<uint8_t*>(frame.payloadData()) + skip;
+            iov[count].iov_len = frame.payloadSize() - skip;
+            count++;
+            skip = 0;
+        } else {
+            skip -= frame.payloadSize();
+        }
+
+        if (skip < frame.trailerLen) {
+            iov[count].iov_base = frame.trailer + skip;
+            iov[count].iov_len = frame.trailerLen - skip;
+            count++;
+        }
+        skip = 0;
+    }
+
+    return count;
+}
+
+OutputQueue::FlushResult OutputQueue::sendZeroCopy(int fd) {
+#ifdef MSG_ZEROCOPY
+    OutputFrame& frame = frames_.front();
+    size_t offset = frontOffset_ - frame.headLen;
+
+    struct iovec iov;
+    iov.iov_base = const_cast<uint8_t*>(frame.payloadData()) + offset;
+    iov.iov_len = frame.payloadSize() - offset;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    while (true) {
+        ssize_t sent = ::sendmsg(fd, &msg, MSG_ZEROCOPY);
+        if (sent < 0) {
+            if (errno == EINTR) continue; // 被信号中断，重试
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return FlushResult::Pending;
+            }
+            if (errno == ENOBUFS) {
+                // 锁定页数超过optmem限制，本次改为普通发送
+                zcStats_.fallbacks++;
+                sent = ::sendmsg(fd, &msg, 0);
+                if (sent < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return FlushResult::Pending;
+                    }
+                    std::cerr << "发送数据失败: " << strerror(errno) << std::endl;
+                    return FlushResult::Error;
+                }
+                consume(static_cast<size_t>(sent));
+                return FlushResult::Done;
+            }
+            std::cerr << "零拷贝发送失败: " << strerror(errno) << std::endl;
+            return FlushResult::Error;
+        }
+
+        // 每次成功的零拷贝发送占用一个通知序号，负载在通知到达前不能释放或复用
+        uint32_t id = zcNextId_++;
+        if (!frame.zeroCopy) {
+            frame.zeroCopy = true;
+            frame.zcFirst = id;
+        }
+        frame.zcLast = id;
+        zcStats_.sends++;
+
+        consume(static_cast<size_t>(sent));
+        return FlushResult::Done;
+    }
+#else
+    (void)fd;
+    zeroCopyThreshold_ = 0;
+    return FlushResult::Done;
+#endif
+}
+
+void OutputQueue::consume(size_t n) {
+    bytes_ -= n;
+    n += frontOffset_;
+
+    bool popped = false;
+    while (!frames_.empty()) {
+        size_t frameSize = frames_.front().size();
+        if (n < frameSize) {
+            break;
+        }
+        n -= frameSize;
+        retire(frames_.front());
+        frames_.pop_front();
+        popped = true;
+    }
+
+    frontOffset_ = n;
+    if (popped) {
+        schedule();
+        if (!empty()) {
+            // 剩余帧从现在开始计算等待时间
+            oldest_ = Clock::now();
+        }
+    }
+}
+
+void OutputQueue::retire(OutputFrame& frame) {
+    uint32_t outstanding = frame.zeroCopy ? frame.zcLast - frame.zcFirst + 1 - frame.zcCompleted : 0;
+    if (outstanding > 0) {
+        PendingBuffer pending;
+        pending.first = frame.zcFirst;
+        pending.last = frame.zcLast;
+        pending.outstanding = outstanding;
+        pending.buffer = std::move(frame.payload);
+        pending.shared = std::move(frame.shared);
+        zcPending_.push_back(std::move(pending));
+    } else {
+        recycle(std::move(frame.payload));
+    }
+}
+
+void OutputQueue::recycle(std::vector<uint8_t>&& buffer) {
+    if (buffer.capacity() > 0 && pool_.size() < kMaxPooledBuffers) {
+        buffer.clear();
+        pool_.push_back(std::move(buffer));
+    }
+}
+
+std::vector<uint8_t> OutputQueue::acquireBuffer(size_t size) {
+    std::vector<uint8_t> buffer;
+    if (!pool_.empty()) {
+        buffer = std::move(pool_.back());
+        pool_.pop_back();
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+void OutputQueue::reapCompletions(int fd) {
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    while (hasPendingCompletions()) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            // EAGAIN：暂时没有新的通知
+            return;
+        }
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            bool isRecvErr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                             (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!isRecvErr) {
+                continue;
+            }
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                continue;
+            }
+
+            // 通知携带一个闭区间[ee_info, ee_data]内的发送序号
+            uint32_t lo = err.ee_info;
+            uint32_t hi = err.ee_data;
+            uint32_t count = hi - lo + 1;
+            zcStats_.completed += count;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zcStats_.copied += count;
+            }
+
+            // 以lo为原点计算两个序号区间的重叠，允许序号回绕
+            auto overlap = [lo, hi](uint32_t first, uint32_t last) -> uint32_t {
+                int32_t span = static_cast<int32_t>(hi - lo);
+                int32_t start = std::max<int32_t>(static_cast<int32_t>(first - lo), 0);
+                int32_t end = std::min<int32_t>(static_cast<int32_t>(last - lo), span);
+                return end >= start ? static_cast<uint32_t>(end - start + 1) : 0;
+            };
+            
+            for (auto& pending : zcPending_) {
+                uint32_t done = overlap(pending.first, pending.last);
+                pending.outstanding -= std::min(done, pending.outstanding);
+            }
+            
+            // 仍在队列中、只写出了一部分的帧
+            for (auto& frame : frames_) {
+                if (frame.zeroCopy) {
+                    frame.zcCompleted += overlap(frame.zcFirst, frame.zcLast);
+                }
+            }
+        }
+
+        // 释放所有通知都已到达的负载
+        for (auto it = zcPending_.begin(); it != zcPending_.end();) {
+            if (it->outstanding == 0) {
+                recycle(std::move(it->buffer));
+                it = zcPending_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+#else
+    (void)fd;
+#endif
+}
+
+OutputQueue::FlushResult OutputQueue::flush(int fd) {
+    struct iovec iov[kMaxFlushIov];
+
+    if (hasPendingCompletions()) {
+        reapCompletions(fd);
+    }
+
+    while (!frames_.empty()) {
+        if (frontIsZeroCopyPayload()) {
+            FlushResult result = sendZeroCopy(fd);
+            if (result != FlushResult::Done) {
+                return result;
+            }
+            continue;
+        }
+
+        int iovcnt = gather(iov, kMaxFlushIov);
+        ssize_t sent = ::writev(fd, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR) continue; // 被信号中断，重试
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return FlushResult::Pending;
+            }
+            std::cerr << "发送数据失败: " << strerror(errno) << std::endl;
+            return FlushResult::Error;
+        }
+
+        consume(static_cast<size_t>(sent));
+    }
+
+    return FlushResult::Done;
+}
@@ -0,0 +1,536 @@
+#include "../include/payload_codec.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// 内置的LZ编码：LZ77字节流，格式与LZ4块格式相同
+// 每个序列为 token(高4位字面量长度，低4位匹配长度-4) + 扩展长度 + 字面量 + 2字节小端偏移 + 扩展长度，
+// 最后一个序列只有字面量。单个哈希表、只找一个候选，速度优先于压缩率。
+class LzCodec : public PayloadCodec {
+public:
+    uint8_t id() const override { return kLz; }
+    const char* name() const override { return "lz"; }
+
+    bool compress(const uint8_t* in, size_t len, std::vector<uint8_t>& out) const override;
+    bool decompress(const uint8_t* in, size_t len, std::vector<uint8_t>& out, size_t expected) const override;
+
+private:
+    static const int kHashBits = 12;
+    static const size_t kMinMatch = 4;
+    static const size_t kMaxOffset = 65535;
+};
+
+static inline uint32_t load32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// a与b从头开始相同的字节数，a不超过end
+static inline size_t matchLength(const uint8_t* a, const uint8_t* b, const uint8_t* end) {
+    const uint8_t* start = a;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (a + 8 <= end) {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y) {
+            return (a - start) + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+#endif
+    while (a < end && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+// 写出长度超过token容量的部分
+static inline uint8_t* writeLength(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = static_cast<uint8_t>(len);
+    return op;
+}
+
+static inline bool readLength(const uint8_t*& ip, const uint8_t* iend, size_t& len) {
+    uint8_t b;
+    do {
+        if (ip >= iend) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool LzCodec::compress(const uint8_t* in, size_t len, std::vector<uint8_t>& out) const {
+    if (len < 2 * kMinMatch) {
+        return false;
+    }
+
+    // 最坏情况（全部为字面量）的输出长度；超过原长度即放弃
+    out.resize(len + len / 255 + 16);
+    uint8_t* op = out.data();
+    uint8_t* const olimit = op + len;
+
+    uint32_t table[1 << kHashBits];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + kMinMatch <= len) {
+        uint32_t seq = load32(in + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - kHashBits);
+        size_t ref = table[h];
+        table[h] = static_cast<uint32_t>(i);
+
+        if (ref >= i || i - ref > kMaxOffset || load32(in + ref) != seq) {
+            // 越久没有匹配步长越大，不可压缩的数据很快扫过
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        size_t match = kMinMatch + matchLength(in + i + kMinMatch, in + ref + kMinMatch, in + len);
+        size_t literals = i - anchor;
+        if (op + literals + literals / 255 + 8 + match / 255 > olimit) {
+            return false;
+        }
+
+        uint8_t* token = op++;
+        size_t matchCode = match - kMinMatch;
+        *token = static_cast<uint8_t>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(matchCode, 15));
+        if (literals >= 15) {
+            op = writeLength(op, literals - 15);
+        }
+        memcpy(op, in + anchor, literals);
+        op += literals;
+
+        size_t offset = i - ref;
+        *op++ = static_cast<uint8_t>(offset);
+        *op++ = static_cast<uint8_t>(offset >> 8);
+        if (matchCode >= 15) {
+            op = writeLength(op, matchCode - 15);
+        }
+
+        i += match;
+        anchor = i;
+    }
+
+    // 剩余的字面量
+    size_t literals = len - anchor;
+    if (op + literals + literals / 255 + 2 > olimit) {
+        return false;
+    }
+    *op++ = static_cast<uint8_t>(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15) {
+        op = writeLength(op, literals - 15);
+    }
+    memcpy(op, in + anchor, literals);
+    op += literals;
+
+    if (op >= olimit) {
+        return false;
+    }
+    out.resize(op - out.data());
+    return true;
+}
+
+bool LzCodec::decompress(const uint8_t* in, size_t len, std::vector<uint8_t>& out, size_t expected) const {
+    // 每个输入字节最多展开为255字节，超出即为伪造的长度，不为它分配内存
+    if (len == 0 || expected / 255 > len) {
+        return false;
+    }
+    out.resize(expected);
+
+    const uint8_t* ip = in;
+    const uint8_t* const iend = in + len;
+    uint8_t* const base = out.data();
+    size_t pos = 0;
+
+    while (true) {
+        if (ip >= iend) {
+            return false;
+        }
+        uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(ip, iend, literals)) {
+            return false;
+        }
+        if (literals > static_cast<size_t>(iend - ip) || literals > expected - pos) {
+            return false;
+        }
+        // expected为0时base为空，没有字面量的序列不复制
+        if (literals > 0) {
+            memcpy(base + pos, ip, literals);
+        }
+        ip += literals;
+        pos += literals;
+
+        // 最后一个序列只有字面量
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > pos) {
+            return false;
+        }
+
+        size_t match = token & 15;
+        if (match == 15 && !readLength(ip, iend, match)) {
+            return false;
+        }
+        match += kMinMatch;
+        if (match > expected - pos) {
+            return false;
+        }
+
+        // 偏移小于长度时源和目标重叠，逐字节复制以重复短模式
+        uint8_t* dst = base + pos;
+        const uint8_t* src = dst - offset;
+        if (offset >= match) {
+            memcpy(dst, src, match);
+        } else {
+            for (size_t k = 0; k < match; k++) {
+                dst[k] = src[k];
+            }
+        }
+        pos += match;
+    }
+
+    return pos == expected;
+}
+
+// 零块编码：负载按512字节分块，全零的块只记录块数
+// 格式为若干 [零块数 变长整数][数据块数 变长整数][数据块] ，最后是不足一块的尾部原样。
+// 没有零块的负载在扫描后直接放弃，不分配也不拷贝。
+class ZeroBlockCodec : public PayloadCodec {
+public:
+    uint8_t id() const override { return kZeroBlocks; }
+    const char* name() const override { return "zero"; }
+
+    bool compress(const uint8_t* in, size_t len, std::vector<uint8_t>& out) const override;
+    bool decompress(const uint8_t* in, size_t len, std::vector<uint8_t>& out, size_t expected) const override;
+
+    static const size_t kBlockSize = 512;
+
+private:
+    // 按段解码到base；base为空时只检查编码是否恰好描述expected字节
+    static bool decode(const uint8_t* in, size_t len, uint8_t* base, size_t expected);
+};
+
+// 判断一个kBlockSize字节的块是否全为0。有数据的块通常在第一个向量就不为0，立即返回
+using ZeroBlockTest = bool (*)(const uint8_t* block);
+
+static bool isZeroBlockScalar(const uint8_t* block) {
+    for (size_t i = 0; i < ZeroBlockCodec::kBlockSize; i += 64) {
+        uint64_t w[8];
+        memcpy(w, block + i, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static bool isZeroBlockAvx2(const uint8_t* block) {
+    for (size_t i = 0; i < ZeroBlockCodec::kBlockSize; i += 128) {
+        const __m256i* p = reinterpret_cast<const __m256i*>(block + i);
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+                                    _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+        if (!_mm256_testz_si256(v, v)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+__attribute__((target("sse2")))
+static bool isZeroBlockSse2(const uint8_t* block) {
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t i = 0; i < ZeroBlockCodec::kBlockSize; i += 64) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(block + i);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+#elif defined(__aarch64__)
+static bool isZeroBlockNeon(const uint8_t* block) {
+    for (size_t i = 0; i < ZeroBlockCodec::kBlockSize; i += 64) {
+        uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(block + i), vld1q_u8(block + i + 16)),
+                                vorrq_u8(vld1q_u8(block + i + 32), vld1q_u8(block + i + 48)));
+        if (vmaxvq_u8(v) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// 按CPU能力选择一次
+static ZeroBlockTest zeroBlockTest() {
+    static const ZeroBlockTest test = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return &isZeroBlockAvx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return &isZeroBlockSse2;
+        }
+        return &isZeroBlockScalar;
+#elif defined(__aarch64__)
+        return &isZeroBlockNeon;
+#else
+        return &isZeroBlockScalar;
+#endif
+    }();
+    return test;
+}
+
+static inline uint8_t* writeVarint(uint8_t* op, size_t value) {
+    while (value >= 0x80) {
+        *op++ = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    *op++ = static_cast<uint8_t>(value);
+    return op;
+}
+
+static inline bool readVarint(const uint8_t*& ip, const uint8_t* iend, size_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (ip >= iend) {
+            return false;
+        }
+        uint8_t b = *ip++;
+        value |= static_cast<size_t>(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ZeroBlockCodec::compress(const uint8_t* in, size_t len, std::vector<uint8_t>& out) const {
+    const size_t blocks = len / kBlockSize;
+    ZeroBlockTest isZero = zeroBlockTest();
+
+    size_t first = 0;
+    while (first < blocks && !isZero(in + first * kBlockSize)) {
+        first++;
+    }
+    if (first == blocks) {
+        return false;
+    }
+
+    // 每个零块省下512字节，远多于每段两个变长整数，结果一定比原数据小
+    out.resize(len + 16);
+    uint8_t* op = out.data();
+    auto emit = [&op, in](size_t zeros, size_t dataBegin, size_t dataEnd) {
+        op = writeVarint(op, zeros);
+        op = writeVarint(op, dataEnd - dataBegin);
+        memcpy(op, in + dataBegin * kBlockSize, (dataEnd - dataBegin) * kBlockSize);
+        op += (dataEnd - dataBegin) * kBlockSize;
+    };
+
+    // first之前的块已知都有数据
+    if (first > 0) {
+        emit(0, 0, first);
+    }
+
+    size_t blk = first;
+    while (blk < blocks) {
+        size_t zeroEnd = blk;
+        while (zeroEnd < blocks && isZero(in + zeroEnd * kBlockSize)) {
+            zeroEnd++;
+        }
+        size_t dataEnd = zeroEnd;
+        while (dataEnd < blocks && !isZero(in + dataEnd * kBlockSize)) {
+            dataEnd++;
+        }
+        emit(zeroEnd - blk, zeroEnd, dataEnd);
+        blk = dataEnd;
+    }
+
+    size_t tail = len - blocks * kBlockSize;
+    memcpy(op, in + blocks * kBlockSize, tail);
+    op += tail;
+
+    out.resize(op - out.data());
+    return true;
+}
+
+bool ZeroBlockCodec::decode(const uint8_t* in, size_t len, uint8_t* base, size_t expected) {
+    const size_t blocks = expected / kBlockSize;
+    const size_t tail = expected - blocks * kBlockSize;
+
+    const uint8_t* ip = in;
+    const uint8_t* const iend = in + len;
+    size_t blk = 0;
+    while (blk < blocks) {
+        size_t zeros, data;
+        if (!readVarint(ip, iend, zeros) || !readVarint(ip, iend, data)) {
+            return false;
+        }
+        if ((zeros == 0 && data == 0) || zeros > blocks - blk || data > blocks - blk - zeros) {
+            return false;
+        }
+        blk += zeros;
+
+        size_t bytes = data * kBlockSize;
+        if (bytes > static_cast<size_t>(iend - ip)) {
+            return false;
+        }
+        if (base) {
+            memcpy(base + blk * kBlockSize, ip, bytes);
+        }
+        ip += bytes;
+        blk += data;
+    }
+
+    if (static_cast<size_t>(iend - ip) != tail) {
+        return false;
+    }
+    if (base) {
+        memcpy(base + blocks * kBlockSize, ip, tail);
+    }
+    return true;
+}
+
+bool ZeroBlockCodec::decompress(const uint8_t* in, size_t len, std::vector<uint8_t>& out, size_t expected) const {
+    // 解压后的长度由对端声明：先只解析段结构，确认编码恰好描述expected字节之后才分配，
+    // 几个字节的伪造编码换不来一次大的分配
+    if (!decode(in, len, nullptr, expected)) {
+        return false;
+    }
+
+    // 新分配的元素为0，零块不必再写
+    out.assign(expected, 0);
+    return decode(in, len, out.data(), expected);
+}
+
+static const LzCodec kLzCodec;
+static const ZeroBlockCodec kZeroBlockCodec;
+
+// 按优先顺序排列：双方都支持时LZ（它同样能压掉零块）优先
+static const PayloadCodec* const kCodecs[] = {
+    &kLzCodec,
+    &kZeroBlockCodec,
+};
+
+const PayloadCodec* PayloadCodec::find(uint8_t id) {
+    for (const PayloadCodec* codec : kCodecs) {
+        if (codec->id() == id) {
+            return codec;
+        }
+    }
+    return nullptr;
+}
+
+uint32_t PayloadCodec::supportedCaps() {
+    uint32_t caps = 0;
+    for (const PayloadCodec* codec : kCodecs) {
+        caps |= capOf(codec->id());
+    }
+    return caps;
+}
+
+uint8_t PayloadCodec::choose(uint32_t peerCaps) {
+    for (const PayloadCodec* codec : kCodecs) {
+        if (peerCaps & capOf(codec->id())) {
+            return codec->id();
+        }
+    }
+    return 0;
+}
+
+PayloadCompressor::Policy PayloadCompressor::defaultPolicy(uint8_t codecId, size_t threshold) {
+    Policy policy;
+    if (codecId == PayloadCodec::kZeroBlocks) {
+        policy.threshold = ZeroBlockCodec::kBlockSize;
+        policy.maxRatio = 1.0;
+    } else {
+        policy.threshold = threshold;
+    }
+    return policy;
+}
+
+PayloadCompressor::PayloadCompressor(const PayloadCodec* codec, const Policy& policy)
+    : codec_(codec), policy_(policy), skipRemaining_(0), backoff_(policy.backoffFrames),
+      windowFrames_(0), windowIn_(0), windowOut_(0) {
+}
+
+bool PayloadCompressor::compress(const std::vector<uint8_t>& payload, std::vector<uint8_t>& out) {
+    if (payload.size() < policy_.threshold) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (skipRemaining_ > 0) {
+            skipRemaining_--;
+            stats_.skipped++;
+            return false;
+        }
+    }
+
+    // 压缩本身不持锁，多个完成回调线程可以同时压缩
+    bool compressed = codec_->compress(payload.data(), payload.size(), out);
+    size_t sent = compressed ? out.size() : payload.size();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.frames++;
+        stats_.compressed += compressed ? 1 : 0;
+        stats_.bytesIn += payload.size();
+        stats_.bytesOut += sent;
+
+        windowFrames_++;
+        windowIn_ += payload.size();
+        windowOut_ += sent;
+        if (windowFrames_ >= policy_.sampleFrames) {
+            double ratio = static_cast<double>(windowOut_) / static_cast<double>(windowIn_);
+            if (ratio > policy_.maxRatio) {
+                std::cout << "负载压缩率 " << ratio << " 收益不足，暂停压缩 " << backoff_ << " 帧" << std::endl;
+                skipRemaining_ = backoff_;
+                backoff_ = std::min(backoff_ * 2, policy_.maxBackoffFrames);
+            } else {
+                backoff_ = policy_.backoffFrames;
+            }
+            windowFrames_ = 0;
+            windowIn_ = 0;
+            windowOut_ = 0;
+        }
+    }
+
+    return compressed;
+}
+
+PayloadCompressor::Stats PayloadCompressor::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
@@ -0,0 +1,119 @@
+#include "../include/ring_buffer.h"
+#include "../include/low_latency.h"
+#include <algorithm>
+#include <cstring>
+
+RingBuffer::RingBuffer(size_t capacity)
+    : mask_(0), head_(0), tail_(0), locked_(false) {
+    size_t rounded = 1;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    buffer_.resize(rounded);
+    mask_ = rounded - 1;
+}
+
+RingBuffer::~RingBuffer() {
+    if (locked_) {
+        unlockMemory(buffer_.data(), buffer_.size());
+    }
+}
+
+bool RingBuffer::lock() {
+    if (!locked_) {
+        locked_ = lockMemory(buffer_.data(), buffer_.size());
+    }
+    return locked_;
+}
+
+size_t RingBuffer::peek(void* dst, size_t n, size_t offset) const {
+    if (offset >= size()) {
+        return 0;
+    }
+
+    n = std::min(n, size() - offset);
+    size_t start = (head_ + offset) & mask_;
+    size_t first = std::min(n, capacity() - start);
+
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    memcpy(out, buffer_.data() + start, first);
+    if (n > first) {
+        memcpy(out + first, buffer_.data(), n - first);
+    }
+
+    return n;
+}
+
+size_t RingBuffer::read(void* dst, size_t n) {
+    size_t copied = peek(dst, n);
+    consume(copied);
+    return copied;
+}
+
+void RingBuffer::consume(size_t n) {
+    head_ += std::min(n, size());
+
+    // 缓冲区为空时复位，使下一次recv能得到一整段连续空间
+    if (head_ == tail_) {
+        head_ = tail_ = 0;
+    }
+}
+
+size_t RingBuffer::write(const void* src, size_t n) {
+    n = std::min(n, freeSpace());
+    size_t start = tail_ & mask_;
+    size_t first = std::min(n, capacity() - start);
+
+    const uint8_t* in = static_cast<const uint8_t*>(src);
+    memcpy(buffer_.data() + start, in, first);
+    if (n > first) {
+        memcpy(buffer_.data(), in + first, n - first);
+    }
+
+    tail_ += n;
+    return n;
+}
+
+int RingBuffer::readableRegions(struct iovec iov[2]) const {
+    size_t n = size();
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t start = head_ & mask_;
+    size_t first = std::min(n, capacity() - start);
+
+    iov[0].iov_base = const_cast<uint8_t*>(buffer_.data()) + start;
+    iov[0].iov_len = first;
+    if (n > first) {
+        iov[1].iov_base = const_cast<uint8_t*>(buffer_.data());
+        iov[1].iov_len = n - first;
+        return 2;
+    }
+
+    return 1;
+}
+
+int RingBuffer::writableRegions(struct iovec iov[2]) {
+    size_t space = freeSpace();
+    if (space == 0) {
+        return 0;
+    }
+
+    size_t start = tail_ & mask_;
+    size_t first = std::min(space, capacity() - start);
+
+    iov[0].iov_base = buffer_.data() + start;
+    iov[0].iov_len = first;
+    if (space > first) {
+        iov[1].iov_base = buffer_.data();
+        iov[1].iov_len = space - first;
+        return 2;
+    }
+
+    return 1;
+}
+
+void RingBuffer::commit(size_t n) {
+    tail_ += std::min(n, freeSpace());
+}
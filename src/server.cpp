@@ -1,5 +1,7 @@
 #include "../include/server.h"
 #include "../include/usb_device.h"
+#include "../include/usbip_wire.h"
+#include "../include/low_latency.h"
 #include <iostream>
 #include <thread>
 #include <chrono>
@@ -9,6 +11,12 @@
 #include <signal.h>
 #include <atomic>
 #include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
 
 // 全局变量，用于控制程序运行状态
 std::atomic<bool> g_running(true);
@@ -19,8 +27,64 @@ void signal_handler(int sig) {
     g_running = false;
 }
 
+// 在途URB负载的默认内存预算：每个连接足以容纳一个最大的帧，所有连接合计不超过512MB
+static const size_t kDefaultConnectionBudget = 64 * 1024 * 1024;
+static const size_t kDefaultMemoryBudget = 512 * 1024 * 1024;
+
+// 直通转发时每个分块的长度：USB各速率下批量端点最大包长的整数倍，分块不会在总线上多出短包
+static const size_t kCutThroughChunk = 64 * 1024;
+
+// 从操作系统的随机源取len字节（Linux上为getrandom，其他系统读/dev/urandom），会话密钥不可由观察到的输出推出
+static bool secureRandom(uint8_t* out, size_t len) {
+#ifdef __linux__
+    while (len > 0) {
+        ssize_t n = getrandom(out, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        out += n;
+        len -= static_cast<size_t>(n);
+    }
+    if (len == 0) {
+        return true;
+    }
+#endif
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    while (len > 0) {
+        ssize_t n = read(fd, out, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        out += n;
+        len -= static_cast<size_t>(n);
+    }
+    close(fd);
+    return len == 0;
+}
+
+// 比较两段等长的数据，耗时与第一个不同字节的位置无关
+static bool constantTimeEqual(const uint8_t* a, const uint8_t* b, size_t len) {
+    volatile uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
 USBIPServer::USBIPServer(int port)
-    : port_(port), running_(false) {
+    : port_(port), running_(false), zeroCopyThreshold_(0), workerThreads_(0), useIoUring_(true),
+      datagramPort_(0), datagramLoss_(0), compressionThreshold_(0), zeroBlocks_(false), integrity_(false), dataStreams_(0), batchLimit_(0),
+      idleTimeoutMs_(0), urbTimeoutMs_(0), deadPeerMs_(0), resumeGraceMs_(0),
+      connectionBudget_(kDefaultConnectionBudget), memoryBudget_(kDefaultMemoryBudget), cutThroughThreshold_(0), busyPollUs_(0), rescanRequested_(false) {
 }
 
 USBIPServer::~USBIPServer() {
@@ -37,14 +101,52 @@ bool USBIPServer::start() {
         std::cerr << "警告：没有找到可用的USB大容量存储设备" << std::endl;
     }
     
-    // 创建并启动TCP服务器
-    server_ = std::make_unique<Server>(port_);
+    // 忙轮询时每个工作线程和USB事件线程各占一个CPU，事件线程取工作线程之后的一个
+    size_t workers = workerThreads_;
+    if (busyPollUs_ > 0) {
+        if (workers == 0) {
+            workers = std::max<size_t>(1, allowedCpuCount() - 1);
+        }
+        libusb::USBDeviceManager::getInstance().setBusyPoll(busyPollUs_, lowLatencyCpu(workers));
+    }
+    
+    // URB以异步传输提交，由libusb事件线程回调完成
+    if (!libusb::USBDeviceManager::getInstance().startEventThread()) {
+        std::cerr << "启动USB事件线程失败" << std::endl;
+        return false;
+    }
+    
+    // 创建并启动TCP服务器，所有连接由固定数量的事件循环线程处理
+    server_ = std::make_unique<Server>(port_, workers);
+    server_->setIoUring(useIoUring_);
+    server_->setBusyPoll(busyPollUs_);
+    server_->setLocalPath(localPath_);
+    server_->setDatagramPort(datagramPort_);
+    server_->setDatagramLoss(datagramLoss_);
+    server_->setIdleTimeout(idleTimeoutMs_);
+    server_->setUrbTimeout(urbTimeoutMs_);
+    server_->setDeadPeerTimeout(deadPeerMs_);
+    server_->setMemoryBudget(connectionBudget_, memoryBudget_);
+    if (!tlsCert_.empty()) {
+        auto tls = TlsContext::createServer(tlsCert_, tlsKey_.empty() ? tlsCert_ : tlsKey_);
+        if (!tls) {
+            std::cerr << "初始化TLS失败" << std::endl;
+            return false;
+        }
+        server_->setTls(tls);
+    }
     
-    // 设置连接处理函数
     server_->setConnectionHandler([this](std::shared_ptr<TCPSocket> clientSocket) {
-        // 为每个客户端创建一个线程处理请求
-        std::thread clientThread(&USBIPServer::handleClient, this, clientSocket);
-        clientThread.detach();
+        onClientConnected(clientSocket);
+    });
+    server_->setPacketHandler([this](const std::shared_ptr<TCPSocket>& clientSocket, usbip_packet& packet) {
+        return handlePacket(clientSocket, packet);
+    });
+    server_->setCloseHandler([this](std::shared_ptr<TCPSocket> clientSocket) {
+        onClientClosed(clientSocket);
+    });
+    server_->setUrbTimeoutHandler([this](const std::shared_ptr<TCPSocket>& clientSocket, uint32_t devid, uint32_t seqnum) {
+        onUrbTimeout(clientSocket, devid, seqnum);
     });
     
     if (!server_->start()) {
@@ -58,11 +160,13 @@ bool USBIPServer::start() {
     // 保持主线程运行，直到收到停止信号
     try {
         while (running_ && g_running) {
-            // 每5秒重新扫描一次USB设备，检测新设备或已移除设备
-            std::this_thread::sleep_for(std::chrono::seconds(5));
+            // 连接都由事件循环线程处理，这里只等待停止信号
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
             
-            // 重新扫描设备（可选功能）
-            // scanUSBDevices();
+            // 设备列表请求只回复缓存的列表，由这里在事件循环之外重新扫描，供之后的请求使用
+            if (rescanRequested_.exchange(false)) {
+                scanUSBDevices();
+            }
         }
     } catch (const std::exception& e) {
         std::cerr << "服务端运行时遇到异常: " << e.what() << std::endl;
@@ -77,14 +181,23 @@ void USBIPServer::stop() {
         std::cout << "正在停止服务端..." << std::endl;
         running_ = false;
         
+        // 先停止事件循环并关闭所有连接
         if (server_) {
             server_->stop();
         }
         
-        // 清理资源
+        // 取消仍在进行的USB传输，等待回调执行完毕后才能释放设备
         std::lock_guard<std::mutex> lock(deviceMutex_);
+        for (auto& entry : exportedDevices_) {
+            entry.second->cancelTransfers(true);
+        }
+        
+        // 清理资源
         usbDevices_.clear();
         exportedDevices_.clear();
+        devicesById_.clear();
+        exportOwners_.clear();
+        resumable_.clear();
         
         // 清理libusb资源
         libusb::USBDeviceManager::getInstance().cleanup();
@@ -94,8 +207,6 @@ void USBIPServer::stop() {
 }
 
 bool USBIPServer::scanUSBDevices() {
-    std::lock_guard<std::mutex> lock(deviceMutex_);
-    
     // 使用单例获取USB设备管理器
     auto& deviceManager = libusb::USBDeviceManager::getInstance();
     if (!deviceManager.init()) {
@@ -105,16 +216,16 @@ bool USBIPServer::scanUSBDevices() {
     
     // 扫描USB设备
     std::cout << "正在扫描USB大容量存储设备..." << std::endl;
-    usbDevices_ = deviceManager.scanDevices();
+    std::vector<std::shared_ptr<libusb::USBDevice>> devices = deviceManager.scanDevices();
     
-    std::cout << "扫描完成，找到 " << usbDevices_.size() << " 个USB大容量存储设备" << std::endl;
+    std::cout << "扫描完成，找到 " << devices.size() << " 个USB大容量存储设备" << std::endl;
     
     // 打印设备信息
-    if (!usbDevices_.empty()) {
+    if (!devices.empty()) {
         std::cout << "\n可导出的设备列表：" << std::endl;
         std::cout << "------------------------" << std::endl;
         int index = 1;
-        for (const auto& device : usbDevices_) {
+        for (const auto& device : devices) {
             std::cout << index++ << ". 设备ID: " << device->getBusID() << std::endl;
             std::cout << "   厂商ID: 0x" << std::hex << std::setw(4) << std::setfill('0') 
                       << device->getVendorID() << std::endl;
@@ -139,78 +250,205 @@ bool USBIPServer::scanUSBDevices() {
         std::cout << "3. 设备是大容量存储类型（如U盘）" << std::endl;
     }
     
-    return !usbDevices_.empty();
+    // 扫描和打开设备都在锁外进行，只在替换列表时持有锁，不拖住导入和URB路由
+    bool found = !devices.empty();
+    std::lock_guard<std::mutex> lock(deviceMutex_);
+    usbDevices_.swap(devices);
+    return found;
 }
 
-void USBIPServer::handleClient(std::shared_ptr<TCPSocket> clientSocket) {
-    std::cout << "新客户端连接" << std::endl;
+void USBIPServer::onClientConnected(std::shared_ptr<TCPSocket> clientSocket) {
+    std::cout << "新客户端连接，当前连接数: " << server_->connectionCount() << std::endl;
     
-    // 持续处理客户端请求，直到连接关闭
-    while (running_ && clientSocket->isValid()) {
-        usbip_packet packet;
-        
-        // 接收请求
-        if (!clientSocket->receivePacket(packet)) {
-            std::cerr << "接收数据包失败，关闭连接" << std::endl;
-            break;
+    if (zeroCopyThreshold_ > 0 && clientSocket->enableZeroCopy(zeroCopyThreshold_)) {
+        std::cout << "已开启零拷贝发送，阈值 " << zeroCopyThreshold_ << " 字节" << std::endl;
+    }
+    if (cutThroughThreshold_ > 0) {
+        clientSocket->enableSegmentation(cutThroughThreshold_, kCutThroughChunk);
+    }
+}
+
+void USBIPServer::onClientClosed(const std::shared_ptr<TCPSocket>& clientSocket) {
+    // 负载没有收齐的直通URB不再回复，已提交的分块照常完成
+    {
+        std::lock_guard<std::mutex> lock(streamMutex_);
+        streams_.erase(clientSocket.get());
+    }
+    
+    // 已加入的数据连接各自独立，由客户端关闭；这里只让会话号失效。
+    // 可恢复的会话保留到宽限期结束，期间设备不释放
+    std::vector<std::string> retained;
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            if (it->second.control != clientSocket.get()) {
+                ++it;
+                continue;
+            }
+            
+            if (!it->second.resume || resumeGraceMs_ <= 0) {
+                std::cout << "会话 " << it->first << " 结束" << std::endl;
+                it = sessions_.erase(it);
+                continue;
+            }
+            
+            uint64_t epoch;
+            {
+                std::lock_guard<std::mutex> stateLock(it->second.resume->mutex);
+                epoch = ++it->second.resume->epoch;
+            }
+            it->second.control = nullptr;
+            retained.push_back(it->second.busID);
+            
+            uint32_t token = it->first;
+            server_->runAfter(std::chrono::milliseconds(resumeGraceMs_), [this, token, epoch] {
+                expireSession(token, epoch);
+            });
+            std::cout << "会话 " << token << " 的连接已断开，保留设备 " << it->second.busID << " "
+                      << resumeGraceMs_ << " 毫秒等待恢复" << std::endl;
+            ++it;
         }
-        
-        // 根据命令类型处理请求
-        bool success = false;
-        switch (packet.header.command) {
-            case USBIP_OP_REQ_DEVLIST:
-                success = handleDeviceListRequest(clientSocket, packet);
-                break;
-                
-            case USBIP_OP_REQ_IMPORT:
-                success = handleImportRequest(clientSocket, packet);
-                break;
-                
-            case USBIP_CMD_SUBMIT:
-                success = handleURBRequest(clientSocket, packet);
-                break;
-                
-            case 0: // 处理可能的版本检查请求
-                std::cout << "处理可能的版本检查请求" << std::endl;
-                // 准备并发送版本信息
-                {
-                    usbip_packet versionReply;
-                    versionReply.header.version = USBIP_VERSION;
-                    versionReply.header.command = 0; // 响应的命令与请求相同
-                    versionReply.header.status = 0;
-                    
-                    // 以4字节整数形式发送版本号
-                    versionReply.data.resize(4);
-                    uint32_t version = usbip_utils::htonl_wrap(USBIP_VERSION);
-                    memcpy(versionReply.data.data(), &version, sizeof(version));
-                    
-                    success = clientSocket->sendPacket(versionReply);
-                }
-                break;
-                
-            default:
-                std::cerr << "未知命令: " << std::hex << packet.header.command << std::dec << std::endl;
-                // 对于未知命令，尝试继续而不是立即断开连接
-                success = true; // 允许连接继续
-                break;
+    }
+    
+    // 其余导入的设备随控制连接释放，之后其他客户端可以重新导入
+    std::lock_guard<std::mutex> lock(deviceMutex_);
+    for (auto it = exportOwners_.begin(); it != exportOwners_.end();) {
+        if (it->second != clientSocket.get()) {
+            ++it;
+        } else if (std::find(retained.begin(), retained.end(), it->first) != retained.end()) {
+            it->second = nullptr;
+            ++it;
+        } else {
+            releaseDevice(it->first);
+            it = exportOwners_.erase(it);
         }
-        
-        if (!success) {
-            std::cerr << "处理请求失败，关闭连接" << std::endl;
-            break;
+    }
+}
+
+void USBIPServer::releaseDevice(const std::string& busID) {
+    auto device = exportedDevices_.find(busID);
+    if (device == exportedDevices_.end()) {
+        return;
+    }
+    
+    // 回复随连接丢弃，不在事件循环中等待回调
+    size_t pending = device->second->pendingTransfers();
+    device->second->cancelTransfers(false);
+    for (auto byId = devicesById_.begin(); byId != devicesById_.end();) {
+        if (byId->second == device->second) {
+            resumable_.erase(byId->first);
+            byId = devicesById_.erase(byId);
+        } else {
+            ++byId;
+        }
+    }
+    exportedDevices_.erase(device);
+    std::cout << "释放设备 " << busID << "，取消 " << pending << " 个未完成的传输" << std::endl;
+}
+
+void USBIPServer::expireSession(uint32_t token, uint64_t epoch) {
+    std::string busID;
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        auto it = sessions_.find(token);
+        if (it == sessions_.end() || it->second.control != nullptr) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> stateLock(it->second.resume->mutex);
+            if (it->second.resume->epoch != epoch) {
+                return;
+            }
         }
+        busID = it->second.busID;
+        sessions_.erase(it);
+    }
+    
+    std::cout << "会话 " << token << " 未在宽限期内恢复" << std::endl;
+    std::lock_guard<std::mutex> lock(deviceMutex_);
+    releaseDevice(busID);
+    exportOwners_.erase(busID);
+}
+
+bool USBIPServer::handlePacket(const std::shared_ptr<TCPSocket>& clientSocket, usbip_packet& packet) {
+    // 根据命令类型处理请求；回复进入发送队列，由事件循环在本轮读事件处理完后合并写出
+    switch (packet.header.command) {
+        case USBIP_OP_REQ_DEVLIST:
+            return handleDeviceListRequest(clientSocket, packet);
+            
+        case USBIP_OP_REQ_IMPORT:
+            return handleImportRequest(clientSocket, packet);
+            
+        case USBIP_CMD_SUBMIT:
+            return handleURBRequest(clientSocket, packet);
+            
+        case USBIP_OP_REQ_CAPS:
+            return handleCapsRequest(clientSocket, packet);
+            
+        case USBIP_OP_HEARTBEAT:
+            // 收到数据本身已刷新了连接的空闲计时
+            return true;
+            
+        default:
+            // 解码器已拒绝未知命令，这里是客户端不应发送的命令（如各种响应）
+            std::cerr << "忽略客户端发来的命令: 0x" << std::hex << packet.header.command << std::dec << std::endl;
+            return true;
+    }
+}
+
+bool USBIPServer::handleCapsRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet) {
+    std::cout << "收到能力交换请求: 能力=0x" << std::hex << packet.caps.caps << std::dec << std::endl;
+    
+    usbip_packet reply;
+    reply.header.version = USBIP_VERSION;
+    reply.header.command = USBIP_OP_REP_CAPS;
+    reply.header.status = 0;
+    reply.caps.version = USBIP_VERSION;
+    reply.caps.caps = 0;
+    reply.caps.maxBatch = 0;
+    reply.caps.heartbeatMs = 0;
+    
+    // 双方都开启批量帧时同意，每帧的条目上限取较小值
+    size_t maxBatch = std::min<size_t>(batchLimit_, packet.caps.maxBatch);
+    if ((packet.caps.caps & USBIP_CAP_BATCH) && maxBatch > 1) {
+        reply.caps.caps |= USBIP_CAP_BATCH;
+        reply.caps.maxBatch = static_cast<uint32_t>(maxBatch);
     }
     
-    std::cout << "客户端连接已关闭" << std::endl;
+    // 客户端提出心跳时同意，时限以本端的设置为准；未设置时采用客户端提出的时限，限制在合理范围内
+    int heartbeat = deadPeerMs_;
+    if (heartbeat <= 0 && packet.caps.heartbeatMs > 0) {
+        heartbeat = static_cast<int>(std::min<uint32_t>(std::max<uint32_t>(packet.caps.heartbeatMs, USBIP_HEARTBEAT_MIN_MS),
+                                                        USBIP_HEARTBEAT_MAX_MS));
+    }
+    if ((packet.caps.caps & USBIP_CAP_HEARTBEAT) && heartbeat > 0) {
+        reply.caps.caps |= USBIP_CAP_HEARTBEAT;
+        reply.caps.heartbeatMs = static_cast<uint32_t>(heartbeat);
+    }
+    
+    if (!clientSocket->sendPacket(reply)) {
+        return false;
+    }
+    
+    if (reply.caps.caps & USBIP_CAP_HEARTBEAT) {
+        clientSocket->setDeadPeerTimeout(heartbeat);
+        clientSocket->enableHeartbeat(heartbeat);
+        std::cout << "已开启心跳，客户端失联时限 " << heartbeat << " 毫秒" << std::endl;
+    }
+    
+    // 响应已在发送队列中，之后的RET_SUBMIT按批量帧合并
+    if (reply.caps.caps & USBIP_CAP_BATCH) {
+        clientSocket->enableBatching(maxBatch);
+        std::cout << "已开启批量帧，每帧至多 " << maxBatch << " 个URB" << std::endl;
+    }
+    return true;
 }
 
 bool USBIPServer::handleDeviceListRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet) {
     std::cout << "收到设备列表请求，USBIP版本: " << std::hex << packet.header.version << std::dec << std::endl;
     
-    // 扫描设备
-    scanUSBDevices();
-    
-    std::cout << "扫描到 " << usbDevices_.size() << " 个USB设备" << std::endl;
+    // 回复缓存的设备列表：扫描要打开每个设备，不在事件循环线程中进行，交给主线程刷新，供之后的请求使用
+    rescanRequested_ = true;
     
     // 准备回复数据包
     usbip_packet reply;
@@ -220,27 +458,17 @@ bool USBIPServer::handleDeviceListRequest(std::shared_ptr<TCPSocket> clientSocke
     reply.header.command = USBIP_OP_REP_DEVLIST;
     reply.header.status = 0;
     
-    std::cout << "准备发送回复数据包: 版本=" << std::hex << reply.header.version 
-              << ", 命令=" << reply.header.command
-              << ", 状态=" << reply.header.status << std::dec << std::endl;
+    // 整个设备列表按线上格式编码到data中，与头部一次发出：
+    // 设备数量 + 每个设备的 usb_device_info、1字节接口数量和接口描述
+    std::lock_guard<std::mutex> lock(deviceMutex_);
+    const size_t deviceSize = usbip_wire::wireSize<usb_device_info>();
+    const size_t interfaceSize = usbip_wire::wireSize<usb_interface_info>();
     
-    // 发送头部
-    if (!clientSocket->sendPacket(reply)) {
-        std::cerr << "发送设备列表头部失败" << std::endl;
-        return false;
-    }
-    
-    // 发送设备数量 (单独发送，不是数据包的一部分)
-    uint32_t numDevices = usbip_utils::htonl_wrap(usbDevices_.size());
-    if (!clientSocket->send(&numDevices, sizeof(numDevices))) {
-        std::cerr << "发送设备数量失败" << std::endl;
-        return false;
-    }
+    reply.data.resize(sizeof(uint32_t));
+    usbip_wire::storeBE32(reply.data.data(), usbDevices_.size());
     
     std::cout << "发送 " << usbDevices_.size() << " 个设备的信息" << std::endl;
     
-    // 逐个发送设备信息
-    std::lock_guard<std::mutex> lock(deviceMutex_);
     int deviceIndex = 0;
     for (const auto& device : usbDevices_) {
         deviceIndex++;
@@ -248,47 +476,33 @@ bool USBIPServer::handleDeviceListRequest(std::shared_ptr<TCPSocket> clientSocke
         // 填充设备信息
         usb_device_info devInfo;
         device->fillDeviceInfo(devInfo);
-        
-        // 转换为网络字节序
-        devInfo.busnum = usbip_utils::htonl_wrap(devInfo.busnum);
-        devInfo.devnum = usbip_utils::htonl_wrap(devInfo.devnum);
-        devInfo.speed = usbip_utils::htonl_wrap(devInfo.speed);
-        devInfo.idVendor = usbip_utils::htons_wrap(devInfo.idVendor);
-        devInfo.idProduct = usbip_utils::htons_wrap(devInfo.idProduct);
-        devInfo.bcdDevice = usbip_utils::htons_wrap(devInfo.bcdDevice);
-        
-        // 发送设备基本信息结构
-        if (!clientSocket->send(&devInfo, sizeof(devInfo))) {
-            std::cerr << "发送设备 " << deviceIndex << " 信息失败" << std::endl;
-            return false;
-        }
-        
-        // 发送接口数量
         uint8_t numInterfaces = devInfo.bNumInterfaces;
-        if (!clientSocket->send(&numInterfaces, sizeof(numInterfaces))) {
-            std::cerr << "发送设备 " << deviceIndex << " 接口数量失败" << std::endl;
-            return false;
-        }
         
-        std::cout << "发送设备 " << deviceIndex << " 的 " << (int)numInterfaces << " 个接口信息" << std::endl;
+        size_t offset = reply.data.size();
+        reply.data.resize(offset + deviceSize + 1 + numInterfaces * interfaceSize);
+        uint8_t* out = reply.data.data() + offset;
+        
+        out += usbip_wire::encode(devInfo, out);
+        *out++ = numInterfaces;
         
-        // 发送每个接口的信息
+        // 接口描述 (类,子类,协议,填充)
+        usb_interface_info interfaceInfo = {};
+        interfaceInfo.bInterfaceClass = device->isMassStorage() ? USB_CLASS_MASS_STORAGE : 0;
         for (uint8_t i = 0; i < numInterfaces; i++) {
-            // 接口描述 (4字节: 类,子类,协议,填充)
-            uint8_t interfaceData[4] = {
-                static_cast<uint8_t>((device->isMassStorage()) ? USB_CLASS_MASS_STORAGE : 0), // 类
-                0, // 子类
-                0, // 协议
-                0  // 填充字节
-            };
-            
-            if (!clientSocket->send(interfaceData, sizeof(interfaceData))) {
-                std::cerr << "发送设备 " << deviceIndex << " 接口 " << (int)i << " 信息失败" << std::endl;
-                return false;
-            }
+            out += usbip_wire::encode(interfaceInfo, out);
         }
         
-        std::cout << "设备 " << deviceIndex << " 信息发送成功" << std::endl;
+        std::cout << "设备 " << deviceIndex << " 的 " << (int)numInterfaces << " 个接口信息已编码" << std::endl;
+    }
+    
+    std::cout << "准备发送回复数据包: 版本=" << std::hex << reply.header.version 
+              << ", 命令=" << reply.header.command
+              << ", 状态=" << reply.header.status << std::dec
+              << ", 数据=" << reply.data.size() << " 字节" << std::endl;
+    
+    if (!clientSocket->sendPacket(reply)) {
+        std::cerr << "发送设备列表响应失败" << std::endl;
+        return false;
     }
     
     std::cout << "设备列表响应发送成功" << std::endl;
@@ -296,6 +510,13 @@ bool USBIPServer::handleDeviceListRequest(std::shared_ptr<TCPSocket> clientSocke
 }
 
 bool USBIPServer::handleImportRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet) {
+    if (packet.header.flags & USBIP_FLAG_STREAM_ATTACH) {
+        return handleStreamAttach(clientSocket, packet);
+    }
+    if (packet.header.flags & USBIP_FLAG_RESUME) {
+        return handleResume(clientSocket, packet);
+    }
+    
     std::string busID(packet.import_req.busid);
     std::cout << "收到导入设备请求: " << busID << std::endl;
     
@@ -316,11 +537,18 @@ bool USBIPServer::handleImportRequest(std::shared_ptr<TCPSocket> clientSocket, c
     reply.import_rep.status = 0;
     memset(&reply.import_rep.udev, 0, sizeof(reply.import_rep.udev));
     
-    // 查找请求的设备
+    // 查找请求的设备。vid:pid选择器选出第一个未被其他连接导入的匹配设备，
+    // 都已被导入时选第一个（随后以EBUSY失败）
     std::shared_ptr<libusb::USBDevice> targetDevice = nullptr;
+    uint16_t vendor = 0;
+    uint16_t product = 0;
+    bool selector = usbip_wire::parseSelector(packet.import_req.busid, vendor, product);
+    bool busy = false;
+    bool claimed = false;
     
     {
         std::lock_guard<std::mutex> lock(deviceMutex_);
+        std::shared_ptr<libusb::USBDevice> busyDevice = nullptr;
         for (const auto& device : usbDevices_) {
             std::string deviceBusID = device->getBusID();
             std::cout << "检查设备: " << deviceBusID << std::endl;
@@ -330,9 +558,40 @@ bool USBIPServer::handleImportRequest(std::shared_ptr<TCPSocket> clientSocket, c
                 targetDevice = device;
                 break;
             }
+            
+            if (selector && device->getVendorID() == vendor && device->getProductID() == product) {
+                auto owner = exportOwners_.find(deviceBusID);
+                if (owner == exportOwners_.end() || owner->second == clientSocket.get()) {
+                    targetDevice = device;
+                    break;
+                }
+                if (!busyDevice) {
+                    busyDevice = device;
+                }
+            }
+        }
+        if (!targetDevice) {
+            targetDevice = busyDevice;
+        }
+        
+        // 选中后在同一临界区内检查并占用：不同工作线程上的连接同时导入同一设备时只有一个成功。
+        // 设备已被另一条仍然存活的连接导入，或正等待原连接恢复会话时为忙
+        if (targetDevice) {
+            auto owner = exportOwners_.find(targetDevice->getBusID());
+            if (owner == exportOwners_.end()) {
+                exportOwners_[targetDevice->getBusID()] = clientSocket.get();
+                claimed = true;
+            } else if (owner->second != clientSocket.get()) {
+                busy = true;
+            }
         }
     }
     
+    if (selector && targetDevice) {
+        busID = targetDevice->getBusID();
+        std::cout << "选择器 " << packet.import_req.busid << " 选中设备 " << busID << std::endl;
+    }
+    
     if (!targetDevice) {
         std::cerr << "找不到请求的设备: " << busID << std::endl;
         
@@ -344,6 +603,12 @@ bool USBIPServer::handleImportRequest(std::shared_ptr<TCPSocket> clientSocket, c
         return clientSocket->sendPacket(reply);
     }
     
+    if (busy) {
+        reply.import_rep.status = -16; // -EBUSY
+        std::cerr << "设备 " << busID << " 已被其他客户端导入，发送导入失败响应，状态=-16 (EBUSY)" << std::endl;
+        return clientSocket->sendPacket(reply);
+    }
+    
     // 设置回复信息
     reply.import_rep.version = USBIP_VERSION;
     reply.import_rep.status = 0; // 成功
@@ -353,6 +618,12 @@ bool USBIPServer::handleImportRequest(std::shared_ptr<TCPSocket> clientSocket, c
     if (!fillSuccess) {
         std::cerr << "填充设备信息失败" << std::endl;
         reply.import_rep.status = -22; // -EINVAL (参数无效) 的负值
+        
+        // 撤销上面的占用，其他客户端仍可导入
+        if (claimed) {
+            std::lock_guard<std::mutex> lock(deviceMutex_);
+            exportOwners_.erase(busID);
+        }
     } else {
         // 为确保设备信息有效，再次检查关键字段
         if (reply.import_rep.udev.busid[0] == '\0') {
@@ -364,43 +635,258 @@ bool USBIPServer::handleImportRequest(std::shared_ptr<TCPSocket> clientSocket, c
             reply.import_rep.udev.idProduct = targetDevice->getProductID();
         }
         
-        // 为应答设置网络字节序
-        reply.import_rep.udev.busnum = usbip_utils::htonl_wrap(reply.import_rep.udev.busnum);
-        reply.import_rep.udev.devnum = usbip_utils::htonl_wrap(reply.import_rep.udev.devnum);
-        reply.import_rep.udev.speed = usbip_utils::htonl_wrap(reply.import_rep.udev.speed);
-        reply.import_rep.udev.idVendor = usbip_utils::htons_wrap(reply.import_rep.udev.idVendor);
-        reply.import_rep.udev.idProduct = usbip_utils::htons_wrap(reply.import_rep.udev.idProduct);
-        reply.import_rep.udev.bcdDevice = usbip_utils::htons_wrap(reply.import_rep.udev.bcdDevice);
-        
-        // 将设备添加到已导出列表
+        // 将设备添加到已导出列表，URB按devid找到它
+        uint32_t devid = (reply.import_rep.udev.busnum << 16) | reply.import_rep.udev.devnum;
         std::lock_guard<std::mutex> lock(deviceMutex_);
         exportedDevices_[busID] = targetDevice;
+        devicesById_[devid] = targetDevice;
         
-        std::cout << "成功导出设备 " << busID << std::endl;
+        std::cout << "成功导出设备 " << busID << "，devid=0x" << std::hex << devid << std::dec << std::endl;
         
         // 打印设备信息，便于调试
         std::cout << "===设备详细信息===" << std::endl;
         std::cout << "设备ID: " << reply.import_rep.udev.busid << std::endl;
         std::cout << "路径: " << reply.import_rep.udev.path << std::endl;
-        std::cout << "总线号: " << usbip_utils::ntohl_wrap(reply.import_rep.udev.busnum) << std::endl;
-        std::cout << "设备号: " << usbip_utils::ntohl_wrap(reply.import_rep.udev.devnum) << std::endl;
-        std::cout << "速度: " << usbip_utils::ntohl_wrap(reply.import_rep.udev.speed) << std::endl;
-        std::cout << "厂商ID: 0x" << std::hex << usbip_utils::ntohs_wrap(reply.import_rep.udev.idVendor) << std::endl;
-        std::cout << "产品ID: 0x" << usbip_utils::ntohs_wrap(reply.import_rep.udev.idProduct) << std::dec << std::endl;
+        std::cout << "总线号: " << reply.import_rep.udev.busnum << std::endl;
+        std::cout << "设备号: " << reply.import_rep.udev.devnum << std::endl;
+        std::cout << "速度: " << reply.import_rep.udev.speed << std::endl;
+        std::cout << "厂商ID: 0x" << std::hex << reply.import_rep.udev.idVendor << std::endl;
+        std::cout << "产品ID: 0x" << reply.import_rep.udev.idProduct << std::dec << std::endl;
         std::cout << "设备类: " << static_cast<int>(reply.import_rep.udev.bDeviceClass) << std::endl;
         std::cout << "接口数: " << static_cast<int>(reply.import_rep.udev.bNumInterfaces) << std::endl;
         std::cout << "===================" << std::endl;
     }
     
-    // 确保回复状态被设置为网络字节序
-    reply.import_rep.status = usbip_utils::htonl_wrap(reply.import_rep.status);
+    // 客户端提供的负载编码中有本端接受的就选定一种，在响应头部中告知
+    uint8_t codec = 0;
+    if (reply.import_rep.status == 0 && !clientSocket->isSharedMemory()) {
+        codec = PayloadCodec::choose(packet.header.flags & USBIP_FLAG_CODEC_CAPS_MASK & codecCaps());
+        if (codec != 0) {
+            reply.header.flags = PayloadCodec::capOf(codec);
+        }
+    }
+    
+    // 共享内存传输不经过网络，不需要端到端校验
+    bool integrity = integrity_ && reply.import_rep.status == 0 && !clientSocket->isSharedMemory() &&
+                     (packet.header.flags & USBIP_FLAG_CAP_CRC32C);
+    if (integrity) {
+        reply.header.flags |= USBIP_FLAG_CAP_CRC32C;
+    }
+    
+    // 客户端希望附加数据连接或可恢复的会话：建立会话，会话号随响应返回。数据报传输本身已按端点分流，不需要数据连接
+    size_t requested = (packet.header.flags & USBIP_FLAG_STREAMS_MASK) >> USBIP_FLAG_STREAMS_SHIFT;
+    bool streams = requested > 0 && dataStreams_ > 0 && reply.import_rep.status == 0 && !clientSocket->hasTransport();
+    bool resumable = resumeGraceMs_ > 0 && reply.import_rep.status == 0 && (packet.header.flags & USBIP_FLAG_CAP_RESUME);
+    if (streams || resumable) {
+        Session session;
+        session.busID = busID;
+        session.udev = reply.import_rep.udev;
+        session.codec = codec;
+        session.integrity = integrity;
+        session.granted = streams ? std::min(requested, dataStreams_) : 0;
+        session.control = clientSocket.get();
+        if (resumable) {
+            session.resume = std::make_shared<ResumeState>();
+            session.resume->budget = server_->memoryBudget();
+            uint32_t devid = (session.udev.busnum << 16) | session.udev.devnum;
+            std::lock_guard<std::mutex> lock(deviceMutex_);
+            resumable_[devid] = session.resume;
+            reply.header.flags |= USBIP_FLAG_CAP_RESUME;
+        }
+        
+        // 会话号：会话ID之后是随机密钥，两者都取自系统随机源
+        reply.data.resize(usbip_wire::kSessionTokenSize);
+        uint32_t token = 0;
+        bool generated = secureRandom(session.secret.data(), session.secret.size());
+        if (generated) {
+            std::lock_guard<std::mutex> lock(sessionMutex_);
+            do {
+                generated = secureRandom(reply.data.data(), usbip_wire::kSessionIdSize);
+                token = usbip_wire::loadBE32(reply.data.data());
+            } while (generated && (token == 0 || sessions_.count(token)));
+            if (generated) {
+                sessions_[token] = session;
+            }
+        }
+        
+        if (generated) {
+            memcpy(reply.data.data() + usbip_wire::kSessionIdSize, session.secret.data(), session.secret.size());
+            reply.header.flags |= static_cast<uint32_t>(session.granted) << USBIP_FLAG_STREAMS_SHIFT;
+            std::cout << "建立会话 " << token << "，同意 " << session.granted << " 条数据连接"
+                      << (resumable ? "，断开后可恢复" : "") << std::endl;
+        } else {
+            // 无法生成会话号时不建立会话，导入本身照常成功
+            std::cerr << "读取系统随机源失败，不建立会话: " << strerror(errno) << std::endl;
+            reply.data.clear();
+            reply.header.flags &= ~USBIP_FLAG_CAP_RESUME;
+            if (session.resume) {
+                uint32_t devid = (session.udev.busnum << 16) | session.udev.devnum;
+                std::lock_guard<std::mutex> lock(deviceMutex_);
+                resumable_.erase(devid);
+            }
+        }
+    }
     
-    // 确保发送正确格式的响应
-    std::cout << "发送导入设备响应，状态=" << usbip_utils::ntohl_wrap(reply.import_rep.status) << std::endl;
-    return clientSocket->sendPacket(reply);
+    // 字节序转换由线上编码统一处理
+    std::cout << "发送导入设备响应，状态=" << static_cast<int>(reply.import_rep.status) << std::endl;
+    if (!clientSocket->sendPacket(reply)) {
+        return false;
+    }
+    
+    // 响应已在发送队列中，之后的RET_SUBMIT负载按选定的编码压缩
+    if (codec != 0) {
+        PayloadCompressor::Policy policy = PayloadCompressor::defaultPolicy(codec, compressionThreshold_);
+        if (clientSocket->enableCompression(codec, policy)) {
+            std::cout << "已开启负载编码: " << PayloadCodec::find(codec)->name()
+                      << "，阈值 " << policy.threshold << " 字节" << std::endl;
+        }
+    }
+    if (integrity) {
+        clientSocket->enableIntegrity();
+        std::cout << "已开启负载CRC32C校验" << std::endl;
+    }
+    return true;
 }
 
-bool USBIPServer::handleURBRequest(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet) {
+bool USBIPServer::handleStreamAttach(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet) {
+    uint32_t token = usbip_wire::loadBE32(packet.data.data());
+    
+    usbip_packet reply;
+    reply.header.version = USBIP_VERSION;
+    reply.header.command = USBIP_OP_REP_IMPORT;
+    reply.header.status = 0;
+    reply.import_rep.version = USBIP_VERSION;
+    reply.import_rep.status = 0;
+    memset(&reply.import_rep.udev, 0, sizeof(reply.import_rep.udev));
+    
+    Session session;
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        auto it = findSession(packet);
+        if (it == sessions_.end() || it->second.busID != packet.import_req.busid ||
+            it->second.attached >= it->second.granted || clientSocket->hasTransport()) {
+            reply.import_rep.status = -22; // -EINVAL
+        } else {
+            it->second.attached++;
+            session = it->second;
+        }
+    }
+    
+    if (reply.import_rep.status != 0) {
+        std::cerr << "拒绝加入会话 " << token << " 的数据连接" << std::endl;
+        return clientSocket->sendPacket(reply);
+    }
+    
+    reply.import_rep.udev = session.udev;
+    if (!clientSocket->sendPacket(reply)) {
+        return false;
+    }
+    
+    // 数据连接沿用控制连接协商的编码和校验
+    if (session.codec != 0) {
+        clientSocket->enableCompression(session.codec,
+                                        PayloadCompressor::defaultPolicy(session.codec, compressionThreshold_));
+    }
+    if (session.integrity) {
+        clientSocket->enableIntegrity();
+    }
+    
+    std::cout << "数据连接加入会话 " << token << " (" << session.attached << "/" << session.granted << ")" << std::endl;
+    return true;
+}
+
+bool USBIPServer::handleResume(std::shared_ptr<TCPSocket> clientSocket, const usbip_packet& packet) {
+    uint32_t token = usbip_wire::loadBE32(packet.data.data());
+    
+    usbip_packet reply;
+    reply.header.version = USBIP_VERSION;
+    reply.header.command = USBIP_OP_REP_IMPORT;
+    reply.header.status = 0;
+    reply.import_rep.version = USBIP_VERSION;
+    reply.import_rep.status = 0;
+    memset(&reply.import_rep.udev, 0, sizeof(reply.import_rep.udev));
+    
+    // 原来的连接可能尚未被发现断开，这里直接由新连接接管
+    Session session;
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex_);
+        auto it = findSession(packet);
+        if (it == sessions_.end() || !it->second.resume || it->second.busID != packet.import_req.busid) {
+            reply.import_rep.status = -22; // -EINVAL
+        } else {
+            it->second.control = clientSocket.get();
+            it->second.attached = 0;
+            session = it->second;
+        }
+    }
+    
+    if (reply.import_rep.status != 0) {
+        std::cerr << "拒绝恢复会话 " << token << "：会话不存在或已过期" << std::endl;
+        return clientSocket->sendPacket(reply);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(deviceMutex_);
+        exportOwners_[session.busID] = clientSocket.get();
+    }
+    
+    // 响应沿用导入时协商的结果，客户端据此在新连接上开启相同的设置
+    reply.import_rep.udev = session.udev;
+    reply.header.flags = USBIP_FLAG_CAP_RESUME | static_cast<uint32_t>(session.granted) << USBIP_FLAG_STREAMS_SHIFT;
+    if (session.codec != 0) {
+        reply.header.flags |= PayloadCodec::capOf(session.codec);
+    }
+    if (session.integrity) {
+        reply.header.flags |= USBIP_FLAG_CAP_CRC32C;
+    }
+    reply.data = packet.data;
+    if (!clientSocket->sendPacket(reply)) {
+        return false;
+    }
+    
+    if (session.codec != 0) {
+        clientSocket->enableCompression(session.codec,
+                                        PayloadCompressor::defaultPolicy(session.codec, compressionThreshold_));
+    }
+    if (session.integrity) {
+        clientSocket->enableIntegrity();
+    }
+    
+    std::cout << "会话 " << token << " 已恢复，设备 " << session.busID << std::endl;
+    return true;
+}
+
+std::map<uint32_t, USBIPServer::Session>::iterator USBIPServer::findSession(const usbip_packet& packet) {
+    auto it = sessions_.find(usbip_wire::loadBE32(packet.data.data()));
+    if (it == sessions_.end()) {
+        return it;
+    }
+    
+    // 会话ID不是秘密，密钥按常数时间比较，不从响应时间泄露匹配的前缀
+    const uint8_t* secret = packet.data.data() + usbip_wire::kSessionIdSize;
+    if (!constantTimeEqual(it->second.secret.data(), secret, it->second.secret.size())) {
+        return sessions_.end();
+    }
+    return it;
+}
+
+uint32_t USBIPServer::codecCaps() const {
+    uint32_t caps = 0;
+    if (compressionThreshold_ > 0) {
+        caps |= PayloadCodec::capOf(PayloadCodec::kLz);
+    }
+    if (zeroBlocks_) {
+        caps |= PayloadCodec::capOf(PayloadCodec::kZeroBlocks);
+    }
+    return caps;
+}
+
+bool USBIPServer::handleURBRequest(std::shared_ptr<TCPSocket> clientSocket, usbip_packet& packet) {
+    // 直通URB的头部不带负载，照常处理；之后的各段交给所属的OutStream
+    if (packet.segmented && !packet.data.empty()) {
+        return handleSegment(clientSocket, packet);
+    }
+    
     uint32_t seqnum = packet.cmd_submit_data.seqnum;
     uint32_t devid = packet.cmd_submit_data.devid;
     uint32_t direction = packet.cmd_submit_data.direction;
@@ -428,35 +914,67 @@ bool USBIPServer::handleURBRequest(std::shared_ptr<TCPSocket> clientSocket, cons
     reply.ret_submit_data.number_of_packets = 0;
     reply.ret_submit_data.error_count = 0;
     
-    // 查找导出的设备
+    // OUT负载校验失败或超过内存预算被解码器丢弃：不提交给设备，直接以头部中的错误回复
+    if (packet.header.status != 0) {
+        reply.ret_submit_data.status = packet.header.status;
+        return clientSocket->queuePacket(std::move(reply));
+    }
+    
+    // 按devid（busnum<<16|devnum）查找导出的设备，一个连接上可以有多个设备的URB
     std::shared_ptr<libusb::USBDevice> targetDevice = nullptr;
-    std::string busID;
+    std::shared_ptr<ResumeState> resume;
     
     {
         std::lock_guard<std::mutex> lock(deviceMutex_);
-        // 在实际实现中，需要根据devid查找设备
-        // 这里简化处理，假设只有一个设备
-        if (!exportedDevices_.empty()) {
-            auto it = exportedDevices_.begin();
-            busID = it->first;
+        auto it = devicesById_.find(devid);
+        if (it != devicesById_.end()) {
             targetDevice = it->second;
         }
+        auto state = resumable_.find(devid);
+        if (state != resumable_.end()) {
+            resume = state->second;
+        }
     }
     
     if (!targetDevice) {
-        std::cerr << "找不到请求的设备" << std::endl;
-        reply.ret_submit_data.status = -1; // 错误
-        return clientSocket->sendPacket(reply);
+        std::cerr << "找不到请求的设备: devid=0x" << std::hex << devid << std::dec << std::endl;
+        reply.ret_submit_data.status = -19; // -ENODEV
+        return clientSocket->queuePacket(std::move(reply));
+    }
+    
+    // 可恢复的会话：恢复后重新提交的URB不重复交给设备
+    if (resume && resume->submit(clientSocket, reply, (packet.header.flags & USBIP_FLAG_RESUBMIT) != 0)) {
+        std::cout << "URB " << seqnum << " 在断开前已提交，重放或改从新连接回复" << std::endl;
+        return true;
+    }
+    
+    // 按传输类型准备缓冲区，缓冲区在传输完成之前计入连接的内存预算
+    uint8_t type;
+    unsigned char endpoint;
+    std::vector<uint8_t> buffer;
+    std::shared_ptr<MemoryBudget> budget = clientSocket->memoryBudget();
+    
+    // 长度由对端给出：超过预算的请求永远无法满足，不分配缓冲区直接拒绝（OUT负载已由解码器在接收前丢弃，
+    // 这里拦住IN请求）；直通URB按分块计入，不受此限
+    size_t capacity = budget ? budget->capacity() : 0;
+    if (!packet.segmented && capacity > 0 && packet.cmd_submit_data.transfer_buffer_length > capacity) {
+        std::cerr << "URB缓冲区长度 " << packet.cmd_submit_data.transfer_buffer_length
+                  << " 超过内存预算 " << capacity << "，拒绝: 序列号=" << seqnum << std::endl;
+        reply.ret_submit_data.status = -12; // -ENOMEM
+        if (resume) {
+            resume->complete(reply);
+        }
+        return clientSocket->queuePacket(std::move(reply));
     }
     
-    // 处理不同类型的传输
     if (ep == 0) {
-        // 控制传输
-        uint8_t requestType = packet.cmd_submit_data.setup[0];
-        uint8_t request = packet.cmd_submit_data.setup[1];
-        uint16_t value = (packet.cmd_submit_data.setup[3] << 8) | packet.cmd_submit_data.setup[2];
-        uint16_t index = (packet.cmd_submit_data.setup[5] << 8) | packet.cmd_submit_data.setup[4];
-        uint16_t length = (packet.cmd_submit_data.setup[7] << 8) | packet.cmd_submit_data.setup[6];
+        // 控制传输：缓冲区前8字节为setup包，其后为数据阶段
+        const uint8_t* setup = packet.cmd_submit_data.setup;
+        uint8_t requestType = setup[0];
+        uint8_t request = setup[1];
+        uint16_t value = (setup[3] << 8) | setup[2];
+        uint16_t index = (setup[5] << 8) | setup[4];
+        uint16_t length = (setup[7] << 8) | setup[6];
         
         std::cout << "控制传输: requestType=" << (int)requestType 
                   << ", request=" << (int)request
@@ -464,71 +982,320 @@ bool USBIPServer::handleURBRequest(std::shared_ptr<TCPSocket> clientSocket, cons
                   << ", index=" << index
                   << ", length=" << length << std::endl;
         
-        // 分配数据缓冲区
-        std::vector<uint8_t> data(length, 0);
+        type = LIBUSB_TRANSFER_TYPE_CONTROL;
+        endpoint = 0;
+        buffer = clientSocket->acquireBuffer(sizeof(packet.cmd_submit_data.setup) + length);
+        memcpy(buffer.data(), setup, sizeof(packet.cmd_submit_data.setup));
         
         // 如果是OUT传输，数据来自客户端
         if (direction == USBIP_DIR_OUT && !packet.data.empty()) {
-            data = packet.data;
+            memcpy(buffer.data() + sizeof(packet.cmd_submit_data.setup), packet.data.data(),
+                   std::min<size_t>(length, packet.data.size()));
         }
+    } else if (direction == USBIP_DIR_IN) {
+        // 批量读取：设备数据直接读入回复负载缓冲区，之后移动进发送队列，不再拷贝
+        type = LIBUSB_TRANSFER_TYPE_BULK;
+        endpoint = ep | 0x80; // IN端点设置高位
+        buffer = clientSocket->acquireBuffer(packet.cmd_submit_data.transfer_buffer_length);
+    } else if (packet.segmented) {
+        // 直通的批量写入：负载随后分段到达，每段到达即提交给设备
+        auto stream = std::make_shared<OutStream>();
+        stream->reply = reply;
+        stream->socket = clientSocket;
+        stream->device = targetDevice;
+        stream->resume = resume;
+        stream->budget = budget;
+        stream->endpoint = ep;
         
-        // 执行控制传输
-        int result = targetDevice->controlTransfer(
-            requestType, request, value, index, 
-            data.data(), length);
+        std::lock_guard<std::mutex> lock(streamMutex_);
+        streams_[clientSocket.get()] = stream;
+        return true;
+    } else {
+        // 批量写入：直接使用请求中的数据
+        type = LIBUSB_TRANSFER_TYPE_BULK;
+        endpoint = ep;
+        buffer = std::move(packet.data);
+    }
+    
+    size_t charged = buffer.size();
+    if (budget) {
+        budget->charge(charged);
+    }
+    
+    // 传输完成时在libusb事件线程中组装回复并放入发送队列，由连接所属的事件循环写出
+    auto onComplete = [clientSocket, reply, type, resume, budget, charged](int status, int actualLength,
+                                                                         std::vector<uint8_t>& data) mutable {
+        // 回复放入发送队列之后由连接的发送队列上限约束
+        if (budget) {
+            budget->release(charged);
+        }
         
-        if (result < 0) {
-            std::cerr << "控制传输失败: " << result << std::endl;
-            reply.ret_submit_data.status = result;
+        if (status != 0) {
+            std::cerr << (type == LIBUSB_TRANSFER_TYPE_CONTROL ? "控制传输失败: " : "批量传输失败: ")
+                      << status << std::endl;
+            reply.ret_submit_data.status = status;
         } else {
-            // 如果是IN传输，将获取的数据返回给客户端
-            if (direction == USBIP_DIR_IN) {
-                reply.data = data;
-                reply.ret_submit_data.actual_length = result;
-            } else {
-                reply.ret_submit_data.actual_length = result;
+            reply.ret_submit_data.actual_length = actualLength;
+            
+            // 如果是IN传输，只返回实际传输的字节，与actual_length保持一致
+            if (reply.ret_submit_data.direction == USBIP_DIR_IN) {
+                if (type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+                    data.erase(data.begin(), data.begin() + LIBUSB_CONTROL_SETUP_SIZE);
+                }
+                data.resize(actualLength);
+                reply.data = std::move(data);
             }
         }
-    } else {
-        // 批量传输
-        int actualLength = 0;
-        int result = 0;
         
-        if (direction == USBIP_DIR_IN) {
-            // 读取数据
-            std::vector<uint8_t> data(packet.cmd_submit_data.transfer_buffer_length, 0);
-            
-            result = targetDevice->bulkTransfer(
-                ep | 0x80, // IN端点设置高位
-                data.data(), 
-                packet.cmd_submit_data.transfer_buffer_length,
-                &actualLength);
-            
-            if (result == 0) {
-                // 成功读取数据
-                data.resize(actualLength);
-                reply.data = data;
-                reply.ret_submit_data.actual_length = actualLength;
+        // 可恢复的会话中回复发往最近提交它的连接，连接已断开时留待重放
+        std::shared_ptr<TCPSocket> target = resume ? resume->complete(reply) : clientSocket;
+        if (target) {
+            target->queuePacket(std::move(reply));
+        }
+    };
+    
+    // 设置了URB时限时由工作线程的时间轮计时，传输本身不再限时
+    unsigned int timeout = urbTimeoutMs_ > 0 ? 0 : 1000;
+    int result = targetDevice->submitTransfer(type, endpoint, std::move(buffer), std::move(onComplete), timeout,
+                                              clientSocket.get(), seqnum);
+    if (result != 0) {
+        if (budget) {
+            budget->release(charged);
+        }
+        reply.ret_submit_data.status = result;
+        if (resume) {
+            resume->complete(reply);
+        }
+        return clientSocket->queuePacket(std::move(reply));
+    }
+    
+    return true;
+}
+
+bool USBIPServer::handleSegment(const std::shared_ptr<TCPSocket>& clientSocket, usbip_packet& packet) {
+    uint32_t seqnum = packet.cmd_submit_data.seqnum;
+    std::shared_ptr<OutStream> stream;
+    {
+        std::lock_guard<std::mutex> lock(streamMutex_);
+        auto it = streams_.find(clientSocket.get());
+        if (it != streams_.end() && it->second->reply.ret_submit_data.seqnum == seqnum) {
+            stream = it->second;
+            if (packet.lastSegment) {
+                streams_.erase(it);
+            }
+        }
+    }
+    
+    // 头部已直接回复（如找不到设备）或由恢复的会话处理，丢弃其余的负载
+    if (!stream) {
+        return true;
+    }
+    
+    bool submit;
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        submit = stream->status == 0;
+        if (submit) {
+            stream->pending++;
+        }
+    }
+    
+    if (submit) {
+        size_t charged = packet.data.size();
+        if (stream->budget) {
+            stream->budget->charge(charged);
+        }
+        
+        // 分块失败后取消同一URB中排在其后的分块，端点上不会写入不连续的数据
+        auto onChunk = [this, stream, charged, seqnum](int status, int actualLength, std::vector<uint8_t>&) {
+            if (stream->budget) {
+                stream->budget->release(charged);
             }
-        } else {
-            // 写入数据
-            result = targetDevice->bulkTransfer(
-                ep, // OUT端点
-                const_cast<unsigned char*>(packet.data.data()),
-                packet.data.size(),
-                &actualLength);
             
-            if (result == 0) {
-                reply.ret_submit_data.actual_length = actualLength;
+            bool failed = false;
+            {
+                std::lock_guard<std::mutex> lock(stream->mutex);
+                stream->pending--;
+                stream->actual += actualLength;
+                if (status != 0 && stream->status == 0) {
+                    stream->status = status;
+                    failed = true;
+                }
             }
-        }
+            if (failed) {
+                std::cerr << "批量传输失败: " << status << "，取消URB " << seqnum << " 其余的分块" << std::endl;
+                while (stream->device->expireTransfer(stream->socket.get(), seqnum)) {
+                }
+            }
+            finishStream(stream);
+        };
         
+        unsigned int timeout = urbTimeoutMs_ > 0 ? 0 : 1000;
+        int result = stream->device->submitTransfer(LIBUSB_TRANSFER_TYPE_BULK, stream->endpoint, std::move(packet.data),
+                                                    std::move(onChunk), timeout, stream->socket.get(), seqnum);
         if (result != 0) {
-            std::cerr << "批量传输失败: " << result << std::endl;
-            reply.ret_submit_data.status = result;
+            if (stream->budget) {
+                stream->budget->release(charged);
+            }
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            stream->pending--;
+            if (stream->status == 0) {
+                stream->status = result;
+            }
+        } else {
+            // 提交期间前面的分块可能已经失败，它的取消没有覆盖到这一块
+            bool failed;
+            {
+                std::lock_guard<std::mutex> lock(stream->mutex);
+                failed = stream->status != 0;
+            }
+            if (failed) {
+                while (stream->device->expireTransfer(stream->socket.get(), seqnum)) {
+                }
+            }
         }
     }
     
-    // 发送回复
-    return clientSocket->sendPacket(reply);
-} 
\ No newline at end of file
+    if (packet.lastSegment) {
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            stream->received = true;
+        }
+        finishStream(stream);
+    }
+    return true;
+}
+
+void USBIPServer::finishStream(const std::shared_ptr<OutStream>& stream) {
+    usbip_packet reply;
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        if (!stream->received || stream->pending > 0 || stream->replied) {
+            return;
+        }
+        stream->replied = true;
+        reply = stream->reply;
+        reply.ret_submit_data.status = stream->status;
+        reply.ret_submit_data.actual_length = stream->actual;
+    }
+    
+    std::shared_ptr<TCPSocket> target = stream->resume ? stream->resume->complete(reply) : stream->socket;
+    if (target) {
+        target->queuePacket(std::move(reply));
+    }
+}
+
+// 每个可恢复会话保留的已完成回复的上限：断开前发出但对端未收到的回复需要能够重放
+static const size_t kReplayMaxEntries = 1024;
+static const size_t kReplayMaxBytes = 8 * 1024 * 1024;
+
+bool USBIPServer::ResumeState::submit(const std::shared_ptr<TCPSocket>& socket, const usbip_packet& reply, bool resubmit) {
+    uint32_t seqnum = reply.ret_submit_data.seqnum;
+    usbip_packet replay;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto done = completed.end();
+        if (resubmit) {
+            auto running = inflight.find(seqnum);
+            if (running != inflight.end()) {
+                running->second = socket;
+                return true;
+            }
+            done = completed.find(seqnum);
+        }
+        if (done != completed.end()) {
+            replay = done->second;
+        } else if (resubmit && evicted && static_cast<int32_t>(seqnum - lowWater) <= 0) {
+            // 回复可能已随历史丢弃：再次提交会让OUT传输重复写入设备，改为报告URB被中断
+            std::cerr << "URB " << seqnum << " 的回复已超出重放历史，不再提交" << std::endl;
+            replay = reply;
+            replay.ret_submit_data.status = -104; // -ECONNRESET
+            replay.ret_submit_data.actual_length = 0;
+        } else {
+            inflight[seqnum] = socket;
+            return false;
+        }
+    }
+    
+    socket->queuePacket(std::move(replay));
+    return true;
+}
+
+USBIPServer::ResumeState::~ResumeState() {
+    if (budget && bytes > 0) {
+        budget->release(bytes);
+    }
+}
+
+std::shared_ptr<TCPSocket> USBIPServer::ResumeState::complete(usbip_packet& reply) {
+    // 负载在锁外移入共用的缓冲区：历史和发送队列各持一个引用，完成回调线程上不再拷贝
+    if (!reply.data.empty()) {
+        reply.sharedData = std::make_shared<const std::vector<uint8_t>>(std::move(reply.data));
+        reply.data.clear();
+    }
+    size_t size = reply.sharedData ? reply.sharedData->size() : 0;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t seqnum = reply.ret_submit_data.seqnum;
+    std::shared_ptr<TCPSocket> target;
+    auto running = inflight.find(seqnum);
+    if (running != inflight.end()) {
+        target = std::move(running->second);
+        inflight.erase(running);
+    }
+    
+    auto done = completed.find(seqnum);
+    if (done != completed.end()) {
+        forget(done->second);
+        order.erase(std::find(order.begin(), order.end(), seqnum));
+    }
+    completed[seqnum] = reply;
+    order.push_back(seqnum);
+    bytes += size;
+    if (budget) {
+        budget->charge(size);
+    }
+    
+    while (order.size() > kReplayMaxEntries ||
+           ((bytes > kReplayMaxBytes || (budget && budget->exhausted())) && order.size() > 1)) {
+        // 完成的顺序不一定是序列号的顺序，记下丢弃过的最大序列号（按回绕比较）
+        if (!evicted || static_cast<int32_t>(order.front() - lowWater) > 0) {
+            lowWater = order.front();
+            evicted = true;
+        }
+        auto oldest = completed.find(order.front());
+        forget(oldest->second);
+        completed.erase(oldest);
+        order.pop_front();
+    }
+    return target;
+}
+
+void USBIPServer::ResumeState::forget(const usbip_packet& entry) {
+    size_t size = entry.sharedData ? entry.sharedData->size() : 0;
+    bytes -= size;
+    if (budget) {
+        budget->release(size);
+    }
+}
+
+void USBIPServer::onUrbTimeout(const std::shared_ptr<TCPSocket>& clientSocket, uint32_t devid, uint32_t seqnum) {
+    std::shared_ptr<libusb::USBDevice> device;
+    {
+        std::lock_guard<std::mutex> lock(deviceMutex_);
+        auto it = devicesById_.find(devid);
+        if (it == devicesById_.end()) {
+            return;
+        }
+        device = it->second;
+    }
+    
+    // 已经完成的URB找不到对应的传输；取消的传输照常经完成回调回复。直通URB的每个分块都是一个传输
+    bool expired = false;
+    while (device->expireTransfer(clientSocket.get(), seqnum)) {
+        expired = true;
+    }
+    if (expired) {
+        std::cerr << "URB超过 " << urbTimeoutMs_ << " 毫秒未完成，已取消: 序列号=" << seqnum << std::endl;
+    }
+}
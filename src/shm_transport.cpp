@@ -0,0 +1,484 @@
+#include "../include/shm_transport.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define USBIP_HAVE_SHM_TRANSPORT 1
+#endif
+
+static const uint32_t kShmMagic = 0x55534d52; // "USMR"
+static const uint32_t kShmVersion = 1;
+
+// 共享内存布局：第一页放头部和两个环的控制块，之后依次是两个环的数据区
+// 环0为服务端到客户端，环1为客户端到服务端
+static const size_t kControlSize = 4096;
+static const size_t kRingOffset[2] = {1024, 2048};
+static const size_t kMaxRingSize = 1u << 30;
+
+// 经控制套接字随文件描述符一起发送的握手消息
+struct ShmHello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ringSize;
+};
+
+struct ShmTransport::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ringSize;
+    std::atomic<uint32_t> closed[2];  // 按角色记录已关闭的一端
+};
+
+// 生产者和消费者的位置分处不同的缓存行
+struct ShmTransport::Ring {
+    alignas(64) std::atomic<uint64_t> head;  // 消费者已读到的位置
+    alignas(64) std::atomic<uint64_t> tail;  // 生产者已写到的位置
+    alignas(64) std::atomic<uint32_t> readerWaiting;
+    std::atomic<uint32_t> writerWaiting;
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && std::atomic<uint64_t>::is_always_lock_free,
+              "共享内存中的原子变量必须无锁");
+
+ShmTransport::ShmTransport()
+    : controlFd_(-1), localBell_(-1), remoteBell_(-1), role_(0),
+      base_(nullptr), mapSize_(0), header_(nullptr), tx_(nullptr), rx_(nullptr),
+      txData_(nullptr), rxData_(nullptr), ringSize_(0), peerGone_(false) {
+}
+
+ShmTransport::~ShmTransport() {
+    close();
+}
+
+#ifdef USBIP_HAVE_SHM_TRANSPORT
+
+// 共享内存交出之前加上的封印：双方都不能再改变其大小（对端截短后本端访问映射会收到SIGBUS），封印本身也不能再改
+static const int kShmSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+bool ShmTransport::supported() {
+    return true;
+}
+
+bool ShmTransport::offer(int controlFd, size_t ringSize) {
+    if (ringSize == 0 || ringSize > kMaxRingSize || (ringSize & (ringSize - 1)) != 0) {
+        std::cerr << "共享内存环大小必须为2的幂: " << ringSize << std::endl;
+        return false;
+    }
+
+    int memfd = memfd_create("usbip-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        std::cerr << "创建共享内存失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    int serverBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int clientBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    bool ok = serverBell >= 0 && clientBell >= 0;
+    if (!ok) {
+        std::cerr << "创建门铃失败: " << strerror(errno) << std::endl;
+    }
+
+    if (ok && ftruncate(memfd, kControlSize + 2 * ringSize) < 0) {
+        std::cerr << "设置共享内存大小失败: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+    if (ok && fcntl(memfd, F_ADD_SEALS, kShmSeals) < 0) {
+        std::cerr << "封印共享内存失败: " << strerror(errno) << std::endl;
+        ok = false;
+    }
+
+    if (ok && map(memfd, ringSize, 0)) {
+        header_->magic = kShmMagic;
+        header_->version = kShmVersion;
+        header_->ringSize = ringSize;
+        // 两端起初都在等待数据：第一次写入就敲门铃，事件循环不必先读一次空环
+        tx_->readerWaiting.store(1, std::memory_order_relaxed);
+        rx_->readerWaiting.store(1, std::memory_order_relaxed);
+    } else {
+        ok = false;
+    }
+
+    if (ok) {
+        // 共享内存和两个门铃一起交给客户端
+        ShmHello hello = {kShmMagic, kShmVersion, ringSize};
+        struct iovec iov = {&hello, sizeof(hello)};
+        int fds[3] = {memfd, serverBell, clientBell};
+
+        union {
+            char buf[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof(control));
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        if (sendmsg(controlFd, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(hello))) {
+            std::cerr << "发送共享内存描述符失败: " << strerror(errno) << std::endl;
+            ok = false;
+        }
+    }
+
+    ::close(memfd);
+    if (!ok) {
+        if (serverBell >= 0) ::close(serverBell);
+        if (clientBell >= 0) ::close(clientBell);
+        close();
+        return false;
+    }
+
+    controlFd_ = controlFd;
+    localBell_ = serverBell;
+    remoteBell_ = clientBell;
+    return true;
+}
+
+bool ShmTransport::accept(int controlFd) {
+    ShmHello hello;
+    struct iovec iov = {&hello, sizeof(hello)};
+    int fds[3] = {-1, -1, -1};
+
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t received;
+    do {
+        received = recvmsg(controlFd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    struct cmsghdr* cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    bool ok = fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0;
+    if (!ok) {
+        std::cerr << "接收共享内存描述符失败" << (received < 0 ? std::string(": ") + strerror(errno) : std::string())
+                  << std::endl;
+    } else if (received != static_cast<ssize_t>(sizeof(hello)) || hello.magic != kShmMagic ||
+               hello.version != kShmVersion || hello.ringSize == 0 || hello.ringSize > kMaxRingSize ||
+               (hello.ringSize & (hello.ringSize - 1)) != 0) {
+        std::cerr << "共享内存握手消息无效" << std::endl;
+        ok = false;
+    } else {
+        struct stat st;
+        if (fstat(fds[0], &st) < 0 || static_cast<uint64_t>(st.st_size) != kControlSize + 2 * hello.ringSize) {
+            std::cerr << "共享内存大小与握手消息不符" << std::endl;
+            ok = false;
+        } else if ((fcntl(fds[0], F_GET_SEALS) & kShmSeals) != kShmSeals) {
+            std::cerr << "共享内存未封印，大小可能被改变" << std::endl;
+            ok = false;
+        }
+    }
+
+    if (ok && (!map(fds[0], hello.ringSize, 1) || header_->magic != kShmMagic)) {
+        ok = false;
+    }
+
+    if (fds[0] >= 0) {
+        ::close(fds[0]);
+    }
+    if (!ok) {
+        if (fds[1] >= 0) ::close(fds[1]);
+        if (fds[2] >= 0) ::close(fds[2]);
+        close();
+        return false;
+    }
+
+    controlFd_ = controlFd;
+    localBell_ = fds[2];
+    remoteBell_ = fds[1];
+    return true;
+}
+
+bool ShmTransport::map(int memfd, size_t ringSize, int role) {
+    mapSize_ = kControlSize + 2 * ringSize;
+    void* base = mmap(nullptr, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED) {
+        std::cerr << "映射共享内存失败: " << strerror(errno) << std::endl;
+        mapSize_ = 0;
+        return false;
+    }
+
+    uint8_t* bytes = static_cast<uint8_t*>(base);
+    Ring* rings[2] = {reinterpret_cast<Ring*>(bytes + kRingOffset[0]), reinterpret_cast<Ring*>(bytes + kRingOffset[1])};
+    uint8_t* data[2] = {bytes + kControlSize, bytes + kControlSize + ringSize};
+
+    base_ = base;
+    header_ = reinterpret_cast<Header*>(bytes);
+    role_ = role;
+    tx_ = rings[role];
+    rx_ = rings[1 - role];
+    txData_ = data[role];
+    rxData_ = data[1 - role];
+    ringSize_ = ringSize;
+    peerGone_ = false;
+    return true;
+}
+
+void ShmTransport::close() {
+    if (base_) {
+        // 让正在等待的对端看到关闭
+        header_->closed[role_].store(1, std::memory_order_seq_cst);
+        ringPeer();
+        munmap(base_, mapSize_);
+        base_ = nullptr;
+        header_ = nullptr;
+        tx_ = rx_ = nullptr;
+        txData_ = rxData_ = nullptr;
+    }
+    if (localBell_ >= 0) {
+        ::close(localBell_);
+        localBell_ = -1;
+    }
+    if (remoteBell_ >= 0) {
+        ::close(remoteBell_);
+        remoteBell_ = -1;
+    }
+    controlFd_ = -1;
+}
+
+bool ShmTransport::peerClosed() const {
+    return peerGone_ || header_->closed[1 - role_].load(std::memory_order_acquire) != 0;
+}
+
+void ShmTransport::ringPeer() {
+    uint64_t one = 1;
+    ssize_t ret = ::write(remoteBell_, &one, sizeof(one));
+    (void)ret; // 计数溢出时对端已经会被唤醒
+}
+
+void ShmTransport::drainBell() {
+    uint64_t value;
+    ssize_t ret = ::read(localBell_, &value, sizeof(value));
+    (void)ret;
+}
+
+bool ShmTransport::waitFor(std::atomic<uint32_t>& flag, const std::function<bool()>& ready, int timeoutMs, bool drain) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeoutMs, 0));
+
+    while (true) {
+        if (drain) {
+            drainBell();
+        }
+
+        // 先声明在等待再检查一次，对端在两者之间写入/读出时一定会看到标志并敲门铃
+        flag.store(1, std::memory_order_seq_cst);
+        if (ready()) {
+            flag.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        // 不等待：标志保持设置，对端下次写入/读出时敲门铃，由事件循环再次调用
+        if (timeoutMs == 0) {
+            errno = EAGAIN;
+            return false;
+        }
+
+        int waitMs = -1;
+        if (timeoutMs > 0) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0) {
+                flag.store(0, std::memory_order_relaxed);
+                errno = EAGAIN;
+                return false;
+            }
+            waitMs = static_cast<int>(remaining);
+        }
+
+        // 握手之后对端不再经控制套接字发送任何数据，它变为可读即表示对端已退出
+        struct pollfd fds[2];
+        fds[0].fd = localBell_;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = controlFd_;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int n = ::poll(fds, 2, waitMs);
+        if (n < 0 && errno != EINTR) {
+            flag.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        if (n > 0 && fds[1].revents != 0) {
+            peerGone_ = true;
+        }
+        drain = true;
+    }
+}
+
+bool ShmTransport::validSpan(uint64_t head, uint64_t tail) {
+    if (tail - head <= ringSize_) {
+        return true;
+    }
+
+    // 之后的拷贝都以tail - head不超过环大小为前提，不再使用该传输
+    std::cerr << "共享内存环的索引异常: head=" << head << ", tail=" << tail << "，关闭传输" << std::endl;
+    peerGone_ = true;
+    errno = EPROTO;
+    return false;
+}
+
+ssize_t ShmTransport::read(const struct iovec* iov, int iovcnt, int timeoutMs) {
+    if (!base_) {
+        errno = EBADF;
+        return -1;
+    }
+
+    uint64_t head = rx_->head.load(std::memory_order_relaxed);
+    auto available = [this, head]() {
+        return rx_->tail.load(std::memory_order_seq_cst) != head || peerClosed();
+    };
+
+    // 非阻塞读取在环空时取走门铃计数，事件循环的可读状态随之清除
+    if (rx_->tail.load(std::memory_order_acquire) == head &&
+        !waitFor(rx_->readerWaiting, available, timeoutMs, timeoutMs == 0)) {
+        return -1;
+    }
+
+    uint64_t tail = rx_->tail.load(std::memory_order_acquire);
+    if (!validSpan(head, tail)) {
+        return -1;
+    }
+    uint64_t avail = tail - head;
+    if (avail == 0) {
+        return 0; // 对端已关闭
+    }
+
+    size_t mask = ringSize_ - 1;
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < avail; i++) {
+        uint8_t* dst = static_cast<uint8_t*>(iov[i].iov_base);
+        size_t n = static_cast<size_t>(std::min<uint64_t>(iov[i].iov_len, avail - copied));
+
+        // 跨越环尾时分两段拷贝
+        size_t offset = static_cast<size_t>((head + copied) & mask);
+        size_t first = std::min(n, ringSize_ - offset);
+        memcpy(dst, rxData_ + offset, first);
+        memcpy(dst + first, rxData_, n - first);
+        copied += n;
+    }
+
+    rx_->head.store(head + copied, std::memory_order_seq_cst);
+
+    // 对端正在等待空间
+    if (rx_->writerWaiting.load(std::memory_order_seq_cst) != 0 && rx_->writerWaiting.exchange(0) != 0) {
+        ringPeer();
+    }
+    return static_cast<ssize_t>(copied);
+}
+
+ssize_t ShmTransport::write(const struct iovec* iov, int iovcnt, int timeoutMs) {
+    if (!base_) {
+        errno = EBADF;
+        return -1;
+    }
+
+    uint64_t tail = tx_->tail.load(std::memory_order_relaxed);
+    auto hasSpace = [this, tail]() {
+        return tail - tx_->head.load(std::memory_order_seq_cst) != ringSize_ || peerClosed();
+    };
+
+    if (!peerClosed() && tail - tx_->head.load(std::memory_order_acquire) == ringSize_ &&
+        !waitFor(tx_->writerWaiting, hasSpace, timeoutMs, false)) {
+        return -1;
+    }
+
+    if (peerClosed()) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    uint64_t head = tx_->head.load(std::memory_order_acquire);
+    if (!validSpan(head, tail)) {
+        return -1;
+    }
+    uint64_t space = ringSize_ - (tail - head);
+    size_t mask = ringSize_ - 1;
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < space; i++) {
+        const uint8_t* src = static_cast<const uint8_t*>(iov[i].iov_base);
+        size_t n = static_cast<size_t>(std::min<uint64_t>(iov[i].iov_len, space - copied));
+
+        size_t offset = static_cast<size_t>((tail + copied) & mask);
+        size_t first = std::min(n, ringSize_ - offset);
+        memcpy(txData_ + offset, src, first);
+        memcpy(txData_, src + first, n - first);
+        copied += n;
+    }
+
+    tx_->tail.store(tail + copied, std::memory_order_seq_cst);
+
+    // 对端正在等待数据
+    if (tx_->readerWaiting.load(std::memory_order_seq_cst) != 0 && tx_->readerWaiting.exchange(0) != 0) {
+        ringPeer();
+    }
+    return static_cast<ssize_t>(copied);
+}
+
+#else // !USBIP_HAVE_SHM_TRANSPORT
+
+bool ShmTransport::supported() { return false; }
+
+bool ShmTransport::offer(int, size_t) {
+    std::cerr << "当前系统不支持共享内存传输" << std::endl;
+    return false;
+}
+
+bool ShmTransport::accept(int) {
+    std::cerr << "当前系统不支持共享内存传输" << std::endl;
+    return false;
+}
+
+bool ShmTransport::map(int, size_t, int) { return false; }
+void ShmTransport::close() {}
+bool ShmTransport::peerClosed() const { return true; }
+void ShmTransport::ringPeer() {}
+void ShmTransport::drainBell() {}
+bool ShmTransport::validSpan(uint64_t, uint64_t) { return false; }
+bool ShmTransport::waitFor(std::atomic<uint32_t>&, const std::function<bool()>&, int, bool) { return false; }
+
+ssize_t ShmTransport::read(const struct iovec*, int, int) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t ShmTransport::write(const struct iovec*, int, int) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,218 @@
+#include "../include/timer_wheel.h"
+#include <algorithm>
+#include <climits>
+
+const unsigned TimerWheel::kLevels;
+const unsigned TimerWheel::kRootBits;
+const unsigned TimerWheel::kLevelBits;
+const uint32_t TimerWheel::kNone;
+
+// 整个轮覆盖的刻度数，更远的定时器先放在最远处
+static const uint64_t kWheelSpan = 1ull << 26;
+
+TimerWheel::TimerWheel(Clock::time_point now)
+    : origin_(now), current_(0), heads_(levelBase(kLevels), kNone), active_(0) {
+}
+
+unsigned TimerWheel::levelBase(unsigned level) {
+    return level == 0 ? 0 : (1u << kRootBits) + (level - 1) * (1u << kLevelBits);
+}
+
+unsigned TimerWheel::levelSlots(unsigned level) {
+    return level == 0 ? 1u << kRootBits : 1u << kLevelBits;
+}
+
+unsigned TimerWheel::levelShift(unsigned level) {
+    return level == 0 ? 0 : kRootBits + (level - 1) * kLevelBits;
+}
+
+uint64_t TimerWheel::tickOf(Clock::time_point t, bool roundUp) const {
+    if (t <= origin_) {
+        return 0;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t - origin_).count();
+    uint64_t ticks = static_cast<uint64_t>(ns) / 1000000;
+    if (roundUp && static_cast<uint64_t>(ns) % 1000000 != 0) {
+        ticks++;
+    }
+    return ticks;
+}
+
+TimerWheel::TimerId TimerWheel::schedule(Clock::time_point deadline, Callback callback) {
+    uint32_t index;
+    if (!free_.empty()) {
+        index = free_.back();
+        free_.pop_back();
+    } else {
+        index = static_cast<uint32_t>(entries_.size());
+        entries_.push_back(Entry{0, nullptr, 1, kNone, kNone, kNone});
+    }
+
+    Entry& entry = entries_[index];
+    entry.expiry = tickOf(deadline, true);
+    entry.callback = std::move(callback);
+    place(index);
+    active_++;
+    return static_cast<uint64_t>(entry.generation) << 32 | index;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+    uint32_t index = static_cast<uint32_t>(id);
+    if (index >= entries_.size()) {
+        return false;
+    }
+
+    Entry& entry = entries_[index];
+    if (entry.generation != static_cast<uint32_t>(id >> 32) || entry.slot == kNone) {
+        return false;
+    }
+
+    unlink(index);
+    release(index);
+    active_--;
+    return true;
+}
+
+void TimerWheel::place(uint32_t index) {
+    Entry& entry = entries_[index];
+    // 已过期的定时器在下一个刻度处理
+    uint64_t expiry = std::max(entry.expiry, current_);
+    uint64_t delta = std::min(expiry - current_, kWheelSpan - 1);
+    expiry = current_ + delta;
+
+    unsigned level = 0;
+    while (level + 1 < kLevels && delta >= (1ull << levelShift(level + 1))) {
+        level++;
+    }
+    uint64_t slot = (expiry >> levelShift(level)) & (levelSlots(level) - 1);
+    link(index, levelBase(level) + static_cast<uint32_t>(slot));
+}
+
+void TimerWheel::link(uint32_t index, uint32_t slot) {
+    Entry& entry = entries_[index];
+    entry.slot = slot;
+    entry.prev = kNone;
+    entry.next = heads_[slot];
+    if (entry.next != kNone) {
+        entries_[entry.next].prev = index;
+    }
+    heads_[slot] = index;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Entry& entry = entries_[index];
+    if (entry.prev != kNone) {
+        entries_[entry.prev].next = entry.next;
+    } else {
+        heads_[entry.slot] = entry.next;
+    }
+    if (entry.next != kNone) {
+        entries_[entry.next].prev = entry.prev;
+    }
+    entry.slot = kNone;
+    entry.prev = entry.next = kNone;
+}
+
+void TimerWheel::release(uint32_t index) {
+    Entry& entry = entries_[index];
+    entry.callback = nullptr;
+    // 代数跳过0，保证标识不为0
+    if (++entry.generation == 0) {
+        entry.generation = 1;
+    }
+    free_.push_back(index);
+}
+
+unsigned TimerWheel::cascade(unsigned level) {
+    unsigned slot = static_cast<unsigned>((current_ >> levelShift(level)) & (levelSlots(level) - 1));
+    uint32_t index = heads_[levelBase(level) + slot];
+    heads_[levelBase(level) + slot] = kNone;
+
+    while (index != kNone) {
+        uint32_t next = entries_[index].next;
+        place(index);
+        index = next;
+    }
+    return slot;
+}
+
+size_t TimerWheel::advance(Clock::time_point now) {
+    uint64_t target = tickOf(now, false);
+    if (active_ == 0) {
+        // 没有定时器时直接跳到当前时刻
+        current_ = std::max(current_, target + 1);
+        return 0;
+    }
+
+    std::vector<Callback> expired;
+    while (current_ <= target) {
+        // 到达第1层一个槽的起点时级联，该层转完一圈时继续级联更上一层
+        unsigned index = static_cast<unsigned>(current_ & (levelSlots(0) - 1));
+        if (index == 0) {
+            for (unsigned level = 1; level < kLevels && cascade(level) == 0; level++) {
+            }
+        }
+
+        uint32_t entry = heads_[index];
+        heads_[index] = kNone;
+        std::vector<uint32_t> later;
+        while (entry != kNone) {
+            uint32_t next = entries_[entry].next;
+            entries_[entry].slot = kNone;
+            if (entries_[entry].expiry > current_) {
+                // 超出轮的范围时放在了最远处，还没到真正的到期时间
+                later.push_back(entry);
+            } else {
+                expired.push_back(std::move(entries_[entry].callback));
+                release(entry);
+                active_--;
+            }
+            entry = next;
+        }
+
+        current_++;
+        for (uint32_t i : later) {
+            place(i);
+        }
+    }
+
+    // 回调在全部到期的定时器摘下之后执行，其中添加的定时器最早在下一个刻度到期
+    for (auto& callback : expired) {
+        callback();
+    }
+    return expired.size();
+}
+
+int TimerWheel::nextTimeoutMs(Clock::time_point now) const {
+    if (active_ == 0) {
+        return -1;
+    }
+
+    // 第0层中最早的非空槽
+    uint64_t next = UINT64_MAX;
+    for (uint64_t tick = current_; tick < current_ + levelSlots(0); tick++) {
+        if (heads_[tick & (levelSlots(0) - 1)] != kNone) {
+            next = tick;
+            break;
+        }
+    }
+
+    // 上层中最早需要级联的槽：级联发生在该槽覆盖范围的起点
+    for (unsigned level = 1; level < kLevels; level++) {
+        unsigned shift = levelShift(level);
+        uint64_t first = (current_ + (1ull << shift) - 1) >> shift;
+        for (uint64_t i = first; i < first + levelSlots(level); i++) {
+            if (heads_[levelBase(level) + (i & (levelSlots(level) - 1))] != kNone) {
+                next = std::min(next, i << shift);
+                break;
+            }
+        }
+    }
+
+    Clock::time_point at = origin_ + std::chrono::milliseconds(next);
+    if (at <= now) {
+        return 0;
+    }
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(at - now).count();
+    return static_cast<int>(std::min<int64_t>((wait + 999) / 1000, INT_MAX));
+}
@@ -0,0 +1,387 @@
+#include "../include/tls.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#ifdef USBIP_HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+// 用户态加密时把小段拼成一个记录再写出，避免每个帧头单独成为一个记录
+static const size_t kMaxRecordPayload = 16 * 1024;
+
+// 取出并打印OpenSSL错误队列中的所有错误
+static void printErrors(const char* what) {
+    unsigned long err;
+    bool printed = false;
+    while ((err = ERR_get_error()) != 0) {
+        char buf[256];
+        ERR_error_string_n(err, buf, sizeof(buf));
+        std::cerr << what << ": " << buf << std::endl;
+        printed = true;
+    }
+    if (!printed) {
+        std::cerr << what << std::endl;
+    }
+}
+
+// 只用TLS 1.3，优先AES-GCM（内核TLS和AES-NI都支持）
+static SSL_CTX* newContext(const SSL_METHOD* method) {
+    SSL_CTX* ctx = SSL_CTX_new(method);
+    if (!ctx) {
+        printErrors("创建TLS上下文失败");
+        return nullptr;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    return ctx;
+}
+
+bool TlsContext::supported() {
+    return true;
+}
+
+std::shared_ptr<TlsContext> TlsContext::createServer(const std::string& certFile, const std::string& keyFile) {
+    SSL_CTX* ctx = newContext(TLS_server_method());
+    if (!ctx) {
+        return nullptr;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        printErrors("加载TLS证书或私钥失败");
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    // 不发会话票据：握手之后的票据记录会让内核TLS接收方向返回EIO，而连接本就长期保持
+    SSL_CTX_set_num_tickets(ctx, 0);
+    return std::shared_ptr<TlsContext>(new TlsContext(ctx, true));
+}
+
+std::shared_ptr<TlsContext> TlsContext::createClient(const std::string& caFile) {
+    SSL_CTX* ctx = newContext(TLS_client_method());
+    if (!ctx) {
+        return nullptr;
+    }
+
+    int loaded = caFile.empty() ? SSL_CTX_set_default_verify_paths(ctx)
+                                : SSL_CTX_load_verify_locations(ctx, caFile.c_str(), nullptr);
+    if (loaded != 1) {
+        printErrors("加载TLS信任证书失败");
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    return std::shared_ptr<TlsContext>(new TlsContext(ctx, false));
+}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(static_cast<SSL_CTX*>(ctx_));
+}
+
+TlsSession::TlsSession(std::shared_ptr<TlsContext> context)
+    : context_(std::move(context)), ssl_(nullptr), kernelSend_(false), kernelRecv_(false) {
+}
+
+TlsSession::~TlsSession() {
+    close();
+}
+
+// 握手期间以收发超时限制阻塞套接字的等待，结束后恢复原值
+class HandshakeTimeout {
+public:
+    HandshakeTimeout(int fd, int timeoutMs) : fd_(fd) {
+        socklen_t len = sizeof(savedRecv_);
+        getsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &savedRecv_, &len);
+        len = sizeof(savedSend_);
+        getsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &savedSend_, &len);
+
+        struct timeval tv;
+        tv.tv_sec = timeoutMs / 1000;
+        tv.tv_usec = (timeoutMs % 1000) * 1000;
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    ~HandshakeTimeout() {
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &savedRecv_, sizeof(savedRecv_));
+        setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &savedSend_, sizeof(savedSend_));
+    }
+
+private:
+    int fd_;
+    struct timeval savedRecv_;
+    struct timeval savedSend_;
+};
+
+bool TlsSession::begin(int fd, const std::string& peerHost) {
+    SSL* ssl = SSL_new(static_cast<SSL_CTX*>(context_->native()));
+    if (!ssl || SSL_set_fd(ssl, fd) != 1) {
+        printErrors("创建TLS会话失败");
+        SSL_free(ssl);
+        return false;
+    }
+    ssl_ = ssl;
+
+    if (context_->isServer()) {
+        SSL_set_accept_state(ssl);
+    } else {
+        SSL_set_connect_state(ssl);
+
+        // 按IP地址或主机名验证服务端证书
+        struct in6_addr addr;
+        bool isIp = inet_pton(AF_INET, peerHost.c_str(), &addr) == 1 || inet_pton(AF_INET6, peerHost.c_str(), &addr) == 1;
+        X509_VERIFY_PARAM* param = SSL_get0_param(ssl);
+        if (isIp) {
+            X509_VERIFY_PARAM_set1_ip_asc(param, peerHost.c_str());
+        } else {
+            SSL_set_tlsext_host_name(ssl, peerHost.c_str());
+            SSL_set1_host(ssl, peerHost.c_str());
+        }
+    }
+    return true;
+}
+
+TlsSession::Progress TlsSession::step() {
+    SSL* ssl = static_cast<SSL*>(ssl_);
+    if (!ssl) {
+        return Progress::Failed;
+    }
+
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_do_handshake(ssl);
+    if (result == 1) {
+#ifndef OPENSSL_NO_KTLS
+        kernelSend_ = BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+        kernelRecv_ = BIO_get_ktls_recv(SSL_get_rbio(ssl)) != 0;
+#endif
+        return Progress::Done;
+    }
+
+    // 非阻塞套接字暂时没有数据或发不出去，被信号中断时同样如此（errno为EINTR）
+    int err = SSL_get_error(ssl, result);
+    if (err == SSL_ERROR_WANT_READ) {
+        return Progress::WantRead;
+    }
+    if (err == SSL_ERROR_WANT_WRITE) {
+        return Progress::WantWrite;
+    }
+
+    if (!context_->isServer() && SSL_get_verify_result(ssl) != X509_V_OK) {
+        std::cerr << "TLS证书验证失败: " << X509_verify_cert_error_string(SSL_get_verify_result(ssl)) << std::endl;
+    }
+    printErrors("TLS握手失败");
+    close(false);
+    return Progress::Failed;
+}
+
+bool TlsSession::handshake(int fd, const std::string& peerHost, int timeoutMs) {
+    if (!begin(fd, peerHost)) {
+        return false;
+    }
+
+    // 阻塞套接字上只有等待超时或被信号中断时才会返回WantRead/WantWrite，被中断时继续
+    Progress progress;
+    {
+        HandshakeTimeout timeout(fd, timeoutMs);
+        do {
+            progress = step();
+        } while ((progress == Progress::WantRead || progress == Progress::WantWrite) && errno == EINTR);
+    }
+    if (progress == Progress::Done) {
+        return true;
+    }
+
+    if (progress != Progress::Failed) {
+        std::cerr << "TLS握手超时" << std::endl;
+        close(false);
+    }
+    return false;
+}
+
+std::string TlsSession::description() const {
+    SSL* ssl = static_cast<SSL*>(ssl_);
+    if (!ssl) {
+        return "";
+    }
+
+    std::string text = std::string(SSL_get_version(ssl)) + " " + SSL_get_cipher_name(ssl) + "，内核TLS: ";
+    if (kernelSend_ && kernelRecv_) {
+        text += "收发";
+    } else if (kernelSend_) {
+        text += "仅发送";
+    } else if (kernelRecv_) {
+        text += "仅接收";
+    } else {
+        text += "未启用";
+    }
+    return text;
+}
+
+bool TlsSession::pending() const {
+    return ssl_ && SSL_has_pending(static_cast<SSL*>(ssl_)) == 1;
+}
+
+ssize_t TlsSession::read(const struct iovec* iov, int iovcnt) {
+    SSL* ssl = static_cast<SSL*>(ssl_);
+    size_t total = 0;
+    int index = 0;
+    size_t used = 0;
+
+    // 按readv的语义依次填满各段。已解密未取走的数据不会再触发套接字可读，这里尽量取完
+    while (index < iovcnt) {
+        if (used == iov[index].iov_len) {
+            index++;
+            used = 0;
+            continue;
+        }
+
+        size_t n = 0;
+        ERR_clear_error();
+        errno = 0;
+        if (SSL_read_ex(ssl, static_cast<uint8_t*>(iov[index].iov_base) + used, iov[index].iov_len - used, &n) != 1) {
+            int err = SSL_get_error(ssl, 0);
+            if (total > 0) {
+                break;
+            }
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                // 被信号中断时保留EINTR，由调用者重试
+                if (errno != EINTR) {
+                    errno = EAGAIN;
+                }
+                return -1;
+            }
+            if (err == SSL_ERROR_ZERO_RETURN) {
+                return 0;
+            }
+            if (err == SSL_ERROR_SYSCALL) {
+                // errno为0表示对端未发close_notify直接断开，按连接关闭处理；否则errno由套接字调用设置
+                return errno == 0 ? 0 : -1;
+            }
+            printErrors("TLS接收失败");
+            errno = EPROTO;
+            return -1;
+        }
+
+        // 已解密的数据取完即返回，阻塞套接字上不再等待下一个记录
+        total += n;
+        used += n;
+        if (SSL_pending(ssl) == 0) {
+            break;
+        }
+    }
+    return static_cast<ssize_t>(total);
+}
+
+ssize_t TlsSession::write(const struct iovec* iov, int iovcnt) {
+    SSL* ssl = static_cast<SSL*>(ssl_);
+
+    // 大段直接写出，小段拼成不超过一个记录的缓冲区；重试时同样的数据拼出同样的开头
+    const void* data;
+    size_t len;
+    std::vector<uint8_t> staging;
+    if (iovcnt == 1 || iov[0].iov_len >= kMaxRecordPayload) {
+        data = iov[0].iov_base;
+        len = iov[0].iov_len;
+    } else {
+        for (int i = 0; i < iovcnt && staging.size() < kMaxRecordPayload; i++) {
+            size_t take = std::min(iov[i].iov_len, kMaxRecordPayload - staging.size());
+            const uint8_t* p = static_cast<const uint8_t*>(iov[i].iov_base);
+            staging.insert(staging.end(), p, p + take);
+        }
+        data = staging.data();
+        len = staging.size();
+    }
+
+    size_t written = 0;
+    ERR_clear_error();
+    errno = 0;
+    if (SSL_write_ex(ssl, data, len, &written) != 1) {
+        int err = SSL_get_error(ssl, 0);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+            if (errno != EINTR) {
+                errno = EAGAIN;
+            }
+            return -1;
+        }
+        if (err == SSL_ERROR_SYSCALL && errno != 0) {
+            return -1;
+        }
+        printErrors("TLS发送失败");
+        errno = EPIPE;
+        return -1;
+    }
+    return static_cast<ssize_t>(written);
+}
+
+void TlsSession::close(bool notifyPeer) {
+    SSL* ssl = static_cast<SSL*>(ssl_);
+    if (!ssl) {
+        return;
+    }
+
+    // 尽力发出close_notify，不等待对端回应
+    if (notifyPeer) {
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+    }
+    ERR_clear_error();
+    SSL_free(ssl);
+    ssl_ = nullptr;
+}
+
+#else // !USBIP_HAVE_OPENSSL
+
+bool TlsContext::supported() { return false; }
+
+std::shared_ptr<TlsContext> TlsContext::createServer(const std::string&, const std::string&) {
+    std::cerr << "编译时未启用OpenSSL，不支持TLS" << std::endl;
+    return nullptr;
+}
+
+std::shared_ptr<TlsContext> TlsContext::createClient(const std::string&) {
+    std::cerr << "编译时未启用OpenSSL，不支持TLS" << std::endl;
+    return nullptr;
+}
+
+TlsContext::~TlsContext() {}
+
+TlsSession::TlsSession(std::shared_ptr<TlsContext> context)
+    : context_(std::move(context)), ssl_(nullptr), kernelSend_(false), kernelRecv_(false) {
+}
+
+TlsSession::~TlsSession() {}
+
+bool TlsSession::handshake(int, const std::string&, int) { return false; }
+bool TlsSession::begin(int, const std::string&) { return false; }
+TlsSession::Progress TlsSession::step() { return Progress::Failed; }
+std::string TlsSession::description() const { return ""; }
+void TlsSession::close(bool) {}
+bool TlsSession::pending() const { return false; }
+
+ssize_t TlsSession::read(const struct iovec*, int) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t TlsSession::write(const struct iovec*, int) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
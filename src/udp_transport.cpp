@@ -0,0 +1,946 @@
+#include "../include/udp_transport.h"
+#include "../include/usbip_wire.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define USBIP_HAVE_DATAGRAM_TRANSPORT 1
+#endif
+
+const size_t DatagramTransport::kMaxPayload;
+const size_t DatagramTransport::kMaxBuffered;
+
+// 握手消息：2字节标记加2字节UDP端口
+static const uint8_t kHelloMagic[2] = {'U', 'D'};
+static const size_t kHelloSize = 4;
+static const int kHandshakeTimeoutMs = 5000;
+
+// 数据报类型
+static const uint8_t kTypeData = 1;
+static const uint8_t kTypeAck = 2;
+static const uint8_t kFlagLast = 0x01;  // 帧的最后一段
+
+// 数据报头部：类型(1) 标志(1) 流(2) 包号(4) 帧序号(4) 段在帧中的偏移(4)
+// 确认：类型(1) 保留(1) 区间数(2) 之后每个区间为起止包号(4+4)，从最新的区间开始
+static const size_t kDataHeaderSize = 16;
+static const size_t kAckHeaderSize = 4;
+static const size_t kMaxAckRanges = 64;
+static const size_t kDatagramSize = kDataHeaderSize + DatagramTransport::kMaxPayload;
+
+static const size_t kBatchSize = 32;
+static const size_t kRxBufferSize = 2048;
+static const int kSocketBufferSize = 4 * 1024 * 1024;
+static const size_t kMaxFrameSize = 64 * 1024 * 1024;
+
+// 接收方向的上限：每个流最多缓存这么多帧序号之内的帧，流的数量，以及拼装中和待读出的帧合计的字节。
+// 字节上限容得下一个最大的帧加上对端全部未确认的数据，正常的发送方不会触及
+static const uint32_t kReorderWindow = 1024;
+static const size_t kMaxRxStreams = 1024;
+static const size_t kMaxRxBytes = kMaxFrameSize + DatagramTransport::kMaxBuffered;
+
+// 拥塞窗口（按数据报字节计）
+static const size_t kInitialWindow = 32 * kDatagramSize;
+static const size_t kMinWindow = 4 * kDatagramSize;
+
+// 一次最多连续发出的数据报，限速时令牌桶的容量
+static const double kMaxBurst = 16 * kDatagramSize;
+
+// 包号落后最新确认这么多即判为丢失
+static const uint32_t kReorderThreshold = 3;
+
+static const std::chrono::milliseconds kInitialRto(200);
+static const std::chrono::milliseconds kMinRto(5);
+static const std::chrono::milliseconds kMaxRto(2000);
+static const unsigned kMaxTimeouts = 8;
+
+DatagramTransport::DatagramTransport()
+    : controlFd_(-1), udpFd_(-1), timerFd_(-1), epollFd_(-1), failed_(false),
+      nextPacket_(0), bufferedBytes_(0), inflightBytes_(0),
+      cwnd_(kInitialWindow), ssthresh_(kMaxBuffered), largestAcked_(0), recoveryPacket_(0),
+      haveRtt_(false), srtt_(kInitialRto), rttvar_(kInitialRto / 2), timeouts_(0), tokens_(kMaxBurst),
+      ackDue_(false), readOffset_(0), rxBytes_(0), lossRate_(0), lossRng_(std::random_device{}()) {
+}
+
+DatagramTransport::~DatagramTransport() {
+    close();
+}
+
+void DatagramTransport::setInducedLoss(double rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lossRate_ = std::min(std::max(rate, 0.0), 1.0);
+}
+
+DatagramTransport::Stats DatagramTransport::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+#ifdef USBIP_HAVE_DATAGRAM_TRANSPORT
+
+bool DatagramTransport::supported() {
+    return true;
+}
+
+// 在控制连接上收发握手消息，阻塞套接字也以poll限制等待时间
+static bool sendHello(int fd, uint16_t port) {
+    uint8_t hello[kHelloSize];
+    memcpy(hello, kHelloMagic, sizeof(kHelloMagic));
+    usbip_wire::storeBE(hello + 2, 2, port);
+
+    size_t sent = 0;
+    while (sent < kHelloSize) {
+        ssize_t n = ::send(fd, hello + sent, kHelloSize - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "发送数据报传输握手失败: " << strerror(errno) << std::endl;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+static bool parseHello(const uint8_t* hello, uint16_t& port) {
+    if (memcmp(hello, kHelloMagic, sizeof(kHelloMagic)) != 0) {
+        std::cerr << "数据报传输握手格式错误" << std::endl;
+        return false;
+    }
+    port = static_cast<uint16_t>(usbip_wire::loadBE(hello + 2, 2));
+    return true;
+}
+
+static bool receiveHello(int fd, uint16_t& port) {
+    uint8_t hello[kHelloSize];
+    size_t got = 0;
+    while (got < kHelloSize) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = ::poll(&pfd, 1, kHandshakeTimeoutMs);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            std::cerr << "等待数据报传输握手超时" << std::endl;
+            return false;
+        }
+
+        ssize_t n = ::recv(fd, hello + got, kHelloSize - got, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            std::cerr << "接收数据报传输握手失败: " << (n == 0 ? "连接已关闭" : strerror(errno)) << std::endl;
+            return false;
+        }
+        got += n;
+    }
+
+    return parseHello(hello, port);
+}
+
+static void setPort(struct sockaddr_storage& addr, uint16_t port) {
+    if (addr.ss_family == AF_INET6) {
+        reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_port = htons(port);
+    } else {
+        reinterpret_cast<struct sockaddr_in*>(&addr)->sin_port = htons(port);
+    }
+}
+
+static uint16_t getPort(const struct sockaddr_storage& addr) {
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<const struct sockaddr_in6*>(&addr)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<const struct sockaddr_in*>(&addr)->sin_port);
+}
+
+bool DatagramTransport::open(int family, const struct sockaddr* local, socklen_t localLen) {
+    udpFd_ = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (udpFd_ < 0) {
+        std::cerr << "创建UDP套接字失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // 批量传输时一个窗口的数据报可能同时到达，缓冲区太小会在本机丢包
+    setsockopt(udpFd_, SOL_SOCKET, SO_RCVBUF, &kSocketBufferSize, sizeof(kSocketBufferSize));
+    setsockopt(udpFd_, SOL_SOCKET, SO_SNDBUF, &kSocketBufferSize, sizeof(kSocketBufferSize));
+
+    if (::bind(udpFd_, local, localLen) < 0) {
+        std::cerr << "绑定UDP套接字失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (timerFd_ < 0 || epollFd_ < 0) {
+        std::cerr << "创建数据报传输定时器失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // UDP套接字、定时器和控制连接任一可读，pollFd即可读
+    for (int fd : {udpFd_, timerFd_, controlFd_}) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = fd == controlFd_ ? EPOLLIN | EPOLLRDHUP : EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            std::cerr << "注册数据报传输描述符失败: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+
+    rxBuffers_.resize(kBatchSize * kRxBufferSize);
+    batch_.reserve(kBatchSize);
+    lastRefill_ = Clock::now();
+    return true;
+}
+
+bool DatagramTransport::connectPeer(int controlFd, uint16_t port) {
+    struct sockaddr_storage peer;
+    socklen_t peerLen = sizeof(peer);
+    if (getpeername(controlFd, reinterpret_cast<struct sockaddr*>(&peer), &peerLen) < 0) {
+        std::cerr << "获取对端地址失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    setPort(peer, port);
+    if (::connect(udpFd_, reinterpret_cast<struct sockaddr*>(&peer), peerLen) < 0) {
+        std::cerr << "连接对端UDP端口失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// 控制连接的本地地址（端口置0），UDP套接字绑定在同一地址上由系统分配端口
+static bool localAddress(int controlFd, struct sockaddr_storage& local, socklen_t& localLen) {
+    localLen = sizeof(local);
+    if (getsockname(controlFd, reinterpret_cast<struct sockaddr*>(&local), &localLen) < 0) {
+        std::cerr << "获取本地地址失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    setPort(local, 0);
+    return true;
+}
+
+bool DatagramTransport::beginOffer(int controlFd) {
+    controlFd_ = controlFd;
+    hello_.clear();
+
+    struct sockaddr_storage local;
+    socklen_t localLen;
+    if (!localAddress(controlFd, local, localLen) ||
+        !open(local.ss_family, reinterpret_cast<struct sockaddr*>(&local), localLen)) {
+        close();
+        return false;
+    }
+
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    getsockname(udpFd_, reinterpret_cast<struct sockaddr*>(&bound), &boundLen);
+
+    // 新连接的发送缓冲区总能放下4字节的握手消息
+    if (!sendHello(controlFd, getPort(bound))) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool DatagramTransport::continueOffer(bool& done) {
+    done = false;
+
+    uint8_t hello[kHelloSize];
+    while (hello_.size() < kHelloSize) {
+        ssize_t n = ::recv(controlFd_, hello, kHelloSize - hello_.size(), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            std::cerr << "接收数据报传输握手失败: " << (n == 0 ? "连接已关闭" : strerror(errno)) << std::endl;
+            close();
+            return false;
+        }
+        hello_.insert(hello_.end(), hello, hello + n);
+    }
+
+    uint16_t peerPort;
+    if (!parseHello(hello_.data(), peerPort) || !connectPeer(controlFd_, peerPort)) {
+        close();
+        return false;
+    }
+
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    getsockname(udpFd_, reinterpret_cast<struct sockaddr*>(&bound), &boundLen);
+    std::cout << "数据报传输已建立: 本端UDP端口 " << getPort(bound) << "，对端 " << peerPort << std::endl;
+    done = true;
+    return true;
+}
+
+bool DatagramTransport::accept(int controlFd) {
+    controlFd_ = controlFd;
+
+    uint16_t peerPort;
+    struct sockaddr_storage local;
+    socklen_t localLen;
+    if (!receiveHello(controlFd, peerPort) || !localAddress(controlFd, local, localLen) ||
+        !open(local.ss_family, reinterpret_cast<struct sockaddr*>(&local), localLen) ||
+        !connectPeer(controlFd, peerPort)) {
+        close();
+        return false;
+    }
+
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    getsockname(udpFd_, reinterpret_cast<struct sockaddr*>(&bound), &boundLen);
+    if (!sendHello(controlFd, getPort(bound))) {
+        close();
+        return false;
+    }
+
+    std::cout << "数据报传输已建立: 本端UDP端口 " << getPort(bound) << "，对端 " << peerPort << std::endl;
+    return true;
+}
+
+void DatagramTransport::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int* fd : {&epollFd_, &timerFd_, &udpFd_}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    failed_ = true;
+    pending_.clear();
+    inflight_.clear();
+    ready_.clear();
+    rxStreams_.clear();
+    rxBytes_ = 0;
+}
+
+ssize_t DatagramTransport::read(const struct iovec* iov, int iovcnt, int timeoutMs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while (true) {
+        if (udpFd_ < 0) {
+            errno = EBADF;
+            return -1;
+        }
+        service();
+
+        if (!ready_.empty()) {
+            break;
+        }
+        if (failed_) {
+            return 0;
+        }
+
+        int remaining = -1;
+        if (timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+            if (timeoutMs == 0 || left <= 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+            remaining = static_cast<int>(left);
+        }
+        wait(lock, remaining);
+    }
+
+    // 依次拷出已到齐的帧
+    size_t total = 0;
+    int index = 0;
+    size_t used = 0;
+    while (!ready_.empty() && index < iovcnt) {
+        const std::vector<uint8_t>& frame = ready_.front();
+        size_t n = std::min(frame.size() - readOffset_, iov[index].iov_len - used);
+        memcpy(static_cast<uint8_t*>(iov[index].iov_base) + used, frame.data() + readOffset_, n);
+        readOffset_ += n;
+        used += n;
+        total += n;
+
+        if (readOffset_ == frame.size()) {
+            rxBytes_ -= frame.size();
+            ready_.pop_front();
+            readOffset_ = 0;
+        }
+        if (used == iov[index].iov_len) {
+            index++;
+            used = 0;
+        }
+    }
+    return static_cast<ssize_t>(total);
+}
+
+void DatagramTransport::poll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    service();
+}
+
+bool DatagramTransport::sendFrame(uint16_t stream, const struct iovec* iov, int iovcnt, int timeoutMs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    // 未确认的数据过多时等待对端确认；阻塞等待期间收到的帧留给read()
+    while (!failed_ && bufferedBytes_ >= kMaxBuffered) {
+        int remaining = -1;
+        if (timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+            if (timeoutMs == 0 || left <= 0) {
+                errno = EAGAIN;
+                return false;
+            }
+            remaining = static_cast<int>(left);
+        }
+        wait(lock, remaining);
+        service();
+    }
+
+    if (failed_ || udpFd_ < 0) {
+        errno = EPIPE;
+        return false;
+    }
+
+    auto frame = std::make_shared<std::vector<uint8_t>>();
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t* p = static_cast<const uint8_t*>(iov[i].iov_base);
+        frame->insert(frame->end(), p, p + iov[i].iov_len);
+    }
+    if (frame->size() > kMaxFrameSize) {
+        std::cerr << "帧过大，无法经数据报传输发送: " << frame->size() << " 字节" << std::endl;
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    // 切成数据报大小的段，空帧也占一段
+    uint32_t frameSeq = nextFrameSeq_[stream]++;
+    uint32_t offset = 0;
+    do {
+        Fragment fragment;
+        fragment.frame = frame;
+        fragment.stream = stream;
+        fragment.frameSeq = frameSeq;
+        fragment.offset = offset;
+        fragment.len = static_cast<uint32_t>(std::min(frame->size() - offset, kMaxPayload));
+        fragment.last = offset + fragment.len == frame->size();
+        pending_.push_back(fragment);
+        offset += fragment.len;
+    } while (offset < frame->size());
+    bufferedBytes_ += frame->size();
+
+    // 只发出数据，不在这里收取：事件循环中收到的帧必须经可读事件交给read()
+    Clock::time_point now = Clock::now();
+    sendPending(now);
+    armTimer(now);
+    return true;
+}
+
+void DatagramTransport::service() {
+    if (udpFd_ < 0) {
+        return;
+    }
+
+    struct epoll_event events[3];
+    int n = epoll_wait(epollFd_, events, 3, 0);
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == udpFd_) {
+            receiveBatch();
+        } else if (fd == timerFd_) {
+            uint64_t expirations;
+            while (::read(timerFd_, &expirations, sizeof(expirations)) < 0 && errno == EINTR) {
+            }
+        } else if (fd == controlFd_ && peerClosed()) {
+            failed_ = true;
+        }
+    }
+
+    Clock::time_point now = Clock::now();
+    detectLoss(now);
+    onTimeout(now);
+
+    // 确认排在数据之前，和本轮的数据一起批量发出
+    if (ackDue_) {
+        queueAck();
+    }
+    sendPending(now);
+    armTimer(now);
+}
+
+bool DatagramTransport::peerClosed() {
+    // 握手之后对端不再经控制连接发送数据，它可读即表示对端已退出
+    char byte;
+    ssize_t n = ::recv(controlFd_, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return !(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+bool DatagramTransport::wait(std::unique_lock<std::mutex>& lock, int timeoutMs) {
+    struct pollfd pfd = {epollFd_, POLLIN, 0};
+    lock.unlock();
+    int ready = ::poll(&pfd, 1, timeoutMs);
+    lock.lock();
+    return ready > 0;
+}
+
+void DatagramTransport::receiveBatch() {
+    struct mmsghdr msgs[kBatchSize];
+    struct iovec iov[kBatchSize];
+
+    while (udpFd_ >= 0) {
+        memset(msgs, 0, sizeof(msgs));
+        for (size_t i = 0; i < kBatchSize; i++) {
+            iov[i].iov_base = rxBuffers_.data() + i * kRxBufferSize;
+            iov[i].iov_len = kRxBufferSize;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = ::recvmmsg(udpFd_, msgs, kBatchSize, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // EAGAIN：已收完；ECONNREFUSED：对端端口暂不可达，由控制连接判断对端是否退出
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            const uint8_t* p = static_cast<const uint8_t*>(iov[i].iov_base);
+            size_t len = msgs[i].msg_len;
+            stats_.datagramsReceived++;
+            if (len >= kDataHeaderSize && p[0] == kTypeData) {
+                onData(p, len);
+            } else if (len >= kAckHeaderSize && p[0] == kTypeAck) {
+                onAck(p, len);
+            }
+        }
+
+        if (static_cast<size_t>(n) < kBatchSize) {
+            return;
+        }
+    }
+}
+
+void DatagramTransport::onData(const uint8_t* p, size_t len) {
+    uint8_t flags = p[1];
+    uint16_t streamId = static_cast<uint16_t>(usbip_wire::loadBE(p + 2, 2));
+    uint32_t packet = usbip_wire::loadBE32(p + 4);
+    uint32_t frameSeq = usbip_wire::loadBE32(p + 8);
+    uint32_t offset = usbip_wire::loadBE32(p + 12);
+    size_t dataLen = len - kDataHeaderSize;
+
+    // 记录包号，相邻的区间合并
+    auto next = received_.upper_bound(packet);
+    auto prev = next == received_.begin() ? received_.end() : std::prev(next);
+    if (prev != received_.end() && packet <= prev->second) {
+        stats_.duplicates++;
+        ackDue_ = true;
+        return;
+    }
+
+    // 放不下的段丢弃且不确认：对端稍后重传，重传超时同时让它收缩拥塞窗口，
+    // 本端读出已到齐的帧之后才再次接受
+    if (!admitSegment(streamId, frameSeq, offset + dataLen)) {
+        stats_.refused++;
+        return;
+    }
+
+    if (prev != received_.end() && prev->second + 1 == packet) {
+        prev->second = packet;
+    } else {
+        prev = received_.emplace(packet, packet).first;
+    }
+    if (next != received_.end() && next->first == prev->second + 1) {
+        prev->second = next->second;
+        received_.erase(next);
+    }
+    while (received_.size() > kMaxAckRanges) {
+        received_.erase(received_.begin());
+    }
+    ackDue_ = true;
+
+    // 除最后一段外每段都恰好kMaxPayload字节
+    bool last = (flags & kFlagLast) != 0;
+    if (offset % kMaxPayload != 0 || dataLen > kMaxPayload || (!last && dataLen != kMaxPayload) ||
+        offset + dataLen > kMaxFrameSize) {
+        return;
+    }
+
+    RxStream& stream = rxStreams_[streamId];
+    if (static_cast<int32_t>(frameSeq - stream.next) < 0) {
+        // 重传的段属于已经交付的帧
+        stats_.duplicates++;
+        return;
+    }
+
+    PartialFrame& frame = stream.frames[frameSeq];
+    size_t index = offset / kMaxPayload;
+    if (index >= frame.got.size()) {
+        frame.got.resize(index + 1, false);
+    }
+    if (frame.got[index]) {
+        stats_.duplicates++;
+        return;
+    }
+
+    if (frame.data.size() < offset + dataLen) {
+        rxBytes_ += offset + dataLen - frame.data.size();
+        frame.data.resize(offset + dataLen);
+    }
+    memcpy(frame.data.data() + offset, p + kDataHeaderSize, dataLen);
+    frame.got[index] = true;
+    frame.received++;
+    if (last) {
+        frame.lastIndex = static_cast<int32_t>(index);
+    }
+
+    // 按帧序号依次交付已到齐的帧
+    while (!stream.frames.empty() && stream.frames.begin()->first == stream.next) {
+        PartialFrame& head = stream.frames.begin()->second;
+        if (head.lastIndex < 0 || head.received != static_cast<uint32_t>(head.lastIndex) + 1) {
+            break;
+        }
+        ready_.push_back(std::move(head.data));
+        stream.frames.erase(stream.frames.begin());
+        stream.next++;
+        stats_.framesDelivered++;
+    }
+}
+
+bool DatagramTransport::admitSegment(uint16_t streamId, uint32_t frameSeq, size_t end) const {
+    auto it = rxStreams_.find(streamId);
+    if (it == rxStreams_.end() && rxStreams_.size() >= kMaxRxStreams) {
+        return false;
+    }
+
+    // 新的流从帧序号0开始；已交付的帧的重传照常确认后丢弃
+    uint32_t next = it == rxStreams_.end() ? 0 : it->second.next;
+    if (static_cast<int32_t>(frameSeq - next) < 0) {
+        return true;
+    }
+    if (frameSeq - next >= kReorderWindow) {
+        return false;
+    }
+
+    // 只有让帧变长的段需要新的内存
+    size_t have = 0;
+    if (it != rxStreams_.end()) {
+        auto frame = it->second.frames.find(frameSeq);
+        if (frame != it->second.frames.end()) {
+            have = frame->second.data.size();
+        }
+    }
+    return end <= have || rxBytes_ + (end - have) <= kMaxRxBytes;
+}
+
+void DatagramTransport::onAck(const uint8_t* p, size_t len) {
+    size_t count = std::min<size_t>(usbip_wire::loadBE(p + 2, 2), (len - kAckHeaderSize) / 8);
+    Clock::time_point now = Clock::now();
+
+    bool progressed = false;
+    uint32_t newestAcked = 0;
+    Clock::time_point newestSent;
+    size_t ackedBytes = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t first = usbip_wire::loadBE32(p + kAckHeaderSize + i * 8);
+        uint32_t last = usbip_wire::loadBE32(p + kAckHeaderSize + i * 8 + 4);
+        if (last < first) {
+            continue;
+        }
+
+        auto it = inflight_.lower_bound(first);
+        while (it != inflight_.end() && it->first <= last) {
+            size_t size = kDataHeaderSize + it->second.fragment.len;
+            inflightBytes_ -= size;
+            bufferedBytes_ -= it->second.fragment.len;
+            ackedBytes += size;
+            if (!progressed || it->first > newestAcked) {
+                newestAcked = it->first;
+                newestSent = it->second.sentAt;
+            }
+            progressed = true;
+            it = inflight_.erase(it);
+        }
+    }
+
+    if (!progressed) {
+        return;
+    }
+
+    // 每个包号只发送一次，用最新被确认的包更新RTT估计
+    Clock::duration sample = now - newestSent;
+    if (!haveRtt_) {
+        srtt_ = sample;
+        rttvar_ = sample / 2;
+        haveRtt_ = true;
+    } else {
+        Clock::duration delta = srtt_ > sample ? srtt_ - sample : sample - srtt_;
+        rttvar_ = (rttvar_ * 3 + delta) / 4;
+        srtt_ = (srtt_ * 7 + sample) / 8;
+    }
+    largestAcked_ = std::max(largestAcked_, newestAcked);
+    timeouts_ = 0;
+
+    // 慢启动按确认字节增长，之后每个RTT增长一个数据报
+    if (cwnd_ < ssthresh_) {
+        cwnd_ += ackedBytes;
+    } else {
+        cwnd_ += std::max<size_t>(kDatagramSize * ackedBytes / cwnd_, 1);
+    }
+    cwnd_ = std::min(cwnd_, kMaxBuffered);
+}
+
+void DatagramTransport::detectLoss(Clock::time_point now) {
+    Clock::duration threshold = std::max<Clock::duration>(srtt_ * 9 / 8, std::chrono::milliseconds(1));
+    std::vector<Fragment> lost;
+    bool congestion = false;
+
+    for (auto it = inflight_.begin(); it != inflight_.end() && it->first < largestAcked_;) {
+        if (largestAcked_ - it->first < kReorderThreshold && now - it->second.sentAt < threshold) {
+            ++it;
+            continue;
+        }
+
+        congestion |= it->first >= recoveryPacket_;
+        inflightBytes_ -= kDataHeaderSize + it->second.fragment.len;
+        lost.push_back(std::move(it->second.fragment));
+        it = inflight_.erase(it);
+    }
+
+    if (lost.empty()) {
+        return;
+    }
+
+    // 同一窗口内的多个丢包只减半一次
+    if (congestion) {
+        cwnd_ = std::max(cwnd_ / 2, kMinWindow);
+        ssthresh_ = cwnd_;
+        recoveryPacket_ = nextPacket_;
+    }
+
+    stats_.retransmits += lost.size();
+    pending_.insert(pending_.begin(), lost.begin(), lost.end());
+}
+
+DatagramTransport::Clock::duration DatagramTransport::rto() const {
+    Clock::duration base = std::max<Clock::duration>(srtt_ + rttvar_ * 4, kMinRto);
+    for (unsigned i = 0; i < timeouts_ && base < kMaxRto; i++) {
+        base *= 2;
+    }
+    return std::min<Clock::duration>(base, kMaxRto);
+}
+
+void DatagramTransport::onTimeout(Clock::time_point now) {
+    if (inflight_.empty() || now < inflight_.begin()->second.sentAt + rto()) {
+        return;
+    }
+
+    // 超时：全部未确认的包视为丢失，窗口回到最小
+    if (++timeouts_ > kMaxTimeouts) {
+        std::cerr << "数据报传输对端长时间没有确认，视为断开" << std::endl;
+        failed_ = true;
+        return;
+    }
+
+    std::vector<Fragment> lost;
+    for (auto& entry : inflight_) {
+        lost.push_back(std::move(entry.second.fragment));
+    }
+    inflight_.clear();
+    inflightBytes_ = 0;
+
+    stats_.retransmits += lost.size();
+    pending_.insert(pending_.begin(), lost.begin(), lost.end());
+    ssthresh_ = std::max(cwnd_ / 2, kMinWindow);
+    cwnd_ = kMinWindow;
+    recoveryPacket_ = nextPacket_;
+}
+
+void DatagramTransport::sendPending(Clock::time_point now) {
+    if (failed_) {
+        return;
+    }
+
+    // 令牌按窗口/RTT的1.25倍速率补充；还没有RTT样本时不限速
+    if (haveRtt_) {
+        double seconds = std::chrono::duration<double>(now - lastRefill_).count();
+        double rate = 1.25 * cwnd_ / std::max(std::chrono::duration<double>(srtt_).count(), 1e-6);
+        tokens_ = std::min(tokens_ + rate * seconds, kMaxBurst);
+    } else {
+        tokens_ = kMaxBurst;
+    }
+    lastRefill_ = now;
+
+    while (!pending_.empty()) {
+        size_t size = kDataHeaderSize + pending_.front().len;
+        if (inflightBytes_ + size > cwnd_ || tokens_ < size) {
+            break;
+        }
+
+        Fragment fragment = std::move(pending_.front());
+        pending_.pop_front();
+
+        uint32_t packet = nextPacket_++;
+        Outgoing out;
+        out.head[0] = kTypeData;
+        out.head[1] = fragment.last ? kFlagLast : 0;
+        usbip_wire::storeBE(out.head + 2, 2, fragment.stream);
+        usbip_wire::storeBE32(out.head + 4, packet);
+        usbip_wire::storeBE32(out.head + 8, fragment.frameSeq);
+        usbip_wire::storeBE32(out.head + 12, fragment.offset);
+        out.data = fragment.frame->data() + fragment.offset;
+        out.len = fragment.len;
+        batch_.push_back(out);
+
+        InFlight& entry = inflight_[packet];
+        entry.fragment = std::move(fragment);
+        entry.sentAt = now;
+        inflightBytes_ += size;
+        tokens_ -= size;
+
+        if (batch_.size() == kBatchSize) {
+            flushBatch();
+        }
+    }
+    flushBatch();
+}
+
+void DatagramTransport::queueAck() {
+    // 从最新的区间开始，最多kMaxAckRanges个
+    ackBuffer_.resize(kMaxAckRanges * 8);
+    size_t count = 0;
+    for (auto it = received_.rbegin(); it != received_.rend() && count < kMaxAckRanges; ++it, ++count) {
+        usbip_wire::storeBE32(ackBuffer_.data() + count * 8, it->first);
+        usbip_wire::storeBE32(ackBuffer_.data() + count * 8 + 4, it->second);
+    }
+
+    Outgoing out;
+    out.head[0] = kTypeAck;
+    out.head[1] = 0;
+    usbip_wire::storeBE(out.head + 2, 2, static_cast<uint32_t>(count));
+    out.data = ackBuffer_.data();
+    out.len = count * 8;
+    batch_.push_back(out);
+    ackDue_ = false;
+}
+
+void DatagramTransport::flushBatch() {
+    if (batch_.empty()) {
+        return;
+    }
+
+    struct mmsghdr msgs[kBatchSize];
+    struct iovec iov[kBatchSize][2];
+    size_t count = 0;
+
+    for (const Outgoing& out : batch_) {
+        // 故意丢弃的数据报当作已在网络上丢失
+        if (lossRate_ > 0 && std::uniform_real_distribution<double>(0, 1)(lossRng_) < lossRate_) {
+            stats_.dropped++;
+            continue;
+        }
+
+        iov[count][0].iov_base = const_cast<uint8_t*>(out.head);
+        iov[count][0].iov_len = out.head[0] == kTypeData ? kDataHeaderSize : kAckHeaderSize;
+        iov[count][1].iov_base = const_cast<uint8_t*>(out.data);
+        iov[count][1].iov_len = out.len;
+        memset(&msgs[count], 0, sizeof(msgs[count]));
+        msgs[count].msg_hdr.msg_iov = iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 2;
+        count++;
+    }
+
+    size_t sent = 0;
+    while (sent < count) {
+        int n = ::sendmmsg(udpFd_, msgs + sent, count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // 发送缓冲区已满或对端暂不可达：剩余的数据报按丢失处理，由重传补发
+            break;
+        }
+        sent += n;
+    }
+
+    stats_.datagramsSent += sent;
+    batch_.clear();
+}
+
+void DatagramTransport::armTimer(Clock::time_point now) {
+    if (timerFd_ < 0) {
+        return;
+    }
+
+    // 下一个截止时间：最早未确认包的重传超时，或令牌不足时补足令牌的时刻
+    bool armed = false;
+    Clock::time_point deadline;
+    if (!inflight_.empty()) {
+        deadline = inflight_.begin()->second.sentAt + rto();
+        armed = true;
+    }
+    if (!pending_.empty() && !failed_) {
+        size_t size = kDataHeaderSize + pending_.front().len;
+        if (inflightBytes_ + size <= cwnd_ && tokens_ < size && haveRtt_) {
+            double rate = 1.25 * cwnd_ / std::max(std::chrono::duration<double>(srtt_).count(), 1e-6);
+            auto wait = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>((size - tokens_) / rate));
+            Clock::time_point refill = now + wait;
+            deadline = armed ? std::min(deadline, refill) : refill;
+            armed = true;
+        }
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (armed) {
+        auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+        delay = std::max<long long>(delay, 1000);  // 全0表示停止定时器
+        spec.it_value.tv_sec = delay / 1000000000;
+        spec.it_value.tv_nsec = delay % 1000000000;
+    }
+    timerfd_settime(timerFd_, 0, &spec, nullptr);
+}
+
+#else // !USBIP_HAVE_DATAGRAM_TRANSPORT
+
+bool DatagramTransport::supported() { return false; }
+
+bool DatagramTransport::beginOffer(int) {
+    std::cerr << "当前系统不支持数据报传输" << std::endl;
+    return false;
+}
+
+bool DatagramTransport::continueOffer(bool& done) {
+    done = false;
+    return false;
+}
+
+bool DatagramTransport::accept(int) {
+    std::cerr << "当前系统不支持数据报传输" << std::endl;
+    return false;
+}
+
+void DatagramTransport::close() {}
+
+ssize_t DatagramTransport::read(const struct iovec*, int, int) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+void DatagramTransport::poll() {}
+
+bool DatagramTransport::sendFrame(uint16_t, const struct iovec*, int, int) {
+    errno = ENOTSUP;
+    return false;
+}
+
+#endif
@@ -0,0 +1,136 @@
+#include "../include/urb_window.h"
+#include <algorithm>
+#include <cmath>
+
+// 窗口的初始值和上下限（URB数）。上限与服务端为可恢复会话保留的回复数相同
+static const size_t kInitialWindow = 16;
+static const size_t kMinWindow = 4;
+static const size_t kMaxWindow = 1024;
+
+// 窗口为估计的带宽时延积乘以该增益，留出余量吸收回复到达的抖动
+static const double kWindowGain = 2.0;
+
+// 最小RTT的有效期：超过后以新样本为准，路由变化后能够重新收敛
+static const std::chrono::seconds kMinRttExpiry(10);
+
+// 速率样本保留若干个RTT，RTT很小时（如回环、共享内存）至少保留一段时间
+static const unsigned kRateWindowRtts = 10;
+static const std::chrono::milliseconds kMinRateWindow(100);
+
+UrbWindow::UrbWindow()
+    : window_(kInitialWindow), delivered_(0), deliveredBytes_(0), haveRtt_(false), srtt_(0), minRtt_(0) {
+}
+
+void UrbWindow::onSend(uint32_t seqnum, size_t bytes, Clock::time_point now) {
+    // 还没有投递过时以第一个发出的时间为起点
+    if (delivered_ == 0 && inflight_.empty()) {
+        deliveredAt_ = now;
+        firstSentAt_ = now;
+    }
+
+    Sent& sent = inflight_[seqnum];
+    sent.sentAt = now;
+    sent.bytes = bytes;
+    sent.delivered = delivered_;
+    sent.deliveredBytes = deliveredBytes_;
+    sent.deliveredAt = deliveredAt_;
+    sent.firstSentAt = firstSentAt_;
+    sent.appLimited = inflight_.size() < window_;
+}
+
+bool UrbWindow::onReply(uint32_t seqnum, size_t bytes, Clock::time_point now) {
+    auto it = inflight_.find(seqnum);
+    if (it == inflight_.end()) {
+        return false;
+    }
+    Sent sent = it->second;
+    inflight_.erase(it);
+
+    delivered_++;
+    deliveredBytes_ += sent.bytes + bytes;
+    deliveredAt_ = now;
+    firstSentAt_ = sent.sentAt;
+
+    Clock::duration sample = now - sent.sentAt;
+    if (!haveRtt_) {
+        srtt_ = sample;
+        haveRtt_ = true;
+    } else {
+        srtt_ = (srtt_ * 7 + sample) / 8;
+    }
+    if (minRtt_ == Clock::duration::zero() || sample <= minRtt_ || now - minRttAt_ > kMinRttExpiry) {
+        minRtt_ = sample;
+        minRttAt_ = now;
+    }
+
+    // 投递速率：从该URB发出到现在这段时间里完成的URB和字节。
+    // 回复可能成批到达，时间取到达间隔和对应的发出间隔中较长的一个
+    Clock::duration elapsed = std::max(now - sent.deliveredAt, sent.sentAt - sent.firstSentAt);
+    double interval = std::chrono::duration<double>(elapsed).count();
+    if (interval > 0) {
+        RateSample rate;
+        rate.at = now;
+        rate.urbRate = (delivered_ - sent.delivered) / interval;
+        rate.bandwidth = (deliveredBytes_ - sent.deliveredBytes) / interval;
+
+        // 窗口未用满时的样本只反映发送方的需求，低于当前估计时丢弃
+        double best = 0;
+        for (const auto& r : rates_) {
+            best = std::max(best, r.urbRate);
+        }
+        if (!sent.appLimited || rate.urbRate >= best) {
+            rates_.push_back(rate);
+        }
+    }
+
+    Clock::duration keep = rateWindow();
+    while (rates_.size() > 1 && now - rates_.front().at > keep) {
+        rates_.pop_front();
+    }
+
+    updateWindow();
+    return true;
+}
+
+void UrbWindow::reset() {
+    window_ = kInitialWindow;
+    inflight_.clear();
+    delivered_ = 0;
+    deliveredBytes_ = 0;
+    haveRtt_ = false;
+    srtt_ = Clock::duration::zero();
+    minRtt_ = Clock::duration::zero();
+    rates_.clear();
+}
+
+UrbWindow::Clock::duration UrbWindow::rateWindow() const {
+    return std::max<Clock::duration>(srtt_ * kRateWindowRtts, kMinRateWindow);
+}
+
+void UrbWindow::updateWindow() {
+    if (rates_.empty()) {
+        return;
+    }
+
+    double urbRate = 0;
+    for (const auto& r : rates_) {
+        urbRate = std::max(urbRate, r.urbRate);
+    }
+    double bdp = urbRate * std::chrono::duration<double>(minRtt_).count();
+    size_t window = static_cast<size_t>(std::ceil(bdp * kWindowGain));
+    window_ = std::min(std::max(window, kMinWindow), kMaxWindow);
+}
+
+UrbWindow::Stats UrbWindow::stats() const {
+    Stats stats;
+    stats.window = window_;
+    stats.inflight = inflight_.size();
+    stats.srtt = srtt_;
+    stats.minRtt = minRtt_;
+    for (const auto& r : rates_) {
+        stats.urbRate = std::max(stats.urbRate, r.urbRate);
+        stats.bandwidth = std::max(stats.bandwidth, r.bandwidth);
+    }
+    stats.bdpBytes = static_cast<size_t>(stats.bandwidth * std::chrono::duration<double>(minRtt_).count());
+    return stats;
+}
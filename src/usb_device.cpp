@@ -1,11 +1,40 @@
 #include "../include/usb_device.h"
+#include "../include/low_latency.h"
 #include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <cstring>
+#include <chrono>
+#include <sys/time.h>
 
 namespace libusb {
 
+// 等待被取消的传输回调的最长时间
+static const std::chrono::seconds kCancelWait(2);
+
+// 一次异步传输的上下文，随libusb_transfer的user_data传递
+struct USBDevice::AsyncTransfer {
+    USBDevice* device;
+    std::vector<uint8_t> buffer;
+    TransferCallback callback;
+    const void* owner;  // 提交者给出的标识，供expireTransfer()查找
+    uint32_t id;
+    bool expired;       // 因超时被取消，完成时报告LIBUSB_ERROR_TIMEOUT
+};
+
+// 将异步传输的完成状态映射为与同步接口一致的libusb错误码
+static int transferStatusToError(libusb_transfer_status status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return LIBUSB_SUCCESS;
+        case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+        default:                        return LIBUSB_ERROR_IO;
+    }
+}
+
 // USBDevice 实现
 USBDevice::USBDevice(libusb_device* device)
     : device_(device), handle_(nullptr), isOpen_(false) {
@@ -14,6 +43,7 @@ USBDevice::USBDevice(libusb_device* device)
 }
 
 USBDevice::~USBDevice() {
+    cancelTransfers(true);
     close();
 }
 
@@ -34,6 +64,8 @@ bool USBDevice::open() {
 
 void USBDevice::close() {
     if (isOpen_ && handle_) {
+        // 句柄关闭前不能留有未完成的传输
+        cancelTransfers(true);
         libusb_close(handle_);
         handle_ = nullptr;
         isOpen_ = false;
@@ -116,6 +148,123 @@ int USBDevice::interruptTransfer(unsigned char endpoint,
     return libusb_interrupt_transfer(handle_, endpoint, data, length, actualLength, timeout);
 }
 
+int USBDevice::submitTransfer(uint8_t type, unsigned char endpoint,
+                              std::vector<uint8_t>&& buffer,
+                              TransferCallback callback,
+                              unsigned int timeout,
+                              const void* owner, uint32_t id) {
+    if (!isOpen_ || !handle_) {
+        if (!open()) {
+            return LIBUSB_ERROR_NO_DEVICE;
+        }
+    }
+    
+    libusb_transfer* transfer = libusb_alloc_transfer(0);
+    if (!transfer) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    
+    AsyncTransfer* context = new AsyncTransfer{this, std::move(buffer), std::move(callback), owner, id, false};
+    unsigned char* data = context->buffer.data();
+    int length = static_cast<int>(context->buffer.size());
+    
+    switch (type) {
+        case LIBUSB_TRANSFER_TYPE_CONTROL:
+            // 长度取自setup包中的wLength
+            libusb_fill_control_transfer(transfer, handle_, data, onTransferComplete, context, timeout);
+            break;
+        case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+            libusb_fill_interrupt_transfer(transfer, handle_, endpoint, data, length, onTransferComplete, context, timeout);
+            break;
+        default:
+            libusb_fill_bulk_transfer(transfer, handle_, endpoint, data, length, onTransferComplete, context, timeout);
+            break;
+    }
+    
+    // 先登记再提交，回调可能在提交返回前就在事件线程中执行
+    {
+        std::lock_guard<std::mutex> lock(transferMutex_);
+        inflight_.insert(transfer);
+    }
+    
+    int ret = libusb_submit_transfer(transfer);
+    if (ret != LIBUSB_SUCCESS) {
+        std::cerr << "提交USB传输失败: " << libusb_error_name(ret) << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(transferMutex_);
+            inflight_.erase(transfer);
+        }
+        // 提交失败时缓冲区交还给调用方
+        buffer = std::move(context->buffer);
+        delete context;
+        libusb_free_transfer(transfer);
+        return ret;
+    }
+    
+    USBDeviceManager::getInstance().noteTransfer(true);
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL USBDevice::onTransferComplete(libusb_transfer* transfer) {
+    AsyncTransfer* context = static_cast<AsyncTransfer*>(transfer->user_data);
+    USBDevice* device = context->device;
+    USBDeviceManager::getInstance().noteTransfer(false);
+    
+    int status = transferStatusToError(transfer->status);
+    if (context->expired && transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+        status = LIBUSB_ERROR_TIMEOUT;
+    }
+    int actualLength = transfer->actual_length;
+    
+    if (context->callback) {
+        context->callback(status, actualLength, context->buffer);
+    }
+    
+    // 回调可能持有设备的最后一个引用：先移到这里，注销完成后才析构，之前设备不会被释放
+    TransferCallback callback = std::move(context->callback);
+    
+    // 回调执行完之后、释放传输之前注销：cancelTransfers(true)据此判断可以安全返回，
+    // cancelTransfers()和expireTransfer()也不会再取消或读取已释放的传输
+    {
+        std::lock_guard<std::mutex> lock(device->transferMutex_);
+        device->inflight_.erase(transfer);
+        device->transferDone_.notify_all();
+    }
+    
+    delete context;
+    libusb_free_transfer(transfer);
+}
+
+void USBDevice::cancelTransfers(bool wait) {
+    std::unique_lock<std::mutex> lock(transferMutex_);
+    for (libusb_transfer* transfer : inflight_) {
+        libusb_cancel_transfer(transfer);
+    }
+    
+    if (wait && !transferDone_.wait_for(lock, kCancelWait, [this] { return inflight_.empty(); })) {
+        std::cerr << "等待USB传输取消超时，仍有 " << inflight_.size() << " 个传输未完成" << std::endl;
+    }
+}
+
+bool USBDevice::expireTransfer(const void* owner, uint32_t id) {
+    std::lock_guard<std::mutex> lock(transferMutex_);
+    for (libusb_transfer* transfer : inflight_) {
+        AsyncTransfer* context = static_cast<AsyncTransfer*>(transfer->user_data);
+        if (context->owner == owner && context->id == id && !context->expired) {
+            // 已在完成途中的传输取消失败（LIBUSB_ERROR_NOT_FOUND）也算找到：调用者据此继续取消同一id的其余传输
+            context->expired = true;
+            libusb_cancel_transfer(transfer);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t USBDevice::pendingTransfers() const {
+    std::lock_guard<std::mutex> lock(transferMutex_);
+    return inflight_.size();
+}
+
 std::string USBDevice::getBusID() const {
     std::stringstream ss;
     ss << static_cast<int>(getBusNumber()) << "-" << static_cast<int>(getDeviceAddress());
@@ -251,7 +400,8 @@ bool USBDevice::fillDeviceInfo(usb_device_info& info) {
 
 // USBDeviceManager 实现
 USBDeviceManager::USBDeviceManager()
-    : context_(nullptr), isInitialized_(false) {
+    : context_(nullptr), isInitialized_(false), eventsRunning_(false), busyPollUs_(0), eventCpu_(-1),
+      lastTransfer_(0), eventWaiting_(false) {
 }
 
 USBDeviceManager::~USBDeviceManager() {
@@ -274,6 +424,8 @@ bool USBDeviceManager::init() {
 }
 
 void USBDeviceManager::cleanup() {
+    stopEventThread();
+    
     if (isInitialized_ && context_) {
         libusb_exit(context_);
         context_ = nullptr;
@@ -281,6 +433,78 @@ void USBDeviceManager::cleanup() {
     }
 }
 
+bool USBDeviceManager::startEventThread() {
+    if (eventThread_.joinable()) {
+        return true;
+    }
+    
+    if (!isInitialized_ && !init()) {
+        return false;
+    }
+    
+    eventsRunning_ = true;
+    eventThread_ = std::thread(&USBDeviceManager::eventLoop, this);
+    return true;
+}
+
+void USBDeviceManager::stopEventThread() {
+    eventsRunning_ = false;
+    if (eventThread_.joinable()) {
+        eventThread_.join();
+    }
+}
+
+void USBDeviceManager::eventLoop() {
+    if (busyPollUs_ > 0) {
+        pinThread(eventCpu_);
+    }
+    const auto spin = std::chrono::microseconds(busyPollUs_);
+    
+    // 定期醒来检查退出标志
+    while (eventsRunning_) {
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        
+        // 忙轮询：最近有传输提交或完成时不进入等待
+        bool wait = true;
+        if (busyPollUs_ > 0) {
+            auto last = std::chrono::steady_clock::time_point(
+                std::chrono::steady_clock::duration(lastTransfer_.load(std::memory_order_relaxed)));
+            wait = std::chrono::steady_clock::now() - last >= spin;
+            if (!wait) {
+                tv.tv_usec = 0;
+            }
+            eventWaiting_ = wait;
+        }
+        
+        int ret = libusb_handle_events_timeout_completed(context_, &tv, nullptr);
+        eventWaiting_ = false;
+        if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED) {
+            std::cerr << "处理USB事件失败: " << libusb_error_name(ret) << std::endl;
+        }
+        if (!wait) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void USBDeviceManager::noteTransfer(bool submitted) {
+    if (busyPollUs_ == 0) {
+        return;
+    }
+    lastTransfer_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    // 唤醒发生在USB传输进行期间，不增加这次传输的延迟
+    if (submitted && eventWaiting_.exchange(false)) {
+        libusb_interrupt_event_handler(context_);
+    }
+#else
+    (void)submitted;
+#endif
+}
+
 std::vector<std::shared_ptr<USBDevice>> USBDeviceManager::scanDevices() {
     std::vector<std::shared_ptr<USBDevice>> devices;
     